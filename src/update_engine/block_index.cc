@@ -0,0 +1,202 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/block_index.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include "update_engine/graph_types.h"
+#include "update_engine/graph_utils.h"
+#include "update_engine/utils.h"
+
+using std::min;
+using std::set;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+// Blocks with the same contents, e.g. zeros, share a hash. Only this many
+// of them are looked at for each block looked up, so that looking up many
+// such blocks doesn't take quadratic time. Zeros compress well anyway.
+const size_t kMaxCandidates = 64;
+
+// Files are hashed this many blocks at a time, as big ones don't fit in
+// memory whole.
+const uint64_t kChunkBlocks = 1024 * 1024 / BlockIndex::kBlockSize;
+
+// A lookup keeps up to this many indexed files open, closing them all once
+// it needs another.
+const size_t kMaxOpenFiles = 64;
+}  // namespace {}
+
+const size_t BlockIndex::kBlockSize;
+
+uint64_t BlockIndex::HashBlock(const char *block)
+{
+    // FNV-1a, a word rather than a byte at a time.
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < kBlockSize; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, block + i, sizeof(word));
+        hash = (hash ^ word) * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+bool BlockIndex::AddFile(const ImageFile &file)
+{
+    const uint64_t full_blocks = file.size / kBlockSize;
+
+    if (full_blocks == 0) {
+        return true;
+    }
+
+    vector<Extent> extents;
+    TEST_AND_RETURN_FALSE(files_.GetExtents(file.path, &extents));
+    unique_ptr<ImageFileReader> reader;
+    TEST_AND_RETURN_FALSE(files_.OpenFile(file.path, &reader));
+
+    const size_t path_index = paths_.size();
+    paths_.push_back(file.path);
+    uint64_t file_block = 0;
+    vector<char> chunk;
+    uint64_t chunk_block = 0;  // the first block of the file in |chunk|
+
+    for (const Extent &extent : extents) {
+        for (uint64_t i = 0;
+                i < extent.num_blocks() && file_block < full_blocks;
+                i++, file_block++) {
+            if (extent.start_block() == kSparseHole) {
+                continue;
+            }
+
+            if (file_block >= chunk_block + chunk.size() / kBlockSize) {
+                chunk_block = file_block - file_block % kChunkBlocks;
+                const uint64_t chunk_blocks = min(kChunkBlocks,
+                                                  full_blocks - chunk_block);
+                chunk.clear();
+                TEST_AND_RETURN_FALSE(reader->ReadChunk(
+                                          chunk_block * kBlockSize,
+                                          chunk_blocks * kBlockSize, &chunk));
+                TEST_AND_RETURN_FALSE(chunk.size() ==
+                                      chunk_blocks * kBlockSize);
+            }
+
+            Location location;
+            location.file = path_index;
+            location.file_block = file_block;
+            location.image_block = extent.start_block() + i;
+            locations_.insert(std::make_pair(
+                                  HashBlock(&chunk[(file_block - chunk_block) *
+                                                   kBlockSize]),
+                                  location));
+        }
+    }
+
+    return true;
+}
+
+bool BlockIndex::Matches(const Location &location,
+                         const char *block,
+                         OpenFiles *open_files,
+                         bool *out_matches) const
+{
+    auto it = open_files->find(location.file);
+
+    if (it == open_files->end()) {
+        if (open_files->size() >= kMaxOpenFiles) {
+            open_files->clear();
+        }
+
+        unique_ptr<ImageFileReader> reader;
+        TEST_AND_RETURN_FALSE(files_.OpenFile(paths_[location.file],
+                                              &reader));
+        it = open_files->insert(std::make_pair(location.file,
+                                               std::move(reader))).first;
+    }
+
+    vector<char> data;
+    TEST_AND_RETURN_FALSE(it->second->ReadChunk(
+                              location.file_block * kBlockSize, kBlockSize,
+                              &data));
+    TEST_AND_RETURN_FALSE(data.size() == kBlockSize);
+    *out_matches = memcmp(data.data(), block, kBlockSize) == 0;
+    return true;
+}
+
+bool BlockIndex::FindBlocks(const vector<char> &data,
+                            vector<Extent> *out_extents,
+                            vector<char> *out_data) const
+{
+    set<uint64_t> used_blocks;
+    OpenFiles open_files;
+    uint64_t next_block = kSparseHole;  // the one after the last found
+
+    for (size_t offset = 0; offset + kBlockSize <= data.size();
+            offset += kBlockSize) {
+        const char *block = data.data() + offset;
+        auto range = locations_.equal_range(HashBlock(block));
+
+        // Try the block continuing the last run of found blocks first, as
+        // longer extents diff and apply faster.
+        vector<const Location *> candidates;
+        size_t scanned = 0;
+
+        for (auto it = range.first;
+                it != range.second && scanned < kMaxCandidates;
+                ++it, ++scanned) {
+            const Location &location = it->second;
+
+            if (used_blocks.count(location.image_block)) {
+                continue;
+            }
+
+            if (location.image_block == next_block) {
+                candidates.insert(candidates.begin(), &location);
+            } else {
+                candidates.push_back(&location);
+            }
+        }
+
+        const Location *found = NULL;
+
+        for (const Location *location : candidates) {
+            bool matches = false;
+            TEST_AND_RETURN_FALSE(Matches(*location, block, &open_files,
+                                          &matches));
+
+            if (matches) {
+                found = location;
+                break;
+            }
+        }
+
+        if (!found) {
+            next_block = kSparseHole;
+            continue;
+        }
+
+        used_blocks.insert(found->image_block);
+        graph_utils::AppendBlockToExtents(out_extents, found->image_block);
+        out_data->insert(out_data->end(), block, block + kBlockSize);
+        next_block = found->image_block + 1;
+    }
+
+    return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,86 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_BLOCK_INDEX_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_BLOCK_INDEX_H__
+
+#include <stdint.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "macros.h"
+#include "update_engine/image_files.h"
+#include "update_engine/update_metadata.pb.h"
+
+// A BlockIndex finds blocks of the old image by their contents, so that a new
+// file with no counterpart at its own path can still be diffed against data
+// that moved: a renamed or reorganised file, or a copy of one. The index
+// holds a hash of each full block of the old files added to it; matches are
+// confirmed by comparing the contents, so hash collisions do no harm.
+// Once built, it can be used from multiple threads at once.
+
+namespace chromeos_update_engine {
+
+class BlockIndex
+{
+public:
+    static const size_t kBlockSize = 4096;  // bytes
+
+    explicit BlockIndex(const ImageFiles &files) : files_(files) {}
+
+    // Indexes the full blocks of |file| in the old image. Holes and the
+    // partial block at the end, if any, are left out. Returns true on
+    // success.
+    bool AddFile(const ImageFile &file);
+
+    // Looks up the full blocks of |data|. For each one whose contents are at
+    // an indexed block, appends that block to |out_extents| and its contents
+    // to |out_data|, in the order of |data|. No indexed block is used twice.
+    // Returns true on success, which includes finding nothing.
+    bool FindBlocks(const std::vector<char> &data,
+                    std::vector<Extent> *out_extents,
+                    std::vector<char> *out_data) const;
+
+    // The number of blocks indexed.
+    size_t size() const
+    {
+        return locations_.size();
+    }
+
+    // Returns the hash the index uses for the block at |block|.
+    static uint64_t HashBlock(const char *block);
+
+private:
+    // Where an indexed block is, both in its file and in the image.
+    struct Location {
+        size_t file;  // index into |paths_|
+        uint64_t file_block;
+        uint64_t image_block;
+    };
+
+    // The indexed files a lookup has open, by index into |paths_|.
+    typedef std::map<size_t, std::unique_ptr<ImageFileReader>> OpenFiles;
+
+    // Sets |out_matches| to whether the block at |location| holds the same
+    // bytes as |block|, reading it through |open_files|, which it opens the
+    // file in if needed. Returns true on success.
+    bool Matches(const Location &location,
+                 const char *block,
+                 OpenFiles *open_files,
+                 bool *out_matches) const;
+
+    const ImageFiles &files_;
+    std::vector<std::string> paths_;
+    std::unordered_multimap<uint64_t, Location> locations_;
+
+    DISALLOW_COPY_AND_ASSIGN(BlockIndex);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_BLOCK_INDEX_H__
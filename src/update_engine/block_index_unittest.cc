@@ -0,0 +1,119 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/block_index.h"
+#include "update_engine/extent_mapper.h"
+#include "update_engine/image_files.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class BlockIndexTest : public ::testing::Test {};
+
+namespace {
+const size_t kBlockSize = BlockIndex::kBlockSize;
+
+// Returns a block filled with |c|.
+vector<char> Block(char c)
+{
+    return vector<char>(kBlockSize, c);
+}
+
+void Append(vector<char> *data, const vector<char> &more)
+{
+    data->insert(data->end(), more.begin(), more.end());
+}
+}  // namespace {}
+
+TEST(BlockIndexTest, FindBlocksTest)
+{
+    string root;
+    ASSERT_TRUE(utils::MakeTempDirectory("/tmp/BlockIndexTest.XXXXXX", &root));
+    ScopedDirRemover root_remover(root);
+
+    // Three full blocks and a partial one, which isn't indexed.
+    vector<char> old_data;
+    Append(&old_data, Block('a'));
+    Append(&old_data, Block('b'));
+    Append(&old_data, Block('c'));
+    old_data.resize(old_data.size() + 100, 'd');
+    ASSERT_TRUE(WriteFileVector(root + "/old", old_data));
+
+    vector<Extent> old_extents;
+    ASSERT_TRUE(extent_mapper::ExtentsForFile(root + "/old", &old_extents));
+
+    MountedImageFiles files(root);
+    BlockIndex index(files);
+    bool exists = false;
+    ImageFile old_file;
+    ASSERT_TRUE(files.GetFile("/old", &exists, &old_file));
+    ASSERT_TRUE(exists);
+    EXPECT_TRUE(index.AddFile(old_file));
+    EXPECT_EQ(3, index.size());
+
+    // Blocks b and c are found, in that order, then a; x and d aren't, nor
+    // is b a second time.
+    vector<char> new_data;
+    Append(&new_data, Block('b'));
+    Append(&new_data, Block('c'));
+    Append(&new_data, Block('x'));
+    Append(&new_data, Block('b'));
+    Append(&new_data, Block('a'));
+    Append(&new_data, Block('d'));
+
+    vector<Extent> found_extents;
+    vector<char> found_data;
+    EXPECT_TRUE(index.FindBlocks(new_data, &found_extents, &found_data));
+
+    vector<char> expected_data;
+    Append(&expected_data, Block('b'));
+    Append(&expected_data, Block('c'));
+    Append(&expected_data, Block('a'));
+    EXPECT_TRUE(expected_data == found_data);
+
+    // The blocks found are those of the old file.
+    vector<uint64_t> found_blocks;
+
+    for (const Extent &extent : found_extents) {
+        for (uint64_t i = 0; i < extent.num_blocks(); i++) {
+            found_blocks.push_back(extent.start_block() + i);
+        }
+    }
+
+    vector<uint64_t> old_blocks;
+
+    for (const Extent &extent : old_extents) {
+        for (uint64_t i = 0; i < extent.num_blocks(); i++) {
+            old_blocks.push_back(extent.start_block() + i);
+        }
+    }
+
+    ASSERT_EQ(3, found_blocks.size());
+    EXPECT_EQ(old_blocks[1], found_blocks[0]);
+    EXPECT_EQ(old_blocks[2], found_blocks[1]);
+    EXPECT_EQ(old_blocks[0], found_blocks[2]);
+}
+
+TEST(BlockIndexTest, NothingFoundTest)
+{
+    MountedImageFiles files("/nonexistent");
+    BlockIndex index(files);
+    vector<char> data = Block('a');
+    vector<Extent> found_extents;
+    vector<char> found_data;
+    EXPECT_TRUE(index.FindBlocks(data, &found_extents, &found_data));
+    EXPECT_TRUE(found_extents.empty());
+    EXPECT_TRUE(found_data.empty());
+}
+
+}  // namespace chromeos_update_engine
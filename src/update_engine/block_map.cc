@@ -0,0 +1,96 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/block_map.h"
+
+#include <glog/logging.h>
+
+namespace chromeos_update_engine {
+
+bool BlockMap::AddRun(uint64_t start_block,
+                      uint64_t num_blocks,
+                      Vertex::Index vertex,
+                      RunMap *runs,
+                      Run *conflict)
+{
+    CHECK(vertex != Vertex::kInvalidIndex);
+    CHECK_LE(start_block, num_blocks_);
+    CHECK_LE(num_blocks, num_blocks_ - start_block);
+
+    if (num_blocks == 0) {
+        return true;
+    }
+
+    const uint64_t end_block = start_block + num_blocks;
+
+    // The first run that starts after |start_block|, and the one before it,
+    // are the only ones that can overlap or touch the new run.
+    RunMap::iterator next = runs->upper_bound(start_block);
+    RunMap::iterator prev = next;
+
+    if (prev != runs->begin()) {
+        --prev;
+
+        if (prev->second.end_block() > start_block) {
+            if (conflict) {
+                *conflict = prev->second;
+            }
+
+            return false;
+        }
+    } else {
+        prev = runs->end();
+    }
+
+    if (next != runs->end() && next->first < end_block) {
+        if (conflict) {
+            *conflict = next->second;
+        }
+
+        return false;
+    }
+
+    if (prev != runs->end() && prev->second.end_block() == start_block &&
+            prev->second.vertex == vertex) {
+        prev->second.num_blocks += num_blocks;
+
+        if (next != runs->end() && next->first == end_block &&
+                next->second.vertex == vertex) {
+            prev->second.num_blocks += next->second.num_blocks;
+            runs->erase(next);
+        }
+
+        return true;
+    }
+
+    Run run = { start_block, num_blocks, vertex };
+
+    if (next != runs->end() && next->first == end_block &&
+            next->second.vertex == vertex) {
+        run.num_blocks += next->second.num_blocks;
+        runs->erase(next++);
+    }
+
+    runs->insert(next, std::make_pair(start_block, run));
+    return true;
+}
+
+Vertex::Index BlockMap::Find(const RunMap &runs, uint64_t block)
+{
+    RunMap::const_iterator it = runs.upper_bound(block);
+
+    if (it == runs.begin()) {
+        return Vertex::kInvalidIndex;
+    }
+
+    --it;
+
+    if (block >= it->second.end_block()) {
+        return Vertex::kInvalidIndex;
+    }
+
+    return it->second.vertex;
+}
+
+}  // namespace chromeos_update_engine
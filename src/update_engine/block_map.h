@@ -0,0 +1,113 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_BLOCK_MAP_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_BLOCK_MAP_H__
+
+#include <stdint.h>
+
+#include <map>
+
+#include "update_engine/graph_types.h"
+
+// During install, each block on the install partition will be written and
+// some may be read (in all likelihood, many will be read). The reading and
+// writing will be performed by InstallOperations, each of which has a
+// corresponding vertex in a graph. A BlockMap tells which vertex will read
+// and which will write each block at install time.
+//
+// Blocks are kept as runs of consecutive blocks with the same reader or
+// writer, so the map takes memory in proportion to the number of extents of
+// the operations rather than to the size of the partition, and can be
+// walked an extent at a time.
+
+namespace chromeos_update_engine {
+
+class BlockMap
+{
+public:
+    // A run of consecutive blocks read or written by the same vertex.
+    struct Run {
+        uint64_t start_block;
+        uint64_t num_blocks;
+        Vertex::Index vertex;
+
+        uint64_t end_block() const
+        {
+            return start_block + num_blocks;
+        }
+    };
+
+    // The runs of a map, keyed and sorted by start block. Consecutive runs
+    // of the same vertex are merged.
+    typedef std::map<uint64_t, Run> RunMap;
+
+    // Creates a map of a partition of |num_blocks| blocks with no readers or
+    // writers yet.
+    explicit BlockMap(uint64_t num_blocks) : num_blocks_(num_blocks) {}
+
+    uint64_t num_blocks() const
+    {
+        return num_blocks_;
+    }
+
+    // Records |vertex| as the reader or the writer of |num_blocks| blocks
+    // from |start_block|. A block can only have one reader and one writer:
+    // if some of the blocks already have one, returns false and sets
+    // |conflict|, if not NULL, to the run they're in; nothing is recorded in
+    // that case. Returns true otherwise.
+    bool AddReader(uint64_t start_block,
+                   uint64_t num_blocks,
+                   Vertex::Index vertex,
+                   Run *conflict)
+    {
+        return AddRun(start_block, num_blocks, vertex, &readers_, conflict);
+    }
+
+    bool AddWriter(uint64_t start_block,
+                   uint64_t num_blocks,
+                   Vertex::Index vertex,
+                   Run *conflict)
+    {
+        return AddRun(start_block, num_blocks, vertex, &writers_, conflict);
+    }
+
+    // Return the reader or the writer of |block|, or Vertex::kInvalidIndex
+    // if it has none.
+    Vertex::Index reader(uint64_t block) const
+    {
+        return Find(readers_, block);
+    }
+
+    Vertex::Index writer(uint64_t block) const
+    {
+        return Find(writers_, block);
+    }
+
+    const RunMap &readers() const
+    {
+        return readers_;
+    }
+
+    const RunMap &writers() const
+    {
+        return writers_;
+    }
+
+private:
+    bool AddRun(uint64_t start_block,
+                uint64_t num_blocks,
+                Vertex::Index vertex,
+                RunMap *runs,
+                Run *conflict);
+    static Vertex::Index Find(const RunMap &runs, uint64_t block);
+
+    uint64_t num_blocks_;
+    RunMap readers_;
+    RunMap writers_;
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_BLOCK_MAP_H__
@@ -0,0 +1,89 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <gtest/gtest.h>
+
+#include "update_engine/block_map.h"
+
+namespace chromeos_update_engine {
+
+class BlockMapTest : public ::testing::Test {};
+
+namespace {
+const Vertex::Index kInvalidIndex = Vertex::kInvalidIndex;
+}
+
+TEST(BlockMapTest, SimpleTest)
+{
+    BlockMap blocks(100);
+    EXPECT_EQ(100, blocks.num_blocks());
+    EXPECT_EQ(kInvalidIndex, blocks.reader(0));
+    EXPECT_EQ(kInvalidIndex, blocks.writer(99));
+
+    EXPECT_TRUE(blocks.AddReader(10, 5, 1, NULL));
+    EXPECT_TRUE(blocks.AddWriter(12, 5, 2, NULL));
+    EXPECT_EQ(kInvalidIndex, blocks.reader(9));
+    EXPECT_EQ(1, blocks.reader(10));
+    EXPECT_EQ(1, blocks.reader(14));
+    EXPECT_EQ(kInvalidIndex, blocks.reader(15));
+    EXPECT_EQ(kInvalidIndex, blocks.writer(11));
+    EXPECT_EQ(2, blocks.writer(12));
+    EXPECT_EQ(2, blocks.writer(16));
+    EXPECT_EQ(kInvalidIndex, blocks.writer(17));
+
+    // Empty runs are fine too.
+    EXPECT_TRUE(blocks.AddReader(100, 0, 3, NULL));
+    EXPECT_EQ(1, blocks.readers().size());
+}
+
+TEST(BlockMapTest, MergeTest)
+{
+    BlockMap blocks(100);
+
+    // Touching runs of the same vertex merge, on either side.
+    EXPECT_TRUE(blocks.AddWriter(10, 5, 1, NULL));
+    EXPECT_TRUE(blocks.AddWriter(20, 5, 1, NULL));
+    EXPECT_TRUE(blocks.AddWriter(5, 5, 1, NULL));
+    EXPECT_TRUE(blocks.AddWriter(25, 5, 2, NULL));
+    EXPECT_EQ(3, blocks.writers().size());
+    EXPECT_TRUE(blocks.AddWriter(15, 5, 1, NULL));
+    ASSERT_EQ(2, blocks.writers().size());
+
+    const BlockMap::Run &run = blocks.writers().begin()->second;
+    EXPECT_EQ(5, run.start_block);
+    EXPECT_EQ(20, run.num_blocks);
+    EXPECT_EQ(1, run.vertex);
+    EXPECT_EQ(25, blocks.writers().rbegin()->second.start_block);
+    EXPECT_EQ(2, blocks.writers().rbegin()->second.vertex);
+}
+
+TEST(BlockMapTest, ConflictTest)
+{
+    BlockMap blocks(100);
+    EXPECT_TRUE(blocks.AddReader(10, 10, 1, NULL));
+    EXPECT_TRUE(blocks.AddReader(30, 10, 2, NULL));
+
+    BlockMap::Run conflict;
+    EXPECT_FALSE(blocks.AddReader(5, 6, 3, &conflict));
+    EXPECT_EQ(10, conflict.start_block);
+    EXPECT_EQ(1, conflict.vertex);
+    EXPECT_FALSE(blocks.AddReader(19, 2, 3, &conflict));
+    EXPECT_EQ(1, conflict.vertex);
+    EXPECT_FALSE(blocks.AddReader(20, 20, 3, &conflict));
+    EXPECT_EQ(30, conflict.start_block);
+    EXPECT_EQ(2, conflict.vertex);
+    EXPECT_FALSE(blocks.AddReader(0, 100, 3, NULL));
+
+    // Nothing was recorded for the failed calls.
+    EXPECT_EQ(2, blocks.readers().size());
+    EXPECT_EQ(kInvalidIndex, blocks.reader(5));
+    EXPECT_EQ(kInvalidIndex, blocks.reader(20));
+    EXPECT_TRUE(blocks.AddReader(20, 10, 3, NULL));
+    EXPECT_EQ(3, blocks.readers().size());
+
+    // Readers and writers are independent.
+    EXPECT_TRUE(blocks.AddWriter(0, 100, 3, NULL));
+}
+
+}  // namespace chromeos_update_engine
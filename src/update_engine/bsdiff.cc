@@ -0,0 +1,560 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/bsdiff.h"
+
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <utility>
+
+#include <bzlib.h>
+#include <glib.h>
+#include <glog/logging.h>
+
+#include "update_engine/utils.h"
+
+using std::max;
+using std::min;
+using std::pair;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace bsdiff {
+
+namespace {
+
+const char kMagic[] = "BSDIFF40";
+const size_t kHeaderSize = 32;
+
+// Inputs smaller than this are sorted on the calling thread; for them the
+// cost of starting threads outweighs the gain.
+const size_t kParallelSortThreshold = 4 * 1024 * 1024;
+
+// Number of possible values of the two byte keys the suffixes are bucketed
+// by first: 0 for the empty suffix, then one per single byte suffix and one
+// per byte pair.
+const size_t kNumBuckets = 1 + 256 + 256 * 256;
+
+// Runs |work| for every index in [0, count) on up to |num_threads| threads,
+// the calling one included, and returns once all of them are done.
+class ParallelFor
+{
+public:
+    ParallelFor(size_t count, const std::function<void(size_t)> &work)
+        : count_(count),
+          work_(work),
+          next_(0) {}
+
+    void Run(size_t num_threads)
+    {
+        vector<GThread *> threads;
+
+        for (size_t i = 1; i < min(num_threads, count_); i++) {
+            GThread *thread =
+                g_thread_try_new("bsdiff_sort", WorkThread, this, NULL);
+
+            // The calling thread does the work on its own if need be.
+            if (!thread) {
+                break;
+            }
+
+            threads.push_back(thread);
+        }
+
+        DoWork();
+
+        for (GThread *thread : threads) {
+            g_thread_join(thread);
+        }
+    }
+
+private:
+    void DoWork()
+    {
+        for (;;) {
+            size_t index = g_atomic_int_add(&next_, 1);
+
+            if (index >= count_) {
+                return;
+            }
+
+            work_(index);
+        }
+    }
+
+    static gpointer WorkThread(gpointer data)
+    {
+        reinterpret_cast<ParallelFor *>(data)->DoWork();
+        return NULL;
+    }
+
+    const size_t count_;
+    const std::function<void(size_t)> &work_;
+    volatile gint next_;
+
+    DISALLOW_COPY_AND_ASSIGN(ParallelFor);
+};
+
+// A run [first, second) of suffix array positions whose suffixes aren't
+// told apart yet.
+typedef pair<int32_t, int32_t> Group;
+
+// Splits |groups| into about |num_parts| consecutive parts of similar total
+// size, so that the parts can be handed to different threads. |parts|
+// receives the index of the first group of each part and a final
+// groups.size().
+void SplitGroups(const vector<Group> &groups,
+                 size_t num_parts,
+                 vector<size_t> *parts)
+{
+    size_t total = 0;
+
+    for (const Group &group : groups) {
+        total += group.second - group.first;
+    }
+
+    const size_t part_size = max(total / num_parts, static_cast<size_t>(1));
+    size_t current = 0;
+    parts->clear();
+    parts->push_back(0);
+
+    for (size_t i = 0; i < groups.size(); i++) {
+        current += groups[i].second - groups[i].first;
+
+        if (current >= part_size && i + 1 < groups.size()) {
+            parts->push_back(i + 1);
+            current = 0;
+        }
+    }
+
+    parts->push_back(groups.size());
+}
+
+// Returns the length of the common prefix of |a| and |b|.
+off_t MatchLength(const uint8_t *a, off_t a_size,
+                  const uint8_t *b, off_t b_size)
+{
+    off_t i = 0;
+
+    while (i < a_size && i < b_size && a[i] == b[i]) {
+        i++;
+    }
+
+    return i;
+}
+
+// Finds the suffix of |old_data| with the longest common prefix with
+// |new_data|, stores its position in |pos| and returns the prefix length.
+off_t Search(const vector<int32_t> &suffix_array,
+             const uint8_t *old_data, off_t old_size,
+             const uint8_t *new_data, off_t new_size,
+             off_t *pos)
+{
+    off_t start = 0;
+    off_t end = old_size;
+
+    while (end - start >= 2) {
+        off_t middle = start + (end - start) / 2;
+        off_t suffix = suffix_array[middle];
+
+        if (memcmp(old_data + suffix, new_data,
+                   min(old_size - suffix, new_size)) < 0) {
+            start = middle;
+        } else {
+            end = middle;
+        }
+    }
+
+    off_t start_length = MatchLength(old_data + suffix_array[start],
+                                     old_size - suffix_array[start],
+                                     new_data, new_size);
+    off_t end_length = MatchLength(old_data + suffix_array[end],
+                                   old_size - suffix_array[end],
+                                   new_data, new_size);
+
+    if (start_length > end_length) {
+        *pos = suffix_array[start];
+        return start_length;
+    }
+
+    *pos = suffix_array[end];
+    return end_length;
+}
+
+// Appends |value| to |out| as the 8 byte sign-magnitude little endian number
+// bspatch expects.
+void AppendOffset(off_t value, vector<char> *out)
+{
+    uint64_t magnitude = value < 0 ? -value : value;
+
+    for (int i = 0; i < 8; i++) {
+        uint8_t byte = magnitude & 0xff;
+
+        if (i == 7 && value < 0) {
+            byte |= 0x80;
+        }
+
+        out->push_back(static_cast<char>(byte));
+        magnitude >>= 8;
+    }
+}
+
+// Bzip2 compresses |in| into |out|. Unlike BzipCompress() this produces a
+// valid stream for empty input, as bspatch opens all three streams.
+bool CompressStream(const vector<char> &in, vector<char> *out)
+{
+    // The worst case size documented by libbz2.
+    unsigned int out_size = in.size() + in.size() / 100 + 600;
+    out->resize(out_size);
+    // libbz2 rejects a NULL input even if it's empty.
+    char empty = 0;
+    int rc = BZ2_bzBuffToBuffCompress(out->data(),
+                                      &out_size,
+                                      in.empty() ? &empty :
+                                      const_cast<char *>(in.data()),
+                                      in.size(),
+                                      9,  // Best compression
+                                      0,  // Silent verbosity
+                                      0);  // Default work factor
+    TEST_AND_RETURN_FALSE(rc == BZ_OK);
+    out->resize(out_size);
+    return true;
+}
+
+}  // namespace {}
+
+// Sorts the suffixes by prefix doubling: once the suffixes are sorted by
+// their first |h| bytes, sorting each group of suffixes that share them by
+// the rank of the suffix |h| bytes further sorts them by their first 2 * |h|
+// bytes. The groups are independent of each other, so each round spreads
+// them over the threads. Ranks are only updated once a round has sorted all
+// groups, so every thread sees the ranks of the previous round.
+bool BuildSuffixArray(const vector<char> &data, vector<int32_t> *suffix_array)
+{
+    TEST_AND_RETURN_FALSE(data.size() <
+                          static_cast<size_t>(std::numeric_limits<int32_t>::max()));
+    const int32_t size = data.size();
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(data.data());
+    vector<int32_t> &sa = *suffix_array;
+    sa.assign(size + 1, 0);
+
+    // The rank of a suffix is the first position of its group in the suffix
+    // array, so comparing ranks compares the sorted prefixes.
+    vector<int32_t> rank(size + 1);
+
+    // Bucket the suffixes by their first two bytes.
+    auto bucket = [bytes, size](int32_t i) -> size_t {
+        if (i == size) {
+            return 0;
+        }
+
+        if (i + 1 == size) {
+            return 1 + bytes[i];
+        }
+
+        return 1 + 256 + (bytes[i] << 8) + bytes[i + 1];
+    };
+    vector<int32_t> bucket_size(kNumBuckets, 0);
+
+    for (int32_t i = 0; i <= size; i++) {
+        bucket_size[bucket(i)]++;
+    }
+
+    // Single byte suffixes sort before the byte pairs starting with the same
+    // byte, so the buckets are laid out in that order rather than by key.
+    vector<size_t> bucket_order;
+    bucket_order.push_back(0);
+
+    for (size_t first = 0; first < 256; first++) {
+        bucket_order.push_back(1 + first);
+
+        for (size_t second = 0; second < 256; second++) {
+            bucket_order.push_back(1 + 256 + (first << 8) + second);
+        }
+    }
+
+    vector<int32_t> next_position(kNumBuckets);
+    vector<Group> groups;
+    int32_t position = 0;
+
+    for (size_t key : bucket_order) {
+        int32_t count = bucket_size[key];
+        next_position[key] = position;
+
+        if (count > 1) {
+            groups.push_back(Group(position, position + count));
+        }
+
+        position += count;
+    }
+
+    for (int32_t i = 0; i <= size; i++) {
+        sa[next_position[bucket(i)]++] = i;
+    }
+
+    // |next_position| now holds the end of each bucket, so the first
+    // suffix of a bucket is the one after the end of the previous bucket.
+    position = 0;
+
+    for (size_t key : bucket_order) {
+        for (int32_t j = position; j < next_position[key]; j++) {
+            rank[sa[j]] = position;
+        }
+
+        position = next_position[key];
+    }
+
+    size_t num_threads = 1;
+
+    if (data.size() >= kParallelSortThreshold) {
+        num_threads = max(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+    }
+
+    // The rank of the suffix |h| bytes further of each position of a group,
+    // as used to sort it.
+    vector<int32_t> keys(size + 1);
+
+    for (int32_t h = 2; !groups.empty(); h *= 2) {
+        vector<size_t> parts;
+        SplitGroups(groups, num_threads * 4, &parts);
+
+        // Suffixes of a group share their first |h| bytes. The empty suffix
+        // is alone in its group, so none of them ends within |h| bytes and
+        // i + h is a valid index for each.
+        std::function<void(size_t)> sort_part = [&](size_t part) {
+            // Sorting the keys packed with the suffixes keeps the sort from
+            // chasing into |rank| on every comparison.
+            vector<uint64_t> packed;
+
+            for (size_t g = parts[part]; g < parts[part + 1]; g++) {
+                const Group &group = groups[g];
+                packed.clear();
+
+                for (int32_t j = group.first; j < group.second; j++) {
+                    packed.push_back(
+                        (static_cast<uint64_t>(rank[sa[j] + h]) << 32) | sa[j]);
+                }
+
+                std::sort(packed.begin(), packed.end());
+
+                for (int32_t j = group.first; j < group.second; j++) {
+                    const uint64_t value = packed[j - group.first];
+                    sa[j] = static_cast<int32_t>(value & 0xffffffff);
+                    keys[j] = static_cast<int32_t>(value >> 32);
+                }
+            }
+        };
+        ParallelFor(parts.size() - 1, sort_part).Run(num_threads);
+
+        // Split the groups where the keys differ and collect the new groups
+        // of each part in order.
+        vector<vector<Group>> part_groups(parts.size() - 1);
+        std::function<void(size_t)> split_part = [&](size_t part) {
+            for (size_t g = parts[part]; g < parts[part + 1]; g++) {
+                const Group &group = groups[g];
+                int32_t start = group.first;
+
+                for (int32_t j = group.first; j <= group.second; j++) {
+                    if (j == group.second || keys[j] != keys[start]) {
+                        if (j - start > 1) {
+                            part_groups[part].push_back(Group(start, j));
+                        }
+
+                        start = j;
+                    }
+
+                    if (j < group.second) {
+                        rank[sa[j]] = start;
+                    }
+                }
+            }
+        };
+        ParallelFor(parts.size() - 1, split_part).Run(num_threads);
+
+        groups.clear();
+
+        for (const vector<Group> &new_groups : part_groups) {
+            groups.insert(groups.end(), new_groups.begin(), new_groups.end());
+        }
+    }
+
+    return true;
+}
+
+// This is the bsdiff 4 algorithm by Colin Percival: it extends approximate
+// matches found through the suffix array of the old data forwards and
+// backwards, stores the bytewise difference of the matched regions in the
+// diff block and the unmatched new bytes in the extra block.
+bool Diff(const vector<char> &old_data,
+          const vector<char> &new_data,
+          vector<char> *patch)
+{
+    vector<int32_t> suffix_array;
+    TEST_AND_RETURN_FALSE(BuildSuffixArray(old_data, &suffix_array));
+
+    const uint8_t *old_bytes =
+        reinterpret_cast<const uint8_t *>(old_data.data());
+    const uint8_t *new_bytes =
+        reinterpret_cast<const uint8_t *>(new_data.data());
+    const off_t old_size = old_data.size();
+    const off_t new_size = new_data.size();
+
+    vector<char> control;
+    vector<char> diff;
+    vector<char> extra;
+    diff.reserve(new_size);
+
+    off_t scan = 0;
+    off_t length = 0;
+    off_t pos = 0;
+    off_t last_scan = 0;
+    off_t last_pos = 0;
+    off_t last_offset = 0;
+
+    while (scan < new_size) {
+        off_t old_score = 0;
+        off_t scsc = scan += length;
+
+        for (; scan < new_size; scan++) {
+            length = Search(suffix_array, old_bytes, old_size,
+                            new_bytes + scan, new_size - scan, &pos);
+
+            for (; scsc < scan + length; scsc++) {
+                if (scsc + last_offset < old_size &&
+                        old_bytes[scsc + last_offset] == new_bytes[scsc]) {
+                    old_score++;
+                }
+            }
+
+            if ((length == old_score && length != 0) ||
+                    length > old_score + 8) {
+                break;
+            }
+
+            if (scan + last_offset < old_size &&
+                    old_bytes[scan + last_offset] == new_bytes[scan]) {
+                old_score--;
+            }
+        }
+
+        if (length == old_score && scan != new_size) {
+            continue;
+        }
+
+        // Extend the previous match forwards...
+        off_t score = 0;
+        off_t best_forward_score = 0;
+        off_t forward_length = 0;
+
+        for (off_t i = 0; last_scan + i < scan && last_pos + i < old_size;) {
+            if (old_bytes[last_pos + i] == new_bytes[last_scan + i]) {
+                score++;
+            }
+
+            i++;
+
+            if (score * 2 - i > best_forward_score * 2 - forward_length) {
+                best_forward_score = score;
+                forward_length = i;
+            }
+        }
+
+        // ...and the new one backwards.
+        off_t backward_length = 0;
+
+        if (scan < new_size) {
+            score = 0;
+            off_t best_backward_score = 0;
+
+            for (off_t i = 1; scan >= last_scan + i && pos >= i; i++) {
+                if (old_bytes[pos - i] == new_bytes[scan - i]) {
+                    score++;
+                }
+
+                if (score * 2 - i > best_backward_score * 2 - backward_length) {
+                    best_backward_score = score;
+                    backward_length = i;
+                }
+            }
+        }
+
+        // If the extensions overlap, split the overlap where it fits best.
+        if (last_scan + forward_length > scan - backward_length) {
+            off_t overlap = (last_scan + forward_length) -
+                            (scan - backward_length);
+            score = 0;
+            off_t best_score = 0;
+            off_t split_length = 0;
+
+            for (off_t i = 0; i < overlap; i++) {
+                if (new_bytes[last_scan + forward_length - overlap + i] ==
+                        old_bytes[last_pos + forward_length - overlap + i]) {
+                    score++;
+                }
+
+                if (new_bytes[scan - backward_length + i] ==
+                        old_bytes[pos - backward_length + i]) {
+                    score--;
+                }
+
+                if (score > best_score) {
+                    best_score = score;
+                    split_length = i + 1;
+                }
+            }
+
+            forward_length += split_length - overlap;
+            backward_length -= split_length;
+        }
+
+        for (off_t i = 0; i < forward_length; i++) {
+            diff.push_back(new_bytes[last_scan + i] - old_bytes[last_pos + i]);
+        }
+
+        const off_t extra_length =
+            (scan - backward_length) - (last_scan + forward_length);
+        extra.insert(extra.end(),
+                     new_data.begin() + last_scan + forward_length,
+                     new_data.begin() + last_scan + forward_length +
+                     extra_length);
+
+        AppendOffset(forward_length, &control);
+        AppendOffset(extra_length, &control);
+        AppendOffset((pos - backward_length) - (last_pos + forward_length),
+                     &control);
+
+        last_scan = scan - backward_length;
+        last_pos = pos - backward_length;
+        last_offset = pos - scan;
+    }
+
+    vector<char> control_bz;
+    vector<char> diff_bz;
+    vector<char> extra_bz;
+    TEST_AND_RETURN_FALSE(CompressStream(control, &control_bz));
+    TEST_AND_RETURN_FALSE(CompressStream(diff, &diff_bz));
+    TEST_AND_RETURN_FALSE(CompressStream(extra, &extra_bz));
+
+    patch->clear();
+    patch->reserve(kHeaderSize + control_bz.size() + diff_bz.size() +
+                   extra_bz.size());
+    patch->insert(patch->end(), kMagic, kMagic + strlen(kMagic));
+    AppendOffset(control_bz.size(), patch);
+    AppendOffset(diff_bz.size(), patch);
+    AppendOffset(new_size, patch);
+    CHECK_EQ(patch->size(), kHeaderSize);
+    patch->insert(patch->end(), control_bz.begin(), control_bz.end());
+    patch->insert(patch->end(), diff_bz.begin(), diff_bz.end());
+    patch->insert(patch->end(), extra_bz.begin(), extra_bz.end());
+    return true;
+}
+
+}  // namespace bsdiff
+
+}  // namespace chromeos_update_engine
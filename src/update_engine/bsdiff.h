@@ -0,0 +1,37 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_BSDIFF_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_BSDIFF_H__
+
+#include <stdint.h>
+
+#include <vector>
+
+// An in-process implementation of the bsdiff algorithm. The patches it
+// creates are in the BSDIFF40 format read by the bspatch tool on the client,
+// so they can be used as the data of BSDIFF operations as is.
+
+namespace chromeos_update_engine {
+
+namespace bsdiff {
+
+// Sorts the suffixes of |data| into |suffix_array|, which is resized to
+// data.size() + 1. The empty suffix is included and comes first. Large inputs
+// are sorted on multiple threads. Returns true on success, false if |data| is
+// too large to be indexed.
+bool BuildSuffixArray(const std::vector<char> &data,
+                      std::vector<int32_t> *suffix_array);
+
+// Computes the patch that turns |old_data| into |new_data| and stores it in
+// |patch|. Returns true on success.
+bool Diff(const std::vector<char> &old_data,
+          const std::vector<char> &new_data,
+          std::vector<char> *patch);
+
+}  // namespace bsdiff
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_BSDIFF_H__
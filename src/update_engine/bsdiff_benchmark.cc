@@ -0,0 +1,179 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "update_engine/bsdiff.h"
+#include "update_engine/filesystem_iterator.h"
+#include "update_engine/utils.h"
+
+DEFINE_string(old_dir, "",
+              "Directory where the old partition is loop mounted read-only");
+DEFINE_string(new_dir, "",
+              "Directory where the new partition is loop mounted read-only");
+DEFINE_int64(min_size, 0, "Skip files smaller than this many bytes");
+
+// This program measures the bsdiff step of delta generation: it diffs every
+// regular file of the new directory against the file at the same path in the
+// old directory, as delta_generator does, and reports the time and the peak
+// memory each diff takes. Each file is diffed in a child process so that the
+// peak resident set size is that of the file alone.
+
+using std::set;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The result of diffing one file, as reported by the child process.
+struct DiffResult {
+    bool success;
+    int64_t patch_size;
+    double seconds;
+};
+
+// Diffs |old_path| against |new_path| and reports the result through |fd|.
+void DiffInChild(const string &old_path, const string &new_path, int fd)
+{
+    DiffResult result = { false, 0, 0.0 };
+    vector<char> old_data;
+    vector<char> new_data;
+    vector<char> patch;
+
+    if (utils::ReadFile(old_path, &old_data) &&
+            utils::ReadFile(new_path, &new_data)) {
+        auto start = std::chrono::steady_clock::now();
+        result.success = bsdiff::Diff(old_data, new_data, &patch);
+        result.seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start).count();
+        result.patch_size = patch.size();
+    }
+
+    utils::WriteAll(fd, &result, sizeof(result));
+}
+
+// Diffs the files in a child process and stores the result and the peak
+// resident set size of the child in KiB. Returns true on success.
+bool BenchmarkFile(const string &old_path,
+                   const string &new_path,
+                   DiffResult *result,
+                   long *max_rss_kb)
+{
+    int fds[2];
+    TEST_AND_RETURN_FALSE_ERRNO(pipe(fds) == 0);
+    pid_t pid = fork();
+    TEST_AND_RETURN_FALSE_ERRNO(pid >= 0);
+
+    if (pid == 0) {
+        close(fds[0]);
+        DiffInChild(old_path, new_path, fds[1]);
+        _exit(0);
+    }
+
+    close(fds[1]);
+    // The result is smaller than PIPE_BUF, so it arrives in one piece.
+    ssize_t bytes_read = read(fds[0], result, sizeof(*result));
+    close(fds[0]);
+
+    int status = 0;
+    struct rusage usage;
+    TEST_AND_RETURN_FALSE_ERRNO(wait4(pid, &status, 0, &usage) == pid);
+    TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(sizeof(*result)));
+    TEST_AND_RETURN_FALSE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    *max_rss_kb = usage.ru_maxrss;
+    return true;
+}
+
+int Main(int argc, char **argv)
+{
+    // Disable glog's default behavior of logging to files.
+    FLAGS_logtostderr = true;
+    GFLAGS_NAMESPACE::ParseCommandLineFlags(&argc, &argv, true);
+    google::InitGoogleLogging(argv[0]);
+
+    LOG_IF(FATAL, FLAGS_old_dir.empty() || FLAGS_new_dir.empty())
+            << "Must pass --old_dir and --new_dir.";
+
+    int64_t total_new_size = 0;
+    int64_t total_patch_size = 0;
+    double total_seconds = 0.0;
+    long max_rss_kb = 0;
+    int failures = 0;
+
+    printf("%12s %12s %12s %10s %10s  %s\n",
+           "old size", "new size", "patch size", "seconds", "peak KiB",
+           "file");
+
+    for (FilesystemIterator fs_iter(FLAGS_new_dir,
+                                    set<string> {"/lost+found"});
+            !fs_iter.IsEnd(); fs_iter.Increment()) {
+        if (!S_ISREG(fs_iter.GetStat().st_mode) ||
+                fs_iter.GetStat().st_size < FLAGS_min_size) {
+            continue;
+        }
+
+        string old_path = FLAGS_old_dir + fs_iter.GetPartialPath();
+        struct stat old_stbuf;
+
+        if (lstat(old_path.c_str(), &old_stbuf) != 0 ||
+                !S_ISREG(old_stbuf.st_mode)) {
+            continue;
+        }
+
+        DiffResult result;
+        long file_rss_kb = 0;
+
+        if (!BenchmarkFile(old_path, fs_iter.GetFullPath(), &result,
+                           &file_rss_kb) || !result.success) {
+            LOG(ERROR) << "Failed to diff " << fs_iter.GetPartialPath();
+            failures++;
+            continue;
+        }
+
+        printf("%12jd %12jd %12jd %10.3f %10ld  %s\n",
+               static_cast<intmax_t>(old_stbuf.st_size),
+               static_cast<intmax_t>(fs_iter.GetStat().st_size),
+               static_cast<intmax_t>(result.patch_size),
+               result.seconds,
+               file_rss_kb,
+               fs_iter.GetPartialPath().c_str());
+        total_new_size += fs_iter.GetStat().st_size;
+        total_patch_size += result.patch_size;
+        total_seconds += result.seconds;
+        max_rss_kb = std::max(max_rss_kb, file_rss_kb);
+    }
+
+    printf("%12s %12jd %12jd %10.3f %10ld  %s\n", "",
+           static_cast<intmax_t>(total_new_size),
+           static_cast<intmax_t>(total_patch_size),
+           total_seconds,
+           max_rss_kb,
+           "<total>");
+    return failures == 0 ? 0 : 1;
+}
+
+}  // namespace {}
+
+}  // namespace chromeos_update_engine
+
+int main(int argc, char **argv)
+{
+    return chromeos_update_engine::Main(argc, argv);
+}
@@ -0,0 +1,197 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "macros.h"
+#include "update_engine/bsdiff.h"
+#include "update_engine/bzip.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class BsdiffTest : public ::testing::Test { };
+
+namespace {
+
+// Fills |data| with |size| pseudo random bytes out of |alphabet| values, so
+// that small alphabets give plenty of repeated substrings.
+void RandomData(size_t size, int alphabet, unsigned int seed,
+                vector<char> *data)
+{
+    data->resize(size);
+
+    for (size_t i = 0; i < size; i++) {
+        (*data)[i] = 'a' + (rand_r(&seed) >> 8) % alphabet;
+    }
+}
+
+int64_t ReadOffset(const char *buf)
+{
+    int64_t value = 0;
+
+    for (int i = 7; i >= 0; i--) {
+        value = (value << 8) | static_cast<uint8_t>(buf[i] & (i == 7 ? 0x7f : 0xff));
+    }
+
+    return (buf[7] & 0x80) ? -value : value;
+}
+
+// Applies a BSDIFF40 |patch| to |old_data| the way bspatch does.
+bool Patch(const vector<char> &old_data, const vector<char> &patch,
+           vector<char> *new_data)
+{
+    if (patch.size() < 32 || memcmp(patch.data(), "BSDIFF40", 8) != 0) {
+        return false;
+    }
+
+    int64_t control_size = ReadOffset(&patch[8]);
+    int64_t diff_size = ReadOffset(&patch[16]);
+    int64_t new_size = ReadOffset(&patch[24]);
+    vector<char> control, diff, extra;
+    vector<char>::const_iterator it = patch.begin() + 32;
+
+    if (!BzipDecompress(vector<char>(it, it + control_size), &control) ||
+            !BzipDecompress(vector<char>(it + control_size,
+                                         it + control_size + diff_size), &diff) ||
+            !BzipDecompress(vector<char>(it + control_size + diff_size,
+                                         patch.end()), &extra)) {
+        return false;
+    }
+
+    new_data->clear();
+    int64_t old_pos = 0;
+    size_t diff_pos = 0;
+    size_t extra_pos = 0;
+
+    for (size_t c = 0; c + 24 <= control.size(); c += 24) {
+        int64_t add = ReadOffset(&control[c]);
+        int64_t copy = ReadOffset(&control[c + 8]);
+        int64_t seek = ReadOffset(&control[c + 16]);
+
+        for (int64_t i = 0; i < add; i++) {
+            new_data->push_back(diff[diff_pos++] + old_data[old_pos + i]);
+        }
+
+        old_pos += add;
+        new_data->insert(new_data->end(), extra.begin() + extra_pos,
+                         extra.begin() + extra_pos + copy);
+        extra_pos += copy;
+        old_pos += seek;
+    }
+
+    return static_cast<int64_t>(new_data->size()) == new_size;
+}
+
+// Checks that |suffix_array| is a permutation of the suffixes of |data| in
+// increasing order.
+void ExpectSorted(const vector<char> &data,
+                  const vector<int32_t> &suffix_array)
+{
+    ASSERT_EQ(data.size() + 1, suffix_array.size());
+    vector<bool> seen(suffix_array.size(), false);
+
+    for (int32_t suffix : suffix_array) {
+        ASSERT_GE(suffix, 0);
+        ASSERT_LE(suffix, static_cast<int32_t>(data.size()));
+        ASSERT_FALSE(seen[suffix]);
+        seen[suffix] = true;
+    }
+
+    for (size_t i = 1; i < suffix_array.size(); i++) {
+        ASSERT_TRUE(std::lexicographical_compare(
+                        data.begin() + suffix_array[i - 1], data.end(),
+                        data.begin() + suffix_array[i], data.end()))
+                << "at " << i;
+    }
+}
+
+}  // namespace {}
+
+TEST_F(BsdiffTest, SuffixArrayTest)
+{
+    const string kText = "mississippi";
+    vector<char> data(kText.begin(), kText.end());
+    vector<int32_t> suffix_array;
+    EXPECT_TRUE(bsdiff::BuildSuffixArray(data, &suffix_array));
+    const int32_t kExpected[] = { 11, 10, 7, 4, 1, 0, 9, 8, 6, 3, 5, 2 };
+    EXPECT_EQ(vector<int32_t>(kExpected, kExpected + arraysize(kExpected)),
+              suffix_array);
+
+    EXPECT_TRUE(bsdiff::BuildSuffixArray(vector<char>(), &suffix_array));
+    EXPECT_EQ(vector<int32_t>(1, 0), suffix_array);
+}
+
+TEST_F(BsdiffTest, SuffixArrayRepetitiveTest)
+{
+    vector<char> data;
+    RandomData(20000, 2, 1, &data);
+    data.insert(data.end(), 5000, '\0');
+    vector<int32_t> suffix_array;
+    EXPECT_TRUE(bsdiff::BuildSuffixArray(data, &suffix_array));
+    ExpectSorted(data, suffix_array);
+}
+
+TEST_F(BsdiffTest, SuffixArrayParallelTest)
+{
+    // Large enough to be sorted on multiple threads.
+    vector<char> data;
+    RandomData(5 * 1024 * 1024, 4, 2, &data);
+    vector<int32_t> suffix_array;
+    EXPECT_TRUE(bsdiff::BuildSuffixArray(data, &suffix_array));
+    ExpectSorted(data, suffix_array);
+}
+
+TEST_F(BsdiffTest, DiffTest)
+{
+    vector<char> old_data;
+    RandomData(100000, 26, 3, &old_data);
+
+    // Change some bytes, drop a range and insert new data.
+    vector<char> new_data = old_data;
+
+    for (size_t i = 0; i < new_data.size(); i += 1000) {
+        new_data[i]++;
+    }
+
+    new_data.erase(new_data.begin() + 20000, new_data.begin() + 30000);
+    vector<char> inserted;
+    RandomData(5000, 26, 4, &inserted);
+    new_data.insert(new_data.begin() + 50000, inserted.begin(), inserted.end());
+
+    vector<char> patch;
+    EXPECT_TRUE(bsdiff::Diff(old_data, new_data, &patch));
+    EXPECT_LT(patch.size(), new_data.size() / 4);
+
+    vector<char> patched;
+    EXPECT_TRUE(Patch(old_data, patch, &patched));
+    EXPECT_TRUE(patched == new_data);
+}
+
+TEST_F(BsdiffTest, DiffEmptyTest)
+{
+    vector<char> data;
+    RandomData(1000, 26, 5, &data);
+    vector<char> patch;
+    vector<char> patched;
+
+    EXPECT_TRUE(bsdiff::Diff(vector<char>(), data, &patch));
+    EXPECT_TRUE(Patch(vector<char>(), patch, &patched));
+    EXPECT_TRUE(patched == data);
+
+    EXPECT_TRUE(bsdiff::Diff(data, vector<char>(), &patch));
+    EXPECT_TRUE(Patch(data, patch, &patched));
+    EXPECT_TRUE(patched.empty());
+}
+
+}  // namespace chromeos_update_engine
@@ -16,9 +16,13 @@ namespace chromeos_update_engine {
 
 namespace {
 
+// Levels are the bzip2 block size in units of 100 KB.
+const int kBzipBestLevel = 9;
+
 // BzipData compresses or decompresses the input to the output.
 // Returns true on success.
-// Use one of BzipBuffToBuff*ompress as the template parameter to BzipData().
+// Pass one of BzipBuffToBuff*ompress, with any parameters past |in_length|
+// bound, as |f| to BzipData().
 int BzipBuffToBuffDecompress(char *out,
                              uint32_t *out_length,
                              const char *in,
@@ -35,22 +39,23 @@ int BzipBuffToBuffDecompress(char *out,
 int BzipBuffToBuffCompress(char *out,
                            uint32_t *out_length,
                            const char *in,
-                           uint32_t in_length)
+                           uint32_t in_length,
+                           int level)
 {
     return BZ2_bzBuffToBuffCompress(out,
                                     out_length,
                                     const_cast<char *>(in),
                                     in_length,
-                                    9,  // Best compression
+                                    level,
                                     0,  // Silent verbosity
                                     0);  // Default work factor
 }
 
-template<int F(char *out,
-               uint32_t *out_length,
-               const char *in,
-               uint32_t in_length)>
-bool BzipData(const char *const in,
+// The buffer |out| already has is reused, so passing the same vector for
+// many inputs of about the same size doesn't allocate each time.
+template<typename F>
+bool BzipData(F f,
+              const char *const in,
               const int32_t in_size,
               vector<char> *const out)
 {
@@ -67,7 +72,7 @@ bool BzipData(const char *const in,
 
     for (;;) {
         uint32_t data_size = buf_size;
-        int rc = F(&(*out)[0], &data_size, in, in_size);
+        int rc = f(&(*out)[0], &data_size, in, in_size);
         TEST_AND_RETURN_FALSE(rc == BZ_OUTBUFF_FULL || rc == BZ_OK);
 
         if (rc == BZ_OK) {
@@ -82,18 +87,52 @@ bool BzipData(const char *const in,
     }
 }
 
+bool BzipDecompressData(const char *const in,
+                        const int32_t in_size,
+                        vector<char> *const out)
+{
+    return BzipData(BzipBuffToBuffDecompress, in, in_size, out);
+}
+
+bool BzipCompressData(const char *const in,
+                      const int32_t in_size,
+                      int level,
+                      vector<char> *const out)
+{
+    TEST_AND_RETURN_FALSE(level >= 1 && level <= kBzipBestLevel);
+    return BzipData([level](char *out,
+                            uint32_t *out_length,
+                            const char *in,
+                            uint32_t in_length) {
+        return BzipBuffToBuffCompress(out, out_length, in, in_length, level);
+    },
+    in, in_size, out);
+}
+
+bool BzipBestCompressData(const char *const in,
+                          const int32_t in_size,
+                          vector<char> *const out)
+{
+    return BzipCompressData(in, in_size, kBzipBestLevel, out);
+}
+
 }  // namespace {}
 
 bool BzipDecompress(const std::vector<char> &in, std::vector<char> *out)
 {
-    return BzipData<BzipBuffToBuffDecompress>(&in[0],
-            static_cast<int32_t>(in.size()),
-            out);
+    return BzipDecompressData(&in[0], static_cast<int32_t>(in.size()), out);
 }
 
 bool BzipCompress(const std::vector<char> &in, std::vector<char> *out)
 {
-    return BzipData<BzipBuffToBuffCompress>(&in[0], in.size(), out);
+    return BzipBestCompressData(&in[0], in.size(), out);
+}
+
+bool BzipCompress(const std::vector<char> &in,
+                  int level,
+                  std::vector<char> *out)
+{
+    return BzipCompressData(&in[0], in.size(), level, out);
 }
 
 namespace {
@@ -117,13 +156,13 @@ bool BzipString(const std::string &str,
 bool BzipCompressString(const std::string &str,
                         std::vector<char> *out)
 {
-    return BzipString<BzipData<BzipBuffToBuffCompress>>(str, out);
+    return BzipString<BzipBestCompressData>(str, out);
 }
 
 bool BzipDecompressString(const std::string &str,
                           std::vector<char> *out)
 {
-    return BzipString<BzipData<BzipBuffToBuffDecompress>>(str, out);
+    return BzipString<BzipDecompressData>(str, out);
 }
 
 } // namespace chromeos_update_engine
@@ -10,6 +10,12 @@ namespace chromeos_update_engine {
 // Bzip2 compresses or decompresses str/in to out.
 bool BzipDecompress(const std::vector<char> &in, std::vector<char> *out);
 bool BzipCompress(const std::vector<char> &in, std::vector<char> *out);
+// Like BzipCompress(), which compresses best, but at |level|, from 1 to 9.
+// Lower levels use smaller blocks, so they take less memory and a little
+// less time.
+bool BzipCompress(const std::vector<char> &in,
+                  int level,
+                  std::vector<char> *out);
 bool BzipCompressString(const std::string &str, std::vector<char> *out);
 bool BzipDecompressString(const std::string &str, std::vector<char> *out);
 
@@ -0,0 +1,85 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/chunk_processor.h"
+
+#include "update_engine/bzip.h"
+#include "update_engine/utils.h"
+
+using std::make_pair;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+ChunkProcessor::ChunkProcessor(int fd, off_t offset, size_t size)
+    : thread_(NULL),
+      fd_(fd),
+      ranges_(1, make_pair(offset, size)),
+      buffer_in_(size) {}
+
+ChunkProcessor::ChunkProcessor(int fd,
+                               const vector<Extent> &extents,
+                               off_t block_size)
+    : thread_(NULL),
+      fd_(fd)
+{
+    CHECK(!extents.empty());
+    size_t size = 0;
+
+    for (const Extent &extent : extents) {
+        ranges_.push_back(make_pair(extent.start_block() * block_size,
+                                    extent.num_blocks() * block_size));
+        size += ranges_.back().second;
+    }
+
+    buffer_in_.resize(size);
+}
+
+bool ChunkProcessor::Start()
+{
+    // g_thread_create is deprecated since glib 2.32. Use
+    // g_thread_new instead.
+    thread_ = g_thread_try_new("chunk_proc", ReadAndCompressThread, this, NULL);
+    TEST_AND_RETURN_FALSE(thread_ != NULL);
+    return true;
+}
+
+bool ChunkProcessor::Wait()
+{
+    if (!thread_) {
+        return false;
+    }
+
+    gpointer result = g_thread_join(thread_);
+    thread_ = NULL;
+    TEST_AND_RETURN_FALSE(result == this);
+    return true;
+}
+
+gpointer ChunkProcessor::ReadAndCompressThread(gpointer data)
+{
+    return
+        reinterpret_cast<ChunkProcessor *>(data)->ReadAndCompress() ? data : NULL;
+}
+
+bool ChunkProcessor::ReadAndCompress()
+{
+    char *buffer = buffer_in_.data();
+
+    for (const std::pair<off_t, size_t> &range : ranges_) {
+        ssize_t bytes_read = -1;
+        TEST_AND_RETURN_FALSE(utils::PReadAll(fd_,
+                                              buffer,
+                                              range.second,
+                                              range.first,
+                                              &bytes_read));
+        TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(range.second));
+        buffer += range.second;
+    }
+
+    TEST_AND_RETURN_FALSE(BzipCompress(buffer_in_, &buffer_compressed_));
+    return true;
+}
+
+}  // namespace chromeos_update_engine
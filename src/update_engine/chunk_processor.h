@@ -0,0 +1,86 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_CHUNK_PROCESSOR_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_CHUNK_PROCESSOR_H__
+
+#include <glib.h>
+#include <sys/types.h>
+
+#include <utility>
+#include <vector>
+
+#include "macros.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// This class encapsulates a chunk processing thread. The processor reads a
+// chunk of data from the input file descriptor and compresses it. The
+// processor needs to be started through Start() then waited on through
+// Wait().
+class ChunkProcessor
+{
+public:
+    // Read a chunk of |size| bytes from |fd| starting at offset |offset|.
+    ChunkProcessor(int fd, off_t offset, size_t size);
+
+    // Read the blocks of |extents|, of |block_size| bytes each, from |fd|
+    // one after the other into a single chunk.
+    ChunkProcessor(int fd,
+                   const std::vector<Extent> &extents,
+                   off_t block_size);
+
+    ~ChunkProcessor()
+    {
+        Wait();
+    }
+
+    // The offset of the first byte of the chunk.
+    off_t offset() const
+    {
+        return ranges_.front().first;
+    }
+    const std::vector<char> &buffer_in() const
+    {
+        return buffer_in_;
+    }
+    const std::vector<char> &buffer_compressed() const
+    {
+        return buffer_compressed_;
+    }
+
+    // Starts the processor. Returns true on success, false on failure.
+    bool Start();
+
+    // Waits for the processor to complete. Returns true on success, false on
+    // failure.
+    bool Wait();
+
+    bool ShouldCompress() const
+    {
+        return buffer_compressed_.size() < buffer_in_.size();
+    }
+
+private:
+    // Reads the input data into |buffer_in_| and compresses it into
+    // |buffer_compressed_|. Returns true on success, false otherwise.
+    bool ReadAndCompress();
+    static gpointer ReadAndCompressThread(gpointer data);
+
+    GThread *thread_;
+    int fd_;
+
+    // The byte ranges to read, as offset and size.
+    std::vector<std::pair<off_t, size_t>> ranges_;
+
+    std::vector<char> buffer_in_;
+    std::vector<char> buffer_compressed_;
+
+    DISALLOW_COPY_AND_ASSIGN(ChunkProcessor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_CHUNK_PROCESSOR_H__
@@ -0,0 +1,67 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <fcntl.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "files/scoped_file.h"
+#include "update_engine/bzip.h"
+#include "update_engine/chunk_processor.h"
+#include "update_engine/test_utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+const size_t kBlockSize = 4096;
+}  // namespace {}
+
+class ChunkProcessorTest : public ::testing::Test { };
+
+TEST(ChunkProcessorTest, ExtentsTest)
+{
+    vector<char> data(16 * kBlockSize);
+    FillWithData(&data);
+
+    string path;
+    EXPECT_TRUE(utils::MakeTempFile("/tmp/ChunkProcessorTest.XXXXXX",
+                                    &path,
+                                    NULL));
+    ScopedPathUnlinker path_unlinker(path);
+    EXPECT_TRUE(WriteFileVector(path, data));
+    int fd = open(path.c_str(), O_RDONLY, 0);
+    EXPECT_GE(fd, 0);
+    files::ScopedFD fd_closer(fd);
+
+    vector<Extent> extents(2);
+    extents[0].set_start_block(10);
+    extents[0].set_num_blocks(3);
+    extents[1].set_start_block(2);
+    extents[1].set_num_blocks(1);
+
+    ChunkProcessor processor(fd, extents, kBlockSize);
+    EXPECT_EQ(10 * kBlockSize, processor.offset());
+    EXPECT_TRUE(processor.Start());
+    EXPECT_TRUE(processor.Wait());
+
+    // The extents are read in order, one after the other.
+    vector<char> expected(data.begin() + 10 * kBlockSize,
+                          data.begin() + 13 * kBlockSize);
+    expected.insert(expected.end(),
+                    data.begin() + 2 * kBlockSize,
+                    data.begin() + 3 * kBlockSize);
+    EXPECT_TRUE(processor.buffer_in() == expected);
+
+    vector<char> decompressed;
+    EXPECT_TRUE(BzipDecompress(processor.buffer_compressed(), &decompressed));
+    EXPECT_TRUE(decompressed == expected);
+}
+
+}  // namespace chromeos_update_engine
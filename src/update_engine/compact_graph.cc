@@ -0,0 +1,68 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/compact_graph.h"
+
+#include <limits>
+
+#include <glog/logging.h>
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+template<typename T>
+uint64_t VectorMemoryUsage(const vector<T> &vect)
+{
+    return vect.capacity() * sizeof(T);
+}
+
+}  // namespace {}
+
+CompactGraph::CompactGraph(const Graph &graph)
+{
+    CHECK_LT(graph.size(), std::numeric_limits<uint32_t>::max());
+
+    // Size everything exactly, as these can be large.
+    size_t edge_count = 0;
+
+    for (const Vertex &vertex : graph) {
+        edge_count += vertex.out_edges.size();
+    }
+
+    CHECK_LT(edge_count, std::numeric_limits<EdgeIndex>::max());
+    edge_offsets_.reserve(graph.size() + 1);
+    edge_targets_.reserve(edge_count);
+    edge_weights_.reserve(edge_count);
+
+    edge_offsets_.push_back(0);
+
+    for (const Vertex &vertex : graph) {
+        for (const auto &edge : vertex.out_edges) {
+            uint64_t weight = 0;
+
+            for (const Extent &extent : edge.second.extents) {
+                if (extent.start_block() != kSparseHole) {
+                    weight += extent.num_blocks();
+                }
+            }
+
+            edge_targets_.push_back(edge.first);
+            edge_weights_.push_back(weight);
+        }
+
+        edge_offsets_.push_back(edge_targets_.size());
+    }
+}
+
+uint64_t CompactGraph::MemoryUsage() const
+{
+    return VectorMemoryUsage(edge_offsets_) +
+           VectorMemoryUsage(edge_targets_) +
+           VectorMemoryUsage(edge_weights_);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,81 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_COMPACT_GRAPH_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_COMPACT_GRAPH_H__
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "macros.h"
+#include "update_engine/graph_types.h"
+
+// A read-only snapshot of the edges of a Graph in compressed sparse row form.
+// The out edges of all vertices live in a few flat arrays, sorted by source
+// and then by target like the EdgeMaps they come from, with their weights
+// but not their extents. This takes a fraction of the memory of the Graph's
+// maps and is much faster to traverse, so the algorithms that only read the
+// graph (cycle breaking, strongly connected components, topological sorting)
+// work on a CompactGraph built right before they run, shared while the graph
+// doesn't change.
+
+namespace chromeos_update_engine {
+
+class CompactGraph
+{
+public:
+    // Index of an edge, in [0, num_edges()).
+    typedef uint32_t EdgeIndex;
+
+    explicit CompactGraph(const Graph &graph);
+
+    Vertex::Index size() const
+    {
+        return edge_offsets_.size() - 1;
+    }
+
+    EdgeIndex num_edges() const
+    {
+        return edge_targets_.size();
+    }
+
+    // The out edges of |vertex| are [EdgesBegin(vertex), EdgesEnd(vertex)).
+    EdgeIndex EdgesBegin(Vertex::Index vertex) const
+    {
+        return edge_offsets_[vertex];
+    }
+
+    EdgeIndex EdgesEnd(Vertex::Index vertex) const
+    {
+        return edge_offsets_[vertex + 1];
+    }
+
+    Vertex::Index EdgeTarget(EdgeIndex edge) const
+    {
+        return edge_targets_[edge];
+    }
+
+    // Same as graph_utils::EdgeWeight() for the edge in the original graph.
+    uint64_t EdgeWeight(EdgeIndex edge) const
+    {
+        return edge_weights_[edge];
+    }
+
+    // Returns the number of bytes allocated for the graph.
+    uint64_t MemoryUsage() const;
+
+private:
+    // Index of the first out edge of each vertex, plus the number of edges.
+    std::vector<EdgeIndex> edge_offsets_;
+
+    std::vector<uint32_t> edge_targets_;
+    std::vector<uint64_t> edge_weights_;
+
+    DISALLOW_COPY_AND_ASSIGN(CompactGraph);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_COMPACT_GRAPH_H__
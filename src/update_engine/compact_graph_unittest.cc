@@ -0,0 +1,76 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/compact_graph.h"
+#include "update_engine/graph_types.h"
+#include "update_engine/graph_utils.h"
+
+using std::make_pair;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class CompactGraphTest : public ::testing::Test {};
+
+namespace {
+Extent MakeExtent(uint64_t start_block, uint64_t num_blocks)
+{
+    Extent extent;
+    extent.set_start_block(start_block);
+    extent.set_num_blocks(num_blocks);
+    return extent;
+}
+}  // namespace {}
+
+TEST(CompactGraphTest, SimpleTest)
+{
+    Graph graph(4);
+
+    EdgeProperties props;
+    props.extents.push_back(MakeExtent(10, 2));
+    props.extents.push_back(MakeExtent(kSparseHole, 5));
+    graph[0].out_edges.insert(make_pair(3, props));
+    props.write_extents.push_back(MakeExtent(20, 1));
+    graph[0].out_edges.insert(make_pair(1, props));
+    graph[2].out_edges.insert(make_pair(0, EdgeProperties()));
+
+    CompactGraph compact_graph(graph);
+    EXPECT_EQ(4, compact_graph.size());
+    EXPECT_EQ(3, compact_graph.num_edges());
+
+    // Edges are ordered by target, like the EdgeMap.
+    EXPECT_EQ(0, compact_graph.EdgesBegin(0));
+    EXPECT_EQ(2, compact_graph.EdgesEnd(0));
+    EXPECT_EQ(1, compact_graph.EdgeTarget(0));
+    EXPECT_EQ(3, compact_graph.EdgeTarget(1));
+    EXPECT_EQ(compact_graph.EdgesBegin(1), compact_graph.EdgesEnd(1));
+    EXPECT_EQ(1, compact_graph.EdgesEnd(2) - compact_graph.EdgesBegin(2));
+    EXPECT_EQ(0, compact_graph.EdgeTarget(compact_graph.EdgesBegin(2)));
+    EXPECT_EQ(compact_graph.EdgesBegin(3), compact_graph.EdgesEnd(3));
+
+    for (CompactGraph::EdgeIndex e = 0; e < 2; e++) {
+        EXPECT_EQ(graph_utils::EdgeWeight(
+                      graph, make_pair(0, compact_graph.EdgeTarget(e))),
+                  compact_graph.EdgeWeight(e));
+    }
+
+    // Sparse holes don't count.
+    EXPECT_EQ(2, compact_graph.EdgeWeight(0));
+    EXPECT_EQ(0, compact_graph.EdgeWeight(2));
+    EXPECT_GT(compact_graph.MemoryUsage(), 0);
+}
+
+TEST(CompactGraphTest, EmptyTest)
+{
+    CompactGraph compact_graph((Graph()));
+    EXPECT_EQ(0, compact_graph.size());
+    EXPECT_EQ(0, compact_graph.num_edges());
+}
+
+}  // namespace chromeos_update_engine
@@ -6,221 +6,256 @@
 
 #include <inttypes.h>
 
-#include <limits>
+#include <algorithm>
 #include <set>
+#include <tuple>
 #include <utility>
 
-#include "strings/string_printf.h"
-#include "update_engine/graph_utils.h"
 #include "update_engine/tarjan.h"
 #include "update_engine/utils.h"
 
 using std::make_pair;
 using std::set;
 using std::vector;
-using strings::StringPrintf;
 
 namespace chromeos_update_engine {
 
-// This is the outer function from the original paper.
-void CycleBreaker::BreakCycles(const Graph &graph, set<Edge> *out_cut_edges)
-{
-    cut_edges_.clear();
+namespace {
+
+const Vertex::Index kInvalidIndex = -1;
 
-    // Make a copy, which we will modify by removing edges. Thus, in each
-    // iteration subgraph_ is the current subgraph or the original with
-    // vertices we desire. This variable was "A_K" in the original paper.
-    subgraph_ = graph;
+// An edge within the component being broken, in local vertex indexes.
+struct ComponentEdge {
+    size_t from;
+    size_t to;
+    uint64_t weight;
+    Edge edge;  // in the graph
+};
 
-    // The paper calls for the "adjacency structure (i.e., graph) of
-    // strong (-ly connected) component K with least vertex in subgraph
-    // induced by {s, s + 1, ..., n}".
-    // We arbitrarily order each vertex by its index in the graph. Thus,
-    // each iteration, we are looking at the subgraph {s, s + 1, ..., n}
-    // and looking for the strongly connected component with vertex s.
+}  // namespace {}
+
+void CycleBreaker::BreakCycles(const Graph &graph, set<Edge> *out_cut_edges)
+{
+    BreakCycles(graph, CompactGraph(graph), out_cut_edges);
+}
 
-    TarjanAlgorithm tarjan;
+void CycleBreaker::BreakCycles(const Graph &graph,
+                               const CompactGraph &compact_graph,
+                               set<Edge> *out_cut_edges)
+{
+    CHECK_EQ(graph.size(), compact_graph.size());
+    cut_edges_.clear();
+    cut_weight_ = 0;
     skipped_ops_ = 0;
 
-    for (Graph::size_type i = 0; i < subgraph_.size(); i++) {
-        InstallOperation_Type op_type = graph[i].op.type();
+    for (const Vertex &vertex : graph) {
+        InstallOperation_Type op_type = vertex.op.type();
 
+        // These can't be on a cycle, as they read no blocks; their components
+        // are single vertices, which BreakComponent() ignores anyway.
         if (op_type == InstallOperation_Type_REPLACE ||
                 op_type == InstallOperation_Type_REPLACE_BZ) {
             skipped_ops_++;
-            continue;
         }
+    }
 
-        if (i > 0) {
-            // Erase node (i - 1) from subgraph_. First, erase what it points to
-            subgraph_[i - 1].out_edges.clear();
+    vector<vector<Vertex::Index>> components;
+    TarjanAlgorithm::FindAllComponents(compact_graph, &components);
+    size_t cyclic_components = 0;
+    local_index_.assign(graph.size(), kInvalidIndex);
 
-            // Now, erase any pointers to node (i - 1)
-            for (Graph::size_type j = i; j < subgraph_.size(); j++) {
-                subgraph_[j].out_edges.erase(i - 1);
-            }
-        }
+    for (const vector<Vertex::Index> &component : components) {
+        const size_t cut_edges_before = cut_edges_.size();
+        BreakComponent(compact_graph, component);
 
-        // Calculate SCC (strongly connected component) with vertex i.
-        vector<Vertex::Index> component_indexes;
-        tarjan.Execute(i, &subgraph_, &component_indexes);
-
-        // Set subgraph edges for the components in the SCC.
-        for (vector<Vertex::Index>::iterator it = component_indexes.begin();
-                it != component_indexes.end(); ++it) {
-            subgraph_[*it].subgraph_edges.clear();
-
-            for (vector<Vertex::Index>::iterator jt = component_indexes.begin();
-                    jt != component_indexes.end(); ++jt) {
-                // If there's a link from *it -> *jt in the graph,
-                // add a subgraph_ edge
-                if (subgraph_[*it].out_edges.count(*jt)) {
-                    subgraph_[*it].subgraph_edges.insert(*jt);
-                }
-            }
+        if (cut_edges_.size() != cut_edges_before) {
+            cyclic_components++;
         }
-
-        current_vertex_ = i;
-        blocked_.clear();
-        blocked_.resize(subgraph_.size());
-        blocked_graph_.clear();
-        blocked_graph_.resize(subgraph_.size());
-        Circuit(current_vertex_, 0);
     }
 
+    LOG(INFO) << "Cycle breaker cut " << cut_edges_.size() << " edges of "
+              << cut_weight_ << " blocks in " << cyclic_components
+              << " components; skipped " << skipped_ops_ << " ops.";
     out_cut_edges->swap(cut_edges_);
-    LOG(INFO) << "Cycle breaker skipped " << skipped_ops_ << " ops.";
-    DCHECK(stack_.empty());
+    local_index_.clear();
 }
 
-static const size_t kMaxEdgesToConsider = 2;
-
-void CycleBreaker::HandleCircuit()
+void CycleBreaker::BreakComponent(const CompactGraph &graph,
+                                  const vector<Vertex::Index> &component)
 {
-    stack_.push_back(current_vertex_);
-    CHECK_GE(stack_.size(),
-             static_cast<std::vector<Vertex::Index>::size_type>(2));
-    Edge min_edge = make_pair(stack_[0], stack_[1]);
-    uint64_t min_edge_weight = std::numeric_limits<uint64_t>::max();
-    size_t edges_considered = 0;
-
-    for (vector<Vertex::Index>::const_iterator it = stack_.begin();
-            it != (stack_.end() - 1); ++it) {
-        Edge edge = make_pair(*it, *(it + 1));
-
-        if (cut_edges_.find(edge) != cut_edges_.end()) {
-            stack_.pop_back();
-            return;
+    if (component.size() == 1) {
+        // Only a self loop makes a cycle here.
+        const Vertex::Index vertex = component[0];
+
+        for (CompactGraph::EdgeIndex e = graph.EdgesBegin(vertex);
+                e != graph.EdgesEnd(vertex); e++) {
+            if (graph.EdgeTarget(e) == vertex) {
+                cut_edges_.insert(make_pair(vertex, vertex));
+                cut_weight_ += graph.EdgeWeight(e);
+            }
         }
 
-        uint64_t edge_weight = graph_utils::EdgeWeight(subgraph_, edge);
-
-        if (edge_weight < min_edge_weight) {
-            min_edge_weight = edge_weight;
-            min_edge = edge;
-        }
+        return;
+    }
 
-        edges_considered++;
+    // Number the vertices of the component 0..n-1, in graph order so that
+    // ties are broken the same way every time.
+    vector<Vertex::Index> vertices(component);
+    std::sort(vertices.begin(), vertices.end());
+    const size_t n = vertices.size();
 
-        if (edges_considered == kMaxEdgesToConsider) {
-            break;
-        }
+    for (size_t i = 0; i < n; i++) {
+        local_index_[vertices[i]] = i;
     }
 
-    cut_edges_.insert(min_edge);
-    stack_.pop_back();
-}
+    vector<ComponentEdge> edges;
+    vector<vector<size_t>> out_edges(n);
+    vector<vector<size_t>> in_edges(n);
 
-void CycleBreaker::Unblock(Vertex::Index u)
-{
-    blocked_[u] = false;
+    for (size_t i = 0; i < n; i++) {
+        for (CompactGraph::EdgeIndex e = graph.EdgesBegin(vertices[i]);
+                e != graph.EdgesEnd(vertices[i]); e++) {
+            const size_t to = local_index_[graph.EdgeTarget(e)];
+
+            if (to == kInvalidIndex) {
+                continue;
+            }
 
-    for (Vertex::EdgeMap::iterator it = blocked_graph_[u].out_edges.begin();
-            it != blocked_graph_[u].out_edges.end();) {
-        Vertex::Index w = it->first;
-        blocked_graph_[u].out_edges.erase(it++);
+            const Edge edge = make_pair(vertices[i], graph.EdgeTarget(e));
 
-        if (blocked_[w]) {
-            Unblock(w);
+            if (to == i) {
+                cut_edges_.insert(edge);
+                cut_weight_ += graph.EdgeWeight(e);
+                continue;
+            }
+
+            ComponentEdge component_edge = { i, to, graph.EdgeWeight(e), edge };
+            out_edges[i].push_back(edges.size());
+            in_edges[to].push_back(edges.size());
+            edges.push_back(component_edge);
         }
     }
-}
 
-bool CycleBreaker::StackContainsCutEdge() const
-{
-    for (std::vector<Vertex::Index>::const_iterator it = ++stack_.begin(),
-            e = stack_.end(); it != e; ++it) {
-        Edge edge = make_pair(*(it - 1), *it);
+    // Components are disjoint, so only this one's vertices need resetting.
+    for (size_t i = 0; i < n; i++) {
+        local_index_[vertices[i]] = kInvalidIndex;
+    }
 
-        if (cut_edges_.count(edge)) {
-            return true;
-        }
+    // Edge counts and weights of each vertex towards the vertices that are
+    // not placed yet.
+    vector<size_t> in_count(n), out_count(n);
+    vector<int64_t> in_weight(n, 0), out_weight(n, 0);
+
+    for (const ComponentEdge &edge : edges) {
+        out_count[edge.from]++;
+        out_weight[edge.from] += edge.weight;
+        in_count[edge.to]++;
+        in_weight[edge.to] += edge.weight;
     }
 
-    return false;
-}
+    // The candidates to go first, best first: most weight going out rather
+    // than in, then most edges going out rather than in, then lowest index.
+    typedef std::tuple<int64_t, int64_t, size_t> Priority;
+    auto priority = [&](size_t v) {
+        return Priority(in_weight[v] - out_weight[v],
+                        static_cast<int64_t>(in_count[v]) -
+                        static_cast<int64_t>(out_count[v]),
+                        v);
+    };
+    set<Priority> candidates;
+
+    for (size_t v = 0; v < n; v++) {
+        candidates.insert(priority(v));
+    }
 
-bool CycleBreaker::Circuit(Vertex::Index vertex, Vertex::Index depth)
-{
-    // "vertex" was "v" in the original paper.
-    bool found = false;  // Was "f" in the original paper.
-    stack_.push_back(vertex);
-    blocked_[vertex] = true;
-    {
-        static int counter = 0;
-        counter++;
-
-        if (counter == 10000) {
-            counter = 0;
-            std::string stack_str;
-
-            for (vector<Vertex::Index>::const_iterator it = stack_.begin();
-                    it != stack_.end(); ++it) {
-                stack_str += StringPrintf("%lu -> ",
-                                          static_cast<long unsigned int>(*it));
+    vector<bool> placed(n, false);
+    vector<size_t> sinks;
+    vector<size_t> sources;
+    vector<size_t> first;  // placed at the front, in order
+    vector<size_t> last;  // placed at the back, in reverse order
+
+    // Takes |v| out of the remaining graph.
+    auto place = [&](size_t v) {
+        placed[v] = true;
+        candidates.erase(priority(v));
+
+        for (size_t e : out_edges[v]) {
+            const size_t to = edges[e].to;
+
+            if (placed[to]) {
+                continue;
             }
 
-            LOG(INFO) << "stack: " << stack_str;
+            candidates.erase(priority(to));
+            in_count[to]--;
+            in_weight[to] -= edges[e].weight;
+            candidates.insert(priority(to));
+
+            if (in_count[to] == 0) {
+                sources.push_back(to);
+            }
         }
-    }
 
-    for (Vertex::SubgraphEdgeMap::iterator w =
-                subgraph_[vertex].subgraph_edges.begin();
-            w != subgraph_[vertex].subgraph_edges.end(); ++w) {
-        if (*w == current_vertex_) {
-            // The original paper called for printing stack_ followed by
-            // current_vertex_ here, which is a cycle. Instead, we call
-            // HandleCircuit() to break it.
-            HandleCircuit();
-            found = true;
-        } else if (!blocked_[*w]) {
-            if (Circuit(*w, depth + 1)) {
-                found = true;
-
-                if ((depth > kMaxEdgesToConsider) || StackContainsCutEdge()) {
-                    break;
-                }
+        for (size_t e : in_edges[v]) {
+            const size_t from = edges[e].from;
+
+            if (placed[from]) {
+                continue;
+            }
+
+            candidates.erase(priority(from));
+            out_count[from]--;
+            out_weight[from] -= edges[e].weight;
+            candidates.insert(priority(from));
+
+            if (out_count[from] == 0) {
+                sinks.push_back(from);
             }
         }
-    }
+    };
+
+    while (!candidates.empty()) {
+        if (!sinks.empty()) {
+            const size_t v = sinks.back();
+            sinks.pop_back();
+
+            if (!placed[v]) {
+                last.push_back(v);
+                place(v);
+            }
+        } else if (!sources.empty()) {
+            const size_t v = sources.back();
+            sources.pop_back();
 
-    if (found) {
-        Unblock(vertex);
-    } else {
-        for (Vertex::SubgraphEdgeMap::iterator w =
-                    subgraph_[vertex].subgraph_edges.begin();
-                w != subgraph_[vertex].subgraph_edges.end(); ++w) {
-            if (blocked_graph_[*w].out_edges.find(vertex) ==
-                    blocked_graph_[*w].out_edges.end()) {
-                blocked_graph_[*w].out_edges.insert(make_pair(vertex,
-                                                    EdgeProperties()));
+            if (!placed[v]) {
+                first.push_back(v);
+                place(v);
             }
+        } else {
+            const size_t v = std::get<2>(*candidates.begin());
+            first.push_back(v);
+            place(v);
         }
     }
 
-    CHECK_EQ(vertex, stack_.back());
-    stack_.pop_back();
-    return found;
+    vector<size_t> position(n);
+    size_t next_position = 0;
+
+    for (size_t v : first) {
+        position[v] = next_position++;
+    }
+
+    for (vector<size_t>::reverse_iterator it = last.rbegin();
+            it != last.rend(); ++it) {
+        position[*it] = next_position++;
+    }
+
+    for (const ComponentEdge &edge : edges) {
+        if (position[edge.from] > position[edge.to]) {
+            cut_edges_.insert(edge.edge);
+            cut_weight_ += edge.weight;
+        }
+    }
 }
 
 }  // namespace chromeos_update_engine
@@ -5,23 +5,24 @@
 #ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_CYCLE_BREAKER_H__
 #define CHROMEOS_PLATFORM_UPDATE_ENGINE_CYCLE_BREAKER_H__
 
-// This is a modified implementation of Donald B. Johnson's algorithm for
-// finding all elementary cycles (a.k.a. circuits) in a directed graph.
-// See the paper "Finding All the Elementary Circuits of a Directed Graph"
-// at http://dutta.csc.ncsu.edu/csc791_spring07/wrap/circuits_johnson.pdf
-// for reference.
-
-// Note: this version of the algorithm not only finds cycles, but breaks them.
-// It uses a simple greedy algorithm for cutting: when a cycle is discovered,
-// the edge with the least weight is cut. Longer term we may wish to do
-// something more intelligent, since the goal is (ideally) to minimize the
-// sum of the weights of all cut cycles. In practice, it's intractable
-// to consider all cycles before cutting any; there are simply too many.
-// In a sample graph representative of a typical workload, I found over
-// 5 * 10^15 cycles.
+// This breaks all cycles of a graph by cutting a set of edges of small total
+// weight, where the weight of an edge (see graph_utils::EdgeWeight()) is the
+// number of blocks that must be moved to temp space when it's cut.
+//
+// Finding the set of least weight (the minimum feedback arc set) is NP-hard,
+// and enumerating cycles, as a previous Johnson's algorithm based version
+// did, is exponential: a typical graph has over 5 * 10^15 of them. Instead,
+// the strongly connected components of the graph are found in linear time,
+// and the vertices of each component are ordered with the greedy heuristic
+// of Eades, Lin and Smyth ("A fast and effective heuristic for the feedback
+// arc set problem", 1993), weighted by edge weight: sinks go last, sources go
+// first, and otherwise the vertex whose out edges outweigh its in edges the
+// most goes first. All edges that point backwards in that order are cut.
+// This takes O(E log V) time overall.
 
 #include <set>
 #include <vector>
+#include "update_engine/compact_graph.h"
 #include "update_engine/graph_types.h"
 
 namespace chromeos_update_engine {
@@ -33,25 +34,31 @@ public:
     // out_cut_edges is replaced with the cut edges.
     void BreakCycles(const Graph &graph, std::set<Edge> *out_cut_edges);
 
+    // Same as above, with |compact_graph| built from |graph| by the caller.
+    void BreakCycles(const Graph &graph,
+                     const CompactGraph &compact_graph,
+                     std::set<Edge> *out_cut_edges);
+
     size_t skipped_ops() const
     {
         return skipped_ops_;
     }
 
 private:
-    void HandleCircuit();
-    void Unblock(Vertex::Index u);
-    bool Circuit(Vertex::Index vertex, Vertex::Index depth);
-    bool StackContainsCutEdge() const;
-
-    std::vector<bool> blocked_;  // "blocked" in the paper
-    Vertex::Index current_vertex_;  // "s" in the paper
-    std::vector<Vertex::Index> stack_;  // the stack variable in the paper
-    Graph subgraph_;  // "A_K" in the paper
-    Graph blocked_graph_;  // "B" in the paper
+    // Orders the vertices of |component| and adds the edges between them
+    // that point backwards in that order to |cut_edges_|.
+    void BreakComponent(const CompactGraph &graph,
+                        const std::vector<Vertex::Index> &component);
 
     std::set<Edge> cut_edges_;
 
+    // Index of each vertex within the component being broken, or -1 for
+    // vertices of other components.
+    std::vector<Vertex::Index> local_index_;
+
+    // Total weight of |cut_edges_|.
+    uint64_t cut_weight_;
+
     // Number of operations skipped b/c we know they don't have any
     // incoming edges.
     size_t skipped_ops_;
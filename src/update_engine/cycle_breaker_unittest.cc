@@ -2,6 +2,8 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <stdlib.h>
+
 #include <set>
 #include <string>
 #include <utility>
@@ -10,6 +12,8 @@
 #include <gtest/gtest.h>
 #include "update_engine/cycle_breaker.h"
 #include "update_engine/graph_types.h"
+#include "update_engine/graph_utils.h"
+#include "update_engine/tarjan.h"
 #include "update_engine/utils.h"
 
 using std::make_pair;
@@ -27,6 +31,35 @@ void SetOpForNodes(Graph *graph)
         it->op.set_type(InstallOperation_Type_MOVE);
     }
 }
+
+// Checks that no cycles are left in |graph| once |cut_edges| are removed.
+void ExpectAcyclicAfterCuts(const Graph &graph, const set<Edge> &cut_edges)
+{
+    Graph cut_graph = graph;
+
+    for (const Edge &edge : cut_edges) {
+        EXPECT_EQ(1, cut_graph[edge.first].out_edges.erase(edge.second));
+    }
+
+    vector<vector<Vertex::Index>> components;
+    TarjanAlgorithm::FindAllComponents(cut_graph, &components);
+    EXPECT_EQ(graph.size(), components.size());
+
+    for (Vertex::Index i = 0; i < cut_graph.size(); i++) {
+        EXPECT_EQ(0, cut_graph[i].out_edges.count(i));
+    }
+}
+
+uint64_t CutWeight(const Graph &graph, const set<Edge> &cut_edges)
+{
+    uint64_t weight = 0;
+
+    for (const Edge &edge : cut_edges) {
+        weight += graph_utils::EdgeWeight(graph, edge);
+    }
+
+    return weight;
+}
 }  // namespace {}
 
 class CycleBreakerTest : public ::testing::Test {};
@@ -79,6 +112,7 @@ TEST(CycleBreakerTest, SimpleTest)
     EXPECT_TRUE(broken_edges.count(make_pair(n_g, n_h)) ||
                 broken_edges.count(make_pair(n_h, n_g)));
     EXPECT_EQ(3, broken_edges.size());
+    ExpectAcyclicAfterCuts(graph, broken_edges);
 }
 
 namespace {
@@ -111,9 +145,9 @@ pair<Vertex::Index, EdgeProperties> EdgeWithWeight(Vertex::Index dest,
 //                N          |
 //                 \_________/
 //
-// such that the original cutting algo would cut edges (s). We changed
-// the algorithm to cut cycles (t) instead, since they are closer to the
-// root, and that can massively speed up cycle cutting.
+// which has a huge number of cycles. All of them go through the edge back to
+// the root, so cutting edges (s), of weight 3, or edges (t), of weight 6,
+// breaks them all. Cycle enumeration used to take forever on such graphs.
 TEST(CycleBreakerTest, AggressiveCutTest)
 {
     int counter = 0;
@@ -159,14 +193,8 @@ TEST(CycleBreakerTest, AggressiveCutTest)
     LOG(INFO) << "If this hangs for more than 1 second, the test has failed.";
     breaker.BreakCycles(graph, &broken_edges);
 
-    set<Edge> expected_cuts;
-
-    for (Vertex::EdgeMap::const_iterator it = graph[n_root].out_edges.begin(),
-            e = graph[n_root].out_edges.end(); it != e; ++it) {
-        expected_cuts.insert(make_pair(n_root, it->first));
-    }
-
-    EXPECT_TRUE(broken_edges == expected_cuts);
+    ExpectAcyclicAfterCuts(graph, broken_edges);
+    EXPECT_LE(CutWeight(graph, broken_edges), 6);
 }
 
 TEST(CycleBreakerTest, WeightTest)
@@ -243,9 +271,30 @@ TEST(CycleBreakerTest, UnblockGraphTest)
     set<Edge> broken_edges;
     breaker.BreakCycles(graph, &broken_edges);
 
-    // These are required to be broken:
-    EXPECT_TRUE(broken_edges.count(make_pair(n_a, n_b)));
-    EXPECT_TRUE(broken_edges.count(make_pair(n_a, n_c)));
+    // Cutting a->b and c->b breaks all the cycles at the least weight.
+    ExpectAcyclicAfterCuts(graph, broken_edges);
+    EXPECT_LE(CutWeight(graph, broken_edges), 3);
+}
+
+TEST(CycleBreakerTest, LargeGraphTest)
+{
+    // Dense enough that enumerating its cycles would never finish.
+    const Graph::size_type kNodeCount = 20000;
+    Graph graph(kNodeCount);
+    SetOpForNodes(&graph);
+    unsigned int seed = 1;
+
+    for (int i = 0; i < 100000; i++) {
+        graph[rand_r(&seed) % kNodeCount].out_edges.insert(
+            EdgeWithWeight(rand_r(&seed) % kNodeCount, 1 + rand_r(&seed) % 8));
+    }
+
+    CycleBreaker breaker;
+
+    set<Edge> broken_edges;
+    breaker.BreakCycles(graph, &broken_edges);
+
+    ExpectAcyclicAfterCuts(graph, broken_edges);
 }
 
 TEST(CycleBreakerTest, SkipOpsTest)
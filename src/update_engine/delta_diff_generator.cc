@@ -9,8 +9,11 @@
 #include <inttypes.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <chrono>
+#include <deque>
 #include <map>
 #include <memory>
 #include <set>
@@ -18,25 +21,31 @@
 #include <utility>
 #include <vector>
 
-#include <bzlib.h>
+#include <glib.h>
 #include <glog/logging.h>
 
 #include "files/scoped_file.h"
 #include "strings/string_printf.h"
+#include "update_engine/block_index.h"
+#include "update_engine/bsdiff.h"
 #include "update_engine/bzip.h"
+#include "update_engine/chunk_processor.h"
+#include "update_engine/compact_graph.h"
 #include "update_engine/cycle_breaker.h"
 #include "update_engine/delta_metadata.h"
+#include "update_engine/diff_cache.h"
+#include "update_engine/ext2_image_files.h"
 #include "update_engine/ext2_metadata.h"
-#include "update_engine/extent_mapper.h"
 #include "update_engine/extent_ranges.h"
 #include "update_engine/file_writer.h"
-#include "update_engine/filesystem_iterator.h"
 #include "update_engine/full_update_generator.h"
+#include "update_engine/generator_profile.h"
 #include "update_engine/graph_types.h"
 #include "update_engine/graph_utils.h"
+#include "update_engine/image_files.h"
 #include "update_engine/omaha_hash_calculator.h"
 #include "update_engine/payload_signer.h"
-#include "update_engine/subprocess.h"
+#include "update_engine/rename_matcher.h"
 #include "update_engine/topological_sort.h"
 #include "update_engine/update_metadata.pb.h"
 #include "update_engine/utils.h"
@@ -49,20 +58,32 @@ using std::pair;
 using std::set;
 using std::string;
 using std::vector;
+using std::chrono::steady_clock;
 using strings::StringPrintf;
 
 namespace chromeos_update_engine {
 
-typedef DeltaDiffGenerator::Block Block;
 typedef map<const InstallOperation *,
         const string *> OperationNameMap;
 
+DiffCache *DeltaDiffGenerator::diff_cache_ = NULL;
+off_t DeltaDiffGenerator::max_op_size_ = 0;
+int DeltaDiffGenerator::full_compression_level_ = 9;
+GeneratorProfile *DeltaDiffGenerator::profile_ = NULL;
+
 namespace {
 const size_t kBlockSize = 4096;  // bytes
-const string kNonexistentPath = "";
 
 const uint64_t kFullUpdateChunkSize = 1024 * 1024;  // bytes
 
+// The data of diffed files a FileDiffer holds before they are written out,
+// beyond which its threads only take the file the writer waits for.
+const uint64_t kMaxPendingDiffBytes = 256 * 1024 * 1024;  // bytes
+
+// The FileDiffer threads diffing a file at the moment. While they keep every
+// processor busy, ChooseCandidate() starts no threads of its own.
+volatile gint busy_diff_threads = 0;
+
 static const char *kInstallOperationTypes[] = {
     "REPLACE",
     "REPLACE_BZ",
@@ -70,39 +91,69 @@ static const char *kInstallOperationTypes[] = {
     "BSDIFF"
 };
 
-// Stores all Extents for a file into 'out'. Returns true on success.
-bool GatherExtents(const string &path,
+// Stores the Extents of the |length| bytes from |offset| of the file at
+// |path| in |files| into 'out'. |offset| must be a multiple of the block
+// size. Returns true on success.
+bool GatherExtents(const ImageFiles &files,
+                   const string &path,
+                   off_t offset,
+                   off_t length,
                    google::protobuf::RepeatedPtrField<Extent> *out)
 {
     vector<Extent> extents;
-    TEST_AND_RETURN_FALSE(extent_mapper::ExtentsForFileFibmap(path, &extents));
-    DeltaDiffGenerator::StoreExtents(extents, out);
+    TEST_AND_RETURN_FALSE(files.GetExtents(path, &extents));
+
+    // Keep the blocks from |offset| on.
+    uint64_t skip_blocks = offset / kBlockSize;
+    uint64_t keep_blocks = (length + kBlockSize - 1) / kBlockSize;
+    vector<Extent> chunk_extents;
+
+    for (const Extent &extent : extents) {
+        if (keep_blocks == 0) {
+            break;
+        }
+
+        if (skip_blocks >= extent.num_blocks()) {
+            skip_blocks -= extent.num_blocks();
+            continue;
+        }
+
+        Extent chunk_extent = extent;
+
+        if (extent.start_block() != kSparseHole) {
+            chunk_extent.set_start_block(extent.start_block() + skip_blocks);
+        }
+
+        chunk_extent.set_num_blocks(min(extent.num_blocks() - skip_blocks,
+                                        keep_blocks));
+        keep_blocks -= chunk_extent.num_blocks();
+        skip_blocks = 0;
+        chunk_extents.push_back(chunk_extent);
+    }
+
+    TEST_AND_RETURN_FALSE(keep_blocks == 0);
+    DeltaDiffGenerator::StoreExtents(chunk_extents, out);
     return true;
 }
 
-// For a given regular file which must exist at new_root + path, and
-// may exist at old_root + path, creates a new InstallOperation and
-// adds it to the graph. Also, populates the |blocks| array as
-// necessary, if |blocks| is non-NULL.  Also, writes the data
-// necessary to send the file down to the client into data_fd, which
-// has length *data_file_size. *data_file_size is updated
-// appropriately. If |existing_vertex| is no kInvalidIndex, use that
-// rather than allocating a new vertex. Returns true on success.
-bool DeltaReadFile(Graph *graph,
-                   Vertex::Index existing_vertex,
-                   vector<Block> *blocks,
-                   const string &old_root,
-                   const string &new_root,
-                   const string &path,  // within new_root
-                   int data_fd,
-                   off_t *data_file_size)
+// For a given regular file which must exist at path in |new_files|, and
+// may exist at |old_path| in |old_files| (if not NULL), determines the best
+// way to send the |chunk_size| bytes from |chunk_offset| of it (all of them
+// if -1) down to the client and stores the operation in |operation| and its
+// data in |data|. If there's no old file, blocks of it found in
+// |block_index|, if not NULL, are used instead. Doesn't touch any shared
+// state, so it may be called from multiple threads at once. Returns true on
+// success.
+bool DiffFile(const ImageFiles *old_files,
+              const ImageFiles &new_files,
+              const BlockIndex *block_index,
+              const string &old_path,
+              const string &path,
+              off_t chunk_offset,
+              off_t chunk_size,
+              vector<char> *data,
+              InstallOperation *operation)
 {
-    vector<char> data;
-    InstallOperation operation;
-
-    string old_path = (old_root == kNonexistentPath) ? kNonexistentPath :
-                      old_root + path;
-
     // If bsdiff breaks again, blacklist the problem file by using:
     //   bsdiff_allowed = (path != "/foo/bar")
     //
@@ -113,23 +164,50 @@ bool DeltaReadFile(Graph *graph,
         LOG(INFO) << "bsdiff blacklisting: " << path;
     }
 
-    TEST_AND_RETURN_FALSE(DeltaDiffGenerator::ReadFileToDiff(old_path,
-                          new_root + path,
+    TEST_AND_RETURN_FALSE(DeltaDiffGenerator::ReadFileToDiff(old_files,
+                          old_path,
+                          new_files,
+                          path,
+                          block_index,
+                          chunk_offset,
+                          chunk_size,
                           bsdiff_allowed,
-                          &data,
-                          &operation,
+                          data,
+                          operation,
                           true));
+    return true;
+}
 
+// Adds |operation| for the chunk of the file at |path| from |chunk_offset|
+// of |chunk_size| bytes (the whole file if -1), with its |data|, to the
+// graph. Also, populates the |blocks| map as necessary, if |blocks| is non-NULL.
+// Also, writes |data| into data_fd, which has length *data_file_size.
+// *data_file_size is updated appropriately. If |existing_vertex| is no
+// kInvalidIndex, use that rather than allocating a new vertex. Returns true
+// on success.
+bool AddFileOperation(Graph *graph,
+                      Vertex::Index existing_vertex,
+                      BlockMap *blocks,
+                      const string &path,
+                      off_t chunk_offset,
+                      off_t chunk_size,
+                      const vector<char> &data,
+                      InstallOperation operation,
+                      int data_fd,
+                      off_t *data_file_size)
+{
     // Write the data
     if (operation.type() != InstallOperation_Type_MOVE) {
         operation.set_data_offset(*data_file_size);
         operation.set_data_length(data.size());
+        TEST_AND_RETURN_FALSE(
+            DeltaDiffGenerator::AddOperationHash(&operation, data));
     }
 
-    TEST_AND_RETURN_FALSE(utils::WriteAll(data_fd, &data[0], data.size()));
+    TEST_AND_RETURN_FALSE(utils::WriteAll(data_fd, data.data(), data.size()));
     *data_file_size += data.size();
 
-    // Now, insert into graph and blocks vector
+    // Now, insert into graph and block map
     Vertex::Index vertex = existing_vertex;
 
     if (vertex == Vertex::kInvalidIndex) {
@@ -140,9 +218,11 @@ bool DeltaReadFile(Graph *graph,
     (*graph)[vertex].op = operation;
     CHECK((*graph)[vertex].op.has_type());
     (*graph)[vertex].file_name = path;
+    (*graph)[vertex].chunk_offset = chunk_offset;
+    (*graph)[vertex].chunk_size = chunk_size;
 
     if (blocks)
-        TEST_AND_RETURN_FALSE(DeltaDiffGenerator::AddInstallOpToBlocksVector(
+        TEST_AND_RETURN_FALSE(DeltaDiffGenerator::AddInstallOpToBlockMap(
                                   (*graph)[vertex].op,
                                   *graph,
                                   vertex,
@@ -151,40 +231,322 @@ bool DeltaReadFile(Graph *graph,
     return true;
 }
 
-// For each regular file within new_root, creates a node in the graph,
+// For a given regular file which must exist at path in |new_files|, and
+// may exist at path in |old_files|, creates a new InstallOperation for the
+// |chunk_size| bytes from |chunk_offset| of it (all of them if -1) and
+// adds it to the graph. Also, populates the |blocks| map as
+// necessary, if |blocks| is non-NULL.  Also, writes the data
+// necessary to send the file down to the client into data_fd, which
+// has length *data_file_size. *data_file_size is updated
+// appropriately. If |existing_vertex| is no kInvalidIndex, use that
+// rather than allocating a new vertex. Returns true on success.
+bool DeltaReadFile(Graph *graph,
+                   Vertex::Index existing_vertex,
+                   BlockMap *blocks,
+                   const ImageFiles *old_files,
+                   const ImageFiles &new_files,
+                   const string &path,
+                   off_t chunk_offset,
+                   off_t chunk_size,
+                   int data_fd,
+                   off_t *data_file_size)
+{
+    vector<char> data;
+    InstallOperation operation;
+
+    TEST_AND_RETURN_FALSE(DiffFile(old_files, new_files, NULL, path, path,
+                                   chunk_offset, chunk_size, &data,
+                                   &operation));
+    TEST_AND_RETURN_FALSE(AddFileOperation(graph,
+                                           existing_vertex,
+                                           blocks,
+                                           path,
+                                           chunk_offset,
+                                           chunk_size,
+                                           data,
+                                           operation,
+                                           data_fd,
+                                           data_file_size));
+    return true;
+}
+
+// A regular file of the new image, or a chunk of one, as diffed by a
+// FileDiffer.
+struct FileDiffJob {
+    string path;
+    bool from_old;  // whether diffed from a file of the old image
+    string old_path;  // of that file; not |path| if it was renamed
+    off_t chunk_offset;
+    off_t chunk_size;  // -1 for the whole file
+    off_t size;  // of the chunk
+
+    // Set by the FileDiffer once the file is diffed.
+    bool done;
+    bool success;
+    vector<char> data;
+    InstallOperation operation;
+};
+
+// Diffs the files of a DeltaReadFiles pass on a number of threads. Whenever
+// a thread is free it takes the largest file no thread has taken yet, so that
+// the few big files that dominate the run time start first and the many small
+// ones fill in around them. The results are handed out in file order through
+// WaitForJob(), so the generated payload doesn't depend on the scheduling.
+// As files finish out of order their data piles up until written; beyond
+// kMaxPendingDiffBytes the threads wait, only taking the file WaitForJob()
+// waits for, until ReleaseJob() frees some.
+class FileDiffer
+{
+public:
+    FileDiffer(const ImageFiles &old_files,
+               const ImageFiles &new_files,
+               const BlockIndex &block_index,
+               vector<FileDiffJob> *jobs);
+    ~FileDiffer();
+
+    // Starts up to |max_threads| threads. Returns true on success, false on
+    // failure.
+    bool Start(size_t max_threads);
+
+    // Waits for job |index| to complete. Returns true if the file was diffed
+    // successfully, false otherwise.
+    bool WaitForJob(size_t index);
+
+    // Tells that the data of job |index|, which must be complete, has been
+    // freed.
+    void ReleaseJob(size_t index);
+
+private:
+    // Diffs files until there are none left or the differ is stopped.
+    void DiffFiles();
+    static gpointer DiffFilesThread(gpointer data);
+
+    // Makes the threads stop after their current file and waits for them.
+    void Stop();
+
+    const ImageFiles &old_files_;
+    const ImageFiles &new_files_;
+    const BlockIndex &block_index_;
+    vector<FileDiffJob> *jobs_;
+
+    // Indices into |jobs_|, largest file first, and the next one to take.
+    vector<size_t> order_;
+    size_t next_job_;
+    bool stopping_;
+
+    // Whether each job has been taken by a thread, and the data size of
+    // each completed one.
+    vector<bool> taken_;
+    vector<uint64_t> pending_bytes_;
+
+    // The data of the completed jobs not released yet, and the job
+    // WaitForJob() waits for, if any.
+    uint64_t total_pending_bytes_;
+    size_t wanted_job_;
+
+    // Protects the members above and the done and success fields of the
+    // jobs. |job_done_| is signalled whenever a job completes, |job_released_|
+    // whenever the threads may take another one.
+    GMutex mutex_;
+    GCond job_done_;
+    GCond job_released_;
+
+    vector<GThread *> threads_;
+
+    DISALLOW_COPY_AND_ASSIGN(FileDiffer);
+};
+
+FileDiffer::FileDiffer(const ImageFiles &old_files,
+                       const ImageFiles &new_files,
+                       const BlockIndex &block_index,
+                       vector<FileDiffJob> *jobs)
+    : old_files_(old_files),
+      new_files_(new_files),
+      block_index_(block_index),
+      jobs_(jobs),
+      next_job_(0),
+      stopping_(false),
+      taken_(jobs->size(), false),
+      pending_bytes_(jobs->size(), 0),
+      total_pending_bytes_(0),
+      wanted_job_(jobs->size())
+{
+    for (size_t i = 0; i < jobs_->size(); i++) {
+        order_.push_back(i);
+    }
+
+    // Ties keep the file order so the schedule is reproducible.
+    std::stable_sort(order_.begin(), order_.end(),
+    [this](size_t a, size_t b) {
+        return (*jobs_)[a].size > (*jobs_)[b].size;
+    });
+    g_mutex_init(&mutex_);
+    g_cond_init(&job_done_);
+    g_cond_init(&job_released_);
+}
+
+FileDiffer::~FileDiffer()
+{
+    Stop();
+    g_cond_clear(&job_released_);
+    g_cond_clear(&job_done_);
+    g_mutex_clear(&mutex_);
+}
+
+bool FileDiffer::Start(size_t max_threads)
+{
+    size_t num_threads = min(max_threads, jobs_->size());
+
+    for (size_t i = 0; i < num_threads; i++) {
+        GThread *thread =
+            g_thread_try_new("file_differ", DiffFilesThread, this, NULL);
+        TEST_AND_RETURN_FALSE(thread != NULL);
+        threads_.push_back(thread);
+    }
+
+    LOG(INFO) << "Diffing " << jobs_->size() << " files on " << num_threads
+              << " threads";
+    return true;
+}
+
+bool FileDiffer::WaitForJob(size_t index)
+{
+    g_mutex_lock(&mutex_);
+    wanted_job_ = index;
+    g_cond_broadcast(&job_released_);
+
+    while (!(*jobs_)[index].done) {
+        g_cond_wait(&job_done_, &mutex_);
+    }
+
+    wanted_job_ = jobs_->size();
+    bool success = (*jobs_)[index].success;
+    g_mutex_unlock(&mutex_);
+    return success;
+}
+
+void FileDiffer::ReleaseJob(size_t index)
+{
+    g_mutex_lock(&mutex_);
+    CHECK((*jobs_)[index].done);
+    total_pending_bytes_ -= pending_bytes_[index];
+    pending_bytes_[index] = 0;
+    g_cond_broadcast(&job_released_);
+    g_mutex_unlock(&mutex_);
+}
+
+void FileDiffer::Stop()
+{
+    g_mutex_lock(&mutex_);
+    stopping_ = true;
+    g_cond_broadcast(&job_released_);
+    g_mutex_unlock(&mutex_);
+
+    for (GThread *thread : threads_) {
+        g_thread_join(thread);
+    }
+
+    threads_.clear();
+}
+
+gpointer FileDiffer::DiffFilesThread(gpointer data)
+{
+    reinterpret_cast<FileDiffer *>(data)->DiffFiles();
+    return NULL;
+}
+
+void FileDiffer::DiffFiles()
+{
+    for (;;) {
+        g_mutex_lock(&mutex_);
+        size_t index = jobs_->size();
+
+        while (index == jobs_->size()) {
+            // Skips the jobs taken out of order.
+            while (next_job_ < order_.size() && taken_[order_[next_job_]]) {
+                next_job_++;
+            }
+
+            if (stopping_ || next_job_ == order_.size()) {
+                g_mutex_unlock(&mutex_);
+                return;
+            }
+
+            if (total_pending_bytes_ < kMaxPendingDiffBytes) {
+                index = order_[next_job_++];
+            } else if (wanted_job_ < jobs_->size() && !taken_[wanted_job_]) {
+                index = wanted_job_;
+            } else {
+                g_cond_wait(&job_released_, &mutex_);
+            }
+        }
+
+        taken_[index] = true;
+        FileDiffJob *job = &(*jobs_)[index];
+        g_mutex_unlock(&mutex_);
+
+        // Only this thread touches the data and operation of |job| until it's
+        // marked done.
+        LOG(INFO) << "Encoding file " << job->path;
+        g_atomic_int_add(&busy_diff_threads, 1);
+        bool success = DiffFile(job->from_old ? &old_files_ : NULL,
+                                new_files_, &block_index_, job->old_path,
+                                job->path, job->chunk_offset,
+                                job->chunk_size, &job->data, &job->operation);
+        g_atomic_int_add(&busy_diff_threads, -1);
+
+        g_mutex_lock(&mutex_);
+        job->done = true;
+        job->success = success;
+        pending_bytes_[index] = job->data.capacity();
+        total_pending_bytes_ += pending_bytes_[index];
+        g_cond_broadcast(&job_done_);
+        g_mutex_unlock(&mutex_);
+    }
+}
+
+// For each regular file in |new_files|, creates a node in the graph,
 // determines the best way to compress it (REPLACE, REPLACE_BZ, COPY, BSDIFF),
-// and writes any necessary data to the end of data_fd.
+// and writes any necessary data to the end of data_fd. New files with no old
+// version at their own path are diffed against the old file they seem to
+// have been renamed from, if any. Files bigger than |max_op_size| bytes, if
+// not 0, get a node for each chunk of that size. The files are diffed in
+// parallel, but the data and the nodes are added in the order of the
+// filesystem iteration, so the result is the same as that of a serial pass.
 bool DeltaReadFiles(Graph *graph,
-                    vector<Block> *blocks,
-                    const string &old_root,
-                    const string &new_root,
+                    BlockMap *blocks,
+                    const ImageFiles &old_files,
+                    const ImageFiles &new_files,
+                    off_t max_op_size,
                     int data_fd,
                     off_t *data_file_size)
 {
+    TEST_AND_RETURN_FALSE(max_op_size >= 0 && max_op_size % kBlockSize == 0);
+
     set<ino_t> visited_inodes;
     set<ino_t> visited_src_inodes;
+    vector<FileDiffJob> file_jobs;  // one for each whole file
 
-    for (FilesystemIterator fs_iter(new_root,
-                                    set<string> {"/lost+found"});
-            !fs_iter.IsEnd(); fs_iter.Increment()) {
-        // We never diff symlinks (here, we check that dst file is not a symlink).
-        if (!S_ISREG(fs_iter.GetStat().st_mode)) {
-            continue;
-        }
+    // The new files with no old version at their own path, and the index of
+    // their jobs.
+    vector<pair<size_t, ImageFile>> unmatched_files;
 
+    // We never diff symlinks; only regular files are listed.
+    vector<ImageFile> files;
+    TEST_AND_RETURN_FALSE(new_files.ListFiles(&files));
+
+    for (const ImageFile &file : files) {
         // Make sure we visit each inode only once.
-        if (visited_inodes.count(fs_iter.GetStat().st_ino)) {
+        if (visited_inodes.count(file.inode)) {
             continue;
         }
 
-        visited_inodes.insert(fs_iter.GetStat().st_ino);
+        visited_inodes.insert(file.inode);
 
-        if (fs_iter.GetStat().st_size == 0) {
+        if (file.size == 0) {
             continue;
         }
 
-        LOG(INFO) << "Encoding file " << fs_iter.GetPartialPath();
-
         // We can't visit each dst image inode more than once, as that would
         // duplicate work. Here, we avoid visiting each source image inode
         // more than once. Technically, we could have multiple operations
@@ -194,27 +556,182 @@ bool DeltaReadFiles(Graph *graph,
         // time, it will be easy (non-complex) to have many operations read
         // from the same source blocks. At that time, this code can die. -adlr
         bool should_diff_from_source = false;
-        string src_path = old_root + fs_iter.GetPartialPath();
-        struct stat src_stbuf;
+        bool src_exists = false;
+        ImageFile src_file;
+        TEST_AND_RETURN_FALSE(old_files.GetFile(file.path, &src_exists,
+                                                &src_file));
+
+        // We never diff symlinks (here, we check that src file is not a
+        // symlink).
+        if (src_exists && S_ISREG(src_file.mode)) {
+            should_diff_from_source = !visited_src_inodes.count(src_file.inode);
+            visited_src_inodes.insert(src_file.inode);
+        }
 
-        // We never diff symlinks (here, we check that src file is not a symlink).
-        if (0 == lstat(src_path.c_str(), &src_stbuf) &&
-                S_ISREG(src_stbuf.st_mode)) {
-            should_diff_from_source = !visited_src_inodes.count(src_stbuf.st_ino);
-            visited_src_inodes.insert(src_stbuf.st_ino);
+        if (!src_exists || !S_ISREG(src_file.mode)) {
+            unmatched_files.push_back(make_pair(file_jobs.size(), file));
         }
 
-        TEST_AND_RETURN_FALSE(DeltaReadFile(graph,
-                                            Vertex::kInvalidIndex,
-                                            blocks,
-                                            (should_diff_from_source ?
-                                             old_root :
-                                             kNonexistentPath),
-                                            new_root,
-                                            fs_iter.GetPartialPath(),
-                                            data_fd,
-                                            data_file_size));
+        FileDiffJob job;
+        job.path = file.path;
+        job.from_old = should_diff_from_source;
+        job.old_path = file.path;
+        job.chunk_offset = 0;
+        job.chunk_size = -1;
+        job.size = file.size;
+        job.done = false;
+        job.success = false;
+        file_jobs.push_back(job);
+    }
+
+    vector<ImageFile> old_file_list;
+    TEST_AND_RETURN_FALSE(old_files.ListFiles(&old_file_list));
+
+    // Those may have been renamed or moved from an old file that no new file
+    // has at its own path.
+    size_t renamed = 0;
+    {
+        RenameMatcher matcher(old_files);
+        set<ino_t> candidate_inodes;
+
+        for (const ImageFile &old_file : old_file_list) {
+            if (visited_src_inodes.count(old_file.inode) ||
+                    candidate_inodes.count(old_file.inode)) {
+                continue;
+            }
+
+            candidate_inodes.insert(old_file.inode);
+            matcher.AddCandidate(old_file);
+        }
+
+        for (const pair<size_t, ImageFile> &unmatched : unmatched_files) {
+            bool found = false;
+            ImageFile old_file;
+            TEST_AND_RETURN_FALSE(matcher.Match(new_files, unmatched.second,
+                                                &found, &old_file));
+
+            if (!found) {
+                continue;
+            }
+
+            FileDiffJob &job = file_jobs[unmatched.first];
+            job.from_old = true;
+            job.old_path = old_file.path;
+            visited_src_inodes.insert(old_file.inode);
+            renamed++;
+        }
+
+        LOG(INFO) << "Matched " << renamed << " of " << unmatched_files.size()
+                  << " new files with no old version to renamed old files";
+    }
+
+    vector<FileDiffJob> jobs;
+
+    for (const FileDiffJob &file_job : file_jobs) {
+        if (max_op_size == 0 || file_job.size <= max_op_size) {
+            jobs.push_back(file_job);
+            continue;
+        }
+
+        // Each chunk of a big file is diffed against the same bytes of the
+        // old file.
+        FileDiffJob job = file_job;
+
+        for (off_t offset = 0; offset < file_job.size;
+                offset += max_op_size) {
+            job.chunk_offset = offset;
+            job.chunk_size = max_op_size;
+            job.size = min(max_op_size, file_job.size - offset);
+            jobs.push_back(job);
+        }
+    }
+
+    // The rest are looked up block by block in the old files that aren't
+    // read for diffing already: copied files, and files renamed beyond
+    // recognition, are found there.
+    BlockIndex block_index(old_files);
+    {
+        set<ino_t> indexed_inodes;
+
+        for (const ImageFile &old_file : old_file_list) {
+            if (visited_src_inodes.count(old_file.inode) ||
+                    indexed_inodes.count(old_file.inode)) {
+                continue;
+            }
+
+            indexed_inodes.insert(old_file.inode);
+            TEST_AND_RETURN_FALSE(block_index.AddFile(old_file));
+        }
+
+        LOG(INFO) << "Indexed " << block_index.size() << " blocks of "
+                  << indexed_inodes.size() << " unmatched old files";
     }
+
+    FileDiffer differ(old_files, new_files, block_index, &jobs);
+    TEST_AND_RETURN_FALSE(differ.Start(max(sysconf(_SC_NPROCESSORS_ONLN), 1L)));
+
+    // Each old block can only be read by one operation. Files diffed on
+    // different threads may have found the same blocks, so the later ones
+    // in file order are diffed again without the index.
+    ExtentRanges found_blocks;
+    size_t rediffed = 0;
+    // What the renamed files' diffs save over sending those files in full.
+    uint64_t renamed_size = 0;
+    uint64_t renamed_data_size = 0;
+
+    for (size_t i = 0; i < jobs.size(); i++) {
+        FileDiffJob &job = jobs[i];
+        TEST_AND_RETURN_FALSE(differ.WaitForJob(i));
+
+        if (!job.from_old && job.operation.src_extents_size() > 0) {
+            ExtentRanges job_blocks;
+            job_blocks.AddRepeatedExtents(job.operation.src_extents());
+            ExtentRanges overlap = job_blocks;
+            overlap.IntersectRanges(found_blocks);
+
+            if (overlap.blocks() == 0) {
+                found_blocks.AddRanges(job_blocks);
+            } else {
+                job.data.clear();
+                job.operation.Clear();
+                TEST_AND_RETURN_FALSE(DiffFile(NULL, new_files, NULL,
+                                               job.path, job.path,
+                                               job.chunk_offset,
+                                               job.chunk_size, &job.data,
+                                               &job.operation));
+                rediffed++;
+            }
+        }
+
+        if (job.from_old && job.old_path != job.path) {
+            renamed_size += job.size;
+            renamed_data_size += min(static_cast<uint64_t>(job.size),
+                                     static_cast<uint64_t>(job.data.size()));
+        }
+
+        TEST_AND_RETURN_FALSE(AddFileOperation(graph,
+                                               Vertex::kInvalidIndex,
+                                               blocks,
+                                               job.path,
+                                               job.chunk_offset,
+                                               job.chunk_size,
+                                               job.data,
+                                               job.operation,
+                                               data_fd,
+                                               data_file_size));
+        // The data is in data_fd now; don't hold on to it while waiting for
+        // the remaining files.
+        vector<char>().swap(job.data);
+        differ.ReleaseJob(i);
+    }
+
+    LOG(INFO) << "Diffing against " << found_blocks.blocks()
+              << " old blocks found by content; " << rediffed
+              << " files or file chunks had to be diffed again";
+    LOG(INFO) << "Diffing " << renamed << " renamed files against their old "
+              << "versions took " << renamed_data_size << " bytes instead of "
+              << renamed_size << ", saving "
+              << renamed_size - renamed_data_size << " bytes";
     return true;
 }
 
@@ -240,126 +757,135 @@ private:
 };
 
 // Reads blocks from image_path that are not yet marked as being written
-// in the blocks array. These blocks that remain are non-file-data blocks.
+// in the block map. These blocks that remain are non-file-data blocks.
 // In the future we might consider intelligent diffing between this data
 // and data in the previous image, but for now we just bzip2 compress it
 // and include it in the update.
-// Creates a new node in the graph to write these blocks and writes the
+// The blocks are split into groups of kFullUpdateChunkSize bytes, which are
+// compressed in parallel. Adds a node to the graph to write each group,
+// marks it as the writer of the group's blocks in |blocks| and writes the
 // appropriate blob to blobs_fd. Reads and updates blobs_length;
-bool ReadUnwrittenBlocks(const vector<Block> &blocks,
+bool ReadUnwrittenBlocks(BlockMap *blocks,
                          int blobs_fd,
                          off_t *blobs_length,
                          const string &image_path,
-                         Vertex *vertex)
+                         Graph *graph)
 {
-    vertex->file_name = "<fs-non-file-data>";
-
-    InstallOperation *out_op = &vertex->op;
     int image_fd = open(image_path.c_str(), O_RDONLY, 000);
     TEST_AND_RETURN_FALSE_ERRNO(image_fd >= 0);
     files::ScopedFD image_fd_closer(image_fd);
 
-    string temp_file_path;
-    TEST_AND_RETURN_FALSE(utils::MakeTempFile("/tmp/CrAU_temp_data.XXXXXX",
-                          &temp_file_path,
-                          NULL));
-
-    FILE *file = fopen(temp_file_path.c_str(), "w");
-    TEST_AND_RETURN_FALSE(file);
-    int err = BZ_OK;
-
-    BZFILE *bz_file = BZ2_bzWriteOpen(&err,
-                                      file,
-                                      9,  // max compression
-                                      0,  // verbosity
-                                      0);  // default work factor
-    TEST_AND_RETURN_FALSE(err == BZ_OK);
-
-    vector<Extent> extents;
-    vector<Block>::size_type block_count = 0;
-
     LOG(INFO) << "Appending left over blocks to extents";
 
-    for (vector<Block>::size_type i = 0; i < blocks.size(); i++) {
-        if (blocks[i].writer != Vertex::kInvalidIndex) {
-            continue;
+    // The left over blocks are the gaps between the writer runs. Split them
+    // into groups as we go.
+    const uint64_t group_blocks = kFullUpdateChunkSize / kBlockSize;
+    vector<vector<Extent>> groups(1);
+    uint64_t group_block_count = 0;
+    uint64_t block_count = 0;
+    uint64_t next_block = 0;
+
+    for (BlockMap::RunMap::const_iterator writer = blocks->writers().begin();
+            next_block < blocks->num_blocks(); ++writer) {
+        const uint64_t end_block = (writer == blocks->writers().end()) ?
+                                   blocks->num_blocks() : writer->first;
+
+        while (next_block < end_block) {
+            if (group_block_count == group_blocks) {
+                groups.resize(groups.size() + 1);
+                group_block_count = 0;
+            }
+
+            const uint64_t num_blocks = min(end_block - next_block,
+                                            group_blocks - group_block_count);
+            graph_utils::AppendBlocksToExtents(&groups.back(), next_block,
+                                               num_blocks);
+            group_block_count += num_blocks;
+            block_count += num_blocks;
+            next_block += num_blocks;
         }
 
-        if (blocks[i].reader != Vertex::kInvalidIndex) {
-            graph_utils::AddReadBeforeDep(vertex, blocks[i].reader, i);
+        if (writer == blocks->writers().end()) {
+            break;
         }
 
-        graph_utils::AppendBlockToExtents(&extents, i);
-        block_count++;
+        next_block = writer->second.end_block();
     }
 
-    // Code will handle 'buf' at any size that's a multiple of kBlockSize,
-    // so we arbitrarily set it to 1024 * kBlockSize.
-    vector<char> buf(1024 * kBlockSize);
+    if (block_count == 0) {
+        LOG(INFO) << "No left over blocks";
+        return true;
+    }
 
-    LOG(INFO) << "Reading left over blocks";
-    vector<Block>::size_type blocks_copied_count = 0;
+    LOG(INFO) << "Compressing " << block_count << " left over blocks in "
+              << groups.size() << " groups";
+
+    size_t max_threads = max(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+    std::deque<std::shared_ptr<ChunkProcessor>> threads;
+    size_t next_group = 0;
+    size_t written_groups = 0;
+    uint64_t blocks_copied_count = 0;
+    uint64_t compressed_size = 0;
+    float printed_progress = -1;
+
+    while (written_groups < groups.size()) {
+        // Keep up to max_threads groups compressing.
+        while (threads.size() < max_threads && next_group < groups.size()) {
+            std::shared_ptr<ChunkProcessor> processor(
+                new ChunkProcessor(image_fd, groups[next_group], kBlockSize));
+            threads.push_back(processor);
+            TEST_AND_RETURN_FALSE(processor->Start());
+            next_group++;
+        }
 
-    // For each extent in extents, write the data into BZ2_bzWrite which
-    // sends it to an output file.
-    // We use the temporary buffer 'buf' to hold the data, which may be
-    // smaller than the extent, so in that case we have to loop to get
-    // the extent's data (that's the inner while loop).
-    for (const Extent &extent : extents) {
-        vector<Block>::size_type blocks_read = 0;
-        float printed_progress = -1;
-
-        while (blocks_read < extent.num_blocks()) {
-            const int copy_block_cnt =
-                min(buf.size() / kBlockSize,
-                    static_cast<vector<char>::size_type>(
-                        extent.num_blocks() - blocks_read));
-            ssize_t rc = pread(image_fd,
-                               &buf[0],
-                               copy_block_cnt * kBlockSize,
-                               (extent.start_block() + blocks_read) * kBlockSize);
-            TEST_AND_RETURN_FALSE_ERRNO(rc >= 0);
-            TEST_AND_RETURN_FALSE(static_cast<size_t>(rc) ==
-                                  copy_block_cnt * kBlockSize);
-            BZ2_bzWrite(&err, bz_file, &buf[0], copy_block_cnt * kBlockSize);
-            TEST_AND_RETURN_FALSE(err == BZ_OK);
-            blocks_read += copy_block_cnt;
-            blocks_copied_count += copy_block_cnt;
-            float current_progress =
-                static_cast<float>(blocks_copied_count) / block_count;
-
-            if (printed_progress + 0.1 < current_progress ||
-                    blocks_copied_count == block_count) {
-                LOG(INFO) << "progress: " << current_progress;
-                printed_progress = current_progress;
-            }
+        // Write the groups out in order, so the result doesn't depend on
+        // the number of threads.
+        const vector<Extent> &extents = groups[written_groups];
+        std::shared_ptr<ChunkProcessor> processor = threads.front();
+        threads.pop_front();
+        TEST_AND_RETURN_FALSE(processor->Wait());
+
+        const bool compress = processor->ShouldCompress();
+        const vector<char> &use_buf =
+            compress ? processor->buffer_compressed() : processor->buffer_in();
+        TEST_AND_RETURN_FALSE(utils::WriteAll(blobs_fd,
+                                              use_buf.data(),
+                                              use_buf.size()));
+
+        // Add node to graph to write these blocks
+        graph->resize(graph->size() + 1);
+        Vertex *vertex = &graph->back();
+        vertex->file_name = StringPrintf("<fs-non-file-data-%zu>",
+                                         written_groups++);
+        InstallOperation *out_op = &vertex->op;
+        out_op->set_type(compress ?
+                         InstallOperation_Type_REPLACE_BZ :
+                         InstallOperation_Type_REPLACE);
+        out_op->set_data_offset(*blobs_length);
+        out_op->set_data_length(use_buf.size());
+        TEST_AND_RETURN_FALSE(
+            DeltaDiffGenerator::AddOperationHash(out_op, use_buf));
+        *blobs_length += use_buf.size();
+        compressed_size += use_buf.size();
+        out_op->set_dst_length(processor->buffer_in().size());
+        DeltaDiffGenerator::StoreExtents(extents, out_op->mutable_dst_extents());
+
+        // CreateEdges() makes it run after the readers of its blocks.
+        TEST_AND_RETURN_FALSE(DeltaDiffGenerator::AddInstallOpToBlockMap(
+                                  *out_op, *graph, graph->size() - 1, blocks));
+
+        blocks_copied_count += processor->buffer_in().size() / kBlockSize;
+        float current_progress =
+            static_cast<float>(blocks_copied_count) / block_count;
+
+        if (printed_progress + 0.1 < current_progress ||
+                blocks_copied_count == block_count) {
+            LOG(INFO) << "progress: " << current_progress;
+            printed_progress = current_progress;
         }
     }
 
-    BZ2_bzWriteClose(&err, bz_file, 0, NULL, NULL);
-    TEST_AND_RETURN_FALSE(err == BZ_OK);
-    bz_file = NULL;
-    TEST_AND_RETURN_FALSE_ERRNO(0 == fclose(file));
-    file = NULL;
-
-    vector<char> compressed_data;
-    LOG(INFO) << "Reading compressed data off disk";
-    TEST_AND_RETURN_FALSE(utils::ReadFile(temp_file_path, &compressed_data));
-    TEST_AND_RETURN_FALSE(unlink(temp_file_path.c_str()) == 0);
-
-    // Add node to graph to write these blocks
-    out_op->set_type(InstallOperation_Type_REPLACE_BZ);
-    out_op->set_data_offset(*blobs_length);
-    out_op->set_data_length(compressed_data.size());
-    LOG(INFO) << "fs non-data blocks compressed take up "
-              << compressed_data.size();
-    *blobs_length += compressed_data.size();
-    out_op->set_dst_length(kBlockSize * block_count);
-    DeltaDiffGenerator::StoreExtents(extents, out_op->mutable_dst_extents());
-
-    TEST_AND_RETURN_FALSE(utils::WriteAll(blobs_fd,
-                                          &compressed_data[0],
-                                          compressed_data.size()));
+    LOG(INFO) << "fs non-data blocks compressed take up " << compressed_size;
     LOG(INFO) << "done with extra blocks";
     return true;
 }
@@ -397,16 +923,95 @@ void InstallOperationsToManifest(
     }
 }
 
+// Computes the size and hash of an image on a thread of its own, so that
+// reading the image overlaps with generating the payload.
+class InfoHasher
+{
+public:
+    explicit InfoHasher(const string &path)
+        : path_(path),
+          thread_(NULL),
+          success_(false) {}
+    ~InfoHasher()
+    {
+        Wait();
+    }
+
+    // Starts hashing the image on another thread, or on this one if there's
+    // no thread to be had.
+    void Start()
+    {
+        thread_ = g_thread_try_new("info_hasher", RunThread, this, NULL);
+
+        if (!thread_) {
+            Run();
+        }
+    }
+
+    // Waits for Start() to finish and stores the result in |info|. Returns
+    // true on success, false on failure.
+    bool Wait(InstallInfo *info)
+    {
+        TEST_AND_RETURN_FALSE(Wait());
+        *info = info_;
+        return true;
+    }
+
+private:
+    void Run()
+    {
+        success_ = DeltaDiffGenerator::InitializeInfo(path_, &info_);
+    }
+
+    bool Wait()
+    {
+        if (thread_) {
+            g_thread_join(thread_);
+            thread_ = NULL;
+        }
+
+        return success_;
+    }
+
+    static gpointer RunThread(gpointer data)
+    {
+        reinterpret_cast<InfoHasher *>(data)->Run();
+        return NULL;
+    }
+
+    const string path_;
+    InstallInfo info_;
+    GThread *thread_;
+    bool success_;
+
+    DISALLOW_COPY_AND_ASSIGN(InfoHasher);
+};
+
+// Returns an InfoHasher that has started on |path|, or NULL if |path| is
+// empty.
+std::unique_ptr<InfoHasher> StartInfoHasher(const string &path)
+{
+    std::unique_ptr<InfoHasher> hasher;
+
+    if (!path.empty()) {
+        hasher.reset(new InfoHasher(path));
+        hasher->Start();
+    }
+
+    return hasher;
+}
+
 // Adds all |kernel_ops| to |manifest|. Filters out no-op operations.
-// Computes hash for old and new kernel images.
+// Gets the hashes of the old and new kernel images from
+// |old_kernel_hasher|, if any, and |new_kernel_hasher|.
 bool KernelProcedureToManifest(
-    const string &old_kernel_path,
-    const string &new_kernel_path,
+    InfoHasher *old_kernel_hasher,
+    InfoHasher *new_kernel_hasher,
     const vector<InstallOperation> &kernel_ops,
     DeltaArchiveManifest *manifest)
 {
     DCHECK(!kernel_ops.empty());
-    DCHECK(!new_kernel_path.empty());
+    DCHECK(new_kernel_hasher);
 
     InstallProcedure *proc = manifest->add_procedures();
     proc->set_type(InstallProcedure_Type_KERNEL);
@@ -420,15 +1025,12 @@ bool KernelProcedureToManifest(
         *op = add_op;
     }
 
-    if (!old_kernel_path.empty()) {
+    if (old_kernel_hasher) {
         TEST_AND_RETURN_FALSE(
-            DeltaDiffGenerator::InitializeInfo(old_kernel_path,
-                                               proc->mutable_old_info()));
+            old_kernel_hasher->Wait(proc->mutable_old_info()));
     }
 
-    TEST_AND_RETURN_FALSE(
-        DeltaDiffGenerator::InitializeInfo(new_kernel_path,
-                                           proc->mutable_new_info()));
+    TEST_AND_RETURN_FALSE(new_kernel_hasher->Wait(proc->mutable_new_info()));
     return true;
 }
 
@@ -498,6 +1100,7 @@ bool DeltaCompressKernel(
     if (op->type() != InstallOperation_Type_MOVE) {
         op->set_data_offset(*blobs_length);
         op->set_data_length(data.size());
+        TEST_AND_RETURN_FALSE(DeltaDiffGenerator::AddOperationHash(op, data));
     }
 
     TEST_AND_RETURN_FALSE(utils::WriteAll(blobs_fd, &data[0], data.size()));
@@ -524,7 +1127,8 @@ struct DeltaObject {
 
 void ReportPayloadUsage(const DeltaArchiveManifest &manifest,
                         const int64_t manifest_metadata_size,
-                        const OperationNameMap &op_name_map)
+                        const OperationNameMap &op_name_map,
+                        GeneratorProfile *profile)
 {
     vector<DeltaObject> objects;
     off_t total_size = 0;
@@ -564,12 +1168,291 @@ void ReportPayloadUsage(const DeltaArchiveManifest &manifest,
                 static_cast<intmax_t>(object.size),
                 object.type >= 0 ? kInstallOperationTypes[object.type] : "-",
                 object.name.c_str());
+
+        if (profile) {
+            GeneratorProfile::PayloadObject profile_object;
+            profile_object.name = object.name;
+            profile_object.type =
+                object.type >= 0 ? kInstallOperationTypes[object.type] : "";
+            profile_object.size = object.size;
+            profile->AddPayloadObject(profile_object);
+        }
     }
 
     fprintf(stderr, kFormatString,
             100.0, static_cast<intmax_t>(total_size), "", "<total>");
 }
 
+// Files at least this big get their REPLACE_BZ candidate compressed on a
+// thread of its own while bsdiff runs, unless FileDiffer threads already
+// keep every processor busy. Smaller files aren't worth a thread.
+const size_t kConcurrentCandidatesMinSize = 1024 * 1024;  // bytes
+
+// bsdiff is skipped if the old file is less than 1/kMostlyNewRatio of the
+// size of the new one: most of the new file would go in the delta as extra
+// data then, which bzip2 compresses about as well on its own.
+const size_t kMostlyNewRatio = 8;
+
+// The compressed size of a file bigger than kCompressSampleSize is
+// estimated by compressing that many bytes from its middle. Full bzip2 is
+// skipped if the bsdiff delta is less than 1/kBsdiffWinRatio of the
+// estimate.
+const size_t kCompressSampleSize = 64 * 1024;  // bytes
+const size_t kBsdiffWinRatio = 4;
+
+// Version of the way ReadFileToDiff() chooses operations: the heuristics
+// above, ChooseCandidate() and bsdiff::Diff(). Part of the diff cache keys;
+// bump it whenever any of them changes what is chosen.
+const int kChooserVersion = 2;
+
+double SecondsSince(steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(steady_clock::now() - start).count();
+}
+
+// What ReadFileToDiff() did, to tune the heuristics that skip candidates.
+struct CandidateStats {
+    CandidateStats()
+        : files(0),
+          found_files(0),
+          found_blocks(0),
+          cache_hits(0),
+          bzip_runs(0),
+          bzip_skips(0),
+          bsdiff_runs(0),
+          bsdiff_skips(0),
+          bzip_seconds(0),
+          bsdiff_seconds(0),
+          sample_seconds(0)
+    {
+        std::fill(wins, wins + arraysize(wins), 0);
+    }
+
+    void Add(const CandidateStats &stats)
+    {
+        files += stats.files;
+        found_files += stats.found_files;
+        found_blocks += stats.found_blocks;
+
+        for (size_t i = 0; i < arraysize(wins); i++) {
+            wins[i] += stats.wins[i];
+        }
+
+        cache_hits += stats.cache_hits;
+        bzip_runs += stats.bzip_runs;
+        bzip_skips += stats.bzip_skips;
+        bsdiff_runs += stats.bsdiff_runs;
+        bsdiff_skips += stats.bsdiff_skips;
+        bzip_seconds += stats.bzip_seconds;
+        bsdiff_seconds += stats.bsdiff_seconds;
+        sample_seconds += stats.sample_seconds;
+    }
+
+    uint64_t files;
+    uint64_t found_files;  // diffed against blocks found by content
+    uint64_t found_blocks;
+    uint64_t wins[arraysize(kInstallOperationTypes)];  // by operation type
+    uint64_t cache_hits;
+    uint64_t bzip_runs;
+    uint64_t bzip_skips;
+    uint64_t bsdiff_runs;
+    uint64_t bsdiff_skips;
+    double bzip_seconds;
+    double bsdiff_seconds;
+    double sample_seconds;
+};
+
+// The totals of all the ReadFileToDiff() calls, which may come from several
+// threads at once.
+CandidateStats candidate_stats;
+GMutex candidate_stats_mutex;
+
+void AddCandidateStats(const CandidateStats &stats)
+{
+    g_mutex_lock(&candidate_stats_mutex);
+    candidate_stats.Add(stats);
+    g_mutex_unlock(&candidate_stats_mutex);
+}
+
+void LogCandidateStats()
+{
+    g_mutex_lock(&candidate_stats_mutex);
+    const CandidateStats stats = candidate_stats;
+    g_mutex_unlock(&candidate_stats_mutex);
+
+    if (stats.files == 0) {
+        return;
+    }
+
+    LOG(INFO) << "Diffed " << stats.files << " files or file chunks, "
+              << stats.cache_hits << " from the diff cache";
+    LOG(INFO) << "Found " << stats.found_blocks << " blocks of "
+              << stats.found_files << " files elsewhere in the old image";
+
+    for (size_t i = 0; i < arraysize(stats.wins); i++) {
+        LOG(INFO) << kInstallOperationTypes[i] << " won for "
+                  << stats.wins[i] << " files ("
+                  << stats.wins[i] * 100.0 / stats.files << "%)";
+    }
+
+    LOG(INFO) << "bzip2 ran " << stats.bzip_runs << " times in "
+              << stats.bzip_seconds << " s, skipped " << stats.bzip_skips
+              << " times after sampling in " << stats.sample_seconds << " s";
+    LOG(INFO) << "bsdiff ran " << stats.bsdiff_runs << " times in "
+              << stats.bsdiff_seconds << " s, skipped "
+              << stats.bsdiff_skips << " times";
+}
+
+// Compresses data with bzip2 for the REPLACE_BZ candidate, either on the
+// calling thread through Run() or on a thread of its own through Start()
+// then Wait().
+class BzipCandidate
+{
+public:
+    explicit BzipCandidate(const vector<char> &data)
+        : data_(data),
+          thread_(NULL),
+          success_(false),
+          seconds_(0) {}
+    ~BzipCandidate()
+    {
+        Wait();
+    }
+
+    // Compresses the data. Returns true on success, false otherwise.
+    bool Run()
+    {
+        const steady_clock::time_point start = steady_clock::now();
+        success_ = BzipCompress(data_, &compressed_);
+        seconds_ = SecondsSince(start);
+        return success_;
+    }
+
+    // Starts compressing the data on another thread, or on this one if
+    // there's no thread to be had.
+    void Start()
+    {
+        thread_ = g_thread_try_new("bzip_candidate", RunThread, this, NULL);
+
+        if (!thread_) {
+            Run();
+        }
+    }
+
+    // Waits for Start() to finish. Returns true on success, false on
+    // failure.
+    bool Wait()
+    {
+        if (thread_) {
+            g_thread_join(thread_);
+            thread_ = NULL;
+        }
+
+        return success_;
+    }
+
+    vector<char> *compressed()
+    {
+        return &compressed_;
+    }
+    double seconds() const
+    {
+        return seconds_;
+    }
+
+private:
+    static gpointer RunThread(gpointer data)
+    {
+        reinterpret_cast<BzipCandidate *>(data)->Run();
+        return NULL;
+    }
+
+    const vector<char> &data_;
+    vector<char> compressed_;
+    GThread *thread_;
+    bool success_;
+    double seconds_;
+
+    DISALLOW_COPY_AND_ASSIGN(BzipCandidate);
+};
+
+// Sets |out_type| and |out_data| to the smallest of the REPLACE, REPLACE_BZ
+// and, if |try_bsdiff|, BSDIFF encodings of |new_data|. Candidates that
+// can't win are skipped if it's cheap to tell. Adds to |stats|. Returns
+// true on success.
+bool ChooseCandidate(const vector<char> &old_data,
+                     const vector<char> &new_data,
+                     bool try_bsdiff,
+                     CandidateStats *stats,
+                     InstallOperation_Type *out_type,
+                     vector<char> *out_data)
+{
+    BzipCandidate bzip(new_data);
+    vector<char> bsdiff_delta;
+    bool bzip_started = false;
+
+    if (try_bsdiff && new_data.size() >= kConcurrentCandidatesMinSize &&
+            g_atomic_int_get(&busy_diff_threads) <
+            sysconf(_SC_NPROCESSORS_ONLN)) {
+        bzip.Start();
+        bzip_started = true;
+    }
+
+    if (try_bsdiff) {
+        const steady_clock::time_point start = steady_clock::now();
+        TEST_AND_RETURN_FALSE(bsdiff::Diff(old_data, new_data, &bsdiff_delta));
+        CHECK_GT(bsdiff_delta.size(), static_cast<vector<char>::size_type>(0));
+        stats->bsdiff_seconds += SecondsSince(start);
+        stats->bsdiff_runs++;
+    }
+
+    if (try_bsdiff && !bzip_started &&
+            new_data.size() > kCompressSampleSize) {
+        const steady_clock::time_point start = steady_clock::now();
+        const size_t sample_start = (new_data.size() - kCompressSampleSize) / 2;
+        const vector<char> sample(
+            new_data.begin() + sample_start,
+            new_data.begin() + sample_start + kCompressSampleSize);
+        vector<char> sample_bz;
+        TEST_AND_RETURN_FALSE(BzipCompress(sample, &sample_bz));
+        const uint64_t estimate = static_cast<uint64_t>(sample_bz.size()) *
+                                  new_data.size() / kCompressSampleSize;
+        stats->sample_seconds += SecondsSince(start);
+
+        if (bsdiff_delta.size() * kBsdiffWinRatio < estimate) {
+            stats->bzip_skips++;
+            *out_type = InstallOperation_Type_BSDIFF;
+            out_data->swap(bsdiff_delta);
+            return true;
+        }
+    }
+
+    if (bzip_started) {
+        TEST_AND_RETURN_FALSE(bzip.Wait());
+    } else {
+        TEST_AND_RETURN_FALSE(bzip.Run());
+    }
+
+    CHECK(!bzip.compressed()->empty());
+    stats->bzip_seconds += bzip.seconds();
+    stats->bzip_runs++;
+
+    if (new_data.size() <= bzip.compressed()->size()) {
+        *out_type = InstallOperation_Type_REPLACE;
+        *out_data = new_data;
+    } else {
+        *out_type = InstallOperation_Type_REPLACE_BZ;
+        out_data->swap(*bzip.compressed());
+    }
+
+    if (try_bsdiff && bsdiff_delta.size() < out_data->size()) {
+        *out_type = InstallOperation_Type_BSDIFF;
+        out_data->swap(bsdiff_delta);
+    }
+
+    return true;
+}
+
 }  // namespace {}
 
 bool DeltaDiffGenerator::ReadFileToDiff(
@@ -580,96 +1463,192 @@ bool DeltaDiffGenerator::ReadFileToDiff(
     InstallOperation *out_op,
     bool gather_extents)
 {
+    return ReadFileToDiff(old_filename, new_filename, 0, -1, bsdiff_allowed,
+                          out_data, out_op, gather_extents);
+}
+
+bool DeltaDiffGenerator::ReadFileToDiff(
+    const string &old_filename,
+    const string &new_filename,
+    off_t chunk_offset,
+    off_t chunk_size,
+    bool bsdiff_allowed,
+    vector<char> *out_data,
+    InstallOperation *out_op,
+    bool gather_extents)
+{
+    const MountedImageFiles files("");
+    return ReadFileToDiff(old_filename.empty() ? NULL : &files,
+                          old_filename,
+                          files,
+                          new_filename,
+                          NULL,
+                          chunk_offset,
+                          chunk_size,
+                          bsdiff_allowed,
+                          out_data,
+                          out_op,
+                          gather_extents);
+}
+
+bool DeltaDiffGenerator::ReadFileToDiff(
+    const ImageFiles *old_files,
+    const string &old_path,
+    const ImageFiles &new_files,
+    const string &new_path,
+    const BlockIndex *block_index,
+    off_t chunk_offset,
+    off_t chunk_size,
+    bool bsdiff_allowed,
+    vector<char> *out_data,
+    InstallOperation *out_op,
+    bool gather_extents)
+{
+    TEST_AND_RETURN_FALSE(chunk_offset % kBlockSize == 0);
+    const steady_clock::time_point read_start = steady_clock::now();
+
     // Read new data in
     vector<char> new_data;
-    TEST_AND_RETURN_FALSE(utils::ReadFile(new_filename, &new_data));
+    TEST_AND_RETURN_FALSE(new_files.ReadChunk(new_path, chunk_offset,
+                          chunk_size, &new_data));
 
     TEST_AND_RETURN_FALSE(!new_data.empty());
 
-    vector<char> new_data_bz;
-    TEST_AND_RETURN_FALSE(BzipCompress(new_data, &new_data_bz));
-    CHECK(!new_data_bz.empty());
-
     vector<char> data;  // Data blob that will be written to delta file.
 
     InstallOperation operation;
-    size_t current_best_size = 0;
-
-    if (new_data.size() <= new_data_bz.size()) {
-        operation.set_type(InstallOperation_Type_REPLACE);
-        current_best_size = new_data.size();
-        data = new_data;
-    } else {
-        operation.set_type(InstallOperation_Type_REPLACE_BZ);
-        current_best_size = new_data_bz.size();
-        data = new_data_bz;
-    }
+    CandidateStats stats;
+    stats.files++;
 
     // Do we have an original file to consider?
-    struct stat old_stbuf;
-    bool original = !old_filename.empty();
+    ImageFile old_file;
+    bool original = false;
 
-    if (original && 0 != stat(old_filename.c_str(), &old_stbuf)) {
-        // If stat-ing the old file fails, it should be because it doesn't exist.
-        TEST_AND_RETURN_FALSE(errno == ENOTDIR || errno == ENOENT);
+    if (old_files) {
+        TEST_AND_RETURN_FALSE(old_files->GetFile(old_path, &original,
+                                                 &old_file));
+    }
+
+    // A chunk past the end of the old file is all new.
+    if (original && chunk_offset > 0 && old_file.size <= chunk_offset) {
         original = false;
     }
 
+    // Read old data
+    vector<char> old_data;
+
     if (original) {
-        // Read old data
-        vector<char> old_data;
-        TEST_AND_RETURN_FALSE(utils::ReadFile(old_filename, &old_data));
-
-        if (old_data == new_data) {
-            // No change in data.
-            operation.set_type(InstallOperation_Type_MOVE);
-            current_best_size = 0;
-            data.clear();
-        } else if (bsdiff_allowed) {
-            // If the source file is considered bsdiff safe (no bsdiff bugs
-            // triggered), see if BSDIFF encoding is smaller.
-            vector<char> bsdiff_delta;
-            TEST_AND_RETURN_FALSE(
-                BsdiffFiles(old_filename, new_filename, &bsdiff_delta));
-            CHECK_GT(bsdiff_delta.size(), static_cast<vector<char>::size_type>(0));
+        TEST_AND_RETURN_FALSE(old_files->ReadChunk(old_path, chunk_offset,
+                              chunk_size, &old_data));
+    }
 
-            if (bsdiff_delta.size() < current_best_size) {
-                operation.set_type(InstallOperation_Type_BSDIFF);
-                current_best_size = bsdiff_delta.size();
-                data = bsdiff_delta;
+    // Otherwise, the blocks may still be somewhere else in the old image.
+    vector<Extent> found_extents;
+
+    if (!original && block_index) {
+        TEST_AND_RETURN_FALSE(block_index->FindBlocks(new_data, &found_extents,
+                              &old_data));
+
+        if (!old_data.empty()) {
+            original = true;
+            stats.found_files++;
+            stats.found_blocks += old_data.size() / kBlockSize;
+        }
+    }
+
+    const double read_seconds = SecondsSince(read_start);
+
+    if (original && old_data == new_data) {
+        // No change in data.
+        operation.set_type(InstallOperation_Type_MOVE);
+    } else {
+        // If the source file is considered bsdiff safe (no bsdiff bugs
+        // triggered), see if BSDIFF encoding is smaller.
+        bool try_bsdiff = original && bsdiff_allowed;
+
+        // Another delta to the same new version may have diffed the very
+        // same contents already.
+        string cache_key;
+        InstallOperation_Type type;
+
+        if (try_bsdiff && diff_cache_) {
+            cache_key = DiffCache::Key(old_data, new_data, kChooserVersion);
+        }
+
+        if (!cache_key.empty() &&
+                diff_cache_->Lookup(cache_key, &type, &data) &&
+                type != InstallOperation_Type_MOVE) {
+            stats.cache_hits++;
+        } else {
+            if (try_bsdiff &&
+                    old_data.size() * kMostlyNewRatio < new_data.size()) {
+                try_bsdiff = false;
+                stats.bsdiff_skips++;
+            }
+
+            TEST_AND_RETURN_FALSE(ChooseCandidate(old_data, new_data,
+                                                  try_bsdiff, &stats,
+                                                  &type, &data));
+
+            if (!cache_key.empty()) {
+                diff_cache_->Store(cache_key, type, data);
             }
         }
+
+        operation.set_type(type);
     }
 
-    // Set parameters of the operations
-    CHECK_EQ(data.size(), current_best_size);
+    stats.wins[operation.type()]++;
+    AddCandidateStats(stats);
 
+    // Set parameters of the operations
     if (operation.type() == InstallOperation_Type_MOVE ||
             operation.type() == InstallOperation_Type_BSDIFF) {
-        if (gather_extents) {
+        if (!found_extents.empty()) {
+            StoreExtents(found_extents, operation.mutable_src_extents());
+        } else if (gather_extents) {
             TEST_AND_RETURN_FALSE(
-                GatherExtents(old_filename, operation.mutable_src_extents()));
+                GatherExtents(*old_files, old_path, chunk_offset,
+                              old_data.size(),
+                              operation.mutable_src_extents()));
         } else {
             Extent *src_extent = operation.add_src_extents();
-            src_extent->set_start_block(0);
+            src_extent->set_start_block(chunk_offset / kBlockSize);
             src_extent->set_num_blocks(
-                (old_stbuf.st_size + kBlockSize - 1) / kBlockSize);
+                (old_data.size() + kBlockSize - 1) / kBlockSize);
         }
 
-        operation.set_src_length(old_stbuf.st_size);
+        operation.set_src_length(old_data.size());
     }
 
     if (gather_extents) {
         TEST_AND_RETURN_FALSE(
-            GatherExtents(new_filename, operation.mutable_dst_extents()));
+            GatherExtents(new_files, new_path, chunk_offset,
+                          new_data.size(),
+                          operation.mutable_dst_extents()));
     } else {
         Extent *dst_extent = operation.add_dst_extents();
-        dst_extent->set_start_block(0);
+        dst_extent->set_start_block(chunk_offset / kBlockSize);
         dst_extent->set_num_blocks((new_data.size() + kBlockSize - 1) / kBlockSize);
     }
 
     operation.set_dst_length(new_data.size());
 
+    if (profile_) {
+        GeneratorProfile::File file;
+        file.path = new_path;
+        file.chunk_offset = chunk_offset;
+        file.read_seconds = read_seconds;
+        file.compress_seconds = stats.bzip_seconds + stats.sample_seconds;
+        file.bsdiff_seconds = stats.bsdiff_seconds;
+        file.bzip_skipped = stats.bzip_skips > 0;
+        file.bsdiff_skipped = stats.bsdiff_skips > 0;
+        file.type = operation.type();
+        file.raw_size = new_data.size();
+        file.blob_size = data.size();
+        profile_->AddFile(file);
+    }
+
     out_data->swap(data);
     *out_op = operation;
 
@@ -690,18 +1669,16 @@ bool DeltaDiffGenerator::InitializeInfo(const string &path, InstallInfo *info)
     return true;
 }
 
-bool InitializePartitionInfos(const string &old_rootfs,
-                              const string &new_rootfs,
+bool InitializePartitionInfos(InfoHasher *old_rootfs_hasher,
+                              InfoHasher *new_rootfs_hasher,
                               DeltaArchiveManifest &manifest)
 {
-    if (!old_rootfs.empty()) {
-        TEST_AND_RETURN_FALSE(DeltaDiffGenerator::InitializeInfo(
-                                  old_rootfs,
+    if (old_rootfs_hasher) {
+        TEST_AND_RETURN_FALSE(old_rootfs_hasher->Wait(
                                   manifest.mutable_old_partition_info()));
     }
 
-    TEST_AND_RETURN_FALSE(DeltaDiffGenerator::InitializeInfo(
-                              new_rootfs,
+    TEST_AND_RETURN_FALSE(new_rootfs_hasher->Wait(
                               manifest.mutable_new_partition_info()));
     return true;
 }
@@ -867,34 +1844,36 @@ void DeltaDiffGenerator::StoreExtents(
 // Creates all the edges for the graph. Writers of a block point to
 // readers of the same block. This is because for an edge A->B, B
 // must complete before A executes.
-void DeltaDiffGenerator::CreateEdges(Graph *graph,
-                                     const vector<Block> &blocks)
+void DeltaDiffGenerator::CreateEdges(Graph *graph, const BlockMap &blocks)
 {
-    for (vector<Block>::size_type i = 0; i < blocks.size(); i++) {
-        // Blocks with both a reader and writer get an edge
-        if (blocks[i].reader == Vertex::kInvalidIndex ||
-                blocks[i].writer == Vertex::kInvalidIndex) {
-            continue;
-        }
+    // Walk the reader and writer runs together; blocks with both a reader
+    // and a writer get an edge.
+    BlockMap::RunMap::const_iterator reader = blocks.readers().begin();
+    BlockMap::RunMap::const_iterator writer = blocks.writers().begin();
+
+    while (reader != blocks.readers().end() &&
+            writer != blocks.writers().end()) {
+        const BlockMap::Run &read_run = reader->second;
+        const BlockMap::Run &write_run = writer->second;
+        const uint64_t start_block = max(read_run.start_block,
+                                         write_run.start_block);
+        const uint64_t end_block = min(read_run.end_block(),
+                                       write_run.end_block());
 
         // Don't have a node depend on itself
-        if (blocks[i].reader == blocks[i].writer) {
-            continue;
+        if (start_block < end_block && read_run.vertex != write_run.vertex) {
+            // Adds onto the existing edge, if any.
+            graph_utils::AddReadBeforeDepBlocks(&(*graph)[write_run.vertex],
+                                                read_run.vertex,
+                                                start_block,
+                                                end_block - start_block);
         }
 
-        // See if there's already an edge we can add onto
-        Vertex::EdgeMap::iterator edge_it =
-            (*graph)[blocks[i].writer].out_edges.find(blocks[i].reader);
-
-        if (edge_it == (*graph)[blocks[i].writer].out_edges.end()) {
-            // No existing edge. Create one
-            (*graph)[blocks[i].writer].out_edges.insert(
-                make_pair(blocks[i].reader, EdgeProperties()));
-            edge_it = (*graph)[blocks[i].writer].out_edges.find(blocks[i].reader);
-            CHECK(edge_it != (*graph)[blocks[i].writer].out_edges.end());
+        if (read_run.end_block() < write_run.end_block()) {
+            ++reader;
+        } else {
+            ++writer;
         }
-
-        graph_utils::AppendBlockToExtents(&edge_it->second.extents, i);
     }
 }
 
@@ -1007,7 +1986,7 @@ bool TempBlocksExistInExtents(const T &extents)
 // all temp nodes invalid.
 bool ConvertCutsToFull(
     Graph *graph,
-    const string &new_root,
+    const ImageFiles &new_files,
     int data_fd,
     off_t *data_file_size,
     vector<Vertex::Index> *op_indexes,
@@ -1021,7 +2000,7 @@ bool ConvertCutsToFull(
         TEST_AND_RETURN_FALSE(DeltaDiffGenerator::ConvertCutToFullOp(
                                   graph,
                                   cut,
-                                  new_root,
+                                  new_files,
                                   data_fd,
                                   data_file_size));
         deleted_nodes.insert(cut.new_vertex);
@@ -1054,7 +2033,7 @@ bool ConvertCutsToFull(
 // on exceptional error cases.
 bool AssignBlockForAdjoiningCuts(
     Graph *graph,
-    const string &new_root,
+    const ImageFiles &new_files,
     int data_fd,
     off_t *data_file_size,
     vector<Vertex::Index> *op_indexes,
@@ -1133,7 +2112,7 @@ bool AssignBlockForAdjoiningCuts(
     if (scratch_ranges.blocks() < blocks_needed) {
         LOG(INFO) << "Unable to find sufficient scratch";
         TEST_AND_RETURN_FALSE(ConvertCutsToFull(graph,
-                                                new_root,
+                                                new_files,
                                                 data_fd,
                                                 data_file_size,
                                                 op_indexes,
@@ -1190,7 +2169,7 @@ bool DeltaDiffGenerator::IsNoopOperation(
 
 bool DeltaDiffGenerator::AssignTempBlocks(
     Graph *graph,
-    const string &new_root,
+    const ImageFiles &new_files,
     int data_fd,
     off_t *data_file_size,
     vector<Vertex::Index> *op_indexes,
@@ -1214,7 +2193,7 @@ bool DeltaDiffGenerator::AssignTempBlocks(
         } else {
             CHECK(!cuts_group.empty());
             TEST_AND_RETURN_FALSE(AssignBlockForAdjoiningCuts(graph,
-                                  new_root,
+                                  new_files,
                                   data_fd,
                                   data_file_size,
                                   op_indexes,
@@ -1232,7 +2211,7 @@ bool DeltaDiffGenerator::AssignTempBlocks(
 
     CHECK(!cuts_group.empty());
     TEST_AND_RETURN_FALSE(AssignBlockForAdjoiningCuts(graph,
-                          new_root,
+                          new_files,
                           data_fd,
                           data_file_size,
                           op_indexes,
@@ -1274,11 +2253,12 @@ bool DeltaDiffGenerator::NoTempBlocksRemain(const Graph &graph)
     return true;
 }
 
-static bool ReorderProcedureDataBlobs(
+// Gives the data blobs of |ops| consecutive offsets from *|next_offset| on,
+// in order, and appends where they are in the blobs file to |blobs|.
+static bool OrderProcedureDataBlobs(
     google::protobuf::RepeatedPtrField<InstallOperation> *ops,
-    int in_fd,
-    DirectFileWriter *writer,
-    uint64_t *written)
+    uint64_t *next_offset,
+    vector<DeltaDiffGenerator::BlobRange> *blobs)
 {
     for (InstallOperation &op : *ops) {
         if (!op.has_data_offset()) {
@@ -1286,16 +2266,55 @@ static bool ReorderProcedureDataBlobs(
         }
 
         CHECK(op.has_data_length());
-        vector<char> buf(op.data_length());
-        ssize_t rc = pread(in_fd, &buf[0], buf.size(), op.data_offset());
-        TEST_AND_RETURN_FALSE(rc == static_cast<ssize_t>(buf.size()));
 
-        // Add the hash of the data blobs for this operation
-        TEST_AND_RETURN_FALSE(DeltaDiffGenerator::AddOperationHash(&op, buf));
+        // The hash was taken when the blob was written.
+        TEST_AND_RETURN_FALSE(op.has_data_sha256_hash());
+
+        // Blobs that follow each other in the file are copied in one go.
+        if (!blobs->empty() &&
+                blobs->back().first + blobs->back().second ==
+                static_cast<uint64_t>(op.data_offset())) {
+            blobs->back().second += op.data_length();
+        } else {
+            blobs->push_back(make_pair(op.data_offset(), op.data_length()));
+        }
 
-        op.set_data_offset(*written);
-        TEST_AND_RETURN_FALSE(writer->Write(&buf[0], buf.size()));
-        *written += buf.size();
+        op.set_data_offset(*next_offset);
+        *next_offset += op.data_length();
+    }
+
+    return true;
+}
+
+bool DeltaDiffGenerator::OrderDataBlobs(DeltaArchiveManifest *manifest,
+                                        vector<BlobRange> *blobs)
+{
+    uint64_t next_offset = 0;
+    TEST_AND_RETURN_FALSE(OrderProcedureDataBlobs(
+                              manifest->mutable_partition_operations(),
+                              &next_offset,
+                              blobs));
+
+    for (InstallProcedure &proc : *manifest->mutable_procedures()) {
+        TEST_AND_RETURN_FALSE(OrderProcedureDataBlobs(proc.mutable_operations(),
+                              &next_offset,
+                              blobs));
+    }
+
+    return true;
+}
+
+bool DeltaDiffGenerator::CopyDataBlobs(const string &data_blobs_path,
+                                       const vector<BlobRange> &blobs,
+                                       int out_fd)
+{
+    int in_fd = open(data_blobs_path.c_str(), O_RDONLY, 0);
+    TEST_AND_RETURN_FALSE_ERRNO(in_fd >= 0);
+    files::ScopedFD in_fd_closer(in_fd);
+
+    for (const BlobRange &blob : blobs) {
+        TEST_AND_RETURN_FALSE(utils::CopyFileRange(in_fd, blob.first, out_fd,
+                              blob.second));
     }
 
     return true;
@@ -1306,29 +2325,13 @@ bool DeltaDiffGenerator::ReorderDataBlobs(
     const std::string &data_blobs_path,
     const std::string &new_data_blobs_path)
 {
-    int in_fd = open(data_blobs_path.c_str(), O_RDONLY, 0);
-    TEST_AND_RETURN_FALSE_ERRNO(in_fd >= 0);
-    files::ScopedFD in_fd_closer(in_fd);
+    vector<BlobRange> blobs;
+    TEST_AND_RETURN_FALSE(OrderDataBlobs(manifest, &blobs));
 
     DirectFileWriter writer(new_data_blobs_path.c_str());
     TEST_AND_RETURN_FALSE_ERRNO(writer.Open() == 0);
     ScopedFileWriterCloser writer_closer(&writer);
-    uint64_t written = 0;
-
-    TEST_AND_RETURN_FALSE(ReorderProcedureDataBlobs(
-                              manifest->mutable_partition_operations(),
-                              in_fd,
-                              &writer,
-                              &written));
-
-    for (InstallProcedure &proc : *manifest->mutable_procedures()) {
-        TEST_AND_RETURN_FALSE(ReorderProcedureDataBlobs(
-                                  proc.mutable_operations(),
-                                  in_fd,
-                                  &writer,
-                                  &written));
-    }
-
+    TEST_AND_RETURN_FALSE(CopyDataBlobs(data_blobs_path, blobs, writer.fd()));
     return true;
 }
 
@@ -1346,9 +2349,91 @@ bool DeltaDiffGenerator::AddOperationHash(
     return true;
 }
 
+bool DeltaDiffGenerator::AddDestinationHashes(
+    const string &new_image,
+    google::protobuf::RepeatedPtrField<InstallOperation> *ops)
+{
+    // Count the writes to each block. Blocks written more than once, e.g. the
+    // temp blocks used to break cycles, don't hold the data of the first
+    // write in the final image.
+    map<uint64_t, int> block_writes;
+
+    for (const InstallOperation &op : *ops) {
+        for (const Extent &extent : op.dst_extents()) {
+            if (extent.start_block() == kSparseHole) {
+                continue;
+            }
+
+            for (uint64_t block = extent.start_block();
+                    block < extent.start_block() + extent.num_blocks();
+                    block++) {
+                block_writes[block]++;
+            }
+        }
+    }
+
+    int fd = open(new_image.c_str(), O_RDONLY, 0);
+    TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+    files::ScopedFD fd_closer(fd);
+
+    const uint64_t kMaxBlocksPerRead = 256;
+    vector<char> buf(kMaxBlocksPerRead * kBlockSize);
+    int hashed = 0;
+
+    for (InstallOperation &op : *ops) {
+        bool unique = op.dst_extents_size() > 0;
+
+        for (const Extent &extent : op.dst_extents()) {
+            if (extent.start_block() == kSparseHole) {
+                unique = false;
+                break;
+            }
+
+            for (uint64_t block = extent.start_block();
+                    unique && block < extent.start_block() + extent.num_blocks();
+                    block++) {
+                unique = block_writes[block] == 1;
+            }
+        }
+
+        if (!unique) {
+            continue;
+        }
+
+        OmahaHashCalculator hasher;
+
+        for (const Extent &extent : op.dst_extents()) {
+            for (uint64_t block = 0; block < extent.num_blocks();
+                    block += kMaxBlocksPerRead) {
+                const size_t count =
+                    min(extent.num_blocks() - block, kMaxBlocksPerRead) *
+                    kBlockSize;
+                ssize_t bytes_read = 0;
+                TEST_AND_RETURN_FALSE(utils::PReadAll(
+                                          fd, &buf[0], count,
+                                          (extent.start_block() + block) *
+                                          kBlockSize,
+                                          &bytes_read));
+                TEST_AND_RETURN_FALSE(bytes_read ==
+                                      static_cast<ssize_t>(count));
+                TEST_AND_RETURN_FALSE(hasher.Update(&buf[0], count));
+            }
+        }
+
+        TEST_AND_RETURN_FALSE(hasher.Finalize());
+        const vector<char> &hash = hasher.raw_hash();
+        op.set_dst_sha256_hash(hash.data(), hash.size());
+        hashed++;
+    }
+
+    LOG(INFO) << "Added destination hashes to " << hashed << "/"
+              << ops->size() << " operations";
+    return true;
+}
+
 bool DeltaDiffGenerator::ConvertCutToFullOp(Graph *graph,
         const CutEdgeVertexes &cut,
-        const string &new_root,
+        const ImageFiles &new_files,
         int data_fd,
         off_t *data_file_size)
 {
@@ -1365,9 +2450,11 @@ bool DeltaDiffGenerator::ConvertCutToFullOp(Graph *graph,
         TEST_AND_RETURN_FALSE(DeltaReadFile(graph,
                                             cut.old_dst,
                                             NULL,
-                                            kNonexistentPath,
-                                            new_root,
+                                            NULL,
+                                            new_files,
                                             (*graph)[cut.old_dst].file_name,
+                                            (*graph)[cut.old_dst].chunk_offset,
+                                            (*graph)[cut.old_dst].chunk_size,
                                             data_fd,
                                             data_file_size));
 
@@ -1388,15 +2475,21 @@ bool DeltaDiffGenerator::ConvertCutToFullOp(Graph *graph,
 }
 
 bool DeltaDiffGenerator::ConvertGraphToDag(Graph *graph,
-        const string &new_root,
+        const ImageFiles &new_files,
         int fd,
         off_t *data_file_size,
         vector<Vertex::Index> *final_order)
 {
+    // Cycle breaking and sorting only read the edges; they share a compact
+    // copy of them while the graph doesn't change.
+    std::unique_ptr<CompactGraph> compact_graph(new CompactGraph(*graph));
+    LOG(INFO) << "Compact graph of " << compact_graph->num_edges()
+              << " edges takes " << compact_graph->MemoryUsage() << " bytes";
+
     CycleBreaker cycle_breaker;
     LOG(INFO) << "Finding cycles...";
     set<Edge> cut_edges;
-    cycle_breaker.BreakCycles(*graph, &cut_edges);
+    cycle_breaker.BreakCycles(*graph, *compact_graph, &cut_edges);
     LOG(INFO) << "done finding cycles";
     CheckGraph(*graph);
 
@@ -1408,8 +2501,23 @@ bool DeltaDiffGenerator::ConvertGraphToDag(Graph *graph,
     LOG(INFO) << "There are " << cuts.size() << " cuts.";
     CheckGraph(*graph);
 
+    if (profile_) {
+        uint64_t temp_blocks = 0;
+
+        for (const CutEdgeVertexes &cut : cuts) {
+            temp_blocks += graph_utils::BlocksInExtents(cut.tmp_extents);
+        }
+
+        profile_->SetCuts(cuts.size(), temp_blocks);
+    }
+
+    // Cutting adds vertices and rewires edges.
+    if (!cuts.empty()) {
+        compact_graph.reset(new CompactGraph(*graph));
+    }
+
     LOG(INFO) << "Creating initial topological order...";
-    TopologicalSort(*graph, final_order);
+    TopologicalSort(*compact_graph, final_order);
     LOG(INFO) << "done with initial topo order";
     CheckGraph(*graph);
 
@@ -1424,7 +2532,7 @@ bool DeltaDiffGenerator::ConvertGraphToDag(Graph *graph,
 
     if (!cuts.empty())
         TEST_AND_RETURN_FALSE(AssignTempBlocks(graph,
-                                               new_root,
+                                               new_files,
                                                fd,
                                                data_file_size,
                                                final_order,
@@ -1479,14 +2587,18 @@ bool DeltaDiffGenerator::GenerateDeltaUpdateFile(
         TEST_AND_RETURN_FALSE(utils::FileSize(new_kernel) >= 0);
     }
 
-    vector<Block> blocks(new_image_size / kBlockSize);
-    LOG(INFO) << "Invalid block index: " << Vertex::kInvalidIndex;
-    LOG(INFO) << "Block count: " << blocks.size();
+    // The images only need to be read once more for their hashes, which goes
+    // on in the background while the payload is generated.
+    std::unique_ptr<InfoHasher> old_image_hasher = StartInfoHasher(old_image);
+    std::unique_ptr<InfoHasher> new_image_hasher = StartInfoHasher(new_image);
+    std::unique_ptr<InfoHasher> old_kernel_hasher =
+        StartInfoHasher(old_kernel);
+    std::unique_ptr<InfoHasher> new_kernel_hasher =
+        StartInfoHasher(new_kernel);
 
-    for (vector<Block>::size_type i = 0; i < blocks.size(); i++) {
-        CHECK(blocks[i].reader == Vertex::kInvalidIndex);
-        CHECK(blocks[i].writer == Vertex::kInvalidIndex);
-    }
+    BlockMap blocks(new_image_size / kBlockSize);
+    LOG(INFO) << "Invalid block index: " << Vertex::kInvalidIndex;
+    LOG(INFO) << "Block count: " << blocks.num_blocks();
 
     Graph graph;
     CheckGraph(graph);
@@ -1512,34 +2624,61 @@ bool DeltaDiffGenerator::GenerateDeltaUpdateFile(
         if (!old_image.empty()) {
             // Delta update
 
-            TEST_AND_RETURN_FALSE(DeltaReadFiles(&graph,
-                                                 &blocks,
-                                                 old_root,
-                                                 new_root,
-                                                 fd,
-                                                 &data_file_size));
+            // Without mount points, the files are read from the images.
+            std::unique_ptr<ImageFiles> old_files, new_files;
+
+            if (old_root.empty() && new_root.empty()) {
+                LOG(INFO) << "Reading files from the images";
+                Ext2ImageFiles *old_ext2_files = new Ext2ImageFiles;
+                old_files.reset(old_ext2_files);
+                TEST_AND_RETURN_FALSE(old_ext2_files->Open(old_image));
+                Ext2ImageFiles *new_ext2_files = new Ext2ImageFiles;
+                new_files.reset(new_ext2_files);
+                TEST_AND_RETURN_FALSE(new_ext2_files->Open(new_image));
+            } else {
+                TEST_AND_RETURN_FALSE(!old_root.empty() && !new_root.empty());
+                old_files.reset(new MountedImageFiles(old_root));
+                new_files.reset(new MountedImageFiles(new_root));
+            }
+
+            {
+                ScopedPhaseTimer timer(profile_, "DeltaReadFiles");
+                TEST_AND_RETURN_FALSE(DeltaReadFiles(&graph,
+                                                     &blocks,
+                                                     *old_files,
+                                                     *new_files,
+                                                     max_op_size_,
+                                                     fd,
+                                                     &data_file_size));
+            }
             LOG(INFO) << "done reading normal files";
             CheckGraph(graph);
 
             LOG(INFO) << "Starting metadata processing";
-            TEST_AND_RETURN_FALSE(Ext2Metadata::DeltaReadMetadata(&graph,
-                                  &blocks,
-                                  old_image,
-                                  new_image,
-                                  fd,
-                                  &data_file_size));
+            {
+                ScopedPhaseTimer timer(profile_, "DeltaReadMetadata");
+                TEST_AND_RETURN_FALSE(Ext2Metadata::DeltaReadMetadata(&graph,
+                                      &blocks,
+                                      old_image,
+                                      new_image,
+                                      fd,
+                                      &data_file_size));
+            }
             LOG(INFO) << "Done metadata processing";
             CheckGraph(graph);
 
-            graph.resize(graph.size() + 1);
-            TEST_AND_RETURN_FALSE(ReadUnwrittenBlocks(blocks,
-                                  fd,
-                                  &data_file_size,
-                                  new_image,
-                                  &graph.back()));
+            {
+                ScopedPhaseTimer timer(profile_, "ReadUnwrittenBlocks");
+                TEST_AND_RETURN_FALSE(ReadUnwrittenBlocks(&blocks,
+                                      fd,
+                                      &data_file_size,
+                                      new_image,
+                                      &graph));
+            }
 
             if (!new_kernel.empty()) {
                 // Read kernel partition
+                ScopedPhaseTimer timer(profile_, "DeltaCompressKernel");
                 TEST_AND_RETURN_FALSE(DeltaCompressKernel(old_kernel,
                                       new_kernel,
                                       &kernel_ops,
@@ -1548,20 +2687,39 @@ bool DeltaDiffGenerator::GenerateDeltaUpdateFile(
                 LOG(INFO) << "done reading kernel";
             }
 
+            LogCandidateStats();
+
             CheckGraph(graph);
 
             LOG(INFO) << "Creating edges...";
-            CreateEdges(&graph, blocks);
+            {
+                ScopedPhaseTimer timer(profile_, "CreateEdges");
+                CreateEdges(&graph, blocks);
+            }
             LOG(INFO) << "Done creating edges";
             CheckGraph(graph);
 
+            if (profile_) {
+                uint64_t edges = 0;
+
+                for (const Vertex &vertex : graph) {
+                    edges += vertex.out_edges.size();
+                }
+
+                profile_->SetGraphSize(graph.size(), edges);
+            }
+
+            ScopedPhaseTimer timer(profile_, "ConvertGraphToDag");
             TEST_AND_RETURN_FALSE(ConvertGraphToDag(&graph,
-                                                    new_root,
+                                                    *new_files,
                                                     fd,
                                                     &data_file_size,
                                                     &final_order));
         } else {
+            ScopedPhaseTimer timer(profile_, "FullUpdateGenerator");
+            BzipChunkCompressor compressor(full_compression_level_);
             FullUpdateGenerator generator(fd, kFullUpdateChunkSize, kBlockSize);
+            generator.set_compressor(&compressor);
 
             TEST_AND_RETURN_FALSE(generator.Partition(new_image,
                                   new_image_size,
@@ -1588,23 +2746,27 @@ bool DeltaDiffGenerator::GenerateDeltaUpdateFile(
     manifest.set_block_size(kBlockSize);
 
     if (!new_kernel.empty()) {
-        TEST_AND_RETURN_FALSE(KernelProcedureToManifest(old_kernel,
-                              new_kernel,
+        TEST_AND_RETURN_FALSE(KernelProcedureToManifest(old_kernel_hasher.get(),
+                              new_kernel_hasher.get(),
                               kernel_ops,
                               &manifest));
     }
 
-    // Reorder the data blobs with the newly ordered manifest
-    string ordered_blobs_path;
-    TEST_AND_RETURN_FALSE(utils::MakeTempFile(
-                              "/tmp/CrAU_temp_data.ordered.XXXXXX",
-                              &ordered_blobs_path,
-                              NULL));
-    ScopedPathUnlinker ordered_blobs_unlinker(ordered_blobs_path);
-    TEST_AND_RETURN_FALSE(ReorderDataBlobs(&manifest,
-                                           temp_file_path,
-                                           ordered_blobs_path));
-    temp_file_unlinker.reset();
+    // Give the data blobs offsets in the order of the newly ordered
+    // manifest. They are copied in that order straight into the payload.
+    vector<BlobRange> blobs;
+    {
+        ScopedPhaseTimer timer(profile_, "OrderDataBlobs");
+        TEST_AND_RETURN_FALSE(OrderDataBlobs(&manifest, &blobs));
+    }
+
+    // Let clients skip the data of operations that wouldn't change anything.
+    {
+        ScopedPhaseTimer timer(profile_, "AddDestinationHashes");
+        TEST_AND_RETURN_FALSE(AddDestinationHashes(
+                                  new_image,
+                                  manifest.mutable_partition_operations()));
+    }
 
     // Fill in the legacy noop_operations list.
     ProceduresToNoops(&manifest);
@@ -1641,9 +2803,13 @@ bool DeltaDiffGenerator::GenerateDeltaUpdateFile(
         AddSignatureOp(next_blob_offset, signature_blob_length, manifest);
     }
 
-    TEST_AND_RETURN_FALSE(InitializePartitionInfos(old_image,
-                          new_image,
-                          manifest));
+    {
+        // Mostly waiting for the hashing that's left.
+        ScopedPhaseTimer timer(profile_, "InitializePartitionInfos");
+        TEST_AND_RETURN_FALSE(InitializePartitionInfos(old_image_hasher.get(),
+                              new_image_hasher.get(),
+                              manifest));
+    }
 
     // Serialize protobuf
     string serialized_manifest;
@@ -1675,26 +2841,17 @@ bool DeltaDiffGenerator::GenerateDeltaUpdateFile(
 
     // Append the data blobs
     LOG(INFO) << "Writing final delta file data blobs...";
-    int blobs_fd = open(ordered_blobs_path.c_str(), O_RDONLY, 0);
-    files::ScopedFD blobs_fd_closer(blobs_fd);
-    TEST_AND_RETURN_FALSE(blobs_fd >= 0);
-
-    for (;;) {
-        char buf[kBlockSize];
-        ssize_t rc = read(blobs_fd, buf, sizeof(buf));
-
-        if (0 == rc) {
-            // EOF
-            break;
-        }
-
-        TEST_AND_RETURN_FALSE_ERRNO(rc > 0);
-        TEST_AND_RETURN_FALSE(writer.Write(buf, rc));
+    {
+        ScopedPhaseTimer timer(profile_, "CopyDataBlobs");
+        TEST_AND_RETURN_FALSE(CopyDataBlobs(temp_file_path, blobs,
+                                            writer.fd()));
     }
+    temp_file_unlinker.reset();
 
     // Write signature blob.
     if (!private_key_path.empty()) {
         LOG(INFO) << "Signing the update...";
+        ScopedPhaseTimer timer(profile_, "SignPayload");
         vector<char> signature_blob;
         TEST_AND_RETURN_FALSE(PayloadSigner::SignPayload(
                                   output_path,
@@ -1706,52 +2863,43 @@ bool DeltaDiffGenerator::GenerateDeltaUpdateFile(
 
     *metadata_size =
         strlen(kDeltaMagic) + 2 * sizeof(uint64_t) + serialized_manifest.size();
-    ReportPayloadUsage(manifest, *metadata_size, op_name_map);
+    ReportPayloadUsage(manifest, *metadata_size, op_name_map, profile_);
+
+    if (diff_cache_) {
+        diff_cache_->LogStats();
+    }
 
     LOG(INFO) << "All done. Successfully created delta file with "
               << "metadata size = " << *metadata_size;
     return true;
 }
 
-// Runs the bsdiff tool on two files and returns the resulting delta in
+// Computes the bsdiff between two files and returns the resulting delta in
 // 'out'. Returns true on success.
 bool DeltaDiffGenerator::BsdiffFiles(const string &old_file,
                                      const string &new_file,
                                      vector<char> *out)
 {
-    const string kPatchFile = "/tmp/delta.patchXXXXXX";
-    string patch_file_path;
-
-    TEST_AND_RETURN_FALSE(
-        utils::MakeTempFile(kPatchFile, &patch_file_path, NULL));
-
-    vector<string> cmd;
-    cmd.push_back(kBsdiffPath);
-    cmd.push_back(old_file);
-    cmd.push_back(new_file);
-    cmd.push_back(patch_file_path);
-
-    int rc = 1;
-    vector<char> patch_file;
-    TEST_AND_RETURN_FALSE(Subprocess::SynchronousExec(cmd, &rc, NULL));
-    TEST_AND_RETURN_FALSE(rc == 0);
-    TEST_AND_RETURN_FALSE(utils::ReadFile(patch_file_path, out));
-    unlink(patch_file_path.c_str());
+    vector<char> old_data;
+    vector<char> new_data;
+    TEST_AND_RETURN_FALSE(utils::ReadFile(old_file, &old_data));
+    TEST_AND_RETURN_FALSE(utils::ReadFile(new_file, &new_data));
+    TEST_AND_RETURN_FALSE(bsdiff::Diff(old_data, new_data, out));
     return true;
 }
 
 // The |blocks| vector contains a reader and writer for each block on the
 // filesystem that's being in-place updated. We populate the reader/writer
 // fields of |blocks| by calling this function.
-// For each block in |operation| that is read or written, find that block
-// in |blocks| and set the reader/writer field to the vertex passed.
+// For each extent in |operation| that is read or written, record the vertex
+// passed as its reader/writer in |blocks|.
 // |graph| is not strictly necessary, but useful for printing out
 // error messages.
-bool DeltaDiffGenerator::AddInstallOpToBlocksVector(
+bool DeltaDiffGenerator::AddInstallOpToBlockMap(
     const InstallOperation &operation,
     const Graph &graph,
     Vertex::Index vertex,
-    vector<Block> *blocks)
+    BlockMap *blocks)
 {
     // See if this is already present.
     TEST_AND_RETURN_FALSE(operation.dst_extents_size() > 0);
@@ -1759,35 +2907,35 @@ bool DeltaDiffGenerator::AddInstallOpToBlocksVector(
     enum BlockField { READER = 0, WRITER, BLOCK_FIELD_COUNT };
 
     for (int field = READER; field < BLOCK_FIELD_COUNT; field++) {
-        const int extents_size =
-            (field == READER) ? operation.src_extents_size() :
-            operation.dst_extents_size();
         const char *past_participle = (field == READER) ? "read" : "written";
         const google::protobuf::RepeatedPtrField<Extent> &extents =
             (field == READER) ? operation.src_extents() : operation.dst_extents();
-        Vertex::Index Block::*access_type =
-            (field == READER) ? &Block::reader : &Block::writer;
-
-        for (int i = 0; i < extents_size; i++) {
-            const Extent &extent = extents.Get(i);
 
+        for (const Extent &extent : extents) {
             if (extent.start_block() == kSparseHole) {
                 // Hole in sparse file. skip
                 continue;
             }
 
-            for (uint64_t block = extent.start_block();
-                    block < (extent.start_block() + extent.num_blocks()); block++) {
-                if ((*blocks)[block].*access_type != Vertex::kInvalidIndex) {
-                    LOG(FATAL) << "Block " << block << " is already "
-                               << past_participle << " by "
-                               << (*blocks)[block].*access_type << "("
-                               << graph[(*blocks)[block].*access_type].file_name
-                               << ") and also " << vertex << "("
-                               << graph[vertex].file_name << ")";
-                }
-
-                (*blocks)[block].*access_type = vertex;
+            BlockMap::Run conflict;
+            const bool added = (field == READER) ?
+                               blocks->AddReader(extent.start_block(),
+                                                 extent.num_blocks(),
+                                                 vertex,
+                                                 &conflict) :
+                               blocks->AddWriter(extent.start_block(),
+                                                 extent.num_blocks(),
+                                                 vertex,
+                                                 &conflict);
+
+            if (!added) {
+                LOG(FATAL) << "Blocks " << conflict.start_block << "-"
+                           << conflict.end_block() - 1 << " are already "
+                           << past_participle << " by "
+                           << conflict.vertex << "("
+                           << graph[conflict.vertex].file_name
+                           << ") and some also by " << vertex << "("
+                           << graph[vertex].file_name << ")";
             }
         }
     }
@@ -1817,7 +2965,6 @@ void DeltaDiffGenerator::AddSignatureOp(uint64_t signature_blob_offset,
                                  kBlockSize);
 }
 
-const char *const kBsdiffPath = "bsdiff";
 const char *const kBspatchPath = "bspatch";
 
 };  // namespace chromeos_update_engine
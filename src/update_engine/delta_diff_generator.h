@@ -6,21 +6,26 @@
 #define CHROMEOS_PLATFORM_UPDATE_ENGINE_DELTA_DIFF_GENERATOR_H__
 
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "macros.h"
+#include "update_engine/block_map.h"
 #include "update_engine/graph_types.h"
 #include "update_engine/update_metadata.pb.h"
 
 // There is one function in DeltaDiffGenerator of importance to users
-// of the class: GenerateDeltaUpdateFile(). Before calling it,
-// the old and new images must be mounted. Call GenerateDeltaUpdateFile()
-// with both the mount-points of the images in addition to the paths of
-// the images (both old and new). A delta from old to new will be
-// generated and stored in output_path.
+// of the class: GenerateDeltaUpdateFile(). Call it with the paths of the
+// images (both old and new) and, if they are mounted, their mount-points.
+// A delta from old to new will be generated and stored in output_path.
 
 namespace chromeos_update_engine {
 
+class BlockIndex;
+class DiffCache;
+class GeneratorProfile;
+class ImageFiles;
+
 // This struct stores all relevant info for an edge that is cut between
 // nodes old_src -> old_dst by creating new vertex new_vertex. The new
 // relationship is:
@@ -40,24 +45,11 @@ struct CutEdgeVertexes {
 class DeltaDiffGenerator
 {
 public:
-    // Represents a disk block on the install partition.
-    struct Block {
-        // During install, each block on the install partition will be written
-        // and some may be read (in all likelihood, many will be read).
-        // The reading and writing will be performed by InstallOperations,
-        // each of which has a corresponding vertex in a graph.
-        // A Block object tells which vertex will read or write this block
-        // at install time.
-        // Generally, there will be a vector of Block objects whose length
-        // is the number of blocks on the install partition.
-        Block() : reader(Vertex::kInvalidIndex), writer(Vertex::kInvalidIndex) {}
-        Vertex::Index reader;
-        Vertex::Index writer;
-    };
-
     // This is the only function that external users of the class should call.
-    // old_image and new_image are paths to two image files. They should be
-    // mounted read-only at paths old_root and new_root respectively.
+    // old_image and new_image are paths to two image files. They may be
+    // mounted read-only at paths old_root and new_root respectively; if both
+    // of those are empty, the files are read from the (ext2) images instead,
+    // which needs no root.
     // {old,new}_kernel are paths to the old and new kernel images.
     // private_key_path points to a private key used to sign the update.
     // Pass empty string to not sign the update.
@@ -80,11 +72,11 @@ public:
     // read from disk, and converts it into a DAG by breaking all cycles
     // and finding temp space to resolve broken edges.
     // The final order of the nodes is given in |final_order|
-    // Some files may need to be reread from disk, thus |fd| and
+    // Some files may need to be reread from |new_files|, thus |fd| and
     // |data_file_size| are be passed.
     // Returns true on success.
     static bool ConvertGraphToDag(Graph *graph,
-                                  const std::string &new_root,
+                                  const ImageFiles &new_files,
                                   int fd,
                                   off_t *data_file_size,
                                   std::vector<Vertex::Index> *final_order);
@@ -104,6 +96,34 @@ public:
                                InstallOperation *out_op,
                                bool gather_extents);
 
+    // Like above, but only encodes the |chunk_size| bytes from
+    // |chunk_offset| of new_filename, or all of them from there if
+    // |chunk_size| is -1, using the same bytes of old_filename, if any.
+    // |chunk_offset| must be a multiple of the block size.
+    static bool ReadFileToDiff(const std::string &old_filename,
+                               const std::string &new_filename,
+                               off_t chunk_offset,
+                               off_t chunk_size,
+                               bool bsdiff_allowed,
+                               std::vector<char> *out_data,
+                               InstallOperation *out_op,
+                               bool gather_extents);
+
+    // Like above, but reads old_path in |old_files|, if not NULL, and
+    // new_path in |new_files|. If there's no old file, the blocks of the new
+    // one found in |block_index|, if not NULL, are diffed against instead.
+    static bool ReadFileToDiff(const ImageFiles *old_files,
+                               const std::string &old_path,
+                               const ImageFiles &new_files,
+                               const std::string &new_path,
+                               const BlockIndex *block_index,
+                               off_t chunk_offset,
+                               off_t chunk_size,
+                               bool bsdiff_allowed,
+                               std::vector<char> *out_data,
+                               InstallOperation *out_op,
+                               bool gather_extents);
+
     // Modifies blocks read by 'op' so that any blocks referred to by
     // 'remove_extents' are replaced with blocks from 'replace_extents'.
     // 'remove_extents' and 'replace_extents' must be the same number of blocks.
@@ -134,7 +154,7 @@ public:
     // Creates all the edges for the graph. Writers of a block point to
     // readers of the same block. This is because for an edge A->B, B
     // must complete before A executes.
-    static void CreateEdges(Graph *graph, const std::vector<Block> &blocks);
+    static void CreateEdges(Graph *graph, const BlockMap &blocks);
 
     // Given a topologically sorted graph |op_indexes| and |graph|, alters
     // |op_indexes| to move all the full operations to the end of the vector.
@@ -151,14 +171,29 @@ public:
     // blocks. Temp blocks are in the range [kTempBlockStart, kSparseHole).
     static bool NoTempBlocksRemain(const Graph &graph);
 
+    // Where a data blob is in a data blobs file: its offset and length.
+    typedef std::pair<uint64_t, uint64_t> BlobRange;
+
     // Install operations in the manifest may reference data blobs, which
-    // are in data_blobs_path. This function creates a new data blobs file
-    // with the data blobs in the same order as the referencing install
-    // operations in the manifest. E.g. if manifest[0] has a data blob
-    // "X" at offset 1, manifest[1] has a data blob "Y" at offset 0,
-    // and data_blobs_path's file contains "YX", new_data_blobs_path
-    // will set to be a file that contains "XY". The operations in
-    // are modified to refer to the new data blob locations.
+    // are in a data blobs file. This function gives the data blobs offsets
+    // in the same order as the referencing install operations in the
+    // manifest, and stores in |blobs| the ranges of the data blobs file to
+    // copy, in order, to get them there. Each operation with a data blob
+    // must already have its hash set.
+    static bool OrderDataBlobs(DeltaArchiveManifest *manifest,
+                               std::vector<BlobRange> *blobs);
+
+    // Writes the |blobs| of data_blobs_path to |out_fd|, at its current
+    // offset.
+    static bool CopyDataBlobs(const std::string &data_blobs_path,
+                              const std::vector<BlobRange> &blobs,
+                              int out_fd);
+
+    // Like OrderDataBlobs(), but creates a new data blobs file with the
+    // data blobs in order. E.g. if manifest[0] has a data blob "X" at
+    // offset 1, manifest[1] has a data blob "Y" at offset 0, and
+    // data_blobs_path's file contains "YX", new_data_blobs_path will set
+    // to be a file that contains "XY".
     static bool ReorderDataBlobs(DeltaArchiveManifest *manifest,
                                  const std::string &data_blobs_path,
                                  const std::string &new_data_blobs_path);
@@ -172,6 +207,13 @@ public:
     static bool AddOperationHash(InstallOperation *op,
                                  const std::vector<char> &buf);
 
+    // Sets the destination hash of each of |ops| whose dst_extents aren't
+    // written by any other operation, from the data of those blocks in
+    // |new_image|. Operations writing to sparse holes get no hash.
+    static bool AddDestinationHashes(
+        const std::string &new_image,
+        google::protobuf::RepeatedPtrField<InstallOperation> *ops);
+
     // Handles allocation of temp blocks to a cut edge by converting the
     // dest node to a full op. This removes the need for temp blocks, but
     // comes at the cost of a worse compression ratio.
@@ -181,7 +223,7 @@ public:
     // A->B. Now, A is a full operation.
     static bool ConvertCutToFullOp(Graph *graph,
                                    const CutEdgeVertexes &cut,
-                                   const std::string &new_root,
+                                   const ImageFiles &new_files,
                                    int data_fd,
                                    off_t *data_file_size);
 
@@ -201,7 +243,7 @@ public:
     // success.
     static bool AssignTempBlocks(
         Graph *graph,
-        const std::string &new_root,
+        const ImageFiles &new_files,
         int data_fd,
         off_t *data_file_size,
         std::vector<Vertex::Index> *op_indexes,
@@ -215,24 +257,24 @@ public:
     // Fill size and hash of the given device or file.
     static bool InitializeInfo(const std::string &path, InstallInfo *info);
 
-    // Runs the bsdiff tool on two files and returns the resulting delta in
-    // |out|. Returns true on success.
+    // Computes the bsdiff between two files and returns the resulting delta
+    // in |out|. Returns true on success.
     static bool BsdiffFiles(const std::string &old_file,
                             const std::string &new_file,
                             std::vector<char> *out);
 
-    // The |blocks| vector contains a reader and writer for each block on the
-    // filesystem that's being in-place updated. We populate the reader/writer
-    // fields of |blocks| by calling this function.
-    // For each block in |operation| that is read or written, find that block
-    // in |blocks| and set the reader/writer field to the vertex passed.
+    // The |blocks| map contains a reader and writer for each block on the
+    // filesystem that's being in-place updated. We populate |blocks| by
+    // calling this function.
+    // For each extent in |operation| that is read or written, record the
+    // vertex passed as its reader/writer in |blocks|.
     // |graph| is not strictly necessary, but useful for printing out
     // error messages.
-    static bool AddInstallOpToBlocksVector(
+    static bool AddInstallOpToBlockMap(
         const InstallOperation &operation,
         const Graph &graph,
         Vertex::Index vertex,
-        std::vector<DeltaDiffGenerator::Block> *blocks);
+        BlockMap *blocks);
 
     // Adds to |manifest| a dummy operation that points to a signature blob
     // located at the specified offset/length.
@@ -240,12 +282,49 @@ public:
                                uint64_t signature_blob_length,
                                DeltaArchiveManifest &manifest);
 
+    // Makes ReadFileToDiff() look up the operations for pairs of files in
+    // |diff_cache| before diffing them, and store the ones it computes there.
+    // Pass NULL to always diff. The cache is not owned.
+    static void set_diff_cache(DiffCache *diff_cache)
+    {
+        diff_cache_ = diff_cache;
+    }
+
+    // Makes GenerateDeltaUpdateFile() split files bigger than
+    // |max_op_size| bytes, which must be a multiple of the block size, into
+    // operations of at most that many bytes each, so that clients never
+    // have to hold more than that in memory for one operation. Pass 0 to
+    // have one operation per file.
+    static void set_max_op_size(off_t max_op_size)
+    {
+        max_op_size_ = max_op_size;
+    }
+
+    // Makes GenerateDeltaUpdateFile() compress the chunks of full updates
+    // with bzip2 at |level|, from 1 to 9 (the default).
+    static void set_full_compression_level(int level)
+    {
+        full_compression_level_ = level;
+    }
+
+    // Makes ReadFileToDiff() and GenerateDeltaUpdateFile() record the files
+    // they diff, their phases and the payload they make in |profile|. Pass
+    // NULL not to. The profile is not owned.
+    static void set_profile(GeneratorProfile *profile)
+    {
+        profile_ = profile;
+    }
+
 private:
+    static DiffCache *diff_cache_;
+    static off_t max_op_size_;
+    static int full_compression_level_;
+    static GeneratorProfile *profile_;
+
 // This should never be constructed
     DISALLOW_IMPLICIT_CONSTRUCTORS(DeltaDiffGenerator);
 };
 
-extern const char *const kBsdiffPath;
 extern const char *const kBspatchPath;
 
 };  // namespace chromeos_update_engine
@@ -5,6 +5,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <stdlib.h>
 #include <unistd.h>
 
 #include <set>
@@ -17,12 +18,15 @@
 #include <gtest/gtest.h>
 
 #include "files/scoped_file.h"
+#include "update_engine/block_index.h"
 #include "update_engine/cycle_breaker.h"
 #include "update_engine/delta_diff_generator.h"
 #include "update_engine/delta_performer.h"
 #include "update_engine/extent_ranges.h"
+#include "update_engine/generator_profile.h"
 #include "update_engine/graph_types.h"
 #include "update_engine/graph_utils.h"
+#include "update_engine/image_files.h"
 #include "update_engine/subprocess.h"
 #include "update_engine/test_utils.h"
 #include "update_engine/topological_sort.h"
@@ -36,8 +40,6 @@ using std::vector;
 
 namespace chromeos_update_engine {
 
-typedef DeltaDiffGenerator::Block Block;
-
 namespace {
 int64_t BlocksInExtents(
     const google::protobuf::RepeatedPtrField<Extent> &extents)
@@ -267,6 +269,227 @@ void OpAppendExtent(InstallOperation *op,
 }
 }
 
+TEST_F(DeltaDiffGeneratorTest, ChunkNoGatherExtentsTest)
+{
+    const size_t kBlockSize = 4096;
+    vector<char> old_data(3 * kBlockSize);
+    FillWithData(&old_data);
+    vector<char> new_data(old_data);
+    new_data[kBlockSize + 10] ^= 1;
+    new_data.resize(5 * kBlockSize + 10, 'a');
+    EXPECT_TRUE(WriteFileVector(old_path(), old_data));
+    EXPECT_TRUE(WriteFileVector(new_path(), new_data));
+
+    // The first block didn't change.
+    vector<char> data;
+    InstallOperation op;
+    EXPECT_TRUE(DeltaDiffGenerator::ReadFileToDiff(old_path(),
+                new_path(),
+                0,
+                kBlockSize,
+                true, // bsdiff_allowed
+                &data,
+                &op,
+                false));
+    EXPECT_TRUE(data.empty());
+    EXPECT_EQ(InstallOperation_Type_MOVE, op.type());
+    EXPECT_EQ(kBlockSize, op.src_length());
+    EXPECT_EQ(kBlockSize, op.dst_length());
+
+    // The second did, and is diffed against the same block of the old file.
+    EXPECT_TRUE(DeltaDiffGenerator::ReadFileToDiff(old_path(),
+                new_path(),
+                kBlockSize,
+                kBlockSize,
+                true, // bsdiff_allowed
+                &data,
+                &op,
+                false));
+    EXPECT_EQ(InstallOperation_Type_BSDIFF, op.type());
+    EXPECT_EQ(1, op.src_extents_size());
+    EXPECT_EQ(1, op.src_extents(0).start_block());
+    EXPECT_EQ(1, op.src_extents(0).num_blocks());
+    EXPECT_EQ(kBlockSize, op.src_length());
+    EXPECT_EQ(1, op.dst_extents_size());
+    EXPECT_EQ(1, op.dst_extents(0).start_block());
+    EXPECT_EQ(1, op.dst_extents(0).num_blocks());
+    EXPECT_EQ(kBlockSize, op.dst_length());
+
+    // The rest is past the end of the old file.
+    EXPECT_TRUE(DeltaDiffGenerator::ReadFileToDiff(old_path(),
+                new_path(),
+                4 * kBlockSize,
+                -1,
+                true, // bsdiff_allowed
+                &data,
+                &op,
+                false));
+    EXPECT_NE(InstallOperation_Type_BSDIFF, op.type());
+    EXPECT_NE(InstallOperation_Type_MOVE, op.type());
+    EXPECT_EQ(0, op.src_extents_size());
+    EXPECT_EQ(1, op.dst_extents_size());
+    EXPECT_EQ(4, op.dst_extents(0).start_block());
+    EXPECT_EQ(2, op.dst_extents(0).num_blocks());
+    EXPECT_EQ(kBlockSize + 10, op.dst_length());
+}
+
+namespace {
+// Fills |data| with bytes that bzip2 can't compress, the same for each
+// |seed|.
+void FillWithRandomData(vector<char> *data, unsigned int seed)
+{
+    for (char &c : *data) {
+        c = rand_r(&seed);
+    }
+}
+
+// Diffs the file at |new_file| against the one at |old_file| into |op| and
+// returns how ReadFileToDiff() went about it.
+GeneratorProfile::File DiffProfiled(const string &old_file,
+                                    const string &new_file,
+                                    InstallOperation *op)
+{
+    GeneratorProfile profile;
+    DeltaDiffGenerator::set_profile(&profile);
+    vector<char> data;
+    EXPECT_TRUE(DeltaDiffGenerator::ReadFileToDiff(old_file,
+                new_file,
+                true, // bsdiff_allowed
+                &data,
+                op,
+                false));
+    DeltaDiffGenerator::set_profile(NULL);
+    const vector<GeneratorProfile::File> files = profile.files();
+    EXPECT_EQ(1, files.size());
+    return files.empty() ? GeneratorProfile::File() : files[0];
+}
+}  // namespace {}
+
+TEST_F(DeltaDiffGeneratorTest, MostlyNewSkipsBsdiffTest)
+{
+    const size_t kBlockSize = 4096;
+    vector<char> old_data(kBlockSize);
+    FillWithRandomData(&old_data, 1);
+    EXPECT_TRUE(WriteFileVector(old_path(), old_data));
+
+    // bsdiff would find all of the new file in the old one, but the old file
+    // is more than 8 times smaller.
+    vector<char> new_data;
+
+    for (int i = 0; i < 9; i++) {
+        new_data.insert(new_data.end(), old_data.begin(), old_data.end());
+    }
+
+    EXPECT_TRUE(WriteFileVector(new_path(), new_data));
+    InstallOperation op;
+    GeneratorProfile::File file = DiffProfiled(old_path(), new_path(), &op);
+    EXPECT_EQ(InstallOperation_Type_REPLACE_BZ, op.type());
+    EXPECT_TRUE(file.bsdiff_skipped);
+    EXPECT_EQ(0, file.bsdiff_seconds);
+
+    // Exactly 8 times smaller is still diffed.
+    new_data.resize(8 * kBlockSize);
+    EXPECT_TRUE(WriteFileVector(new_path(), new_data));
+    file = DiffProfiled(old_path(), new_path(), &op);
+    EXPECT_EQ(InstallOperation_Type_BSDIFF, op.type());
+    EXPECT_FALSE(file.bsdiff_skipped);
+}
+
+TEST_F(DeltaDiffGeneratorTest, SampledCompressibilitySkipsBzipTest)
+{
+    // A few changed bytes make a delta far smaller than what a sample of the
+    // incompressible new file says bzip2 would make.
+    vector<char> old_data(256 * 1024);
+    FillWithRandomData(&old_data, 2);
+    vector<char> new_data(old_data);
+    new_data[1000] ^= 1;
+    new_data[100000] ^= 1;
+    EXPECT_TRUE(WriteFileVector(old_path(), old_data));
+    EXPECT_TRUE(WriteFileVector(new_path(), new_data));
+
+    InstallOperation op;
+    const GeneratorProfile::File file = DiffProfiled(old_path(), new_path(),
+                                        &op);
+    EXPECT_EQ(InstallOperation_Type_BSDIFF, op.type());
+    EXPECT_TRUE(file.bzip_skipped);
+    EXPECT_FALSE(file.bsdiff_skipped);
+}
+
+TEST_F(DeltaDiffGeneratorTest, BsdiffWinsWithoutSkippingBzipTest)
+{
+    // The old file is the first half of the new one: the delta is half the
+    // size of the bzip2 estimate, not small enough to skip bzip2, but still
+    // smaller than what it makes.
+    vector<char> new_data(256 * 1024);
+    FillWithRandomData(&new_data, 3);
+    const vector<char> old_data(new_data.begin(),
+                                new_data.begin() + new_data.size() / 2);
+    EXPECT_TRUE(WriteFileVector(old_path(), old_data));
+    EXPECT_TRUE(WriteFileVector(new_path(), new_data));
+
+    InstallOperation op;
+    const GeneratorProfile::File file = DiffProfiled(old_path(), new_path(),
+                                        &op);
+    EXPECT_EQ(InstallOperation_Type_BSDIFF, op.type());
+    EXPECT_FALSE(file.bzip_skipped);
+    EXPECT_FALSE(file.bsdiff_skipped);
+    EXPECT_LT(file.blob_size, new_data.size() * 3 / 4);
+}
+
+TEST_F(DeltaDiffGeneratorTest, RenamedFileTest)
+{
+    const size_t kBlockSize = 4096;
+    string old_root, new_root;
+    ASSERT_TRUE(utils::MakeTempDirectory("/tmp/RenamedFileTest.XXXXXX",
+                                         &old_root));
+    ScopedDirRemover old_root_remover(old_root);
+    ASSERT_TRUE(utils::MakeTempDirectory("/tmp/RenamedFileTest.XXXXXX",
+                                         &new_root));
+    ScopedDirRemover new_root_remover(new_root);
+
+    vector<char> contents(2 * kBlockSize);
+    FillWithData(&contents);
+    ASSERT_TRUE(WriteFileVector(old_root + "/libfoo.so.1", contents));
+    ASSERT_TRUE(WriteFileVector(new_root + "/libfoo.so.2", contents));
+
+    MountedImageFiles old_files(old_root), new_files(new_root);
+    BlockIndex block_index(old_files);
+    bool exists = false;
+    ImageFile old_file;
+    ASSERT_TRUE(old_files.GetFile("/libfoo.so.1", &exists, &old_file));
+    ASSERT_TRUE(block_index.AddFile(old_file));
+
+    // There's no old libfoo.so.2, but its blocks are found in libfoo.so.1.
+    vector<char> data;
+    InstallOperation op;
+    EXPECT_TRUE(DeltaDiffGenerator::ReadFileToDiff(&old_files,
+                "/libfoo.so.2",
+                new_files,
+                "/libfoo.so.2",
+                &block_index,
+                0,  // chunk_offset
+                -1,  // chunk_size
+                true,  // bsdiff_allowed
+                &data,
+                &op,
+                true));
+    EXPECT_TRUE(data.empty());
+    EXPECT_EQ(InstallOperation_Type_MOVE, op.type());
+    EXPECT_EQ(2 * kBlockSize, op.src_length());
+    EXPECT_EQ(2, BlocksInExtents(op.src_extents()));
+
+    vector<Extent> old_extents;
+    EXPECT_TRUE(old_files.GetExtents("/libfoo.so.1", &old_extents));
+    ASSERT_EQ(old_extents.size(), op.src_extents_size());
+
+    for (size_t i = 0; i < old_extents.size(); i++) {
+        EXPECT_EQ(old_extents[i].start_block(),
+                  op.src_extents(i).start_block());
+        EXPECT_EQ(old_extents[i].num_blocks(),
+                  op.src_extents(i).num_blocks());
+    }
+}
+
 TEST_F(DeltaDiffGeneratorTest, SubstituteBlocksTest)
 {
     vector<Extent> remove_blocks;
@@ -304,7 +527,7 @@ TEST_F(DeltaDiffGeneratorTest, SubstituteBlocksTest)
 TEST_F(DeltaDiffGeneratorTest, CutEdgesTest)
 {
     Graph graph;
-    vector<Block> blocks(9);
+    BlockMap blocks(9);
 
     // Create nodes in graph
     {
@@ -317,9 +540,9 @@ TEST_F(DeltaDiffGeneratorTest, CutEdgesTest)
         graph_utils::AppendBlockToExtents(&extents, 7);
         DeltaDiffGenerator::StoreExtents(extents,
                                          graph.back().op.mutable_src_extents());
-        blocks[3].reader = graph.size() - 1;
-        blocks[5].reader = graph.size() - 1;
-        blocks[7].reader = graph.size() - 1;
+        EXPECT_TRUE(blocks.AddReader(3, 1, graph.size() - 1, NULL));
+        EXPECT_TRUE(blocks.AddReader(5, 1, graph.size() - 1, NULL));
+        EXPECT_TRUE(blocks.AddReader(7, 1, graph.size() - 1, NULL));
 
         // Writes to blocks 1, 2, 4
         extents.clear();
@@ -328,9 +551,9 @@ TEST_F(DeltaDiffGeneratorTest, CutEdgesTest)
         graph_utils::AppendBlockToExtents(&extents, 4);
         DeltaDiffGenerator::StoreExtents(extents,
                                          graph.back().op.mutable_dst_extents());
-        blocks[1].writer = graph.size() - 1;
-        blocks[2].writer = graph.size() - 1;
-        blocks[4].writer = graph.size() - 1;
+        EXPECT_TRUE(blocks.AddWriter(1, 1, graph.size() - 1, NULL));
+        EXPECT_TRUE(blocks.AddWriter(2, 1, graph.size() - 1, NULL));
+        EXPECT_TRUE(blocks.AddWriter(4, 1, graph.size() - 1, NULL));
     }
     {
         graph.resize(graph.size() + 1);
@@ -342,9 +565,9 @@ TEST_F(DeltaDiffGeneratorTest, CutEdgesTest)
         graph_utils::AppendBlockToExtents(&extents, 4);
         DeltaDiffGenerator::StoreExtents(extents,
                                          graph.back().op.mutable_src_extents());
-        blocks[1].reader = graph.size() - 1;
-        blocks[2].reader = graph.size() - 1;
-        blocks[4].reader = graph.size() - 1;
+        EXPECT_TRUE(blocks.AddReader(1, 1, graph.size() - 1, NULL));
+        EXPECT_TRUE(blocks.AddReader(2, 1, graph.size() - 1, NULL));
+        EXPECT_TRUE(blocks.AddReader(4, 1, graph.size() - 1, NULL));
 
         // Writes to blocks 3, 5, 6
         extents.clear();
@@ -353,9 +576,9 @@ TEST_F(DeltaDiffGeneratorTest, CutEdgesTest)
         graph_utils::AppendBlockToExtents(&extents, 6);
         DeltaDiffGenerator::StoreExtents(extents,
                                          graph.back().op.mutable_dst_extents());
-        blocks[3].writer = graph.size() - 1;
-        blocks[5].writer = graph.size() - 1;
-        blocks[6].writer = graph.size() - 1;
+        EXPECT_TRUE(blocks.AddWriter(3, 1, graph.size() - 1, NULL));
+        EXPECT_TRUE(blocks.AddWriter(5, 1, graph.size() - 1, NULL));
+        EXPECT_TRUE(blocks.AddWriter(6, 1, graph.size() - 1, NULL));
     }
 
     // Create edges
@@ -441,9 +664,13 @@ TEST_F(DeltaDiffGeneratorTest, ReorderBlobsTest)
         manifest.add_partition_operations();
     op->set_data_offset(1);
     op->set_data_length(3);
+    EXPECT_TRUE(DeltaDiffGenerator::AddOperationHash(
+                    op, vector<char>(orig_data.begin() + 1, orig_data.end())));
     op = manifest.add_partition_operations();
     op->set_data_offset(0);
     op->set_data_length(1);
+    EXPECT_TRUE(DeltaDiffGenerator::AddOperationHash(
+                    op, vector<char>(orig_data.begin(), orig_data.begin() + 1)));
 
     EXPECT_TRUE(DeltaDiffGenerator::ReorderDataBlobs(&manifest,
                 orig_blobs,
@@ -462,6 +689,44 @@ TEST_F(DeltaDiffGeneratorTest, ReorderBlobsTest)
     unlink(new_blobs.c_str());
 }
 
+TEST_F(DeltaDiffGeneratorTest, OrderDataBlobsTest)
+{
+    const vector<char> data(1, 'x');
+    DeltaArchiveManifest manifest;
+
+    // Blobs at 4, 5, 0 and 1 take two copies.
+    const uint64_t offsets[] = { 4, 5, 0, 1 };
+
+    for (uint64_t offset : offsets) {
+        InstallOperation *op = manifest.add_partition_operations();
+        op->set_data_offset(offset);
+        op->set_data_length(1);
+        EXPECT_TRUE(DeltaDiffGenerator::AddOperationHash(op, data));
+    }
+
+    // Operations without a blob are left alone.
+    manifest.add_partition_operations();
+
+    vector<DeltaDiffGenerator::BlobRange> blobs;
+    EXPECT_TRUE(DeltaDiffGenerator::OrderDataBlobs(&manifest, &blobs));
+    ASSERT_EQ(2, blobs.size());
+    EXPECT_EQ(4, blobs[0].first);
+    EXPECT_EQ(2, blobs[0].second);
+    EXPECT_EQ(0, blobs[1].first);
+    EXPECT_EQ(2, blobs[1].second);
+
+    for (int i = 0; i < 4; i++) {
+        EXPECT_EQ(i, manifest.partition_operations(i).data_offset());
+    }
+
+    EXPECT_FALSE(manifest.partition_operations(4).has_data_offset());
+
+    // Blobs must have been hashed when they were written.
+    manifest.mutable_partition_operations(0)->clear_data_sha256_hash();
+    blobs.clear();
+    EXPECT_FALSE(DeltaDiffGenerator::OrderDataBlobs(&manifest, &blobs));
+}
+
 TEST_F(DeltaDiffGeneratorTest, MoveFullOpsToBackTest)
 {
     Graph graph(4);
@@ -604,7 +869,7 @@ TEST_F(DeltaDiffGeneratorTest, RunAsRootAssignTempBlocksTest)
 
 
     EXPECT_TRUE(DeltaDiffGenerator::ConvertGraphToDag(&graph,
-                temp_dir,
+                MountedImageFiles(temp_dir),
                 fd,
                 &data_file_size,
                 &final_order));
@@ -722,7 +987,7 @@ TEST_F(DeltaDiffGeneratorTest, RunAsRootNoSparseAsTempTest)
     off_t data_file_size = 0;
 
     EXPECT_TRUE(DeltaDiffGenerator::ConvertGraphToDag(&graph,
-                temp_dir,
+                MountedImageFiles(temp_dir),
                 fd,
                 &data_file_size,
                 &final_order));
@@ -746,7 +1011,7 @@ TEST_F(DeltaDiffGeneratorTest, RunAsRootNoSparseAsTempTest)
 TEST_F(DeltaDiffGeneratorTest, NoSparseAsTempTest)
 {
     Graph graph;
-    vector<Block> blocks(4);
+    BlockMap blocks(4);
 
     // Create nodes in |graph|.
     {
@@ -771,7 +1036,7 @@ TEST_F(DeltaDiffGeneratorTest, NoSparseAsTempTest)
         graph_utils::AppendBlockToExtents(&extents, kSparseHole);
         DeltaDiffGenerator::StoreExtents(extents,
                                          graph.back().op.mutable_dst_extents());
-        blocks[0].writer = graph.size() - 1;
+        EXPECT_TRUE(blocks.AddWriter(0, 1, graph.size() - 1, NULL));
     }
     {
         graph.resize(graph.size() + 1);
@@ -794,7 +1059,7 @@ TEST_F(DeltaDiffGeneratorTest, NoSparseAsTempTest)
         graph_utils::AppendBlockToExtents(&extents, kSparseHole);
         DeltaDiffGenerator::StoreExtents(extents,
                                          graph.back().op.mutable_src_extents());
-        blocks[2].reader = graph.size() - 1;
+        EXPECT_TRUE(blocks.AddReader(2, 1, graph.size() - 1, NULL));
 
         // Write to (1, sparse, 3).
         extents.clear();
@@ -803,8 +1068,8 @@ TEST_F(DeltaDiffGeneratorTest, NoSparseAsTempTest)
         graph_utils::AppendBlockToExtents(&extents, 3);
         DeltaDiffGenerator::StoreExtents(extents,
                                          graph.back().op.mutable_dst_extents());
-        blocks[1].writer = graph.size() - 1;
-        blocks[3].writer = graph.size() - 1;
+        EXPECT_TRUE(blocks.AddWriter(1, 1, graph.size() - 1, NULL));
+        EXPECT_TRUE(blocks.AddWriter(3, 1, graph.size() - 1, NULL));
     }
     {
         graph.resize(graph.size() + 1);
@@ -816,8 +1081,8 @@ TEST_F(DeltaDiffGeneratorTest, NoSparseAsTempTest)
         graph_utils::AppendBlockToExtents(&extents, 3);
         DeltaDiffGenerator::StoreExtents(extents,
                                          graph.back().op.mutable_src_extents());
-        blocks[1].reader = graph.size() - 1;
-        blocks[3].reader = graph.size() - 1;
+        EXPECT_TRUE(blocks.AddReader(1, 1, graph.size() - 1, NULL));
+        EXPECT_TRUE(blocks.AddReader(3, 1, graph.size() - 1, NULL));
 
         // Write to (2, sparse, sparse).
         extents.clear();
@@ -826,7 +1091,7 @@ TEST_F(DeltaDiffGeneratorTest, NoSparseAsTempTest)
         graph_utils::AppendBlockToExtents(&extents, kSparseHole);
         DeltaDiffGenerator::StoreExtents(extents,
                                          graph.back().op.mutable_dst_extents());
-        blocks[2].writer = graph.size() - 1;
+        EXPECT_TRUE(blocks.AddWriter(2, 1, graph.size() - 1, NULL));
     }
 
     graph_utils::DumpGraph(graph);
@@ -839,7 +1104,7 @@ TEST_F(DeltaDiffGeneratorTest, NoSparseAsTempTest)
     vector<Vertex::Index> final_order;
     off_t data_file_size = 0;
     EXPECT_TRUE(DeltaDiffGenerator::ConvertGraphToDag(&graph,
-                "/non/existent/dir",
+                MountedImageFiles("/non/existent/dir"),
                 -1,
                 &data_file_size,
                 &final_order));
@@ -982,7 +1247,7 @@ TEST_F(DeltaDiffGeneratorTest, RunAsRootAssignTempBlocksReuseTest)
     off_t data_file_size = 0;
 
     EXPECT_TRUE(DeltaDiffGenerator::AssignTempBlocks(&graph,
-                temp_dir,
+                MountedImageFiles(temp_dir),
                 fd,
                 &data_file_size,
                 &op_indexes,
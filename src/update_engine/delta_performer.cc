@@ -111,6 +111,49 @@ int DeltaPerformer::Close()
     return -err;
 }
 
+bool DeltaPerformer::DestinationMatches(const InstallOperation &operation)
+{
+    CHECK(fd_ >= 0);
+
+    if (!operation.has_dst_sha256_hash() || operation.dst_extents_size() == 0) {
+        return false;
+    }
+
+    DCHECK(block_size_);
+    const uint64_t kMaxBlocksPerRead = 256;
+    vector<char> buf(kMaxBlocksPerRead * block_size_);
+    OmahaHashCalculator hasher;
+
+    for (const Extent &extent : operation.dst_extents()) {
+        TEST_AND_RETURN_FALSE(extent.start_block() != kSparseHole);
+
+        for (uint64_t block = 0; block < extent.num_blocks();
+                block += kMaxBlocksPerRead) {
+            const size_t count =
+                min(extent.num_blocks() - block, kMaxBlocksPerRead) *
+                block_size_;
+            ssize_t bytes_read = 0;
+            TEST_AND_RETURN_FALSE(utils::PReadAll(
+                                      fd_, &buf[0], count,
+                                      (extent.start_block() + block) *
+                                      block_size_,
+                                      &bytes_read));
+
+            // Blocks past the end of the device don't hold anything yet.
+            if (bytes_read != static_cast<ssize_t>(count)) {
+                return false;
+            }
+
+            TEST_AND_RETURN_FALSE(hasher.Update(&buf[0], count));
+        }
+    }
+
+    TEST_AND_RETURN_FALSE(hasher.Finalize());
+    const string &expected_hash = operation.dst_sha256_hash();
+    return hasher.raw_hash() == vector<char>(expected_hash.begin(),
+                                             expected_hash.end());
+}
+
 ActionExitCode DeltaPerformer::PerformOperation(
     const InstallOperation &operation,
     const vector<char> &data)
@@ -44,6 +44,17 @@ public:
     // Wrapper around close. Returns 0 on success or -errno on error.
     int Close();
 
+    // Returns true if the destination blocks of |operation| already hold the
+    // data it writes, according to its destination hash. Returns false if the
+    // operation has no destination hash.
+    bool DestinationMatches(const InstallOperation &operation);
+
+    // Returns true if |op| can be applied again after it was interrupted,
+    // i.e. it doesn't write any of the blocks it reads. Otherwise the client
+    // must not be stopped while applying it.
+    static bool IsIdempotentOperation(
+        const InstallOperation &op);
+
     // Set block size specified by the manifest.
     void SetBlockSize(uint32_t size)
     {
@@ -59,7 +70,6 @@ public:
 private:
     friend class DeltaPerformerTest;
     FRIEND_TEST(DeltaPerformerTest, ExtentsToByteStringTest);
-    FRIEND_TEST(DeltaPerformerTest, IsIdempotentOperationTest);
 
     // Converts an ordered collection of Extent objects which contain data of
     // length full_length to a comma-separated string. For each Extent, the
@@ -76,9 +86,6 @@ private:
         uint64_t full_length,
         std::string *positions_string);
 
-    static bool IsIdempotentOperation(
-        const InstallOperation &op);
-
     // Validates that the hash of the blobs corresponding to the given |operation|
     // matches what's specified in the manifest in the payload.
     // Returns kActionCodeSuccess on match or a suitable error code otherwise.
@@ -0,0 +1,266 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/diff_cache.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <utility>
+
+#include <glog/logging.h>
+
+#include "files/file_path.h"
+#include "files/file_util.h"
+#include "strings/string_number_conversions.h"
+#include "strings/string_printf.h"
+#include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/utils.h"
+
+using std::make_pair;
+using std::pair;
+using std::string;
+using std::vector;
+using strings::StringPrintf;
+
+namespace chromeos_update_engine {
+
+const int DiffCache::kVersion = 1;
+
+namespace {
+
+// An entry file holds the SHA-256 hash of the rest of the file, the
+// operation type as a single byte and the blob.
+const size_t kHashSize = 32;
+const size_t kHeaderSize = kHashSize + 1;
+
+// Eviction stops once the entries take no more than this share of the
+// size limit, so that it doesn't run again on the very next store.
+const uint64_t kEvictToPercent = 90;
+
+// Temp files being written start with this, so that they're never taken
+// for entries.
+const char kTempPrefix[] = ".tmp";
+
+}  // namespace {}
+
+DiffCache::DiffCache(const string &cache_dir, uint64_t max_size)
+    : cache_dir_(cache_dir),
+      max_size_(max_size),
+      size_(0),
+      hits_(0),
+      misses_(0),
+      stores_(0),
+      evictions_(0)
+{
+    g_mutex_init(&mutex_);
+}
+
+DiffCache::~DiffCache()
+{
+    g_mutex_clear(&mutex_);
+}
+
+bool DiffCache::Init()
+{
+    files::FilePath dir(cache_dir_);
+
+    if (!files::DirectoryExists(dir)) {
+        TEST_AND_RETURN_FALSE(files::CreateDirectory(dir));
+    }
+
+    g_mutex_lock(&mutex_);
+    EvictLocked();
+    g_mutex_unlock(&mutex_);
+    LOG(INFO) << "Using diff cache " << cache_dir_ << " with " << size_
+              << " bytes of entries";
+    return true;
+}
+
+string DiffCache::Key(const vector<char> &old_data,
+                      const vector<char> &new_data,
+                      int chooser_version)
+{
+    vector<char> old_hash;
+    vector<char> new_hash;
+    CHECK(OmahaHashCalculator::RawHashOfData(old_data, &old_hash));
+    CHECK(OmahaHashCalculator::RawHashOfData(new_data, &new_hash));
+    return StringPrintf("v%d-c%d-%s-%s", kVersion, chooser_version,
+                        strings::HexEncode(old_hash.data(),
+                                           old_hash.size()).c_str(),
+                        strings::HexEncode(new_hash.data(),
+                                           new_hash.size()).c_str());
+}
+
+bool DiffCache::Lookup(const string &key,
+                       InstallOperation_Type *type,
+                       vector<char> *data)
+{
+    const string path = EntryPath(key);
+    vector<char> entry;
+    bool valid = false;
+
+    if (utils::ReadFile(path, &entry) && entry.size() >= kHeaderSize) {
+        vector<char> hash;
+        const vector<char> contents(entry.begin() + kHashSize, entry.end());
+        valid = OmahaHashCalculator::RawHashOfData(contents, &hash) &&
+                hash.size() == kHashSize &&
+                memcmp(hash.data(), entry.data(), kHashSize) == 0 &&
+                InstallOperation_Type_IsValid(contents[0]);
+
+        if (valid) {
+            *type = static_cast<InstallOperation_Type>(contents[0]);
+            data->assign(contents.begin() + 1, contents.end());
+
+            // The modification time orders the entries for eviction.
+            utimes(path.c_str(), NULL);
+        } else {
+            LOG(WARNING) << "Removing corrupt diff cache entry " << path;
+            unlink(path.c_str());
+        }
+    }
+
+    g_mutex_lock(&mutex_);
+
+    if (valid) {
+        hits_++;
+    } else {
+        misses_++;
+    }
+
+    g_mutex_unlock(&mutex_);
+    return valid;
+}
+
+void DiffCache::Store(const string &key,
+                      InstallOperation_Type type,
+                      const vector<char> &data)
+{
+    vector<char> contents;
+    contents.reserve(1 + data.size());
+    contents.push_back(static_cast<char>(type));
+    contents.insert(contents.end(), data.begin(), data.end());
+
+    vector<char> hash;
+
+    if (!OmahaHashCalculator::RawHashOfData(contents, &hash)) {
+        LOG(ERROR) << "Unable to hash diff cache entry " << key;
+        return;
+    }
+
+    // Write to a temp file first, so that other processes never see a
+    // partial entry.
+    string temp_path;
+    int fd = -1;
+
+    if (!utils::MakeTempFile(cache_dir_ + "/" + kTempPrefix + "XXXXXX",
+                             &temp_path, &fd)) {
+        LOG(ERROR) << "Unable to create diff cache entry " << key;
+        return;
+    }
+
+    bool success = utils::WriteAll(fd, hash.data(), hash.size()) &&
+                   utils::WriteAll(fd, contents.data(), contents.size());
+    success = (close(fd) == 0) && success;
+    success = success && rename(temp_path.c_str(), EntryPath(key).c_str()) == 0;
+
+    if (!success) {
+        PLOG(ERROR) << "Unable to write diff cache entry " << key;
+        unlink(temp_path.c_str());
+        return;
+    }
+
+    g_mutex_lock(&mutex_);
+    stores_++;
+    size_ += hash.size() + contents.size();
+
+    if (size_ > max_size_) {
+        EvictLocked();
+    }
+
+    g_mutex_unlock(&mutex_);
+}
+
+void DiffCache::LogStats()
+{
+    g_mutex_lock(&mutex_);
+    const uint64_t lookups = hits_ + misses_;
+    LOG(INFO) << "Diff cache: " << hits_ << " hits, " << misses_
+              << " misses ("
+              << (lookups ? hits_ * 100 / lookups : 0) << "% hit rate), "
+              << stores_ << " entries stored, " << evictions_
+              << " evicted, " << size_ << " of " << max_size_
+              << " bytes used";
+    g_mutex_unlock(&mutex_);
+}
+
+string DiffCache::EntryPath(const string &key) const
+{
+    return cache_dir_ + "/" + key;
+}
+
+void DiffCache::EvictLocked()
+{
+    // Other processes may share the directory, so take stock of what's
+    // actually there rather than trusting |size_|.
+    DIR *dir = opendir(cache_dir_.c_str());
+
+    if (!dir) {
+        PLOG(ERROR) << "Unable to open diff cache " << cache_dir_;
+        return;
+    }
+
+    // Modification time and name of each entry, and their total size.
+    vector<pair<time_t, string>> entries;
+    uint64_t total_size = 0;
+
+    while (struct dirent *dir_entry = readdir(dir)) {
+        const string name = dir_entry->d_name;
+
+        if (name == "." || name == ".." ||
+                name.compare(0, strlen(kTempPrefix), kTempPrefix) == 0) {
+            continue;
+        }
+
+        struct stat stbuf;
+
+        if (lstat(EntryPath(name).c_str(), &stbuf) != 0 ||
+                !S_ISREG(stbuf.st_mode)) {
+            continue;
+        }
+
+        entries.push_back(make_pair(stbuf.st_mtime, name));
+        total_size += stbuf.st_size;
+    }
+
+    closedir(dir);
+    std::sort(entries.begin(), entries.end());
+
+    const uint64_t target_size =
+        total_size > max_size_ ? max_size_ * kEvictToPercent / 100 : total_size;
+
+    for (const pair<time_t, string> &entry : entries) {
+        if (total_size <= target_size) {
+            break;
+        }
+
+        const string path = EntryPath(entry.second);
+        const off_t entry_size = utils::FileSize(path);
+
+        if (entry_size >= 0 && unlink(path.c_str()) == 0) {
+            total_size -= entry_size;
+            evictions_++;
+        }
+    }
+
+    size_ = total_size;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,94 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_DIFF_CACHE_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_DIFF_CACHE_H__
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <glib.h>
+
+#include "macros.h"
+#include "update_engine/update_metadata.pb.h"
+
+// A persistent cache of the operations chosen for pairs of old and new file
+// contents, so that generating deltas from many old versions to the same new
+// version diffs each distinct pair only once. Entries are files under the
+// cache directory named after the SHA-256 hashes of both contents, kVersion
+// and the version of the way the operation was chosen. When the cache outgrows its size limit the least recently used
+// entries are removed. Can be used from multiple threads at once, and by
+// multiple processes sharing a directory.
+
+namespace chromeos_update_engine {
+
+class DiffCache
+{
+public:
+    // Version of the entry format. Bump it whenever that changes, so that old
+    // entries are no longer used.
+    static const int kVersion;
+
+    // Caches in |cache_dir| up to about |max_size| bytes of entries.
+    DiffCache(const std::string &cache_dir, uint64_t max_size);
+    ~DiffCache();
+
+    // Creates the cache directory if needed and measures its contents.
+    // Returns true on success, false otherwise.
+    bool Init();
+
+    // Returns the key of the entry for diffing |old_data| to |new_data| the
+    // way of |chooser_version|, which the caller bumps whenever the way it
+    // chooses and encodes operations changes, e.g. the bsdiff implementation
+    // or the heuristics that skip candidates.
+    static std::string Key(const std::vector<char> &old_data,
+                           const std::vector<char> &new_data,
+                           int chooser_version);
+
+    // Looks up the entry for |key|. Returns true and sets |type| and |data|
+    // if there's a valid one, false otherwise.
+    bool Lookup(const std::string &key,
+                InstallOperation_Type *type,
+                std::vector<char> *data);
+
+    // Stores |type| and |data| as the entry for |key|, then evicts the least
+    // recently used entries if the cache is too large. Failures are logged
+    // but otherwise ignored, as the cache is only an optimization.
+    void Store(const std::string &key,
+               InstallOperation_Type type,
+               const std::vector<char> &data);
+
+    // Logs the hit and miss counts and the cache size.
+    void LogStats();
+
+private:
+    // Returns the path of the entry file for |key|.
+    std::string EntryPath(const std::string &key) const;
+
+    // Removes the least recently used entries until the cache is
+    // comfortably below its size limit. Must be called with |mutex_| held.
+    void EvictLocked();
+
+    const std::string cache_dir_;
+    const uint64_t max_size_;
+
+    // Protects all the members below.
+    GMutex mutex_;
+
+    // Total size of the entries, as far as this process knows.
+    uint64_t size_;
+
+    uint64_t hits_;
+    uint64_t misses_;
+    uint64_t stores_;
+    uint64_t evictions_;
+
+    DISALLOW_COPY_AND_ASSIGN(DiffCache);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_DIFF_CACHE_H__
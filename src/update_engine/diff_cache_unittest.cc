@@ -0,0 +1,124 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/diff_cache.h"
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class DiffCacheTest : public ::testing::Test
+{
+protected:
+    virtual void SetUp()
+    {
+        ASSERT_TRUE(utils::MakeTempDirectory("/tmp/DiffCacheTest.XXXXXX",
+                                             &cache_dir_));
+    }
+
+    virtual void TearDown()
+    {
+        EXPECT_TRUE(utils::RecursiveUnlinkDir(cache_dir_));
+    }
+
+    // Sets the modification time of the entry for |key| to |seconds|.
+    void SetEntryTime(const string &key, time_t seconds)
+    {
+        struct timeval times[2] = { { seconds, 0 }, { seconds, 0 } };
+        EXPECT_EQ(0, utimes((cache_dir_ + "/" + key).c_str(), times));
+    }
+
+    string cache_dir_;
+};
+
+TEST_F(DiffCacheTest, StoreAndLookupTest)
+{
+    const vector<char> old_data(100, 'a');
+    const vector<char> new_data(100, 'b');
+    const vector<char> blob(10, 'c');
+    const string key = DiffCache::Key(old_data, new_data, 1);
+    EXPECT_NE(key, DiffCache::Key(new_data, old_data, 1));
+    EXPECT_NE(key, DiffCache::Key(old_data, new_data, 2));
+
+    InstallOperation_Type type;
+    vector<char> data;
+    {
+        DiffCache cache(cache_dir_, 1024 * 1024);
+        EXPECT_TRUE(cache.Init());
+        EXPECT_FALSE(cache.Lookup(key, &type, &data));
+        cache.Store(key, InstallOperation_Type_BSDIFF, blob);
+    }
+
+    // Entries persist across instances.
+    DiffCache cache(cache_dir_, 1024 * 1024);
+    EXPECT_TRUE(cache.Init());
+    EXPECT_TRUE(cache.Lookup(key, &type, &data));
+    EXPECT_EQ(InstallOperation_Type_BSDIFF, type);
+    EXPECT_TRUE(data == blob);
+}
+
+TEST_F(DiffCacheTest, CorruptEntryTest)
+{
+    const string key = DiffCache::Key(vector<char>(1, 'a'),
+                                      vector<char>(1, 'b'), 1);
+    DiffCache cache(cache_dir_, 1024 * 1024);
+    EXPECT_TRUE(cache.Init());
+    cache.Store(key, InstallOperation_Type_REPLACE_BZ, vector<char>(10, 'c'));
+
+    // Flip the last byte of the blob.
+    const string path = cache_dir_ + "/" + key;
+    vector<char> entry;
+    EXPECT_TRUE(utils::ReadFile(path, &entry));
+    entry.back() ^= 1;
+    EXPECT_TRUE(utils::WriteFile(path.c_str(), entry.data(), entry.size()));
+
+    InstallOperation_Type type;
+    vector<char> data;
+    EXPECT_FALSE(cache.Lookup(key, &type, &data));
+    EXPECT_FALSE(utils::FileExists(path.c_str()));
+}
+
+TEST_F(DiffCacheTest, EvictLeastRecentlyUsedTest)
+{
+    // Each entry takes 33 bytes of header and 1000 bytes of blob, so the
+    // limit fits three.
+    DiffCache cache(cache_dir_, 3500);
+    EXPECT_TRUE(cache.Init());
+    vector<string> keys;
+
+    for (char c = 'a'; c < 'd'; c++) {
+        keys.push_back(DiffCache::Key(vector<char>(1, c), vector<char>(1, c),
+                                      1));
+        cache.Store(keys.back(), InstallOperation_Type_BSDIFF,
+                    vector<char>(1000, c));
+        SetEntryTime(keys.back(), 1000 + c);
+    }
+
+    // Using the oldest entry makes the second one the least recently used.
+    InstallOperation_Type type;
+    vector<char> data;
+    EXPECT_TRUE(cache.Lookup(keys[0], &type, &data));
+
+    keys.push_back(DiffCache::Key(vector<char>(1, 'd'), vector<char>(1, 'd'),
+                                  1));
+    cache.Store(keys.back(), InstallOperation_Type_BSDIFF,
+                vector<char>(1000, 'd'));
+
+    EXPECT_TRUE(cache.Lookup(keys[0], &type, &data));
+    EXPECT_FALSE(cache.Lookup(keys[1], &type, &data));
+    EXPECT_TRUE(cache.Lookup(keys[2], &type, &data));
+    EXPECT_TRUE(cache.Lookup(keys[3], &type, &data));
+}
+
+}  // namespace chromeos_update_engine
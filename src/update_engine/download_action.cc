@@ -9,14 +9,24 @@
 #include <vector>
 #include <glib.h>
 #include "update_engine/action_pipe.h"
+#include "update_engine/multi_range_http_fetcher.h"
 #include "update_engine/subprocess.h"
+#include "update_engine/utils.h"
 
 using std::min;
+using std::pair;
 using std::string;
 using std::vector;
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::steady_clock;
 
 namespace chromeos_update_engine {
 
+const size_t DownloadAction::kDefaultHighWatermark = 4 * 1024 * 1024;
+const size_t DownloadAction::kDefaultLowWatermark = 1024 * 1024;
+const size_t DownloadAction::kWriteSliceSize = 256 * 1024;
+
 DownloadAction::DownloadAction(PrefsInterface *prefs,
                                HttpFetcher *http_fetcher)
     : prefs_(prefs),
@@ -24,9 +34,23 @@ DownloadAction::DownloadAction(PrefsInterface *prefs,
       writer_(NULL),
       code_(kActionCodeSuccess),
       delegate_(NULL),
-      bytes_downloaded_(0) {}
+      bytes_downloaded_(0),
+      queue_offset_(0),
+      write_source_id_(0),
+      high_watermark_(kDefaultHighWatermark),
+      low_watermark_(kDefaultLowWatermark),
+      fetcher_paused_(false),
+      download_paused_(false),
+      fetcher_pause_count_(0),
+      transfer_complete_pending_(false),
+      transfer_successful_(false),
+      network_stall_time_(0),
+      storage_stall_time_(0) {}
 
-DownloadAction::~DownloadAction() {}
+DownloadAction::~DownloadAction()
+{
+    ClearQueue();
+}
 
 void DownloadAction::PerformAction()
 {
@@ -36,6 +60,13 @@ void DownloadAction::PerformAction()
     CHECK(HasInputObject());
     install_plan_ = GetInputObject();
     bytes_downloaded_ = 0;
+    fetcher_paused_ = false;
+    SetDownloadPaused(false);
+    fetcher_pause_count_ = 0;
+    transfer_complete_pending_ = false;
+    network_stall_time_ = microseconds::zero();
+    storage_stall_time_ = microseconds::zero();
+    writer_idle_since_ = steady_clock::now();
 
     install_plan_.Dump();
 
@@ -54,6 +85,10 @@ void DownloadAction::PerformAction()
         return;
     }
 
+    if (payload_processor_) {
+        SkipAvailableData();
+    }
+
     if (delegate_) {
         delegate_->SetDownloadStatus(true);  // Set to active.
     }
@@ -61,8 +96,43 @@ void DownloadAction::PerformAction()
     http_fetcher_->BeginTransfer(install_plan_.download_url);
 }
 
+void DownloadAction::SkipAvailableData()
+{
+    MultiRangeHttpFetcher *fetcher =
+        dynamic_cast<MultiRangeHttpFetcher *>(http_fetcher_.get());
+
+    if (!fetcher) {
+        return;
+    }
+
+    vector<pair<uint64_t, uint64_t>> ranges;
+
+    if (install_plan_.is_resume) {
+        if (!payload_processor_->PlanResumedRanges(&ranges)) {
+            return;
+        }
+    } else if (!payload_processor_->PlanSkippedOperations(&ranges)) {
+        return;
+    }
+
+    fetcher->ClearRanges();
+
+    for (const pair<uint64_t, uint64_t> &range : ranges) {
+        fetcher->AddRange(range.first, range.second);
+    }
+
+    // Count the skipped data as downloaded for the progress reports.
+    bytes_downloaded_ = payload_processor_->skipped_data_length();
+}
+
 void DownloadAction::TerminateProcessing()
 {
+    ClearQueue();
+    const bool fetcher_paused = fetcher_paused_;
+    EndFetcherPause();
+    SetDownloadPaused(false);
+    transfer_complete_pending_ = false;
+
     if (writer_) {
         LOG_IF(WARNING, writer_->Close() != 0) << "Error closing the writer.";
         writer_ = NULL;
@@ -72,6 +142,12 @@ void DownloadAction::TerminateProcessing()
         delegate_->SetDownloadStatus(false);  // Set to inactive.
     }
 
+    // Don't leave the fetcher paused for its next transfer. Whatever it
+    // delivers meanwhile is dropped, as there's no writer any more.
+    if (fetcher_paused) {
+        http_fetcher_->Unpause();
+    }
+
     // Terminates the transfer. The action is terminated, if necessary, when the
     // TransferTerminated callback is received.
     http_fetcher_->TerminateTransfer();
@@ -93,19 +169,164 @@ void DownloadAction::ReceivedBytes(HttpFetcher *fetcher,
                                  bytes_downloaded_,
                                  install_plan_.payload_size);
 
-    if (writer_ && !writer_->Write(bytes, length, &code_)) {
+    if (!writer_) {
+        return;
+    }
+
+    if (QueuedBytes() == 0) {
+        network_stall_time_ += duration_cast<microseconds>(
+                                   steady_clock::now() - writer_idle_since_);
+    }
+
+    queue_.insert(queue_.end(), bytes, bytes + length);
+
+    if (!write_source_id_) {
+        write_source_id_ = g_idle_add(&StaticWriteQueuedBytes, this);
+    }
+
+    // The fetchers keep connections they open while paused (next range,
+    // retry) paused too, so they only need to be told once.
+    if (QueuedBytes() > high_watermark_ && !fetcher_paused_) {
+        fetcher_paused_ = true;
+        fetcher_pause_count_++;
+        fetcher_paused_since_ = steady_clock::now();
+        SetDownloadPaused(true);
+        http_fetcher_->Pause();
+    }
+}
+
+bool DownloadAction::WriteQueuedBytes()
+{
+    CHECK(writer_);
+    const size_t count = min(QueuedBytes(), kWriteSliceSize);
+    // Nothing is received while the bytes are applied.
+    SetDownloadPaused(true);
+    const bool written = !count ||
+                         writer_->Write(&queue_[queue_offset_], count, &code_);
+    SetDownloadPaused(fetcher_paused_);
+
+    if (!written) {
         LOG(ERROR) << "Error " << code_ << " while processing the received payload"
                    << " -- Terminating processing";
-        // Don't tell the action processor that the action is complete until we get
-        // the TransferTerminated callback. Otherwise, this and the HTTP fetcher
-        // objects may get destroyed before all callbacks are complete.
-        TerminateProcessing();
+        // Returning false below removes this source.
+        write_source_id_ = 0;
+
+        if (transfer_complete_pending_) {
+            // The fetcher is already done, there's nothing left to terminate.
+            ClearQueue();
+            CompleteTransfer(false);
+        } else {
+            // Don't tell the action processor that the action is complete until
+            // we get the TransferTerminated callback. Otherwise, this and the
+            // HTTP fetcher objects may get destroyed before all callbacks are
+            // complete.
+            TerminateProcessing();
+        }
+
+        return false;
+    }
+
+    queue_offset_ += count;
+
+    if (QueuedBytes() == 0) {
+        queue_.clear();
+        queue_offset_ = 0;
+        writer_idle_since_ = steady_clock::now();
+    } else if (queue_offset_ >= queue_.size() / 2) {
+        queue_.erase(queue_.begin(), queue_.begin() + queue_offset_);
+        queue_offset_ = 0;
+    }
+
+    const bool unpause = fetcher_paused_ && QueuedBytes() <= low_watermark_;
+    const bool more = QueuedBytes() > 0;
+
+    if (unpause) {
+        EndFetcherPause();
+    }
+
+    if (!more) {
+        write_source_id_ = 0;
+
+        // A paused fetcher can't have completed, so this doesn't unpause.
+        if (transfer_complete_pending_) {
+            // Note that after this call this object may be destroyed.
+            CompleteTransfer(transfer_successful_);
+            return false;
+        }
+    }
+
+    if (unpause) {
+        // This may call back into ReceivedBytes or TransferComplete, which
+        // may complete the action and destroy this object, so it comes last.
+        http_fetcher_->Unpause();
+    }
+
+    return more;
+}
+
+void DownloadAction::ClearQueue()
+{
+    if (write_source_id_) {
+        g_source_remove(write_source_id_);
+        write_source_id_ = 0;
+    }
+
+    queue_.clear();
+    queue_offset_ = 0;
+}
+
+void DownloadAction::EndFetcherPause()
+{
+    if (!fetcher_paused_) {
         return;
     }
+
+    storage_stall_time_ += duration_cast<microseconds>(
+                               steady_clock::now() - fetcher_paused_since_);
+    fetcher_paused_ = false;
+    SetDownloadPaused(false);
+}
+
+void DownloadAction::SetDownloadPaused(bool paused)
+{
+    if (paused == download_paused_) {
+        return;
+    }
+
+    download_paused_ = paused;
+
+    if (delegate_) {
+        delegate_->DownloadPaused(paused);
+    }
 }
 
 void DownloadAction::TransferComplete(HttpFetcher *fetcher, bool successful)
 {
+    // Terminated or completed already, e.g. while unpausing the fetcher.
+    if (!writer_) {
+        return;
+    }
+
+    if (fetcher_paused_) {
+        EndFetcherPause();
+        // Don't leave the fetcher paused for its next transfer.
+        http_fetcher_->Unpause();
+    }
+
+    if (QueuedBytes()) {
+        // Let the writer catch up before completing the action.
+        transfer_complete_pending_ = true;
+        transfer_successful_ = successful;
+        return;
+    }
+
+    CompleteTransfer(successful);
+}
+
+void DownloadAction::CompleteTransfer(bool successful)
+{
+    transfer_complete_pending_ = false;
+
     if (writer_) {
         LOG_IF(WARNING, writer_->Close() != 0) << "Error closing the writer.";
         writer_ = NULL;
@@ -115,9 +336,15 @@ void DownloadAction::TransferComplete(HttpFetcher *fetcher, bool successful)
         delegate_->SetDownloadStatus(false);  // Set to inactive.
     }
 
+    LogStallTimes();
+
     ActionExitCode code =
         successful ? kActionCodeSuccess : kActionCodeDownloadTransferError;
 
+    if (code_ != kActionCodeSuccess) {
+        code = code_;
+    }
+
     if (code == kActionCodeSuccess && payload_processor_.get()) {
         code = payload_processor_->VerifyPayload();
 
@@ -135,6 +362,15 @@ void DownloadAction::TransferComplete(HttpFetcher *fetcher, bool successful)
     processor_->ActionComplete(this, code);
 }
 
+void DownloadAction::LogStallTimes()
+{
+    LOG(INFO) << "Download stalled on the network for "
+              << utils::ToString(network_stall_time_)
+              << " and on storage for "
+              << utils::ToString(storage_stall_time_)
+              << " (fetcher paused " << fetcher_pause_count_ << " times)";
+}
+
 void DownloadAction::TransferTerminated(HttpFetcher *fetcher)
 {
     if (code_ != kActionCodeSuccess) {
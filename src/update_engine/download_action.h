@@ -9,8 +9,10 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#include <chrono>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include <curl/curl.h>
 #include <google/protobuf/stubs/common.h>
@@ -41,6 +43,11 @@ public:
     virtual void BytesReceived(uint64_t received,
                                uint64_t progress,
                                uint64_t total) = 0;
+
+    // Called with |paused| set to true when the download stops taking in
+    // bytes because the fetcher is paused or the received bytes are being
+    // written, and with |paused| set to false when it takes them in again.
+    virtual void DownloadPaused(bool paused) = 0;
 };
 
 class DownloadAction;
@@ -112,7 +119,78 @@ public:
         return http_fetcher_.get();
     }
 
+    // Flow control between the fetcher and the writer. Received bytes are
+    // queued and handed to the writer from the main loop. Once more than
+    // |high| bytes are queued the fetcher is paused; it is resumed when the
+    // queue drains down to |low| bytes.
+    void set_watermarks(size_t high, size_t low)
+    {
+        CHECK_LE(low, high);
+        high_watermark_ = high;
+        low_watermark_ = low;
+    }
+
+    // Time the writer spent idle waiting on the network and time the fetcher
+    // spent paused waiting on the writer, respectively.
+    std::chrono::microseconds network_stall_time() const
+    {
+        return network_stall_time_;
+    }
+    std::chrono::microseconds storage_stall_time() const
+    {
+        return storage_stall_time_;
+    }
+
+    // Number of times the fetcher was paused because the writer fell behind.
+    int fetcher_pause_count() const
+    {
+        return fetcher_pause_count_;
+    }
+
+    static const size_t kDefaultHighWatermark;
+    static const size_t kDefaultLowWatermark;
+
+    // Maximum number of queued bytes handed to the writer per main loop
+    // iteration.
+    static const size_t kWriteSliceSize;
+
 private:
+    // Hands queued bytes to the writer, pausing and resuming the fetcher as
+    // the queue crosses the watermarks. Returns true while there's more to
+    // write.
+    bool WriteQueuedBytes();
+    static gboolean StaticWriteQueuedBytes(gpointer data)
+    {
+        return reinterpret_cast<DownloadAction *>(data)->WriteQueuedBytes();
+    }
+
+    // Number of received bytes not yet handed to the writer.
+    size_t QueuedBytes() const
+    {
+        return queue_.size() - queue_offset_;
+    }
+
+    // Drops any queued bytes and removes the write source, if any.
+    void ClearQueue();
+
+    // Accounts for the time the fetcher was paused, if it is, and marks it
+    // unpaused. Doesn't unpause the fetcher itself, which may call back.
+    void EndFetcherPause();
+
+    // Tells the delegate whether the download is paused, if that changed.
+    void SetDownloadPaused(bool paused);
+
+    // Completes the action once the transfer is done and the queue is empty.
+    void CompleteTransfer(bool successful);
+
+    // Logs the stall times accumulated by the flow control.
+    void LogStallTimes();
+
+    // Restricts the download to the payload ranges the payload processor
+    // still needs, if it has data it can skip: the spooled data of the next
+    // operation when resuming, or operations already applied otherwise.
+    void SkipAvailableData();
+
     // The InstallPlan passed in
     InstallPlan install_plan_;
 
@@ -136,6 +214,35 @@ private:
     DownloadActionDelegate *delegate_;
     uint64_t bytes_downloaded_;
 
+    // Bytes received from the fetcher but not yet written. The first
+    // |queue_offset_| bytes of |queue_| have already been consumed.
+    std::vector<char> queue_;
+    size_t queue_offset_;
+
+    // Glib idle source draining |queue_| into the writer, 0 if none.
+    guint write_source_id_;
+
+    size_t high_watermark_;
+    size_t low_watermark_;
+
+    // True while the fetcher is paused because of a full queue.
+    bool fetcher_paused_;
+
+    // Whether the delegate was last told the download is paused.
+    bool download_paused_;
+    int fetcher_pause_count_;
+
+    // Set when the fetcher completed while bytes were still queued.
+    bool transfer_complete_pending_;
+    bool transfer_successful_;
+
+    // Stall accounting. |writer_idle_since_| is set while the queue is empty
+    // and |fetcher_paused_since_| while the fetcher is paused.
+    std::chrono::steady_clock::time_point writer_idle_since_;
+    std::chrono::steady_clock::time_point fetcher_paused_since_;
+    std::chrono::microseconds network_stall_time_;
+    std::chrono::microseconds storage_stall_time_;
+
     DISALLOW_COPY_AND_ASSIGN(DownloadAction);
 };
 
@@ -34,6 +34,7 @@ public:
     MOCK_METHOD1(SetDownloadStatus, void(bool active));
     MOCK_METHOD3(BytesReceived,
                  void(uint64_t received, uint64_t progress, uint64_t total));
+    MOCK_METHOD1(DownloadPaused, void(bool paused));
 };
 
 class DownloadActionTestProcessorDelegate : public ActionProcessorDelegate
@@ -137,7 +138,8 @@ gboolean StartProcessorInRunLoop(gpointer data)
 
 void TestWithData(const vector<char> &data,
                   int fail_write,
-                  bool use_download_delegate)
+                  bool use_download_delegate,
+                  bool small_watermarks = false)
 {
     GMainLoop *loop = g_main_loop_new(g_main_context_default(), FALSE);
 
@@ -163,6 +165,12 @@ void TestWithData(const vector<char> &data,
     // takes ownership of passed in HttpFetcher
     DownloadAction download_action(&prefs, http_fetcher);
     download_action.SetTestFileWriter(&writer);
+
+    if (small_watermarks) {
+        // Pause the fetcher after every chunk until the writer caught up.
+        download_action.set_watermarks(kMockHttpFetcherChunkSize / 2, 0);
+    }
+
     BondActions(&feeder_action, &download_action);
     DownloadActionDelegateMock download_delegate;
 
@@ -200,6 +208,13 @@ void TestWithData(const vector<char> &data,
     g_timeout_add(0, &StartProcessorInRunLoop, &args);
     g_main_loop_run(loop);
     g_main_loop_unref(loop);
+
+    if (small_watermarks) {
+        EXPECT_GT(download_action.fetcher_pause_count(), 0);
+        // The last chunk paused the fetcher, which completed meanwhile; it
+        // mustn't stay paused for another transfer.
+        EXPECT_FALSE(http_fetcher->paused());
+    }
 }
 }  // namespace {}
 
@@ -228,6 +243,22 @@ TEST(DownloadActionTest, LargeTest)
                  true);  // use_download_delegate
 }
 
+TEST(DownloadActionTest, BackpressureTest)
+{
+    vector<char> big(5 * kMockHttpFetcherChunkSize);
+    char c = '0';
+
+    for (unsigned int i = 0; i < big.size(); i++) {
+        big[i] = c;
+        c = ('9' == c) ? '0' : c + 1;
+    }
+
+    TestWithData(big,
+                 0,  // fail_write
+                 true,  // use_download_delegate
+                 true);  // small_watermarks
+}
+
 TEST(DownloadActionTest, FailWriteTest)
 {
     vector<char> big(5 * kMockHttpFetcherChunkSize);
@@ -0,0 +1,301 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/ext2_image_files.h"
+
+#include <fcntl.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <et/com_err.h>
+#include <ext2fs/ext2_io.h>
+#include <ext2fs/ext2fs.h>
+#include <glog/logging.h>
+
+#include "update_engine/graph_types.h"
+#include "update_engine/graph_utils.h"
+#include "update_engine/utils.h"
+
+using std::map;
+using std::min;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Utility class to close a file system
+class ScopedExt2fsCloser
+{
+public:
+    explicit ScopedExt2fsCloser(ext2_filsys filsys) : filsys_(filsys) {}
+    ~ScopedExt2fsCloser()
+    {
+        ext2fs_close(filsys_);
+    }
+
+private:
+    ext2_filsys filsys_;
+    DISALLOW_COPY_AND_ASSIGN(ScopedExt2fsCloser);
+};
+
+// What Open() collects while walking the directories of an image.
+struct ImageWalk {
+    ext2_filsys fs;
+    vector<ImageFile> files;
+    map<ino_t, vector<Extent>> extents;
+};
+
+// The directory being iterated over, as passed to ProcessDirEntry().
+struct DirWalk {
+    ImageWalk *walk;
+    string path;  // "" for the root directory
+    bool failed;
+};
+
+bool WalkInode(ImageWalk *walk, ext2_ino_t ino, const string &path);
+
+// Appends the blocks of the first |size| bytes of inode |ino| to |extents|.
+// Holes, and blocks that are allocated but not written yet, read as zeros,
+// so they are holes to us.
+bool MapInodeBlocks(ext2_filsys fs,
+                    ext2_ino_t ino,
+                    struct ext2_inode *inode,
+                    uint64_t size,
+                    vector<Extent> *extents)
+{
+#ifdef EXT4_INLINE_DATA_FL
+
+    if (inode->i_flags & EXT4_INLINE_DATA_FL) {
+        LOG(ERROR) << "Inode " << ino << " has inline data, which has no blocks";
+        return false;
+    }
+
+#endif  // EXT4_INLINE_DATA_FL
+    const uint64_t num_blocks = (size + fs->blocksize - 1) / fs->blocksize;
+
+    for (blk64_t block = 0; block < num_blocks; block++) {
+        blk64_t physical_block = 0;
+        int ret_flags = 0;
+        TEST_AND_RETURN_FALSE_ERRCODE(ext2fs_bmap2(fs, ino, inode, NULL, 0,
+                                      block, &ret_flags,
+                                      &physical_block));
+
+        if (physical_block == 0 || (ret_flags & BMAP_RET_UNINIT)) {
+            physical_block = kSparseHole;
+        }
+
+        graph_utils::AppendBlockToExtents(extents, physical_block);
+    }
+
+    return true;
+}
+
+int ProcessDirEntry(ext2_ino_t dir,
+                    int entry,
+                    struct ext2_dir_entry *dirent,
+                    int offset,
+                    int blocksize,
+                    char *buf,
+                    void *priv)
+{
+    DirWalk *dir_walk = static_cast<DirWalk *>(priv);
+
+    // Skip "." and "..".
+    if (entry < DIRENT_OTHER_FILE) {
+        return 0;
+    }
+
+    string path = dir_walk->path + "/" +
+                  string(dirent->name, dirent->name_len & 0xFF);
+
+    if (path == "/lost+found") {
+        return 0;
+    }
+
+    if (!WalkInode(dir_walk->walk, dirent->inode, path)) {
+        dir_walk->failed = true;
+        return DIRENT_ABORT;
+    }
+
+    return 0;
+}
+
+// Adds the regular files in directory |ino| at |path|, and in its
+// subdirectories, to |walk|.
+bool WalkDir(ImageWalk *walk, ext2_ino_t ino, const string &path)
+{
+    DirWalk dir_walk = {walk, path, false};
+    TEST_AND_RETURN_FALSE_ERRCODE(ext2fs_dir_iterate2(walk->fs, ino, 0, NULL,
+                                  ProcessDirEntry,
+                                  &dir_walk));
+    TEST_AND_RETURN_FALSE(!dir_walk.failed);
+    return true;
+}
+
+// Adds inode |ino| at |path| to |walk| if it's a regular file, or walks it if
+// it's a directory.
+bool WalkInode(ImageWalk *walk, ext2_ino_t ino, const string &path)
+{
+    struct ext2_inode inode;
+    TEST_AND_RETURN_FALSE_ERRCODE(ext2fs_read_inode(walk->fs, ino, &inode));
+
+    if (LINUX_S_ISDIR(inode.i_mode)) {
+        return WalkDir(walk, ino, path);
+    }
+
+    if (!LINUX_S_ISREG(inode.i_mode)) {
+        return true;
+    }
+
+    ImageFile file;
+    file.path = path;
+    file.inode = ino;
+    file.mode = inode.i_mode;
+    file.size = EXT2_I_SIZE(&inode);
+
+    // Hard links share their blocks.
+    if (!walk->extents.count(ino)) {
+        TEST_AND_RETURN_FALSE(MapInodeBlocks(walk->fs, ino, &inode, file.size,
+                                             &walk->extents[ino]));
+    }
+
+    walk->files.push_back(file);
+    return true;
+}
+
+}  // namespace {}
+
+bool Ext2ImageFiles::Open(const string &image_path)
+{
+    ext2_filsys fs;
+    TEST_AND_RETURN_FALSE_ERRCODE(ext2fs_open(image_path.c_str(), 0, 0, 0,
+                                  unix_io_manager, &fs));
+    ScopedExt2fsCloser fs_closer(fs);
+
+    ImageWalk walk;
+    walk.fs = fs;
+    TEST_AND_RETURN_FALSE(WalkDir(&walk, EXT2_ROOT_INO, ""));
+
+    int fd = open(image_path.c_str(), O_RDONLY);
+    TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+    image_fd_.reset(new files::ScopedFD(fd));
+    block_size_ = fs->blocksize;
+
+    files_.swap(walk.files);
+    extents_.swap(walk.extents);
+    file_indexes_.clear();
+
+    for (size_t i = 0; i < files_.size(); i++) {
+        file_indexes_[files_[i].path] = i;
+    }
+
+    LOG(INFO) << "Found " << files_.size() << " files in " << image_path;
+    return true;
+}
+
+ssize_t Ext2ImageFiles::FindFile(const string &path) const
+{
+    map<string, size_t>::const_iterator it = file_indexes_.find(path);
+    return it == file_indexes_.end() ? -1 : it->second;
+}
+
+bool Ext2ImageFiles::ListFiles(vector<ImageFile> *out_files) const
+{
+    out_files->insert(out_files->end(), files_.begin(), files_.end());
+    return true;
+}
+
+bool Ext2ImageFiles::GetFile(const string &path,
+                             bool *out_exists,
+                             ImageFile *out_file) const
+{
+    // Only regular files are known; anything else doesn't exist as far as
+    // the generator is concerned.
+    ssize_t index = FindFile(path);
+    *out_exists = index >= 0;
+
+    if (*out_exists) {
+        *out_file = files_[index];
+    }
+
+    return true;
+}
+
+bool Ext2ImageFiles::ReadChunk(const string &path,
+                               off_t offset,
+                               off_t size,
+                               vector<char> *out_p) const
+{
+    ssize_t index = FindFile(path);
+    TEST_AND_RETURN_FALSE(index >= 0);
+    const ImageFile &file = files_[index];
+
+    off_t end = file.size;
+
+    if (size >= 0) {
+        end = min(end, offset + size);
+    }
+
+    if (offset >= end) {
+        return true;
+    }
+
+    const size_t out_start = out_p->size();
+    out_p->resize(out_start + (end - offset));
+
+    // Copy each extent's part of [offset, end).
+    off_t pos = offset;
+    off_t extent_begin = 0;  // file offset of the extent
+
+    for (const Extent &extent : extents_.find(file.inode)->second) {
+        if (pos == end) {
+            break;
+        }
+
+        const off_t extent_end = extent_begin +
+                                 extent.num_blocks() * block_size_;
+
+        if (extent_end > pos) {
+            const off_t length = min(extent_end, end) - pos;
+            char *buf = out_p->data() + out_start + (pos - offset);
+
+            if (extent.start_block() == kSparseHole) {
+                memset(buf, 0, length);
+            } else {
+                ssize_t bytes_read = 0;
+                TEST_AND_RETURN_FALSE(utils::PReadAll(
+                                          image_fd_->get(), buf, length,
+                                          extent.start_block() * block_size_ +
+                                          (pos - extent_begin),
+                                          &bytes_read));
+                TEST_AND_RETURN_FALSE(bytes_read == length);
+            }
+
+            pos += length;
+        }
+
+        extent_begin = extent_end;
+    }
+
+    TEST_AND_RETURN_FALSE(pos == end);
+    return true;
+}
+
+bool Ext2ImageFiles::GetExtents(const string &path,
+                                vector<Extent> *out) const
+{
+    ssize_t index = FindFile(path);
+    TEST_AND_RETURN_FALSE(index >= 0);
+    const vector<Extent> &extents = extents_.find(files_[index].inode)->second;
+    out->insert(out->end(), extents.begin(), extents.end());
+    return true;
+}
+
+}  // namespace chromeos_update_engine
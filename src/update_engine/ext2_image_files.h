@@ -0,0 +1,63 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_EXT2_IMAGE_FILES_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_EXT2_IMAGE_FILES_H__
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "files/scoped_file.h"
+#include "macros.h"
+#include "update_engine/image_files.h"
+
+// Ext2ImageFiles reads the files of an ext2/3/4 image without mounting it.
+// Open() walks the directories and the block maps of the regular files with
+// libext2fs once; from then on file contents are read straight from the image
+// file, so nothing needs root, a loop device or a mount, and reads don't go
+// through libext2fs, which isn't thread safe.
+
+namespace chromeos_update_engine {
+
+class Ext2ImageFiles : public ImageFiles
+{
+public:
+    Ext2ImageFiles() : block_size_(0) {}
+
+    // Reads the directories and block maps of the image at |image_path|.
+    // Returns true on success.
+    bool Open(const std::string &image_path);
+
+    virtual bool ListFiles(std::vector<ImageFile> *out_files) const;
+    virtual bool GetFile(const std::string &path,
+                         bool *out_exists,
+                         ImageFile *out_file) const;
+    virtual bool ReadChunk(const std::string &path,
+                           off_t offset,
+                           off_t size,
+                           std::vector<char> *out_p) const;
+    virtual bool GetExtents(const std::string &path,
+                            std::vector<Extent> *out) const;
+
+private:
+    // Returns the index into |files_| of the file at |path|, or -1.
+    ssize_t FindFile(const std::string &path) const;
+
+    std::unique_ptr<files::ScopedFD> image_fd_;
+    uint32_t block_size_;
+
+    // The regular files in directory order, the index of each by path, and
+    // the blocks of each inode.
+    std::vector<ImageFile> files_;
+    std::map<std::string, size_t> file_indexes_;
+    std::map<ino_t, std::vector<Extent>> extents_;
+
+    DISALLOW_COPY_AND_ASSIGN(Ext2ImageFiles);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_EXT2_IMAGE_FILES_H__
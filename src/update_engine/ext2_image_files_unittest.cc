@@ -0,0 +1,123 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <sys/mount.h>
+#include <sys/stat.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "strings/string_printf.h"
+#include "update_engine/ext2_image_files.h"
+#include "update_engine/graph_types.h"
+#include "update_engine/image_files.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
+
+using std::map;
+using std::string;
+using std::vector;
+using strings::StringPrintf;
+
+namespace chromeos_update_engine {
+
+class Ext2ImageFilesTest : public ::testing::Test {};
+
+// Checks that reading an image with Ext2ImageFiles gives the same files,
+// contents and blocks as reading it mounted.
+TEST(Ext2ImageFilesTest, RunAsRootMatchesMountedTest)
+{
+    string img;
+    EXPECT_TRUE(utils::MakeTempFile("/tmp/img.XXXXXX", &img, NULL));
+    ScopedPathUnlinker img_unlinker(img);
+    CreateExtImageAtPath(img, NULL);
+
+    // Add files with holes in the middle and at the end, and one big enough
+    // to need an indirect block.
+    {
+        string mnt;
+        ScopedLoopMounter mounter(img, &mnt, 0);
+        EXPECT_EQ(0, System(StringPrintf(
+                                "dd if=/dev/urandom of=%s/sparse bs=4096 "
+                                "count=1 seek=3 && "
+                                "dd if=/dev/urandom of=%s/sparse bs=4096 "
+                                "count=2 seek=7 conv=notrunc && "
+                                "truncate -s 65536 %s/sparse",
+                                mnt.c_str(), mnt.c_str(), mnt.c_str())));
+        EXPECT_EQ(0, System(StringPrintf(
+                                "dd if=/dev/urandom of=%s/some_dir/big "
+                                "bs=1000 count=100",
+                                mnt.c_str())));
+    }
+
+    Ext2ImageFiles ext2_files;
+    ASSERT_TRUE(ext2_files.Open(img));
+    vector<ImageFile> ext2_listed;
+    EXPECT_TRUE(ext2_files.ListFiles(&ext2_listed));
+
+    string mnt;
+    ScopedLoopMounter mounter(img, &mnt, MS_RDONLY);
+    MountedImageFiles mounted_files(mnt);
+    vector<ImageFile> mounted_listed;
+    EXPECT_TRUE(mounted_files.ListFiles(&mounted_listed));
+
+    map<string, ImageFile> mounted_by_path;
+
+    for (const ImageFile &file : mounted_listed) {
+        mounted_by_path[file.path] = file;
+    }
+
+    ASSERT_EQ(mounted_listed.size(), ext2_listed.size());
+    EXPECT_EQ(8, ext2_listed.size());
+
+    for (const ImageFile &file : ext2_listed) {
+        ASSERT_EQ(1, mounted_by_path.count(file.path)) << file.path;
+        const ImageFile &mounted_file = mounted_by_path[file.path];
+        EXPECT_EQ(mounted_file.inode, file.inode) << file.path;
+        EXPECT_EQ(mounted_file.size, file.size) << file.path;
+        EXPECT_TRUE(S_ISREG(file.mode)) << file.path;
+
+        bool exists = false;
+        ImageFile found;
+        EXPECT_TRUE(ext2_files.GetFile(file.path, &exists, &found));
+        EXPECT_TRUE(exists) << file.path;
+
+        vector<char> ext2_data, mounted_data;
+        EXPECT_TRUE(ext2_files.ReadChunk(file.path, 0, -1, &ext2_data));
+        EXPECT_TRUE(mounted_files.ReadChunk(file.path, 0, -1, &mounted_data));
+        EXPECT_TRUE(ext2_data == mounted_data) << file.path;
+
+        ext2_data.clear();
+        mounted_data.clear();
+        EXPECT_TRUE(ext2_files.ReadChunk(file.path, 4096, 12345, &ext2_data));
+        EXPECT_TRUE(mounted_files.ReadChunk(file.path, 4096, 12345,
+                                            &mounted_data));
+        EXPECT_TRUE(ext2_data == mounted_data) << file.path;
+
+        vector<Extent> ext2_extents, mounted_extents;
+        EXPECT_TRUE(ext2_files.GetExtents(file.path, &ext2_extents));
+        EXPECT_TRUE(mounted_files.GetExtents(file.path, &mounted_extents));
+        ASSERT_EQ(mounted_extents.size(), ext2_extents.size()) << file.path;
+
+        for (size_t i = 0; i < ext2_extents.size(); i++) {
+            EXPECT_EQ(mounted_extents[i].start_block(),
+                      ext2_extents[i].start_block()) << file.path;
+            EXPECT_EQ(mounted_extents[i].num_blocks(),
+                      ext2_extents[i].num_blocks()) << file.path;
+        }
+    }
+
+    // Symlinks and other non-regular files aren't known.
+    bool exists = true;
+    ImageFile file;
+    EXPECT_TRUE(ext2_files.GetFile("/sym", &exists, &file));
+    EXPECT_FALSE(exists);
+    EXPECT_TRUE(ext2_files.GetFile("/some_dir", &exists, &file));
+    EXPECT_FALSE(exists);
+}
+
+}  // namespace chromeos_update_engine
@@ -10,8 +10,8 @@
 #include <ext2fs/ext2_io.h>
 #include <ext2fs/ext2fs.h>
 
-#include "files/scoped_file.h"
 #include "strings/string_printf.h"
+#include "update_engine/bsdiff.h"
 #include "update_engine/bzip.h"
 #include "update_engine/delta_diff_generator.h"
 #include "update_engine/ext2_metadata.h"
@@ -29,8 +29,6 @@ namespace chromeos_update_engine {
 namespace {
 const size_t kBlockSize = 4096;
 
-typedef DeltaDiffGenerator::Block Block;
-
 // Utility class to close a file system
 class ScopedExt2fsCloser
 {
@@ -62,10 +60,10 @@ bool ReadExtentsData(const ext2_filsys fs,
 
     // Read in the data blocks
     const size_t kMaxReadBlocks = 256;
-    vector<Block>::size_type blocks_copied_count = 0;
+    uint64_t blocks_copied_count = 0;
 
     for (const Extent &extent : extents) {
-        vector<Block>::size_type blocks_read = 0;
+        uint64_t blocks_read = 0;
 
         while (blocks_read < extent.num_blocks()) {
             const int copy_block_cnt =
@@ -90,43 +88,14 @@ bool ComputeMetadataBsdiff(const vector<char> &old_metadata,
                            const vector<char> &new_metadata,
                            vector<char> *bsdiff_delta)
 {
-    const string kTempFileTemplate("/tmp/CrAU_temp_data.XXXXXX");
-
-    // Write the metadata buffers to temporary files
-    int old_fd;
-    string temp_old_file_path;
-    TEST_AND_RETURN_FALSE(
-        utils::MakeTempFile(kTempFileTemplate, &temp_old_file_path, &old_fd));
-    TEST_AND_RETURN_FALSE(old_fd >= 0);
-    ScopedPathUnlinker temp_old_file_path_unlinker(temp_old_file_path);
-    files::ScopedFD old_fd_closer(old_fd);
-    TEST_AND_RETURN_FALSE(utils::WriteAll(old_fd,
-                                          &old_metadata[0],
-                                          old_metadata.size()));
-
-    int new_fd;
-    string temp_new_file_path;
-    TEST_AND_RETURN_FALSE(
-        utils::MakeTempFile(kTempFileTemplate, &temp_new_file_path, &new_fd));
-    TEST_AND_RETURN_FALSE(new_fd >= 0);
-    ScopedPathUnlinker temp_new_file_path_unlinker(temp_new_file_path);
-    files::ScopedFD new_fd_closer(new_fd);
-    TEST_AND_RETURN_FALSE(utils::WriteAll(new_fd,
-                                          &new_metadata[0],
-                                          new_metadata.size()));
-
-    // Perform bsdiff on these files
-    TEST_AND_RETURN_FALSE(
-        DeltaDiffGenerator::BsdiffFiles(temp_old_file_path,
-                                        temp_new_file_path,
-                                        bsdiff_delta));
-
+    TEST_AND_RETURN_FALSE(bsdiff::Diff(old_metadata, new_metadata,
+                                       bsdiff_delta));
     return true;
 }
 
-// Add the specified metadata extents to the graph and blocks vector.
+// Add the specified metadata extents to the graph and block map.
 bool AddMetadataExtents(Graph *graph,
-                        vector<Block> *blocks,
+                        BlockMap *blocks,
                         const ext2_filsys fs_old,
                         const ext2_filsys fs_new,
                         const string &metadata_name,
@@ -200,19 +169,20 @@ bool AddMetadataExtents(Graph *graph,
     if (op.type() != InstallOperation_Type_MOVE) {
         op.set_data_offset(*data_file_size);
         op.set_data_length(data.size());
+        TEST_AND_RETURN_FALSE(DeltaDiffGenerator::AddOperationHash(&op, data));
     }
 
     TEST_AND_RETURN_FALSE(utils::WriteAll(data_fd, &data[0], data.size()));
     *data_file_size += data.size();
 
-    // Now, insert into graph and blocks vector
+    // Now, insert into graph and block map
     graph->resize(graph->size() + 1);
     Vertex::Index vertex = graph->size() - 1;
     (*graph)[vertex].op = op;
     CHECK((*graph)[vertex].op.has_type());
     (*graph)[vertex].file_name = metadata_name;
 
-    TEST_AND_RETURN_FALSE(DeltaDiffGenerator::AddInstallOpToBlocksVector(
+    TEST_AND_RETURN_FALSE(DeltaDiffGenerator::AddInstallOpToBlockMap(
                               (*graph)[vertex].op,
                               *graph,
                               vertex,
@@ -223,7 +193,7 @@ bool AddMetadataExtents(Graph *graph,
 
 // Reads the file system metadata extents.
 bool ReadFilesystemMetadata(Graph *graph,
-                            vector<Block> *blocks,
+                            BlockMap *blocks,
                             const ext2_filsys fs_old,
                             const ext2_filsys fs_new,
                             int data_fd,
@@ -317,7 +287,7 @@ int ProcessInodeMetadataBlocks(ext2_filsys fs,
 
 // Read inode metadata blocks.
 bool ReadInodeMetadata(Graph *graph,
-                       vector<Block> *blocks,
+                       BlockMap *blocks,
                        const ext2_filsys fs_old,
                        const ext2_filsys fs_new,
                        int data_fd,
@@ -442,7 +412,7 @@ bool ReadInodeMetadata(Graph *graph,
         }
 
         // We have identical inode metadata blocks, we can now add them to
-        // our graph and blocks vector
+        // our graph and block map
         string metadata_name = StringPrintf("<fs-inode-%d-metadata>", ino);
         TEST_AND_RETURN_FALSE(AddMetadataExtents(graph,
                               blocks,
@@ -470,7 +440,7 @@ bool ReadInodeMetadata(Graph *graph,
 // metadata extents to blocks.
 // Returns true on success.
 bool Ext2Metadata::DeltaReadMetadata(Graph *graph,
-                                     vector<Block> *blocks,
+                                     BlockMap *blocks,
                                      const string &old_image,
                                      const string &new_image,
                                      int data_fd,
@@ -26,8 +26,6 @@ using strings::StringPrintf;
 
 namespace chromeos_update_engine {
 
-typedef DeltaDiffGenerator::Block Block;
-
 class Ext2MetadataTest : public ::testing::Test
 {
 };
@@ -44,7 +42,7 @@ TEST_F(Ext2MetadataTest, RunAsRootReadMetadataDissimilarFileSystems)
     CreateEmptyExtImageAtPath(b_img, 11534336, 4096);
 
     Graph graph;
-    vector<Block> blocks;
+    BlockMap blocks(0);
     EXPECT_TRUE(Ext2Metadata::DeltaReadMetadata(&graph,
                 &blocks,
                 a_img,
@@ -57,7 +55,6 @@ TEST_F(Ext2MetadataTest, RunAsRootReadMetadataDissimilarFileSystems)
     CreateEmptyExtImageAtPath(b_img, 10485759, 8192);
 
     graph.clear();
-    blocks.clear();
     EXPECT_TRUE(Ext2Metadata::DeltaReadMetadata(&graph,
                 &blocks,
                 a_img,
@@ -96,7 +93,7 @@ TEST_F(Ext2MetadataTest, RunAsRootReadMetadata)
     files::ScopedFD fd_closer(fd);
 
     Graph graph;
-    vector<Block> blocks(image_size / block_size);
+    BlockMap blocks(image_size / block_size);
     off_t data_file_size;
     EXPECT_TRUE(Ext2Metadata::DeltaReadMetadata(&graph,
                 &blocks,
@@ -14,13 +14,17 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <linux/fiemap.h>
 #include <linux/fs.h>
 
+#include <algorithm>
+
 #include "files/scoped_file.h"
 #include "update_engine/graph_types.h"
 #include "update_engine/graph_utils.h"
 #include "update_engine/utils.h"
 
+using std::min;
 using std::string;
 using std::vector;
 
@@ -29,37 +33,136 @@ namespace chromeos_update_engine {
 namespace extent_mapper {
 
 namespace {
-const int kBlockSize = 4096;
-}
 
-bool ExtentsForFileFibmap(const std::string &path, std::vector<Extent> *out)
+// The number of extents to get per FIEMAP call.
+const uint32_t kFiemapExtentCount = 512;
+
+// Extents with any of these flags can't be expressed in blocks of their own.
+const uint32_t kFiemapUnmappableFlags =
+    FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_ENCODED |
+    FIEMAP_EXTENT_DATA_ENCRYPTED | FIEMAP_EXTENT_NOT_ALIGNED |
+    FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_DATA_TAIL;
+
+// Puts the size of the regular file |fd| in blocks of its filesystem's
+// block size into |out_block_count|, and that block size into
+// |out_block_size|. Returns true on success.
+bool GetFileBlocks(int fd, uint64_t *out_block_count, uint32_t *out_block_size)
 {
-    CHECK(out);
     struct stat stbuf;
-    int rc = stat(path.c_str(), &stbuf);
-    TEST_AND_RETURN_FALSE_ERRNO(rc == 0);
+    TEST_AND_RETURN_FALSE_ERRNO(fstat(fd, &stbuf) == 0);
     TEST_AND_RETURN_FALSE(S_ISREG(stbuf.st_mode));
+    TEST_AND_RETURN_FALSE_ERRNO(ioctl(fd, FIGETBSZ, out_block_size) != -1);
+    TEST_AND_RETURN_FALSE(*out_block_size > 0);
 
+    *out_block_count =
+        (stbuf.st_size + *out_block_size - 1) / *out_block_size;
+    return true;
+}
+
+}  // namespace {}
+
+bool ExtentsForFile(const std::string &path, std::vector<Extent> *out)
+{
+    vector<Extent> extents;
+
+    if (ExtentsForFileFiemap(path, &extents)) {
+        out->insert(out->end(), extents.begin(), extents.end());
+        return true;
+    }
+
+    LOG(WARNING) << "Unable to map " << path << " with FIEMAP, using FIBMAP";
+    return ExtentsForFileFibmap(path, out);
+}
+
+bool ExtentsForFileFiemap(const std::string &path, std::vector<Extent> *out)
+{
+    CHECK(out);
     int fd = open(path.c_str(), O_RDONLY, 0);
     TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
     files::ScopedFD fd_closer(fd);
 
-    // Get file size in blocks
-    rc = fstat(fd, &stbuf);
+    uint64_t block_count;
+    uint32_t block_size;
+    TEST_AND_RETURN_FALSE(GetFileBlocks(fd, &block_count, &block_size));
+
+    vector<char> buf(sizeof(struct fiemap) +
+                     kFiemapExtentCount * sizeof(struct fiemap_extent));
+    struct fiemap *fiemap = reinterpret_cast<struct fiemap *>(buf.data());
+
+    // The first block of the file that isn't in |out| yet.
+    uint64_t next_block = 0;
+    bool last = false;
+
+    while (!last && next_block < block_count) {
+        memset(fiemap, 0, sizeof(*fiemap));
+        fiemap->fm_start = next_block * block_size;
+        fiemap->fm_length = FIEMAP_MAX_OFFSET - fiemap->fm_start;
+        fiemap->fm_flags = FIEMAP_FLAG_SYNC;
+        fiemap->fm_extent_count = kFiemapExtentCount;
+        TEST_AND_RETURN_FALSE_ERRNO(ioctl(fd, FS_IOC_FIEMAP, fiemap) == 0);
+
+        if (fiemap->fm_mapped_extents == 0) {
+            break;
+        }
+
+        for (uint32_t i = 0; i < fiemap->fm_mapped_extents && !last; i++) {
+            const struct fiemap_extent &extent = fiemap->fm_extents[i];
+            TEST_AND_RETURN_FALSE(!(extent.fe_flags & kFiemapUnmappableFlags));
+            TEST_AND_RETURN_FALSE(extent.fe_logical % block_size == 0 &&
+                                  extent.fe_physical % block_size == 0);
+            last = extent.fe_flags & FIEMAP_EXTENT_LAST;
+
+            const uint64_t first_block = extent.fe_logical / block_size;
+
+            // Preallocated blocks past the end of the file aren't in use.
+            if (first_block >= block_count) {
+                last = true;
+                break;
+            }
+
+            TEST_AND_RETURN_FALSE(first_block >= next_block);
+
+            if (first_block > next_block) {
+                graph_utils::AppendBlocksToExtents(out, kSparseHole,
+                                                   first_block - next_block);
+            }
+
+            const uint64_t num_blocks =
+                min(static_cast<uint64_t>(
+                        (extent.fe_length + block_size - 1) / block_size),
+                    block_count - first_block);
+            // Unwritten (preallocated) extents read back as zeros, whatever
+            // their blocks hold on disk.
+            const uint64_t start_block =
+                (extent.fe_flags & FIEMAP_EXTENT_UNWRITTEN) ?
+                kSparseHole : extent.fe_physical / block_size;
+            graph_utils::AppendBlocksToExtents(out, start_block, num_blocks);
+            next_block = first_block + num_blocks;
+        }
+    }
 
-    if (rc < 0) {
-        perror("fstat");
-        return false;
+    if (next_block < block_count) {
+        graph_utils::AppendBlocksToExtents(out, kSparseHole,
+                                           block_count - next_block);
     }
 
-    const int block_count = (stbuf.st_size + kBlockSize - 1) / kBlockSize;
-    Extent current;
-    current.set_start_block(0);
-    current.set_num_blocks(0);
+    return true;
+}
+
+bool ExtentsForFileFibmap(const std::string &path, std::vector<Extent> *out)
+{
+    CHECK(out);
+    int fd = open(path.c_str(), O_RDONLY, 0);
+    TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+    files::ScopedFD fd_closer(fd);
+
+    uint64_t block_count;
+    uint32_t block_size;
+    TEST_AND_RETURN_FALSE(GetFileBlocks(fd, &block_count, &block_size));
 
-    for (int i = 0; i < block_count; i++) {
+    for (uint64_t i = 0; i < block_count; i++) {
         unsigned int block32 = i;
-        rc = ioctl(fd, FIBMAP, &block32);
+        int rc = ioctl(fd, FIBMAP, &block32);
         TEST_AND_RETURN_FALSE_ERRNO(rc == 0);
 
         const uint64_t block = (block32 == 0 ? kSparseHole : block32);
@@ -14,17 +14,26 @@ namespace chromeos_update_engine {
 
 namespace extent_mapper {
 
-// Uses the FIBMAP ioctl to get all blocks used by a file and return them
-// as extents. Blocks are relative to the start of the filesystem. If
-// there is a sparse "hole" in the file, the blocks for that will be
-// represented by an extent whose start block is kSpareseHole.
-// The resulting extents are stored in 'out'. Keep in mind that while
-// the blocksize of a filesystem is often 4096 bytes, that is not always
-// the case, so one should consult GetFilesystemBlockSize(), too.
-// Returns true on success.
+// Gets all blocks used by a file and returns them as extents, using
+// ExtentsForFileFiemap(), or ExtentsForFileFibmap() where FIEMAP can't map
+// the file. Blocks are relative to the start of the filesystem, in units of
+// its block size (see GetFilesystemBlockSize()). If there is a sparse
+// "hole" in the file, the blocks for that will be represented by an extent
+// whose start block is kSparseHole. The resulting extents are appended to
+// 'out'. Returns true on success.
+bool ExtentsForFile(const std::string &path, std::vector<Extent> *out);
+
+// Like ExtentsForFile(), but uses the FIEMAP ioctl, which gets whole lists
+// of extents at a time. Fails if the filesystem doesn't support FIEMAP or
+// some of the file's data isn't in blocks of its own, e.g. when inline.
+bool ExtentsForFileFiemap(const std::string &path, std::vector<Extent> *out);
+
+// Like ExtentsForFile(), but uses the FIBMAP ioctl, which maps one block per
+// call and needs root.
 bool ExtentsForFileFibmap(const std::string &path, std::vector<Extent> *out);
 
-// Puts the blocksize of the filesystem, as used by the FIBMAP ioctl, into
+// Puts the blocksize of the filesystem, as used by the ExtentsForFile*()
+// functions, into
 // out_blocksize by using the FIGETBSZ ioctl. Returns true on success.
 bool GetFilesystemBlockSize(const std::string &path, uint32_t *out_blocksize);
 
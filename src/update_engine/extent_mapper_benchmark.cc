@@ -0,0 +1,121 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "files/scoped_file.h"
+#include "update_engine/extent_mapper.h"
+#include "update_engine/utils.h"
+
+DEFINE_string(dir, "/tmp", "Directory on the filesystem to test");
+DEFINE_int32(extents, 16384, "Number of data extents in the test file");
+DEFINE_int32(extent_blocks, 4, "Length of each data extent in blocks");
+
+// This program measures mapping the blocks of a fragmented file with FIEMAP
+// and with FIBMAP. The test file, in --dir, holds --extents data extents of
+// --extent_blocks blocks, each followed by a hole as long. FIBMAP needs
+// root; it's skipped without.
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+class Timer
+{
+public:
+    explicit Timer(const char *name)
+        : name_(name), start_(std::chrono::steady_clock::now()) {}
+
+    ~Timer()
+    {
+        printf("%-40s %10.3f ms\n", name_,
+               std::chrono::duration<double, std::milli>(
+                   std::chrono::steady_clock::now() - start_).count());
+    }
+
+private:
+    const char *name_;
+    const std::chrono::steady_clock::time_point start_;
+};
+
+// Writes the fragmented test file to |fd|. Returns true on success.
+bool WriteFragmentedFile(int fd, uint32_t block_size)
+{
+    const vector<char> data(FLAGS_extent_blocks * block_size, 'x');
+
+    for (int i = 0; i < FLAGS_extents; i++) {
+        TEST_AND_RETURN_FALSE(utils::PWriteAll(fd, data.data(), data.size(),
+                                               2 * i * data.size()));
+    }
+
+    return fsync(fd) == 0;
+}
+
+int Main(int argc, char **argv)
+{
+    // Disable glog's default behavior of logging to files.
+    FLAGS_logtostderr = true;
+    GFLAGS_NAMESPACE::ParseCommandLineFlags(&argc, &argv, true);
+    google::InitGoogleLogging(argv[0]);
+
+    string path;
+    int fd;
+    CHECK(utils::MakeTempFile(FLAGS_dir + "/extent_mapper_benchmark.XXXXXX",
+                              &path, &fd));
+    ScopedPathUnlinker path_unlinker(path);
+    files::ScopedFD fd_closer(fd);
+
+    uint32_t block_size = 0;
+    CHECK(extent_mapper::GetFilesystemBlockSize(path, &block_size));
+    CHECK(WriteFragmentedFile(fd, block_size));
+
+    vector<Extent> fiemap_extents;
+    {
+        Timer timer("FIEMAP");
+        CHECK(extent_mapper::ExtentsForFileFiemap(path, &fiemap_extents));
+    }
+    printf("%zu extents of %u byte blocks\n", fiemap_extents.size(),
+           block_size);
+
+    if (geteuid() != 0) {
+        printf("Not root, skipping FIBMAP\n");
+        return 0;
+    }
+
+    vector<Extent> fibmap_extents;
+    {
+        Timer timer("FIBMAP");
+        CHECK(extent_mapper::ExtentsForFileFibmap(path, &fibmap_extents));
+    }
+    CHECK_EQ(fiemap_extents.size(), fibmap_extents.size());
+
+    for (size_t i = 0; i < fiemap_extents.size(); i++) {
+        CHECK_EQ(fiemap_extents[i].start_block(),
+                 fibmap_extents[i].start_block());
+        CHECK_EQ(fiemap_extents[i].num_blocks(),
+                 fibmap_extents[i].num_blocks());
+    }
+
+    return 0;
+}
+
+}  // namespace {}
+
+}  // namespace chromeos_update_engine
+
+int main(int argc, char **argv)
+{
+    return chromeos_update_engine::Main(argc, argv);
+}
@@ -2,6 +2,7 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -61,12 +62,15 @@ TEST(ExtentMapperTest, RunAsRootSimpleTest)
     EXPECT_EQ(blocks.size(), (stbuf.st_size + block_size - 1) / block_size);
 }
 
-TEST(ExtentMapperTest, RunAsRootSparseFileTest)
+namespace {
+
+// Checks that |extents_for_file| maps a sparse file with one real block,
+// then two sparse ones, then a real block at the end.
+void TestSparseFile(bool (*extents_for_file)(const string &path,
+                    vector<Extent> *out))
 {
-    // Create sparse file with one real block, then two sparse ones, then a real
-    // block at the end.
     const char tmp_name_template[] =
-        "/tmp/ExtentMapperTest.RunAsRootSparseFileTest.XXXXXX";
+        "/tmp/ExtentMapperTest.SparseFileTest.XXXXXX";
     char buf[sizeof(tmp_name_template)];
     strncpy(buf, tmp_name_template, sizeof(buf));
     static_assert(sizeof(buf) > 8, "buf size incorrect");
@@ -84,7 +88,7 @@ TEST(ExtentMapperTest, RunAsRootSparseFileTest)
     close(fd);
 
     vector<Extent> extents;
-    EXPECT_TRUE(extent_mapper::ExtentsForFileFibmap(buf, &extents));
+    EXPECT_TRUE(extents_for_file(buf, &extents));
     unlink(buf);
     EXPECT_EQ(3, extents.size());
     EXPECT_EQ(1, extents[0].num_blocks());
@@ -96,4 +100,93 @@ TEST(ExtentMapperTest, RunAsRootSparseFileTest)
     EXPECT_NE(extents[2].start_block(), extents[0].start_block());
 }
 
+}  // namespace {}
+
+TEST(ExtentMapperTest, RunAsRootSparseFileTest)
+{
+    TestSparseFile(extent_mapper::ExtentsForFileFibmap);
+}
+
+TEST(ExtentMapperTest, FiemapSparseFileTest)
+{
+    TestSparseFile(extent_mapper::ExtentsForFileFiemap);
+}
+
+TEST(ExtentMapperTest, FiemapTrailingHoleTest)
+{
+    string path;
+    int fd;
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/ExtentMapperTest.XXXXXX", &path,
+                                    &fd));
+    ScopedPathUnlinker path_unlinker(path);
+
+    uint32_t block_size = 0;
+    EXPECT_TRUE(extent_mapper::GetFilesystemBlockSize(path, &block_size));
+    EXPECT_GT(block_size, 0);
+
+    // One real block, then a hole to the end of the file, which ends in the
+    // middle of a block.
+    EXPECT_EQ(1, pwrite(fd, "x", 1, 0));
+    EXPECT_EQ(0, ftruncate(fd, 4 * block_size + 1));
+    close(fd);
+
+    vector<Extent> extents;
+    EXPECT_TRUE(extent_mapper::ExtentsForFileFiemap(path, &extents));
+    ASSERT_EQ(2, extents.size());
+    EXPECT_NE(kSparseHole, extents[0].start_block());
+    EXPECT_EQ(1, extents[0].num_blocks());
+    EXPECT_EQ(kSparseHole, extents[1].start_block());
+    EXPECT_EQ(4, extents[1].num_blocks());
+}
+
+TEST(ExtentMapperTest, FiemapUnwrittenExtentTest)
+{
+    string path;
+    int fd;
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/ExtentMapperTest.XXXXXX", &path,
+                                    &fd));
+    ScopedPathUnlinker path_unlinker(path);
+
+    uint32_t block_size = 0;
+    EXPECT_TRUE(extent_mapper::GetFilesystemBlockSize(path, &block_size));
+    EXPECT_GT(block_size, 0);
+
+    // One written block followed by three preallocated ones, which read back
+    // as zeros.
+    EXPECT_EQ(1, pwrite(fd, "x", 1, 0));
+    EXPECT_EQ(0, fsync(fd));
+    if (fallocate(fd, 0, block_size, 3 * block_size) != 0) {
+        close(fd);
+        LOG(WARNING) << "fallocate() unsupported on /tmp, skipping test";
+        return;
+    }
+    close(fd);
+
+    vector<Extent> extents;
+    EXPECT_TRUE(extent_mapper::ExtentsForFileFiemap(path, &extents));
+    ASSERT_EQ(2, extents.size());
+    EXPECT_NE(kSparseHole, extents[0].start_block());
+    EXPECT_EQ(1, extents[0].num_blocks());
+    EXPECT_EQ(kSparseHole, extents[1].start_block());
+    EXPECT_EQ(3, extents[1].num_blocks());
+}
+
+TEST(ExtentMapperTest, RunAsRootFiemapMatchesFibmapTest)
+{
+    const string kFilename = "/proc/self/exe";
+    vector<Extent> fiemap_extents, fibmap_extents;
+    ASSERT_TRUE(extent_mapper::ExtentsForFileFiemap(kFilename,
+                &fiemap_extents));
+    ASSERT_TRUE(extent_mapper::ExtentsForFileFibmap(kFilename,
+                &fibmap_extents));
+    ASSERT_EQ(fibmap_extents.size(), fiemap_extents.size());
+
+    for (size_t i = 0; i < fibmap_extents.size(); i++) {
+        EXPECT_EQ(fibmap_extents[i].start_block(),
+                  fiemap_extents[i].start_block());
+        EXPECT_EQ(fibmap_extents[i].num_blocks(),
+                  fiemap_extents[i].num_blocks());
+    }
+}
+
 }  // namespace chromeos_update_engine
@@ -4,15 +4,13 @@
 
 #include "update_engine/extent_ranges.h"
 
-#include <set>
-#include <utility>
+#include <algorithm>
 #include <vector>
 
 #include <glog/logging.h>
 
 using std::max;
 using std::min;
-using std::set;
 using std::vector;
 
 namespace chromeos_update_engine {
@@ -51,181 +49,319 @@ bool ExtentRanges::ExtentsOverlap(const Extent &a, const Extent &b)
     }
 }
 
-void ExtentRanges::AddBlock(uint64_t block)
+namespace {
+
+uint64_t ExtentEnd(const CompactExtent &extent)
 {
-    AddExtent(ExtentForRange(block, 1));
+    return extent.start_block + extent.num_blocks;
 }
 
-void ExtentRanges::SubtractBlock(uint64_t block)
+bool StartsBefore(const CompactExtent &a, const CompactExtent &b)
 {
-    SubtractExtent(ExtentForRange(block, 1));
+    return a.start_block < b.start_block;
 }
 
-namespace {
+uint64_t CountBlocks(const vector<CompactExtent> &extents)
+{
+    uint64_t blocks = 0;
+
+    for (const CompactExtent &extent : extents) {
+        blocks += extent.num_blocks;
+    }
 
-Extent UnionOverlappingExtents(const Extent &first, const Extent &second)
+    return blocks;
+}
+
+// Appends |extent| to |extents|, which must be sorted and end at or before
+// its start, merging it with the last extent if they touch.
+void AppendMerged(const CompactExtent &extent, vector<CompactExtent> *extents)
 {
-    CHECK_NE(kSparseHole, first.start_block());
-    CHECK_NE(kSparseHole, second.start_block());
-    uint64_t start = min(first.start_block(), second.start_block());
-    uint64_t end = max(first.start_block() + first.num_blocks(),
-                       second.start_block() + second.num_blocks());
-    return ExtentForRange(start, end - start);
+    if (!extents->empty() && ExtentEnd(extents->back()) >= extent.start_block) {
+        extents->back().num_blocks =
+            std::max(ExtentEnd(extents->back()), ExtentEnd(extent)) -
+            extents->back().start_block;
+    } else {
+        extents->push_back(extent);
+    }
+}
+
+// Returns |extents| sorted, with the ones that overlap or touch merged and
+// sparse holes and empty extents dropped.
+template<typename Extents>
+vector<CompactExtent> NormalizeExtents(const Extents &extents)
+{
+    vector<CompactExtent> sorted;
+    sorted.reserve(extents.size());
+
+    for (const Extent &extent : extents) {
+        if (extent.start_block() != kSparseHole && extent.num_blocks() != 0) {
+            CompactExtent compact_extent = { extent.start_block(),
+                                             extent.num_blocks()
+                                           };
+            sorted.push_back(compact_extent);
+        }
+    }
+
+    if (!std::is_sorted(sorted.begin(), sorted.end(), StartsBefore)) {
+        std::sort(sorted.begin(), sorted.end(), StartsBefore);
+    }
+
+    vector<CompactExtent> merged;
+    merged.reserve(sorted.size());
+
+    for (const CompactExtent &extent : sorted) {
+        AppendMerged(extent, &merged);
+    }
+
+    return merged;
 }
 
 }  // namespace {}
 
+void ExtentRanges::AddBlock(uint64_t block)
+{
+    AddExtent(ExtentForRange(block, 1));
+}
+
+void ExtentRanges::SubtractBlock(uint64_t block)
+{
+    SubtractExtent(ExtentForRange(block, 1));
+}
+
 void ExtentRanges::AddExtent(Extent extent)
 {
     if (extent.start_block() == kSparseHole || extent.num_blocks() == 0) {
         return;
     }
 
-    ExtentSet::iterator begin_del = extent_set_.end();
-    ExtentSet::iterator end_del = extent_set_.end();
-    uint64_t del_blocks = 0;
-
-    for (ExtentSet::iterator it = extent_set_.begin(), e = extent_set_.end();
-            it != e; ++it) {
-        if (ExtentsOverlapOrTouch(*it, extent)) {
-            end_del = it;
-            ++end_del;
-            del_blocks += it->num_blocks();
+    uint64_t start = extent.start_block();
+    uint64_t end = start + extent.num_blocks();
+
+    // Find the extents that overlap or touch |extent| and merge them into it.
+    vector<CompactExtent>::iterator first = std::lower_bound(
+            ranges_.begin(), ranges_.end(), start,
+            [](const CompactExtent &range, uint64_t block) {
+                return ExtentEnd(range) < block;
+            });
+    vector<CompactExtent>::iterator last = first;
+
+    for (; last != ranges_.end() && last->start_block <= end; ++last) {
+        start = min(start, last->start_block);
+        end = max(end, ExtentEnd(*last));
+        blocks_ -= last->num_blocks;
+    }
 
-            if (begin_del == extent_set_.end()) {
-                begin_del = it;
-            }
+    const CompactExtent merged = { start, end - start };
+    blocks_ += merged.num_blocks;
 
-            extent = UnionOverlappingExtents(extent, *it);
-        }
+    if (first == last) {
+        ranges_.insert(first, merged);
+    } else {
+        *first = merged;
+        ranges_.erase(first + 1, last);
     }
-
-    extent_set_.erase(begin_del, end_del);
-    extent_set_.insert(extent);
-    blocks_ -= del_blocks;
-    blocks_ += extent.num_blocks();
 }
 
-namespace {
-// Returns base - subtractee (set subtraction).
-ExtentRanges::ExtentSet SubtractOverlappingExtents(const Extent &base,
-        const Extent &subtractee)
+void ExtentRanges::SubtractExtent(const Extent &extent)
 {
-    ExtentRanges::ExtentSet ret;
+    if (extent.start_block() == kSparseHole || extent.num_blocks() == 0) {
+        return;
+    }
+
+    const uint64_t start = extent.start_block();
+    const uint64_t end = start + extent.num_blocks();
 
-    if (subtractee.start_block() > base.start_block()) {
-        ret.insert(ExtentForRange(base.start_block(),
-                                  subtractee.start_block() - base.start_block()));
+    // Find the extents that overlap |extent|.
+    vector<CompactExtent>::iterator first = std::lower_bound(
+            ranges_.begin(), ranges_.end(), start,
+            [](const CompactExtent &range, uint64_t block) {
+                return ExtentEnd(range) <= block;
+            });
+    vector<CompactExtent>::iterator last = first;
+
+    for (; last != ranges_.end() && last->start_block < end; ++last) {
+        blocks_ -= last->num_blocks;
     }
 
-    uint64_t base_end = base.start_block() + base.num_blocks();
-    uint64_t subtractee_end = subtractee.start_block() + subtractee.num_blocks();
+    if (first == last) {
+        return;
+    }
 
-    if (base_end > subtractee_end) {
-        ret.insert(ExtentForRange(subtractee_end, base_end - subtractee_end));
+    // Only the parts of the first and last of them outside |extent| remain.
+    CompactExtent remains[2];
+    size_t num_remains = 0;
+
+    if (first->start_block < start) {
+        const CompactExtent head = { first->start_block,
+                                     start - first->start_block
+                                   };
+        remains[num_remains++] = head;
     }
 
-    return ret;
+    if (ExtentEnd(*(last - 1)) > end) {
+        const CompactExtent tail = { end, ExtentEnd(*(last - 1)) - end };
+        remains[num_remains++] = tail;
+    }
+
+    for (size_t i = 0; i < num_remains; i++) {
+        blocks_ += remains[i].num_blocks;
+    }
+
+    first = ranges_.erase(first, last);
+    ranges_.insert(first, remains, remains + num_remains);
 }
-}  // namespace {}
 
-void ExtentRanges::SubtractExtent(const Extent &extent)
+void ExtentRanges::Add(const vector<CompactExtent> &extents)
 {
-    if (extent.start_block() == kSparseHole || extent.num_blocks() == 0) {
+    if (extents.empty()) {
         return;
     }
 
-    ExtentSet::iterator begin_del = extent_set_.end();
-    ExtentSet::iterator end_del = extent_set_.end();
-    uint64_t del_blocks = 0;
-    ExtentSet new_extents;
+    vector<CompactExtent> result;
+    result.reserve(ranges_.size() + extents.size());
+    vector<CompactExtent>::const_iterator it = ranges_.begin();
+    vector<CompactExtent>::const_iterator jt = extents.begin();
+
+    while (it != ranges_.end() || jt != extents.end()) {
+        if (jt == extents.end() ||
+                (it != ranges_.end() && it->start_block < jt->start_block)) {
+            AppendMerged(*it++, &result);
+        } else {
+            AppendMerged(*jt++, &result);
+        }
+    }
+
+    ranges_.swap(result);
+    blocks_ = CountBlocks(ranges_);
+}
 
-    for (ExtentSet::iterator it = extent_set_.begin(), e = extent_set_.end();
-            it != e; ++it) {
-        if (!ExtentsOverlap(*it, extent)) {
-            continue;
+void ExtentRanges::Subtract(const vector<CompactExtent> &extents)
+{
+    if (extents.empty() || ranges_.empty()) {
+        return;
+    }
+
+    vector<CompactExtent> result;
+    result.reserve(ranges_.size() + extents.size());
+    vector<CompactExtent>::const_iterator jt = extents.begin();
+
+    for (const CompactExtent &range : ranges_) {
+        // Extents that end before this range can't overlap the later ones
+        // either.
+        while (jt != extents.end() && ExtentEnd(*jt) <= range.start_block) {
+            ++jt;
         }
 
-        if (begin_del == extent_set_.end()) {
-            begin_del = it;
+        uint64_t start = range.start_block;
+        const uint64_t end = ExtentEnd(range);
+
+        for (vector<CompactExtent>::const_iterator kt = jt;
+                kt != extents.end() && kt->start_block < end; ++kt) {
+            if (kt->start_block > start) {
+                const CompactExtent piece = { start, kt->start_block - start };
+                result.push_back(piece);
+            }
+
+            start = max(start, ExtentEnd(*kt));
         }
 
-        end_del = it;
-        ++end_del;
+        if (start < end) {
+            const CompactExtent piece = { start, end - start };
+            result.push_back(piece);
+        }
+    }
 
-        del_blocks += it->num_blocks();
+    ranges_.swap(result);
+    blocks_ = CountBlocks(ranges_);
+}
 
-        ExtentSet subtraction = SubtractOverlappingExtents(*it, extent);
+void ExtentRanges::Intersect(const vector<CompactExtent> &extents)
+{
+    vector<CompactExtent> result;
+    vector<CompactExtent>::const_iterator it = ranges_.begin();
+    vector<CompactExtent>::const_iterator jt = extents.begin();
 
-        for (ExtentSet::iterator jt = subtraction.begin(), je = subtraction.end();
-                jt != je; ++jt) {
-            new_extents.insert(*jt);
-            del_blocks -= jt->num_blocks();
+    while (it != ranges_.end() && jt != extents.end()) {
+        const uint64_t start = max(it->start_block, jt->start_block);
+        const uint64_t end = min(ExtentEnd(*it), ExtentEnd(*jt));
+
+        if (start < end) {
+            const CompactExtent piece = { start, end - start };
+            result.push_back(piece);
+        }
+
+        if (ExtentEnd(*it) < ExtentEnd(*jt)) {
+            ++it;
+        } else {
+            ++jt;
         }
     }
 
-    extent_set_.erase(begin_del, end_del);
-    extent_set_.insert(new_extents.begin(), new_extents.end());
-    blocks_ -= del_blocks;
+    ranges_.swap(result);
+    blocks_ = CountBlocks(ranges_);
 }
 
 void ExtentRanges::AddRanges(const ExtentRanges &ranges)
 {
-    for (ExtentSet::const_iterator it = ranges.extent_set_.begin(),
-            e = ranges.extent_set_.end(); it != e; ++it) {
-        AddExtent(*it);
-    }
+    Add(ranges.ranges_);
 }
 
 void ExtentRanges::SubtractRanges(const ExtentRanges &ranges)
 {
-    for (ExtentSet::const_iterator it = ranges.extent_set_.begin(),
-            e = ranges.extent_set_.end(); it != e; ++it) {
-        SubtractExtent(*it);
-    }
+    Subtract(ranges.ranges_);
+}
+
+void ExtentRanges::IntersectRanges(const ExtentRanges &ranges)
+{
+    Intersect(ranges.ranges_);
 }
 
 void ExtentRanges::AddExtents(const vector<Extent> &extents)
 {
-    for (vector<Extent>::const_iterator it = extents.begin(), e = extents.end();
-            it != e; ++it) {
-        AddExtent(*it);
-    }
+    Add(NormalizeExtents(extents));
 }
 
 void ExtentRanges::SubtractExtents(const vector<Extent> &extents)
 {
-    for (vector<Extent>::const_iterator it = extents.begin(), e = extents.end();
-            it != e; ++it) {
-        SubtractExtent(*it);
-    }
+    Subtract(NormalizeExtents(extents));
+}
+
+void ExtentRanges::IntersectExtents(const vector<Extent> &extents)
+{
+    Intersect(NormalizeExtents(extents));
 }
 
 void ExtentRanges::AddRepeatedExtents(
     const ::google::protobuf::RepeatedPtrField<Extent> &exts)
 {
-    for (int i = 0, e = exts.size(); i != e; ++i) {
-        AddExtent(exts.Get(i));
-    }
+    Add(NormalizeExtents(exts));
 }
 
 void ExtentRanges::SubtractRepeatedExtents(
     const ::google::protobuf::RepeatedPtrField<Extent> &exts)
 {
-    for (int i = 0, e = exts.size(); i != e; ++i) {
-        SubtractExtent(exts.Get(i));
-    }
+    Subtract(NormalizeExtents(exts));
 }
 
 void ExtentRanges::Dump() const
 {
     LOG(INFO) << "ExtentRanges Dump. blocks: " << blocks_;
 
-    for (ExtentSet::const_iterator it = extent_set_.begin(),
-            e = extent_set_.end();
-            it != e; ++it) {
-        LOG(INFO) << "{" << it->start_block() << ", " << it->num_blocks() << "}";
+    for (const CompactExtent &range : ranges_) {
+        LOG(INFO) << "{" << range.start_block << ", " << range.num_blocks << "}";
+    }
+}
+
+ExtentRanges::ExtentSet ExtentRanges::extent_set() const
+{
+    ExtentSet out;
+    out.reserve(ranges_.size());
+
+    for (const CompactExtent &range : ranges_) {
+        out.push_back(ExtentForRange(range.start_block, range.num_blocks));
     }
+
+    return out;
 }
 
 Extent ExtentForRange(uint64_t start_block, uint64_t num_blocks)
@@ -248,27 +384,17 @@ std::vector<Extent> ExtentRanges::GetExtentsForBlockCount(
     uint64_t out_blocks = 0;
     CHECK(count <= blocks_);
 
-    for (ExtentSet::const_iterator it = extent_set_.begin(),
-            e = extent_set_.end();
-            it != e; ++it) {
+    for (const CompactExtent &range : ranges_) {
         const uint64_t blocks_needed = count - out_blocks;
-        const Extent &extent = *it;
-        out.push_back(extent);
-        out_blocks += extent.num_blocks();
-
-        if (extent.num_blocks() < blocks_needed) {
-            continue;
-        }
 
-        if (extent.num_blocks() == blocks_needed) {
+        if (range.num_blocks >= blocks_needed) {
+            // This is the last extent needed; it may be too big.
+            out.push_back(ExtentForRange(range.start_block, blocks_needed));
             break;
         }
 
-        // If we get here, we just added the last extent needed, but it's too big
-        out_blocks -= extent.num_blocks();
-        out_blocks += blocks_needed;
-        out.back().set_num_blocks(blocks_needed);
-        break;
+        out.push_back(ExtentForRange(range.start_block, range.num_blocks));
+        out_blocks += range.num_blocks;
     }
 
     return out;
@@ -5,8 +5,6 @@
 #ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_EXTENT_RANGES_H__
 #define CHROMEOS_PLATFORM_UPDATE_ENGINE_EXTENT_RANGES_H__
 
-#include <map>
-#include <set>
 #include <vector>
 
 #include "update_engine/delta_diff_generator.h"
@@ -19,6 +17,11 @@
 // ignores sparse hole extents mostly to avoid confusion between extending a
 // sparse hole range vs. set addition but also to ensure that the delta
 // generator doesn't use sparse holes as scratch space.
+//
+// The blocks are kept as a sorted vector of disjoint, non-adjacent plain
+// extents. Adding or subtracting a single extent takes a binary search and
+// a move of the extents after it; adding, subtracting or intersecting many
+// extents at once takes a single linear merge.
 
 namespace chromeos_update_engine {
 
@@ -34,7 +37,7 @@ Extent ExtentForRange(uint64_t start_block, uint64_t num_blocks);
 class ExtentRanges
 {
 public:
-    typedef std::set<Extent, ExtentLess> ExtentSet;
+    typedef std::vector<Extent> ExtentSet;
 
     ExtentRanges() : blocks_(0) {}
     void AddBlock(uint64_t block);
@@ -50,6 +53,10 @@ public:
     void AddRanges(const ExtentRanges &ranges);
     void SubtractRanges(const ExtentRanges &ranges);
 
+    // Keeps only the blocks that are also in |ranges| or |extents|.
+    void IntersectRanges(const ExtentRanges &ranges);
+    void IntersectExtents(const std::vector<Extent> &extents);
+
     static bool ExtentsOverlapOrTouch(const Extent &a, const Extent &b);
     static bool ExtentsOverlap(const Extent &a, const Extent &b);
 
@@ -60,19 +67,25 @@ public:
     {
         return blocks_;
     }
-    const ExtentSet &extent_set() const
-    {
-        return extent_set_;
-    }
+
+    // Returns the extents in order.
+    ExtentSet extent_set() const;
 
     // Returns an ordered vector of extents for |count| blocks,
-    // using extents in extent_set_. The returned extents are not
-    // removed from extent_set_. |count| must be less than or equal to
-    // the number of blocks in this extent set.
+    // using the extents in order. The returned extents are not removed.
+    // |count| must be less than or equal to the number of blocks in this
+    // extent set.
     std::vector<Extent> GetExtentsForBlockCount(uint64_t count) const;
 
 private:
-    ExtentSet extent_set_;
+    // Replace |ranges_| with their union, difference or intersection with
+    // |extents|, which must be sorted, disjoint and non-adjacent.
+    void Add(const std::vector<CompactExtent> &extents);
+    void Subtract(const std::vector<CompactExtent> &extents);
+    void Intersect(const std::vector<CompactExtent> &extents);
+
+    // Sorted by start block, with a gap between each extent and the next.
+    std::vector<CompactExtent> ranges_;
     uint64_t blocks_;
 };
 
@@ -0,0 +1,158 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "update_engine/extent_ranges.h"
+
+DEFINE_int32(extents, 100000, "Number of extents in each extent set");
+DEFINE_int32(max_extent_blocks, 16, "Maximum length of an extent in blocks");
+DEFINE_int32(seed, 1, "Random seed");
+
+// This program measures ExtentRanges operations on fragmented extent sets
+// like those of a large, aged filesystem: each set holds --extents short
+// extents at random offsets, and the sets overlap each other partially.
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Returns |count| extents of random lengths with random gaps between them,
+// in random order.
+vector<Extent> FragmentedExtents(int count, unsigned int *seed)
+{
+    vector<Extent> extents;
+    uint64_t block = 0;
+
+    for (int i = 0; i < count; i++) {
+        const uint64_t num_blocks = 1 + rand_r(seed) % FLAGS_max_extent_blocks;
+        block += rand_r(seed) % (2 * FLAGS_max_extent_blocks);
+        extents.push_back(ExtentForRange(block, num_blocks));
+        block += num_blocks;
+    }
+
+    for (int i = count - 1; i > 0; i--) {
+        std::swap(extents[i], extents[rand_r(seed) % (i + 1)]);
+    }
+
+    return extents;
+}
+
+class Timer
+{
+public:
+    explicit Timer(const char *name)
+        : name_(name), start_(std::chrono::steady_clock::now()) {}
+
+    ~Timer()
+    {
+        printf("%-40s %10.3f ms\n", name_,
+               std::chrono::duration<double, std::milli>(
+                   std::chrono::steady_clock::now() - start_).count());
+    }
+
+private:
+    const char *name_;
+    const std::chrono::steady_clock::time_point start_;
+};
+
+int Main(int argc, char **argv)
+{
+    // Disable glog's default behavior of logging to files.
+    FLAGS_logtostderr = true;
+    GFLAGS_NAMESPACE::ParseCommandLineFlags(&argc, &argv, true);
+    google::InitGoogleLogging(argv[0]);
+
+    unsigned int seed = FLAGS_seed;
+    const vector<Extent> extents_a = FragmentedExtents(FLAGS_extents, &seed);
+    const vector<Extent> extents_b = FragmentedExtents(FLAGS_extents, &seed);
+
+    ExtentRanges ranges_a;
+    {
+        Timer timer("AddExtent, one at a time");
+
+        for (const Extent &extent : extents_a) {
+            ranges_a.AddExtent(extent);
+        }
+    }
+
+    ExtentRanges ranges_b;
+    {
+        Timer timer("AddExtents");
+        ranges_b.AddExtents(extents_b);
+    }
+
+    printf("%ju and %ju blocks in %zu and %zu extents\n",
+           static_cast<uintmax_t>(ranges_a.blocks()),
+           static_cast<uintmax_t>(ranges_b.blocks()),
+           ranges_a.extent_set().size(), ranges_b.extent_set().size());
+
+    {
+        ExtentRanges ranges = ranges_a;
+        Timer timer("SubtractExtent, 1000 at a time");
+
+        for (size_t i = 0; i < 1000 && i < extents_b.size(); i++) {
+            ranges.SubtractExtent(extents_b[i]);
+        }
+    }
+    {
+        ExtentRanges ranges = ranges_a;
+        Timer timer("AddRanges");
+        ranges.AddRanges(ranges_b);
+    }
+    {
+        ExtentRanges ranges = ranges_a;
+        Timer timer("SubtractRanges");
+        ranges.SubtractRanges(ranges_b);
+    }
+    {
+        ExtentRanges ranges = ranges_a;
+        Timer timer("SubtractExtents");
+        ranges.SubtractExtents(extents_b);
+    }
+    {
+        ExtentRanges ranges = ranges_a;
+        Timer timer("IntersectRanges");
+        ranges.IntersectRanges(ranges_b);
+    }
+    {
+        Timer timer("GetExtentsForBlockCount, all blocks");
+        ranges_a.GetExtentsForBlockCount(ranges_a.blocks());
+    }
+    {
+        // What DeltaPerformer::IsIdempotentOperation() does for each
+        // operation, with operations of 16 extents.
+        Timer timer("Idempotency checks of 16 extents each");
+
+        for (size_t i = 0; i + 16 <= extents_a.size(); i += 16) {
+            ExtentRanges ranges;
+            ranges.AddExtents(vector<Extent>(extents_a.begin() + i,
+                                             extents_a.begin() + i + 16));
+            const uint64_t blocks = ranges.blocks();
+            ranges.SubtractExtents(vector<Extent>(extents_b.begin() + i,
+                                                  extents_b.begin() + i + 16));
+            CHECK_LE(ranges.blocks(), blocks);
+        }
+    }
+
+    return 0;
+}
+
+}  // namespace {}
+
+}  // namespace chromeos_update_engine
+
+int main(int argc, char **argv)
+{
+    return chromeos_update_engine::Main(argc, argv);
+}
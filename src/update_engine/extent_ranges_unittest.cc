@@ -2,6 +2,9 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <stdlib.h>
+
+#include <set>
 #include <vector>
 
 #include <gtest/gtest.h>
@@ -9,6 +12,7 @@
 #include "update_engine/extent_ranges.h"
 #include "update_engine/test_utils.h"
 
+using std::set;
 using std::vector;
 
 namespace chromeos_update_engine {
@@ -234,6 +238,166 @@ TEST(ExtentRangesTest, MultipleRanges)
     }
 }
 
+TEST(ExtentRangesTest, IntersectTest)
+{
+    ExtentRanges ranges_a, ranges_b;
+    ranges_a.AddExtent(ExtentForRange(0, 10));
+    ranges_a.AddExtent(ExtentForRange(20, 10));
+    ranges_a.AddExtent(ExtentForRange(40, 10));
+    ranges_b.AddExtent(ExtentForRange(5, 20));
+    ranges_b.AddExtent(ExtentForRange(28, 4));
+    ranges_b.AddExtent(ExtentForRange(50, 10));
+    ranges_a.IntersectRanges(ranges_b);
+    {
+        uint64_t expected[] = {5, 5, 20, 5, 28, 2};
+        EXPECT_RANGE_EQ(ranges_a, expected);
+        EXPECT_EQ(3, ranges_a.extent_set().size());
+    }
+
+    vector<Extent> extents;
+    extents.push_back(ExtentForRange(29, 100));
+    extents.push_back(ExtentForRange(kSparseHole, 10));
+    extents.push_back(ExtentForRange(0, 6));
+    ranges_a.IntersectExtents(extents);
+    {
+        uint64_t expected[] = {5, 1, 29, 1};
+        EXPECT_RANGE_EQ(ranges_a, expected);
+        EXPECT_EQ(2, ranges_a.extent_set().size());
+    }
+}
+
+TEST(ExtentRangesTest, UnsortedExtentsTest)
+{
+    // Overlapping, touching and out of order extents are all fine.
+    vector<Extent> extents;
+    extents.push_back(ExtentForRange(30, 10));
+    extents.push_back(ExtentForRange(10, 5));
+    extents.push_back(ExtentForRange(0, 0));
+    extents.push_back(ExtentForRange(15, 5));
+    extents.push_back(ExtentForRange(35, 10));
+    extents.push_back(ExtentForRange(kSparseHole, 10));
+    ExtentRanges ranges;
+    ranges.AddExtents(extents);
+    {
+        uint64_t expected[] = {10, 10, 30, 15};
+        EXPECT_RANGE_EQ(ranges, expected);
+        EXPECT_EQ(2, ranges.extent_set().size());
+    }
+
+    extents.clear();
+    extents.push_back(ExtentForRange(40, 2));
+    extents.push_back(ExtentForRange(12, 2));
+    extents.push_back(ExtentForRange(13, 3));
+    ranges.SubtractExtents(extents);
+    {
+        uint64_t expected[] = {10, 2, 16, 4, 30, 10, 42, 3};
+        EXPECT_RANGE_EQ(ranges, expected);
+        EXPECT_EQ(4, ranges.extent_set().size());
+    }
+}
+
+TEST(ExtentRangesTest, RandomTest)
+{
+    // Checks all the operations against a set of blocks on fragmented
+    // ranges.
+    ExtentRanges ranges;
+    set<uint64_t> blocks;
+    unsigned int seed = 1;
+
+    for (int i = 0; i < 2000; i++) {
+        vector<Extent> extents;
+        ExtentRanges other;
+        set<uint64_t> other_blocks;
+
+        for (int j = 1 + rand_r(&seed) % 4; j > 0; j--) {
+            const Extent extent = ExtentForRange(rand_r(&seed) % 1000,
+                                                 rand_r(&seed) % 20);
+            extents.push_back(extent);
+            other.AddExtent(extent);
+
+            for (uint64_t k = 0; k < extent.num_blocks(); k++) {
+                other_blocks.insert(extent.start_block() + k);
+            }
+        }
+
+        switch (rand_r(&seed) % 6) {
+        case 0:
+            ranges.AddExtent(extents[0]);
+            other_blocks.clear();
+
+            for (uint64_t k = 0; k < extents[0].num_blocks(); k++) {
+                other_blocks.insert(extents[0].start_block() + k);
+            }
+
+            blocks.insert(other_blocks.begin(), other_blocks.end());
+            break;
+
+        case 1:
+            ranges.SubtractExtent(extents[0]);
+
+            for (uint64_t k = 0; k < extents[0].num_blocks(); k++) {
+                blocks.erase(extents[0].start_block() + k);
+            }
+
+            break;
+
+        case 2:
+            ranges.AddExtents(extents);
+            blocks.insert(other_blocks.begin(), other_blocks.end());
+            break;
+
+        case 3:
+            ranges.SubtractExtents(extents);
+
+            for (uint64_t block : other_blocks) {
+                blocks.erase(block);
+            }
+
+            break;
+
+        case 4:
+            ranges.AddRanges(other);
+            blocks.insert(other_blocks.begin(), other_blocks.end());
+            break;
+
+        case 5:
+            // Intersecting with a few small extents would empty the ranges
+            // quickly, so intersect with their complement.
+            other = ExtentRanges();
+            other.AddExtent(ExtentForRange(0, 2000));
+            other.SubtractExtents(extents);
+            ranges.IntersectRanges(other);
+
+            for (uint64_t block : other_blocks) {
+                blocks.erase(block);
+            }
+
+            break;
+        }
+
+        ASSERT_EQ(blocks.size(), ranges.blocks()) << "i = " << i;
+        set<uint64_t> range_blocks;
+        const ExtentRanges::ExtentSet extent_set = ranges.extent_set();
+
+        for (size_t j = 0; j < extent_set.size(); j++) {
+            ASSERT_GT(extent_set[j].num_blocks(), 0);
+
+            if (j > 0) {
+                // Adjacent extents must have been merged.
+                ASSERT_LT(extent_set[j - 1].start_block() +
+                          extent_set[j - 1].num_blocks(),
+                          extent_set[j].start_block());
+            }
+
+            for (uint64_t k = 0; k < extent_set[j].num_blocks(); k++) {
+                range_blocks.insert(extent_set[j].start_block() + k);
+            }
+        }
+
+        ASSERT_TRUE(blocks == range_blocks) << "i = " << i;
+    }
+}
+
 TEST(ExtentRangesTest, GetExtentsForBlockCountTest)
 {
     ExtentRanges ranges;
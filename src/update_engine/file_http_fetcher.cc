@@ -0,0 +1,261 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/file_http_fetcher.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+
+#include <glog/logging.h>
+
+#include "files/eintr_wrapper.h"
+#include "update_engine/http_common.h"
+#include "update_engine/utils.h"
+
+using std::min;
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+const char kFileUrlPrefix[] = "file://";
+const char kLocalhost[] = "localhost";
+}  // namespace {}
+
+// Large enough that the main loop overhead is negligible, small enough to stay
+// below the download action's high watermark.
+const size_t FileHttpFetcher::kMaxSpanSize = 2 * 1024 * 1024;
+
+FileHttpFetcher::~FileHttpFetcher()
+{
+    LOG_IF(ERROR, transfer_in_progress_)
+            << "Destroying the fetcher while a transfer is in progress.";
+    CleanUp();
+}
+
+string FileHttpFetcher::PathForUrl(const string &url)
+{
+    if (!utils::StringHasPrefix(url, kFileUrlPrefix)) {
+        return "";
+    }
+
+    string path = url.substr(strlen(kFileUrlPrefix));
+
+    // file://localhost/path is equivalent to file:///path.
+    if (utils::StringHasPrefix(path, kLocalhost)) {
+        path = path.substr(strlen(kLocalhost));
+    }
+
+    if (path.empty() || path[0] != '/') {
+        return "";
+    }
+
+    return path;
+}
+
+void FileHttpFetcher::BeginTransfer(const string &url)
+{
+    CHECK(!transfer_in_progress_) << "BeginTransfer but already in progress.";
+    url_ = url;
+    http_response_code_ = 0;
+    terminate_requested_ = false;
+    transfer_in_progress_ = true;
+
+    const string path = PathForUrl(url);
+
+    if (path.empty()) {
+        LOG(ERROR) << "Not a local file URL: " << url;
+        http_response_code_ = kHttpResponseBadRequest;
+        idle_source_id_ = g_idle_add(StaticSignalFailure, this);
+        return;
+    }
+
+    fd_ = HANDLE_EINTR(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+
+    if (fd_ < 0) {
+        PLOG(ERROR) << "Unable to open " << path;
+        http_response_code_ = kHttpResponseNotFound;
+        idle_source_id_ = g_idle_add(StaticSignalFailure, this);
+        return;
+    }
+
+    struct stat stbuf;
+
+    if (fstat(fd_, &stbuf) < 0 || !S_ISREG(stbuf.st_mode)) {
+        LOG(ERROR) << path << " is not a regular file.";
+        http_response_code_ = kHttpResponseNotFound;
+        idle_source_id_ = g_idle_add(StaticSignalFailure, this);
+        return;
+    }
+
+    file_size_ = stbuf.st_size;
+
+    if (offset_ > file_size_) {
+        LOG(ERROR) << "Offset " << offset_ << " is beyond the end of " << path
+                   << " (" << file_size_ << " bytes).";
+        http_response_code_ = kHttpResponseReqRangeNotSat;
+        idle_source_id_ = g_idle_add(StaticSignalFailure, this);
+        return;
+    }
+
+    position_ = offset_;
+    end_ = file_size_;
+
+    if (length_ > 0) {
+        end_ = min(end_, static_cast<off_t>(offset_ + length_));
+    }
+
+    // The spans are read in order, so let the kernel read ahead aggressively.
+    posix_fadvise(fd_, position_, end_ - position_, POSIX_FADV_SEQUENTIAL);
+    LOG(INFO) << "Reading " << end_ - position_ << " bytes from " << path
+              << " at offset " << position_;
+
+    if (!paused_) {
+        ScheduleDelivery();
+    }
+}
+
+void FileHttpFetcher::ScheduleDelivery()
+{
+    if (idle_source_id_ == 0) {
+        idle_source_id_ = g_idle_add(StaticDeliverSpan, this);
+    }
+}
+
+bool FileHttpFetcher::DeliverSpan()
+{
+    if (paused_) {
+        idle_source_id_ = 0;
+        return false;
+    }
+
+    if (position_ >= end_) {
+        idle_source_id_ = 0;
+        CleanUp();
+        http_response_code_ = kHttpResponseOk;
+
+        if (delegate_) {
+            // Note that after the callback returns this object may be destroyed.
+            delegate_->TransferComplete(this, true);
+        }
+
+        return false;
+    }
+
+    const size_t span = min(static_cast<off_t>(kMaxSpanSize), end_ - position_);
+    buffer_.resize(kMaxSpanSize);
+    ssize_t bytes_read = 0;
+
+    if (!utils::PReadAll(fd_, &buffer_[0], span, position_, &bytes_read) ||
+            static_cast<size_t>(bytes_read) != span) {
+        LOG(ERROR) << "Unable to read " << span << " bytes at offset "
+                   << position_ << ", got " << bytes_read;
+        idle_source_id_ = 0;
+        CleanUp();
+
+        if (delegate_) {
+            delegate_->TransferComplete(this, false);
+        }
+
+        return false;
+    }
+
+    position_ += span;
+    bytes_downloaded_ += span;
+
+    if (delegate_) {
+        in_write_callback_ = true;
+        delegate_->ReceivedBytes(this, &buffer_[0], span);
+        in_write_callback_ = false;
+    }
+
+    if (terminate_requested_) {
+        idle_source_id_ = 0;
+        ForceTransferTermination();
+        return false;
+    }
+
+    if (paused_) {
+        idle_source_id_ = 0;
+        return false;
+    }
+
+    return true;
+}
+
+bool FileHttpFetcher::SignalFailure()
+{
+    idle_source_id_ = 0;
+    const int http_response_code = http_response_code_;
+    CleanUp();
+    http_response_code_ = http_response_code;
+
+    if (delegate_) {
+        // Note that after the callback returns this object may be destroyed.
+        delegate_->TransferComplete(this, false);
+    }
+
+    return false;
+}
+
+void FileHttpFetcher::TerminateTransfer()
+{
+    if (in_write_callback_) {
+        terminate_requested_ = true;
+    } else {
+        ForceTransferTermination();
+    }
+}
+
+void FileHttpFetcher::ForceTransferTermination()
+{
+    CleanUp();
+    terminate_requested_ = false;
+
+    if (delegate_) {
+        // Note that after the callback returns this object may be destroyed.
+        delegate_->TransferTerminated(this);
+    }
+}
+
+void FileHttpFetcher::Pause()
+{
+    // A pending idle callback notices the flag and removes itself.
+    paused_ = true;
+}
+
+void FileHttpFetcher::Unpause()
+{
+    paused_ = false;
+
+    if (transfer_in_progress_) {
+        ScheduleDelivery();
+    }
+}
+
+void FileHttpFetcher::CleanUp()
+{
+    if (idle_source_id_) {
+        g_source_remove(idle_source_id_);
+        idle_source_id_ = 0;
+    }
+
+    if (fd_ >= 0) {
+        if (close(fd_) != 0) {
+            PLOG(ERROR) << "Unable to close the payload file.";
+        }
+
+        fd_ = -1;
+    }
+
+    transfer_in_progress_ = false;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,152 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_FILE_HTTP_FETCHER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_FILE_HTTP_FETCHER_H__
+
+#include <string>
+#include <vector>
+
+#include <glib.h>
+#include <glog/logging.h>
+
+#include "macros.h"
+#include "update_engine/http_fetcher.h"
+
+// This is a concrete implementation of HttpFetcher for file:// URLs, used when
+// the payload is already present on local storage (e.g. a USB stick or a
+// sideloaded image). Rather than reading the payload through a socket, each
+// span is read with a single pread() into a buffer reused for the whole
+// transfer. The file isn't mapped: a file truncated or a device removed
+// mid-read would raise SIGBUS instead of a plain I/O error. Spans are
+// delivered from the glib main loop, one per idle callback, so the fetcher
+// behaves like the network fetchers with respect to Pause(), Unpause() and
+// TerminateTransfer().
+
+namespace chromeos_update_engine {
+
+class FileHttpFetcher : public HttpFetcher
+{
+public:
+    // The maximum number of bytes passed to a single ReceivedBytes() call.
+    static const size_t kMaxSpanSize;
+
+    FileHttpFetcher()
+        : HttpFetcher(),
+          fd_(-1),
+          file_size_(0),
+          offset_(0),
+          length_(0),
+          position_(0),
+          end_(0),
+          bytes_downloaded_(0),
+          idle_source_id_(0),
+          transfer_in_progress_(false),
+          in_write_callback_(false),
+          terminate_requested_(false),
+          paused_(false) {}
+
+    // Cleans up all internal state. Does not notify delegate.
+    ~FileHttpFetcher();
+
+    virtual void SetOffset(off_t offset)
+    {
+        offset_ = offset;
+        bytes_downloaded_ = offset;
+    }
+
+    virtual void SetLength(size_t length)
+    {
+        length_ = length;
+    }
+    virtual void UnsetLength()
+    {
+        SetLength(0);
+    }
+
+    // Opens the file named by the file:// |url| and starts delivering its
+    // contents from the current offset on the next main loop iteration.
+    virtual void BeginTransfer(const std::string &url);
+
+    // If the transfer is in progress, aborts the transfer early. The transfer
+    // cannot be resumed.
+    virtual void TerminateTransfer();
+
+    // Stops delivering spans until Unpause() is called. The pause persists
+    // across restarted transfers.
+    virtual void Pause();
+
+    // Resumes delivering spans from the next main loop iteration.
+    virtual void Unpause();
+
+    virtual size_t GetBytesDownloaded()
+    {
+        return static_cast<size_t>(bytes_downloaded_);
+    }
+
+    // Returns the local path for a file:// |url|, or an empty string if |url|
+    // is not a file:// URL.
+    static std::string PathForUrl(const std::string &url);
+
+private:
+    // Reads the next span of the file and passes it to the delegate. Returns
+    // true if the idle source should stay installed.
+    bool DeliverSpan();
+    static gboolean StaticDeliverSpan(gpointer data)
+    {
+        return reinterpret_cast<FileHttpFetcher *>(data)->DeliverSpan();
+    }
+
+    // Installs the idle source driving DeliverSpan(), if it is not already.
+    void ScheduleDelivery();
+
+    // Completes the transfer from an idle callback after a failure detected
+    // in BeginTransfer(), so the delegate is never called re-entrantly.
+    bool SignalFailure();
+    static gboolean StaticSignalFailure(gpointer data)
+    {
+        return reinterpret_cast<FileHttpFetcher *>(data)->SignalFailure();
+    }
+
+    // Closes the file and removes the idle source, if any.
+    void CleanUp();
+
+    // Cleans up and notifies the delegate that the transfer was terminated.
+    void ForceTransferTermination();
+
+    int fd_;
+    off_t file_size_;
+
+    // The range requested through SetOffset() and SetLength(). A zero length
+    // means until the end of the file.
+    off_t offset_;
+    size_t length_;
+
+    // The next byte to deliver and the end of the current transfer.
+    off_t position_;
+    off_t end_;
+
+    off_t bytes_downloaded_;
+
+    // Holds the span being delivered, kept across the transfers of the
+    // ranges of a download.
+    std::vector<char> buffer_;
+
+    guint idle_source_id_;
+
+    bool transfer_in_progress_;
+
+    // True while the delegate's ReceivedBytes() is running, in which case a
+    // TerminateTransfer() is deferred until the callback returns.
+    bool in_write_callback_;
+    bool terminate_requested_;
+
+    bool paused_;
+
+    DISALLOW_COPY_AND_ASSIGN(FileHttpFetcher);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_FILE_HTTP_FETCHER_H__
@@ -0,0 +1,282 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <glib.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/file_http_fetcher.h"
+#include "update_engine/http_common.h"
+#include "update_engine/multi_range_http_fetcher.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class FileHttpFetcherTest : public ::testing::Test
+{
+protected:
+    virtual void SetUp()
+    {
+        // The last span is partial.
+        data_.resize(FileHttpFetcher::kMaxSpanSize * 2 + 12345);
+        FillWithData(&data_);
+        ASSERT_TRUE(utils::MakeTempFile("/tmp/FileHttpFetcherTest.XXXXXX",
+                                        &path_,
+                                        NULL));
+        ASSERT_TRUE(WriteFileVector(path_, data_));
+    }
+
+    virtual void TearDown()
+    {
+        EXPECT_EQ(0, unlink(path_.c_str()));
+    }
+
+    string Url() const
+    {
+        return "file://" + path_;
+    }
+
+    vector<char> data_;
+    string path_;
+};
+
+namespace {
+class FileHttpFetcherTestDelegate : public HttpFetcherDelegate
+{
+public:
+    FileHttpFetcherTestDelegate()
+        : loop_(NULL),
+          pause_after_span_(false),
+          terminate_after_span_(false),
+          truncate_after_span_(false),
+          completed_(false),
+          successful_(false),
+          terminated_(false),
+          spans_(0) {}
+
+    virtual void ReceivedBytes(HttpFetcher *fetcher,
+                               const char *bytes, int length)
+    {
+        EXPECT_LE(static_cast<size_t>(length), FileHttpFetcher::kMaxSpanSize);
+        data_.insert(data_.end(), bytes, bytes + length);
+        spans_++;
+
+        if (pause_after_span_) {
+            fetcher->Pause();
+            g_timeout_add(10, StaticUnpause, fetcher);
+        }
+
+        if (terminate_after_span_) {
+            fetcher->TerminateTransfer();
+        }
+
+        if (truncate_after_span_) {
+            // Cut the file in the middle of the next span.
+            EXPECT_EQ(0, truncate(truncate_path_.c_str(), data_.size() + 10));
+            truncate_after_span_ = false;
+        }
+
+        if (!switch_url_.empty()) {
+            MultiRangeHttpFetcher *multi_fetcher =
+                static_cast<MultiRangeHttpFetcher *>(fetcher);
+            multi_fetcher->SwitchUrl(switch_url_);
+            switch_url_.clear();
+        }
+    }
+
+    virtual void TransferComplete(HttpFetcher *fetcher, bool successful)
+    {
+        completed_ = true;
+        successful_ = successful;
+        g_main_loop_quit(loop_);
+    }
+
+    virtual void TransferTerminated(HttpFetcher *fetcher)
+    {
+        terminated_ = true;
+        g_main_loop_quit(loop_);
+    }
+
+    static gboolean StaticUnpause(gpointer data)
+    {
+        reinterpret_cast<HttpFetcher *>(data)->Unpause();
+        return FALSE;
+    }
+
+    GMainLoop *loop_;
+    bool pause_after_span_;
+    bool terminate_after_span_;
+    bool truncate_after_span_;
+    string truncate_path_;
+    bool completed_;
+    bool successful_;
+    bool terminated_;
+    int spans_;
+    vector<char> data_;
+    string switch_url_;  // switch to this URL after the first span
+};
+
+void RunTransfer(HttpFetcher *fetcher,
+                 FileHttpFetcherTestDelegate *delegate,
+                 const string &url)
+{
+    GMainLoop *loop = g_main_loop_new(g_main_context_default(), FALSE);
+    delegate->loop_ = loop;
+    fetcher->set_delegate(delegate);
+    fetcher->BeginTransfer(url);
+    g_main_loop_run(loop);
+    g_main_loop_unref(loop);
+}
+}  // namespace {}
+
+TEST(FileHttpFetcherPathTest, PathForUrlTest)
+{
+    EXPECT_EQ("/foo/bar", FileHttpFetcher::PathForUrl("file:///foo/bar"));
+    EXPECT_EQ("/foo/bar",
+              FileHttpFetcher::PathForUrl("file://localhost/foo/bar"));
+    EXPECT_EQ("", FileHttpFetcher::PathForUrl("file://foo/bar"));
+    EXPECT_EQ("", FileHttpFetcher::PathForUrl("http://127.0.0.1/foo"));
+    EXPECT_EQ("", FileHttpFetcher::PathForUrl(""));
+}
+
+TEST_F(FileHttpFetcherTest, SimpleTest)
+{
+    FileHttpFetcher fetcher;
+    FileHttpFetcherTestDelegate delegate;
+    RunTransfer(&fetcher, &delegate, Url());
+    EXPECT_TRUE(delegate.completed_);
+    EXPECT_TRUE(delegate.successful_);
+    EXPECT_EQ(kHttpResponseOk, fetcher.http_response_code());
+    EXPECT_EQ(3, delegate.spans_);
+    EXPECT_TRUE(delegate.data_ == data_);
+    EXPECT_EQ(data_.size(), fetcher.GetBytesDownloaded());
+}
+
+TEST_F(FileHttpFetcherTest, OffsetAndLengthTest)
+{
+    const off_t kOffset = 4097;
+    const size_t kLength = FileHttpFetcher::kMaxSpanSize + 100;
+    FileHttpFetcher fetcher;
+    FileHttpFetcherTestDelegate delegate;
+    fetcher.SetOffset(kOffset);
+    fetcher.SetLength(kLength);
+    RunTransfer(&fetcher, &delegate, Url());
+    EXPECT_TRUE(delegate.successful_);
+    EXPECT_TRUE(delegate.data_ == vector<char>(data_.begin() + kOffset,
+                                               data_.begin() + kOffset +
+                                               kLength));
+    EXPECT_EQ(static_cast<size_t>(kOffset + kLength),
+              fetcher.GetBytesDownloaded());
+
+    // A length reaching past the end of the file is truncated.
+    delegate.data_.clear();
+    fetcher.SetOffset(data_.size() - 10);
+    fetcher.SetLength(100);
+    RunTransfer(&fetcher, &delegate, Url());
+    EXPECT_TRUE(delegate.successful_);
+    EXPECT_TRUE(delegate.data_ == vector<char>(data_.end() - 10, data_.end()));
+}
+
+TEST_F(FileHttpFetcherTest, ErrorTest)
+{
+    FileHttpFetcher fetcher;
+    FileHttpFetcherTestDelegate delegate;
+    RunTransfer(&fetcher, &delegate, Url() + ".missing");
+    EXPECT_TRUE(delegate.completed_);
+    EXPECT_FALSE(delegate.successful_);
+    EXPECT_EQ(kHttpResponseNotFound, fetcher.http_response_code());
+
+    fetcher.SetOffset(data_.size() + 1);
+    RunTransfer(&fetcher, &delegate, Url());
+    EXPECT_FALSE(delegate.successful_);
+    EXPECT_EQ(kHttpResponseReqRangeNotSat, fetcher.http_response_code());
+    EXPECT_EQ(0, delegate.spans_);
+}
+
+TEST_F(FileHttpFetcherTest, TruncatedTest)
+{
+    FileHttpFetcher fetcher;
+    FileHttpFetcherTestDelegate delegate;
+    delegate.truncate_after_span_ = true;
+    delegate.truncate_path_ = path_;
+    RunTransfer(&fetcher, &delegate, Url());
+    EXPECT_TRUE(delegate.completed_);
+    EXPECT_FALSE(delegate.successful_);
+    EXPECT_EQ(1, delegate.spans_);
+}
+
+TEST_F(FileHttpFetcherTest, PauseTest)
+{
+    FileHttpFetcher fetcher;
+    FileHttpFetcherTestDelegate delegate;
+    delegate.pause_after_span_ = true;
+    RunTransfer(&fetcher, &delegate, Url());
+    EXPECT_TRUE(delegate.successful_);
+    EXPECT_TRUE(delegate.data_ == data_);
+}
+
+TEST_F(FileHttpFetcherTest, TerminateTest)
+{
+    FileHttpFetcher fetcher;
+    FileHttpFetcherTestDelegate delegate;
+    delegate.terminate_after_span_ = true;
+    RunTransfer(&fetcher, &delegate, Url());
+    EXPECT_TRUE(delegate.terminated_);
+    EXPECT_FALSE(delegate.completed_);
+    EXPECT_EQ(1, delegate.spans_);
+}
+
+TEST_F(FileHttpFetcherTest, MultiRangeTest)
+{
+    MultiRangeHttpFetcher fetcher(new FileHttpFetcher);
+    FileHttpFetcherTestDelegate delegate;
+    fetcher.ClearRanges();
+    fetcher.AddRange(0, 100);
+    fetcher.AddRange(FileHttpFetcher::kMaxSpanSize + 1);
+    RunTransfer(&fetcher, &delegate, Url());
+    EXPECT_TRUE(delegate.successful_);
+    vector<char> expected(data_.begin(), data_.begin() + 100);
+    expected.insert(expected.end(),
+                    data_.begin() + FileHttpFetcher::kMaxSpanSize + 1,
+                    data_.end());
+    EXPECT_TRUE(delegate.data_ == expected);
+}
+
+TEST_F(FileHttpFetcherTest, MultiRangeSwitchUrlTest)
+{
+    string other_path;
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/FileHttpFetcherTest.XXXXXX",
+                                    &other_path,
+                                    NULL));
+    ASSERT_TRUE(WriteFileVector(other_path, data_));
+    ScopedPathUnlinker other_path_unlinker(other_path);
+
+    MultiRangeHttpFetcher fetcher(new FileHttpFetcher);
+    FileHttpFetcherTestDelegate delegate;
+    delegate.switch_url_ = "file://" + other_path;
+    fetcher.ClearRanges();
+    fetcher.AddRange(100, FileHttpFetcher::kMaxSpanSize + 100);
+    fetcher.AddRange(FileHttpFetcher::kMaxSpanSize * 2);
+
+    // The first span comes from the original file, the rest of the first
+    // range and the second range from the other one, without gaps.
+    RunTransfer(&fetcher, &delegate, Url());
+    EXPECT_TRUE(delegate.successful_);
+    vector<char> expected(data_.begin() + 100,
+                          data_.begin() + FileHttpFetcher::kMaxSpanSize + 200);
+    expected.insert(expected.end(),
+                    data_.begin() + FileHttpFetcher::kMaxSpanSize * 2,
+                    data_.end());
+    EXPECT_TRUE(delegate.data_ == expected);
+}
+
+}  // namespace chromeos_update_engine
@@ -22,6 +22,7 @@
 #include <glib.h>
 
 #include "update_engine/filesystem_iterator.h"
+#include "update_engine/payload_processor.h"
 #include "update_engine/subprocess.h"
 #include "update_engine/utils.h"
 
@@ -34,6 +35,30 @@ namespace chromeos_update_engine {
 
 namespace {
 const off_t kCopyFileBufferSize = 128 * 1024;
+
+// The scan for applied operations, owned by its task.
+struct AppliedOperationsScan {
+    vector<char> metadata;
+    InstallPlan install_plan;
+    vector<bool> applied_operations;
+};
+
+void RunAppliedOperationsScan(GTask *task,
+                              gpointer source_object,
+                              gpointer task_data,
+                              GCancellable *cancellable)
+{
+    AppliedOperationsScan *scan =
+        reinterpret_cast<AppliedOperationsScan *>(task_data);
+    g_task_return_boolean(task, PayloadProcessor::FindAppliedOperations(
+                              scan->metadata, scan->install_plan,
+                              &scan->applied_operations));
+}
+
+void DeleteAppliedOperationsScan(gpointer data)
+{
+    delete reinterpret_cast<AppliedOperationsScan *>(data);
+}
 }  // namespace {}
 
 FilesystemCopierAction::FilesystemCopierAction(bool verify_hash)
@@ -43,6 +68,8 @@ FilesystemCopierAction::FilesystemCopierAction(bool verify_hash)
       read_done_(false),
       failed_(false),
       cancelled_(false),
+      prefs_(NULL),
+      scan_canceller_(NULL),
       filesystem_size_(std::numeric_limits<int64_t>::max())
 {
     // A lot of code works on the implicit assumption that processing is done on
@@ -82,16 +109,45 @@ void FilesystemCopierAction::PerformAction()
         return;
     }
 
+    vector<char> metadata;
+
+    if (!verify_hash_ && prefs_ &&
+            PayloadProcessor::LoadVerifiedManifest(prefs_,
+                    install_plan_.payload_hash,
+                    verified_manifest_path_,
+                    &metadata)) {
+        // Copying the running system would undo what an earlier attempt
+        // applied of this payload.
+        StartScan(metadata);
+        abort_action_completer.set_should_complete(false);
+        return;
+    }
+
+    if (!StartCopy()) {
+        return;
+    }
+
+    abort_action_completer.set_should_complete(false);
+}
+
+bool FilesystemCopierAction::StartCopy()
+{
     const string source = verify_hash_ ?
                           install_plan_.partition_path : install_plan_.old_partition_path;
     int src_fd = open(source.c_str(), O_RDONLY);
 
     if (src_fd < 0) {
         PLOG(ERROR) << "Unable to open " << source << " for reading:";
-        return;
+        return false;
     }
 
     if (!verify_hash_) {
+        // The copy overwrites what the verified manifest says is applied.
+        if (prefs_) {
+            PayloadProcessor::ResetVerifiedManifest(prefs_,
+                                                    verified_manifest_path_);
+        }
+
         int dst_fd = open(install_plan_.partition_path.c_str(),
                           O_WRONLY | O_TRUNC | O_CREAT,
                           0644);
@@ -100,7 +156,7 @@ void FilesystemCopierAction::PerformAction()
             close(src_fd);
             PLOG(ERROR) << "Unable to open " << install_plan_.partition_path
                         << " for writing:";
-            return;
+            return false;
         }
 
         dst_stream_ = g_unix_output_stream_new(dst_fd, TRUE);
@@ -116,12 +172,68 @@ void FilesystemCopierAction::PerformAction()
 
     // Start the first read.
     SpawnAsyncActions();
+    return true;
+}
 
-    abort_action_completer.set_should_complete(false);
+void FilesystemCopierAction::StartScan(const vector<char> &metadata)
+{
+    AppliedOperationsScan *scan = new AppliedOperationsScan;
+    scan->metadata = metadata;
+    scan->install_plan = install_plan_;
+    scan_canceller_ = g_cancellable_new();
+    GTask *task = g_task_new(NULL, scan_canceller_,
+                             &FilesystemCopierAction::StaticScanDoneCallback,
+                             this);
+    g_task_set_task_data(task, scan, &DeleteAppliedOperationsScan);
+    g_task_run_in_thread(task, &RunAppliedOperationsScan);
+    g_object_unref(task);
+}
+
+void FilesystemCopierAction::ScanDoneCallback(GAsyncResult *res)
+{
+    GTask *task = G_TASK(res);
+    cancelled_ = g_cancellable_is_cancelled(scan_canceller_) == TRUE;
+    g_object_unref(scan_canceller_);
+    scan_canceller_ = NULL;
+
+    if (cancelled_) {
+        return;
+    }
+
+    if (g_task_propagate_boolean(task, NULL)) {
+        AppliedOperationsScan *scan =
+            reinterpret_cast<AppliedOperationsScan *>(g_task_get_task_data(task));
+        LOG(INFO) << "Not copying " << install_plan_.old_partition_path
+                  << ", reapplying the payload verified before";
+        install_plan_.applied_operations.swap(scan->applied_operations);
+
+        if (HasOutputPipe()) {
+            SetOutputObject(install_plan_);
+        }
+
+        processor_->ActionComplete(this, kActionCodeSuccess);
+        return;
+    }
+
+    if (!StartCopy()) {
+        processor_->ActionComplete(this, kActionCodeError);
+    }
+}
+
+void FilesystemCopierAction::StaticScanDoneCallback(GObject *source_object,
+        GAsyncResult *res,
+        gpointer user_data)
+{
+    reinterpret_cast<FilesystemCopierAction *>(user_data)->
+    ScanDoneCallback(res);
 }
 
 void FilesystemCopierAction::TerminateProcessing()
 {
+    if (scan_canceller_) {
+        g_cancellable_cancel(scan_canceller_);
+    }
+
     for (int i = 0; i < 2; i++) {
         if (canceller_[i]) {
             g_cancellable_cancel(canceller_[i]);
@@ -131,7 +243,7 @@ void FilesystemCopierAction::TerminateProcessing()
 
 bool FilesystemCopierAction::IsCleanupPending() const
 {
-    return (src_stream_ != NULL);
+    return (src_stream_ != NULL || scan_canceller_ != NULL);
 }
 
 void FilesystemCopierAction::Cleanup(ActionExitCode code)
@@ -25,6 +25,7 @@
 namespace chromeos_update_engine {
 
 class FilesystemCopierAction;
+class PrefsInterface;
 
 template<>
 class ActionTraits<FilesystemCopierAction>
@@ -48,6 +49,18 @@ public:
     void PerformAction();
     void TerminateProcessing();
 
+    // Lets the copy be skipped when an earlier attempt verified the payload
+    // and left some of it applied: the manifest it cached at
+    // |verified_manifest_path|, if |prefs| say it is of this payload, is
+    // checked against the install partition on a worker thread, see
+    // PayloadProcessor::FindAppliedOperations(). Not used to verify hashes.
+    void set_verified_manifest(PrefsInterface *prefs,
+                               const std::string &verified_manifest_path)
+    {
+        prefs_ = prefs;
+        verified_manifest_path_ = verified_manifest_path;
+    }
+
     // Used for testing. Return true if Cleanup() has not yet been called due
     // to a callback upon the completion or cancellation of the copier action.
     // A test should wait until IsCleanupPending() returns false before
@@ -93,6 +106,20 @@ private:
     // actions asynchronously.
     void SpawnAsyncActions();
 
+    // Opens the partitions and starts copying. Returns false on failure.
+    bool StartCopy();
+
+    // Starts looking for the operations of the verified payload with the
+    // header and manifest |metadata| that are applied already.
+    void StartScan(const std::vector<char> &metadata);
+
+    // Callback from glib when the scan is done. Skips the copy if it found
+    // applied operations, starts it otherwise.
+    void ScanDoneCallback(GAsyncResult *res);
+    static void StaticScanDoneCallback(GObject *source_object,
+                                       GAsyncResult *res,
+                                       gpointer user_data);
+
     // Cleans up all the variables we use for async operations and tells the
     // ActionProcessor we're done w/ |code| as passed in. |cancelled_| should be
     // true if TerminateProcessing() was called.
@@ -133,6 +160,14 @@ private:
     // The install plan we're passed in via the input pipe.
     InstallPlan install_plan_;
 
+    // Where to find the manifest of a payload verified before, if at all.
+    PrefsInterface *prefs_;
+    std::string verified_manifest_path_;
+
+    // The cancellable object of the scan for applied operations while it
+    // runs, NULL otherwise.
+    GCancellable *scan_canceller_;
+
     // Calculates the hash of the copied data.
     OmahaHashCalculator hasher_;
 
@@ -6,130 +6,290 @@
 
 #include <inttypes.h>
 #include <fcntl.h>
+#include <unistd.h>
 
-#include <memory>
+#include <algorithm>
+#include <chrono>
 
 #include "files/scoped_file.h"
 #include "strings/string_printf.h"
 #include "update_engine/bzip.h"
+#include "update_engine/delta_diff_generator.h"
 #include "update_engine/utils.h"
 
-using std::deque;
 using std::max;
 using std::min;
-using std::shared_ptr;
 using std::string;
 using std::vector;
+using std::chrono::steady_clock;
 using strings::StringPrintf;
 
 namespace chromeos_update_engine {
 
 namespace {
-
-// This class encapsulates a full update chunk processing thread. The processor
-// reads a chunk of data from the input file descriptor and compresses it. The
-// processor needs to be started through Start() then waited on through Wait().
-class ChunkProcessor
+// Levels are the bzip2 block size in units of 100 KB.
+const int kBzipBestLevel = 9;
+
+// How many chunks each thread may be ahead of the one being written.
+const size_t kChunksPerThread = 2;
+
+// Reads and compresses the chunks of a file on a pool of threads, which
+// take the chunks in order and hand them back through WaitForChunk() in that
+// order too. Only |window| chunks may be in the pipeline at a time, from the
+// one being read to the one waiting to be written, so a slow chunk holds up
+// the others only once the threads are that far ahead. Each chunk in the
+// pipeline has a slot whose buffers it reuses from the chunk before.
+class ChunkPipeline
 {
 public:
-    // Read a chunk of |size| bytes from |fd| starting at offset |offset|.
-    ChunkProcessor(int fd, off_t offset, size_t size)
-        : thread_(NULL),
-          fd_(fd),
-          offset_(offset),
-          buffer_in_(size) {}
-    ~ChunkProcessor()
-    {
-        Wait();
-    }
+    struct Chunk {
+        size_t index;
+        off_t offset;
+        vector<char> in;
+        vector<char> compressed;
+
+        // Set once the chunk is read and compressed.
+        bool done;
+        bool success;
+        size_t buffer_size;  // capacity of |in| and |compressed| by then
+    };
+
+    ChunkPipeline(int fd,
+                  off_t size,
+                  off_t chunk_size,
+                  const ChunkCompressor &compressor,
+                  size_t window);
+    ~ChunkPipeline();
+
+    // Starts |num_threads| threads. Returns true on success, false on
+    // failure.
+    bool Start(size_t num_threads);
 
-    off_t offset() const
+    // Waits for chunk |index|, which must follow the last one released, and
+    // sets |out_chunk| to it until ReleaseChunk(). Returns true if it was
+    // read and compressed, false otherwise.
+    bool WaitForChunk(size_t index, const Chunk **out_chunk);
+
+    // Frees the slot of the chunk WaitForChunk() returned for another one.
+    void ReleaseChunk();
+
+    // The most memory the buffers of the slots took at once, in bytes.
+    size_t peak_buffer_size() const
     {
-        return offset_;
+        return peak_buffer_size_;
     }
-    const vector<char> &buffer_in() const
-    {
-        return buffer_in_;
+
+private:
+    // Processes chunks until there are none left or the pipeline is
+    // stopped.
+    void ProcessChunks();
+    static gpointer ProcessChunksThread(gpointer data);
+
+    // Reads and compresses |chunk| of |size| bytes. Returns true on success.
+    bool ReadAndCompress(Chunk *chunk, size_t size);
+
+    // Makes the threads stop after their current chunk and waits for them.
+    void Stop();
+
+    const int fd_;
+    const off_t size_;
+    const off_t chunk_size_;
+    const ChunkCompressor &compressor_;
+    const size_t num_chunks_;
+
+    // Chunk i goes in slot i % |slots_.size()|.
+    vector<Chunk> slots_;
+
+    // The next chunk to start, and the first one not released yet.
+    size_t next_chunk_;
+    size_t released_;
+    bool stopping_;
+    size_t peak_buffer_size_;
+
+    // Protects the members above and the done, success and buffer_size
+    // fields of the slots. |chunk_done_| is signalled whenever a chunk is
+    // processed and |slot_free_| whenever one is released or the pipeline
+    // stops.
+    GMutex mutex_;
+    GCond chunk_done_;
+    GCond slot_free_;
+
+    vector<GThread *> threads_;
+
+    DISALLOW_COPY_AND_ASSIGN(ChunkPipeline);
+};
+
+ChunkPipeline::ChunkPipeline(int fd,
+                             off_t size,
+                             off_t chunk_size,
+                             const ChunkCompressor &compressor,
+                             size_t window)
+    : fd_(fd),
+      size_(size),
+      chunk_size_(chunk_size),
+      compressor_(compressor),
+      num_chunks_((size + chunk_size - 1) / chunk_size),
+      slots_(max<size_t>(window, 1)),
+      next_chunk_(0),
+      released_(0),
+      stopping_(false),
+      peak_buffer_size_(0)
+{
+    for (Chunk &chunk : slots_) {
+        chunk.done = false;
+        chunk.success = false;
+        chunk.buffer_size = 0;
     }
-    const vector<char> &buffer_compressed() const
-    {
-        return buffer_compressed_;
+
+    g_mutex_init(&mutex_);
+    g_cond_init(&chunk_done_);
+    g_cond_init(&slot_free_);
+}
+
+ChunkPipeline::~ChunkPipeline()
+{
+    Stop();
+    g_cond_clear(&slot_free_);
+    g_cond_clear(&chunk_done_);
+    g_mutex_clear(&mutex_);
+}
+
+bool ChunkPipeline::Start(size_t num_threads)
+{
+    num_threads = min(num_threads, num_chunks_);
+
+    for (size_t i = 0; i < num_threads; i++) {
+        GThread *thread = g_thread_try_new("chunk_pipeline",
+                                           ProcessChunksThread, this, NULL);
+        TEST_AND_RETURN_FALSE(thread != NULL);
+        threads_.push_back(thread);
     }
 
-    // Starts the processor. Returns true on success, false on failure.
-    bool Start();
+    return true;
+}
 
-    // Waits for the processor to complete. Returns true on success, false on
-    // failure.
-    bool Wait();
+bool ChunkPipeline::WaitForChunk(size_t index, const Chunk **out_chunk)
+{
+    CHECK_EQ(index, released_);
+    Chunk *chunk = &slots_[index % slots_.size()];
+    g_mutex_lock(&mutex_);
 
-    bool ShouldCompress() const
-    {
-        return buffer_compressed_.size() < buffer_in_.size();
+    while (!chunk->done) {
+        g_cond_wait(&chunk_done_, &mutex_);
     }
 
-private:
-    // Reads the input data into |buffer_in_| and compresses it into
-    // |buffer_compressed_|. Returns true on success, false otherwise.
-    bool ReadAndCompress();
-    static gpointer ReadAndCompressThread(gpointer data);
-
-    GThread *thread_;
-    int fd_;
-    off_t offset_;
-    vector<char> buffer_in_;
-    vector<char> buffer_compressed_;
-
-    DISALLOW_COPY_AND_ASSIGN(ChunkProcessor);
-};
+    bool success = chunk->success;
+    g_mutex_unlock(&mutex_);
+    *out_chunk = chunk;
+    return success;
+}
 
-bool ChunkProcessor::Start()
+void ChunkPipeline::ReleaseChunk()
 {
-    // g_thread_create is deprecated since glib 2.32. Use
-    // g_thread_new instead.
-    thread_ = g_thread_try_new("chunk_proc", ReadAndCompressThread, this, NULL);
-    TEST_AND_RETURN_FALSE(thread_ != NULL);
-    return true;
+    g_mutex_lock(&mutex_);
+    slots_[released_ % slots_.size()].done = false;
+    released_++;
+    g_cond_broadcast(&slot_free_);
+    g_mutex_unlock(&mutex_);
 }
 
-bool ChunkProcessor::Wait()
+void ChunkPipeline::Stop()
 {
-    if (!thread_) {
-        return false;
+    g_mutex_lock(&mutex_);
+    stopping_ = true;
+    g_cond_broadcast(&slot_free_);
+    g_mutex_unlock(&mutex_);
+
+    for (GThread *thread : threads_) {
+        g_thread_join(thread);
     }
 
-    gpointer result = g_thread_join(thread_);
-    thread_ = NULL;
-    TEST_AND_RETURN_FALSE(result == this);
-    return true;
+    threads_.clear();
 }
 
-gpointer ChunkProcessor::ReadAndCompressThread(gpointer data)
+gpointer ChunkPipeline::ProcessChunksThread(gpointer data)
 {
-    return
-        reinterpret_cast<ChunkProcessor *>(data)->ReadAndCompress() ? data : NULL;
+    reinterpret_cast<ChunkPipeline *>(data)->ProcessChunks();
+    return NULL;
 }
 
-bool ChunkProcessor::ReadAndCompress()
+void ChunkPipeline::ProcessChunks()
 {
+    for (;;) {
+        g_mutex_lock(&mutex_);
+
+        while (!stopping_ && next_chunk_ < num_chunks_ &&
+                next_chunk_ >= released_ + slots_.size()) {
+            g_cond_wait(&slot_free_, &mutex_);
+        }
+
+        if (stopping_ || next_chunk_ == num_chunks_) {
+            g_mutex_unlock(&mutex_);
+            return;
+        }
+
+        const size_t index = next_chunk_++;
+        g_mutex_unlock(&mutex_);
+
+        // Only this thread touches the slot until the chunk is marked done.
+        Chunk *chunk = &slots_[index % slots_.size()];
+        chunk->index = index;
+        chunk->offset = index * chunk_size_;
+        bool success = ReadAndCompress(
+                           chunk, min(chunk_size_, size_ - chunk->offset));
+        const size_t chunk_buffer_size =
+            chunk->in.capacity() + chunk->compressed.capacity();
+
+        // Other threads may be resizing the buffers of their slots, so only
+        // the sizes they recorded are summed.
+        g_mutex_lock(&mutex_);
+        chunk->done = true;
+        chunk->success = success;
+        chunk->buffer_size = chunk_buffer_size;
+        size_t buffer_size = 0;
+
+        for (const Chunk &slot : slots_) {
+            buffer_size += slot.buffer_size;
+        }
+
+        peak_buffer_size_ = max(peak_buffer_size_, buffer_size);
+        g_cond_broadcast(&chunk_done_);
+        g_mutex_unlock(&mutex_);
+    }
+}
+
+bool ChunkPipeline::ReadAndCompress(Chunk *chunk, size_t size)
+{
+    chunk->in.resize(size);
     ssize_t bytes_read = -1;
-    TEST_AND_RETURN_FALSE(utils::PReadAll(fd_,
-                                          buffer_in_.data(),
-                                          buffer_in_.size(),
-                                          offset_,
-                                          &bytes_read));
-    TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(buffer_in_.size()));
-    TEST_AND_RETURN_FALSE(BzipCompress(buffer_in_, &buffer_compressed_));
+    TEST_AND_RETURN_FALSE(utils::PReadAll(fd_, chunk->in.data(), size,
+                                          chunk->offset, &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(size));
+    TEST_AND_RETURN_FALSE(compressor_.Compress(chunk->in,
+                                               &chunk->compressed));
     return true;
 }
+}  // namespace {}
 
-}  // namespace
+InstallOperation_Type BzipChunkCompressor::type() const
+{
+    return InstallOperation_Type_REPLACE_BZ;
+}
+
+bool BzipChunkCompressor::Compress(const vector<char> &in,
+                                   vector<char> *out) const
+{
+    return BzipCompress(in, level_, out);
+}
 
 FullUpdateGenerator::FullUpdateGenerator(
     int fd, off_t chunk_size, off_t block_size)
     : fd_(fd),
       chunk_size_(chunk_size),
       block_size_(block_size),
+      default_compressor_(kBzipBestLevel),
+      compressor_(&default_compressor_),
+      max_threads_(max(sysconf(_SC_NPROCESSORS_ONLN), 1L)),
       data_file_size_(0)
 {
     CHECK(chunk_size_ > 0);
@@ -169,56 +329,46 @@ bool FullUpdateGenerator::Add(const string &path,
 bool FullUpdateGenerator::Add(const string &path, off_t size,
                               vector<InstallOperation> *ops)
 {
-
-    size_t max_threads = max(sysconf(_SC_NPROCESSORS_ONLN), 4L);
-    LOG(INFO) << "Max threads: " << max_threads;
-
     TEST_AND_RETURN_FALSE(size >= 0 && size <= utils::FileSize(path));
+    TEST_AND_RETURN_FALSE(max_threads_ > 0);
 
     LOG(INFO) << "compressing " << path;
     int in_fd = open(path.c_str(), O_RDONLY, 0);
     TEST_AND_RETURN_FALSE(in_fd >= 0);
     files::ScopedFD in_fd_closer(in_fd);
-    deque<shared_ptr<ChunkProcessor>> threads;
+    const size_t num_chunks = (size + chunk_size_ - 1) / chunk_size_;
+    const size_t num_threads = min(max_threads_, max<size_t>(num_chunks, 1));
+    const steady_clock::time_point start = steady_clock::now();
+    ChunkPipeline pipeline(in_fd, size, chunk_size_, *compressor_,
+                           num_threads * kChunksPerThread);
+    TEST_AND_RETURN_FALSE(pipeline.Start(num_threads));
     int last_progress_update = INT_MIN;
-    off_t bytes_left = size, offset = 0;
-
-    while (bytes_left > 0 || !threads.empty()) {
-        // Check and start new chunk processors if possible.
-        while (threads.size() < max_threads && bytes_left > 0) {
-            shared_ptr<ChunkProcessor> processor(
-                new ChunkProcessor(in_fd, offset, min(bytes_left, chunk_size_)));
-            threads.push_back(processor);
-            TEST_AND_RETURN_FALSE(processor->Start());
-            bytes_left -= chunk_size_;
-            offset += chunk_size_;
-        }
 
-        // Need to wait for a chunk processor to complete and process its ouput
-        // before spawning new processors.
-        shared_ptr<ChunkProcessor> processor = threads.front();
-        threads.pop_front();
-        TEST_AND_RETURN_FALSE(processor->Wait());
+    for (size_t i = 0; i < num_chunks; i++) {
+        const ChunkPipeline::Chunk *chunk = NULL;
+        TEST_AND_RETURN_FALSE(pipeline.WaitForChunk(i, &chunk));
 
         ops->resize(ops->size() + 1);
         InstallOperation &op = ops->back();
 
-        const bool compress = processor->ShouldCompress();
-        const vector<char> &use_buf =
-            compress ? processor->buffer_compressed() : processor->buffer_in();
+        const bool compress = chunk->compressed.size() < chunk->in.size();
+        const vector<char> &use_buf = compress ? chunk->compressed : chunk->in;
         op.set_type(compress ?
-                    InstallOperation_Type_REPLACE_BZ :
+                    compressor_->type() :
                     InstallOperation_Type_REPLACE);
         op.set_data_offset(data_file_size_);
         TEST_AND_RETURN_FALSE(utils::WriteAll(fd_, &use_buf[0], use_buf.size()));
         data_file_size_ += use_buf.size();
         op.set_data_length(use_buf.size());
+        TEST_AND_RETURN_FALSE(
+            DeltaDiffGenerator::AddOperationHash(&op, use_buf));
         Extent *dst_extent = op.add_dst_extents();
-        dst_extent->set_start_block(processor->offset() / block_size_);
+        dst_extent->set_start_block(chunk->offset / block_size_);
         dst_extent->set_num_blocks(chunk_size_ / block_size_);
 
         int progress = static_cast<int>(
-                           (processor->offset() + processor->buffer_in().size()) * 100.0 / size);
+                           (chunk->offset + chunk->in.size()) * 100.0 / size);
+        pipeline.ReleaseChunk();
 
         if (last_progress_update < progress &&
                 (last_progress_update + 10 <= progress || progress == 100)) {
@@ -228,6 +378,14 @@ bool FullUpdateGenerator::Add(const string &path, off_t size,
         }
     }
 
+    const double seconds =
+        std::chrono::duration<double>(steady_clock::now() - start).count();
+    LOG(INFO) << StringPrintf("Compressed %.1f MiB in %.2f s (%.1f MiB/s) on "
+                              "%zu threads; buffers peaked at %.1f MiB",
+                              size / 1048576.0, seconds,
+                              seconds > 0 ? size / 1048576.0 / seconds : 0,
+                              num_threads,
+                              pipeline.peak_buffer_size() / 1048576.0);
     return true;
 }
 
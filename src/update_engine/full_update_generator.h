@@ -7,15 +7,66 @@
 
 #include <glib.h>
 
+#include <string>
+#include <vector>
+
 #include "update_engine/graph_types.h"
 
 namespace chromeos_update_engine {
 
+// Compresses the chunks of a full update. Compress() may be called from
+// several threads at once.
+class ChunkCompressor
+{
+public:
+    virtual ~ChunkCompressor() {}
+
+    // The type of the operations for chunks Compress() makes smaller.
+    virtual InstallOperation_Type type() const = 0;
+
+    // Replaces the contents of |out| with |in| compressed. |out| may hold a
+    // previous chunk, whose buffer should be reused. Returns true on
+    // success.
+    virtual bool Compress(const std::vector<char> &in,
+                          std::vector<char> *out) const = 0;
+};
+
+// Compresses chunks with bzip2 at |level|, from 1 to 9, for REPLACE_BZ
+// operations.
+class BzipChunkCompressor : public ChunkCompressor
+{
+public:
+    explicit BzipChunkCompressor(int level) : level_(level) {}
+
+    virtual InstallOperation_Type type() const;
+    virtual bool Compress(const std::vector<char> &in,
+                          std::vector<char> *out) const;
+
+private:
+    const int level_;
+
+    DISALLOW_COPY_AND_ASSIGN(BzipChunkCompressor);
+};
+
 class FullUpdateGenerator
 {
 public:
     FullUpdateGenerator(int fd, off_t chunk_size, off_t block_size);
 
+    // Compresses chunks with |compressor| rather than bzip2 at its best
+    // level. The compressor is not owned.
+    void set_compressor(const ChunkCompressor *compressor)
+    {
+        compressor_ = compressor;
+    }
+
+    // Compresses up to |max_threads| chunks at once, rather than one for
+    // each processor.
+    void set_max_threads(size_t max_threads)
+    {
+        max_threads_ = max_threads;
+    }
+
     // Reads a new rootfs (|new_image|), creating a full update of chunk_size
     // chunks. Populates |graph| and |final_order| with data about the update
     // operations, and writes relevant data to |fd|, updating |data_file_size| as
@@ -50,6 +101,10 @@ private:
     // Basic unit use for data sizes/lengths in the manifest.
     off_t block_size_;
 
+    BzipChunkCompressor default_compressor_;
+    const ChunkCompressor *compressor_;
+    size_t max_threads_;
+
     // Amount of data written so far.
     off_t data_file_size_;
 
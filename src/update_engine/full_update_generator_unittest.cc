@@ -8,8 +8,10 @@
 #include <gtest/gtest.h>
 
 #include "files/scoped_file.h"
+#include "update_engine/bzip.h"
 #include "update_engine/full_update_generator.h"
 #include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
 
 using std::string;
 using std::vector;
@@ -112,4 +114,74 @@ TEST(FullUpdateGeneratorTest, RunTest)
     EXPECT_EQ(out_offset, utils::FileSize(out_blobs_path));
 }
 
+// Checks that the payload doesn't depend on the number of threads, and that
+// chunks compressed at any level decompress to the input.
+TEST(FullUpdateGeneratorTest, ThreadsAndLevelsTest)
+{
+    const off_t kChunkSize = 128 * 1024;
+    vector<char> new_root(10 * kChunkSize + 3 * kBlockSize);
+    FillWithData(&new_root);
+
+    string new_root_path;
+    EXPECT_TRUE(utils::MakeTempFile("/tmp/NewFullUpdateTest_R.XXXXXX",
+                                    &new_root_path,
+                                    NULL));
+    ScopedPathUnlinker new_root_path_unlinker(new_root_path);
+    EXPECT_TRUE(WriteFileVector(new_root_path, new_root));
+
+    const struct {
+        size_t max_threads;
+        int level;
+    } kConfigs[] = {{1, 9}, {3, 9}, {16, 9}, {2, 1}};
+    vector<char> first_blobs;
+
+    for (size_t c = 0; c < arraysize(kConfigs); c++) {
+        string out_blobs_path;
+        int out_blobs_fd;
+        EXPECT_TRUE(utils::MakeTempFile("/tmp/NewFullUpdateTest_D.XXXXXX",
+                                        &out_blobs_path,
+                                        &out_blobs_fd));
+        ScopedPathUnlinker out_blobs_path_unlinker(out_blobs_path);
+        files::ScopedFD out_blobs_fd_closer(out_blobs_fd);
+
+        BzipChunkCompressor compressor(kConfigs[c].level);
+        FullUpdateGenerator generator(out_blobs_fd, kChunkSize, kBlockSize);
+        generator.set_compressor(&compressor);
+        generator.set_max_threads(kConfigs[c].max_threads);
+        vector<InstallOperation> ops;
+        EXPECT_TRUE(generator.Add(new_root_path, &ops));
+        ASSERT_EQ(11, ops.size()) << "config " << c;
+
+        vector<char> blobs;
+        EXPECT_TRUE(utils::ReadFile(out_blobs_path, &blobs));
+        EXPECT_EQ(generator.Size(), blobs.size());
+
+        if (c == 0) {
+            first_blobs = blobs;
+        } else if (kConfigs[c].level == kConfigs[0].level) {
+            EXPECT_TRUE(first_blobs == blobs) << "config " << c;
+        }
+
+        vector<char> contents;
+
+        for (const InstallOperation &op : ops) {
+            vector<char> data(blobs.begin() + op.data_offset(),
+                              blobs.begin() + op.data_offset() +
+                              op.data_length());
+
+            if (op.type() == InstallOperation_Type_REPLACE_BZ) {
+                vector<char> decompressed;
+                EXPECT_TRUE(BzipDecompress(data, &decompressed));
+                data.swap(decompressed);
+            } else {
+                EXPECT_EQ(InstallOperation_Type_REPLACE, op.type());
+            }
+
+            contents.insert(contents.end(), data.begin(), data.end());
+        }
+
+        EXPECT_TRUE(new_root == contents) << "config " << c;
+    }
+}
+
 }  // namespace chromeos_update_engine
@@ -8,6 +8,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#include <memory>
 #include <set>
 #include <string>
 #include <vector>
@@ -22,6 +23,9 @@
 #include "strings/string_number_conversions.h"
 #include "strings/string_split.h"
 #include "update_engine/delta_diff_generator.h"
+#include "update_engine/diff_cache.h"
+#include "update_engine/generator_profile.h"
+#include "update_engine/payload_inspector.h"
 #include "update_engine/payload_processor.h"
 #include "update_engine/payload_signer.h"
 #include "update_engine/prefs.h"
@@ -31,9 +35,12 @@
 #include "update_engine/utils.h"
 
 DEFINE_string(old_dir, "",
-              "Directory where the old partition is loop mounted read-only");
+              "Directory where the old partition is loop mounted read-only, "
+              "if at all; without old_dir and new_dir the files are read "
+              "from the ext2 images");
 DEFINE_string(new_dir, "",
-              "Directory where the new partition is loop mounted read-only");
+              "Directory where the new partition is loop mounted read-only, "
+              "if at all");
 DEFINE_string(old_image, "", "Path to the old partition");
 DEFINE_string(new_image, "", "Path to the new partition");
 DEFINE_string(old_kernel, "", "Path to the old kernel image");
@@ -49,6 +56,34 @@ DEFINE_string(public_key, "", "Path to public key in .pem format");
 DEFINE_int32(public_key_version,
              chromeos_update_engine::kSignatureMessageCurrentVersion,
              "Key-check version # of client");
+DEFINE_string(diff_cache_dir, "",
+              "Directory caching the diffs of file contents across runs, "
+              "e.g. when generating deltas from many old versions");
+DEFINE_int64(diff_cache_size, 4096,
+             "Size limit of the diff cache in MiB, used with diff_cache_dir");
+DEFINE_int64(max_op_size, 64,
+             "Size limit of the operations of a delta in MiB; bigger files "
+             "are split into operations of that size. 0 for no limit");
+DEFINE_string(profile_out, "",
+              "Path to write a JSON report of where generating the payload "
+              "spent its time and bytes to");
+DEFINE_int32(full_compression_level, 9,
+             "bzip2 level, from 1 to 9, of the chunks of a full update; "
+             "lower levels use less memory");
+DEFINE_string(inspect_payload, "",
+              "Path to a payload to print the operations of and estimate "
+              "the time to apply on a device of the --device_*_mbps speeds");
+DEFINE_double(device_read_mbps, 40,
+              "Speed the device reads its partitions at, in MB/s");
+DEFINE_double(device_write_mbps, 15,
+              "Speed the device writes its partitions at, in MB/s");
+DEFINE_double(device_decompress_mbps, 10,
+              "Speed the device decompresses bzip2 data at, in MB/s of output");
+DEFINE_double(device_bspatch_mbps, 5,
+              "Speed the device applies bsdiff patches at, in MB/s of output");
+DEFINE_double(max_apply_seconds, 0,
+              "With inspect_payload, fail if the payload is estimated to take "
+              "longer to apply. 0 for no limit");
 DEFINE_string(prefs_dir, "/tmp/update_engine_prefs",
               "Preferences directory, used with apply_delta");
 DEFINE_string(signature_size, "",
@@ -221,6 +256,41 @@ void ApplyDelta()
     LOG(INFO) << "Done applying delta.";
 }
 
+// Returns 0 if the payload of --inspect_payload can be read and is estimated
+// to apply within --max_apply_seconds, 1 otherwise.
+int InspectPayload()
+{
+    DeltaArchiveManifest manifest;
+    uint64_t metadata_size = 0;
+
+    if (!PayloadInspector::ReadManifest(FLAGS_inspect_payload, &manifest,
+                                        &metadata_size)) {
+        return 1;
+    }
+
+    PayloadStats stats;
+    PayloadInspector::GetStats(manifest, metadata_size, &stats);
+    DeviceProfile profile;
+    profile.read_mbps = FLAGS_device_read_mbps;
+    profile.write_mbps = FLAGS_device_write_mbps;
+    profile.decompress_mbps = FLAGS_device_decompress_mbps;
+    profile.bspatch_mbps = FLAGS_device_bspatch_mbps;
+    LOG_IF(FATAL, profile.read_mbps <= 0 || profile.write_mbps <= 0 ||
+           profile.decompress_mbps <= 0 || profile.bspatch_mbps <= 0)
+            << "Device speeds must be positive";
+    const ApplyCost cost = PayloadInspector::EstimateApplyCost(stats, profile);
+    PayloadInspector::Print(stats, cost, stdout);
+
+    if (FLAGS_max_apply_seconds > 0 &&
+            cost.total_seconds() > FLAGS_max_apply_seconds) {
+        LOG(ERROR) << "Payload is estimated to take " << cost.total_seconds()
+                   << " s to apply, more than " << FLAGS_max_apply_seconds;
+        return 1;
+    }
+
+    return 0;
+}
+
 int Main(int argc, char **argv)
 {
     // Disable glog's default behavior of logging to files.
@@ -261,6 +331,10 @@ int Main(int argc, char **argv)
         return 0;
     }
 
+    if (!FLAGS_inspect_payload.empty()) {
+        return InspectPayload();
+    }
+
     if (!FLAGS_in_file.empty()) {
         ApplyDelta();
         return 0;
@@ -273,25 +347,63 @@ int Main(int argc, char **argv)
         LOG(INFO) << "Generating full update";
     } else {
         LOG(INFO) << "Generating delta update";
-        CHECK(!FLAGS_old_dir.empty());
-        CHECK(!FLAGS_new_dir.empty());
+        CHECK_EQ(FLAGS_old_dir.empty(), FLAGS_new_dir.empty())
+                << "Pass both old_dir and new_dir, or neither";
 
-        if ((!IsDir(FLAGS_old_dir.c_str())) || (!IsDir(FLAGS_new_dir.c_str()))) {
+        if (!FLAGS_old_dir.empty() &&
+                ((!IsDir(FLAGS_old_dir.c_str())) ||
+                 (!IsDir(FLAGS_new_dir.c_str())))) {
             LOG(FATAL) << "old_dir or new_dir not directory";
         }
     }
 
+    std::unique_ptr<DiffCache> diff_cache;
+
+    if (!FLAGS_diff_cache_dir.empty()) {
+        diff_cache.reset(new DiffCache(FLAGS_diff_cache_dir,
+                                       FLAGS_diff_cache_size * 1024 * 1024));
+        LOG_IF(FATAL, !diff_cache->Init()) << "Unable to use diff cache "
+                                           << FLAGS_diff_cache_dir;
+        DeltaDiffGenerator::set_diff_cache(diff_cache.get());
+    }
+
+    LOG_IF(FATAL, FLAGS_max_op_size < 0) << "Invalid max_op_size";
+    DeltaDiffGenerator::set_max_op_size(FLAGS_max_op_size * 1024 * 1024);
+
+    LOG_IF(FATAL, FLAGS_full_compression_level < 1 ||
+           FLAGS_full_compression_level > 9) << "Invalid full_compression_level";
+    DeltaDiffGenerator::set_full_compression_level(
+        FLAGS_full_compression_level);
+
+    std::unique_ptr<GeneratorProfile> profile;
+
+    if (!FLAGS_profile_out.empty()) {
+        profile.reset(new GeneratorProfile);
+        DeltaDiffGenerator::set_profile(profile.get());
+    }
+
     uint64_t metadata_size;
+    bool success;
+    {
+        ScopedPhaseTimer timer(profile.get(), "GenerateDeltaUpdateFile");
+        success = DeltaDiffGenerator::GenerateDeltaUpdateFile(FLAGS_old_dir,
+                  FLAGS_old_image,
+                  FLAGS_new_dir,
+                  FLAGS_new_image,
+                  FLAGS_old_kernel,
+                  FLAGS_new_kernel,
+                  FLAGS_out_file,
+                  FLAGS_private_key,
+                  &metadata_size);
+    }
+
+    if (profile) {
+        DeltaDiffGenerator::set_profile(NULL);
+        LOG_IF(ERROR, !profile->WriteJson(FLAGS_profile_out))
+                << "Unable to write profile to " << FLAGS_profile_out;
+    }
 
-    if (!DeltaDiffGenerator::GenerateDeltaUpdateFile(FLAGS_old_dir,
-            FLAGS_old_image,
-            FLAGS_new_dir,
-            FLAGS_new_image,
-            FLAGS_old_kernel,
-            FLAGS_new_kernel,
-            FLAGS_out_file,
-            FLAGS_private_key,
-            &metadata_size)) {
+    if (!success) {
         return 1;
     }
 
@@ -0,0 +1,262 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/generator_profile.h"
+
+#include <inttypes.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "strings/string_printf.h"
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+using strings::StringPrintf;
+
+namespace chromeos_update_engine {
+
+namespace {
+// Returns the length of the valid UTF-8 sequence that starts at |pos| in
+// |str|, or 0 if the bytes there aren't one: a stray continuation byte, a
+// truncated sequence, an overlong form, a surrogate or a code point past
+// U+10FFFF.
+size_t Utf8SequenceLength(const string &str, size_t pos)
+{
+    unsigned char lead = str[pos];
+    size_t length;
+    uint32_t code_point;
+    uint32_t min_code_point;
+
+    if (lead < 0x80) {
+        return 1;
+    } else if ((lead & 0xe0) == 0xc0) {
+        length = 2;
+        code_point = lead & 0x1f;
+        min_code_point = 0x80;
+    } else if ((lead & 0xf0) == 0xe0) {
+        length = 3;
+        code_point = lead & 0x0f;
+        min_code_point = 0x800;
+    } else if ((lead & 0xf8) == 0xf0) {
+        length = 4;
+        code_point = lead & 0x07;
+        min_code_point = 0x10000;
+    } else {
+        return 0;
+    }
+
+    if (pos + length > str.size()) {
+        return 0;
+    }
+
+    for (size_t i = 1; i < length; i++) {
+        unsigned char c = str[pos + i];
+
+        if ((c & 0xc0) != 0x80) {
+            return 0;
+        }
+
+        code_point = (code_point << 6) | (c & 0x3f);
+    }
+
+    if (code_point < min_code_point || code_point > 0x10ffff ||
+            (code_point >= 0xd800 && code_point <= 0xdfff)) {
+        return 0;
+    }
+
+    return length;
+}
+
+// Returns |str| as a JSON string, quotes included. Paths are bytes, not
+// necessarily UTF-8; the bytes that aren't part of valid UTF-8 are written
+// as \u00XX so that the output stays valid JSON.
+string JsonString(const string &str)
+{
+    string json = "\"";
+
+    for (size_t i = 0; i < str.size();) {
+        unsigned char c = str[i];
+        size_t length = Utf8SequenceLength(str, i);
+
+        if (length == 0 || c < 0x20) {
+            json += StringPrintf("\\u%04x", c);
+            i++;
+        } else if (c == '"' || c == '\\') {
+            json += '\\';
+            json += c;
+            i++;
+        } else {
+            json.append(str, i, length);
+            i += length;
+        }
+    }
+
+    return json + "\"";
+}
+
+// Returns the peak resident set size of the process so far, in bytes, or 0
+// if it can't be had.
+uint64_t PeakRssBytes()
+{
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024;  // from KiB
+}
+}  // namespace {}
+
+GeneratorProfile::GeneratorProfile()
+    : vertices_(0),
+      edges_(0),
+      cuts_(0),
+      temp_blocks_(0)
+{
+    g_mutex_init(&mutex_);
+}
+
+GeneratorProfile::~GeneratorProfile()
+{
+    g_mutex_clear(&mutex_);
+}
+
+void GeneratorProfile::AddFile(const File &file)
+{
+    g_mutex_lock(&mutex_);
+    files_.push_back(file);
+    g_mutex_unlock(&mutex_);
+}
+
+vector<GeneratorProfile::File> GeneratorProfile::files() const
+{
+    g_mutex_lock(&mutex_);
+    const vector<File> files = files_;
+    g_mutex_unlock(&mutex_);
+    return files;
+}
+
+void GeneratorProfile::AddPhase(const string &name, double seconds)
+{
+    Phase phase;
+    phase.name = name;
+    phase.seconds = seconds;
+    phases_.push_back(phase);
+}
+
+void GeneratorProfile::AddPayloadObject(const PayloadObject &object)
+{
+    payload_objects_.push_back(object);
+}
+
+void GeneratorProfile::SetGraphSize(uint64_t vertices, uint64_t edges)
+{
+    vertices_ = vertices;
+    edges_ = edges;
+}
+
+void GeneratorProfile::SetCuts(uint64_t cuts, uint64_t temp_blocks)
+{
+    cuts_ = cuts;
+    temp_blocks_ = temp_blocks;
+}
+
+bool GeneratorProfile::WriteJson(const string &path) const
+{
+    g_mutex_lock(&mutex_);
+    vector<File> files = files_;
+    g_mutex_unlock(&mutex_);
+
+    // The files are added in whatever order the threads finish them.
+    std::sort(files.begin(), files.end(), [](const File &a, const File &b) {
+        return a.path != b.path ? a.path < b.path :
+               a.chunk_offset < b.chunk_offset;
+    });
+
+    string json = StringPrintf("{\n  \"peak_rss_bytes\": %" PRIu64 ",\n",
+                               PeakRssBytes());
+
+    json += "  \"phases\": [";
+
+    for (size_t i = 0; i < phases_.size(); i++) {
+        json += StringPrintf("%s\n    {\"name\": %s, \"seconds\": %.6f}",
+                             i ? "," : "",
+                             JsonString(phases_[i].name).c_str(),
+                             phases_[i].seconds);
+    }
+
+    json += "\n  ],\n";
+    json += StringPrintf("  \"graph\": {\"vertices\": %" PRIu64 ", "
+                         "\"edges\": %" PRIu64 ", \"cuts\": %" PRIu64 ", "
+                         "\"temp_blocks\": %" PRIu64 "},\n",
+                         vertices_, edges_, cuts_, temp_blocks_);
+
+    json += "  \"files\": [";
+
+    for (size_t i = 0; i < files.size(); i++) {
+        const File &file = files[i];
+        json += StringPrintf("%s\n    {\"path\": %s, \"chunk_offset\": %jd, "
+                             "\"read_seconds\": %.6f, "
+                             "\"compress_seconds\": %.6f, "
+                             "\"bsdiff_seconds\": %.6f, "
+                             "\"bzip_skipped\": %s, "
+                             "\"bsdiff_skipped\": %s, \"type\": %s, "
+                             "\"raw_size\": %" PRIu64 ", "
+                             "\"blob_size\": %" PRIu64 "}",
+                             i ? "," : "",
+                             JsonString(file.path).c_str(),
+                             static_cast<intmax_t>(file.chunk_offset),
+                             file.read_seconds,
+                             file.compress_seconds,
+                             file.bsdiff_seconds,
+                             file.bzip_skipped ? "true" : "false",
+                             file.bsdiff_skipped ? "true" : "false",
+                             JsonString(InstallOperation_Type_Name(
+                                            file.type)).c_str(),
+                             file.raw_size,
+                             file.blob_size);
+    }
+
+    json += "\n  ],\n";
+
+    uint64_t total_size = 0;
+    json += "  \"payload\": {\n    \"objects\": [";
+
+    for (size_t i = 0; i < payload_objects_.size(); i++) {
+        const PayloadObject &object = payload_objects_[i];
+        const string type =
+            object.type.empty() ? "null" : JsonString(object.type);
+        json += StringPrintf("%s\n      {\"name\": %s, \"type\": %s, "
+                             "\"size\": %" PRIu64 "}",
+                             i ? "," : "",
+                             JsonString(object.name).c_str(),
+                             type.c_str(),
+                             object.size);
+        total_size += object.size;
+    }
+
+    json += StringPrintf("\n    ],\n    \"total_size\": %" PRIu64
+                         "\n  }\n}\n",
+                         total_size);
+
+    TEST_AND_RETURN_FALSE(utils::WriteFile(path.c_str(), json.data(),
+                                           json.size()));
+    return true;
+}
+
+ScopedPhaseTimer::~ScopedPhaseTimer()
+{
+    if (profile_) {
+        profile_->AddPhase(name_, std::chrono::duration<double>(
+                               std::chrono::steady_clock::now() - start_)
+                           .count());
+    }
+}
+
+}  // namespace chromeos_update_engine
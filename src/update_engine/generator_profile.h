@@ -0,0 +1,112 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_GENERATOR_PROFILE_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_GENERATOR_PROFILE_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <glib.h>
+
+#include "macros.h"
+#include "update_engine/update_metadata.pb.h"
+
+// A GeneratorProfile records where the time and bytes of generating a
+// payload go: each file diffed, each phase of the generator, the size of the
+// graph and how the payload breaks down, as ReportPayloadUsage() prints it.
+// WriteJson() writes it all out, along with the peak RSS of the process, for
+// tools to find the files and phases that cost the most. Files may be added
+// from multiple threads at once.
+
+namespace chromeos_update_engine {
+
+class GeneratorProfile
+{
+public:
+    // A file, or a chunk of one, as diffed by ReadFileToDiff().
+    struct File {
+        std::string path;
+        off_t chunk_offset;
+        double read_seconds;
+        double compress_seconds;  // including sampling
+        double bsdiff_seconds;
+        bool bzip_skipped;  // after sampling showed bsdiff would win
+        bool bsdiff_skipped;  // as the old data is too small to help
+        InstallOperation_Type type;
+        uint64_t raw_size;  // of the new data
+        uint64_t blob_size;  // of the operation's data in the payload
+    };
+
+    // An item of the payload, as in ReportPayloadUsage().
+    struct PayloadObject {
+        std::string name;
+        std::string type;  // empty for metadata
+        uint64_t size;
+    };
+
+    GeneratorProfile();
+    ~GeneratorProfile();
+
+    void AddFile(const File &file);
+
+    // Returns the files added so far, in the order they were added.
+    std::vector<File> files() const;
+    void AddPhase(const std::string &name, double seconds);
+    void AddPayloadObject(const PayloadObject &object);
+
+    // The graph once its edges are created, and the cuts made to break its
+    // cycles.
+    void SetGraphSize(uint64_t vertices, uint64_t edges);
+    void SetCuts(uint64_t cuts, uint64_t temp_blocks);
+
+    // Writes the profile to |path| as JSON. Returns true on success.
+    bool WriteJson(const std::string &path) const;
+
+private:
+    struct Phase {
+        std::string name;
+        double seconds;
+    };
+
+    // Protects |files_|.
+    mutable GMutex mutex_;
+    std::vector<File> files_;
+
+    std::vector<Phase> phases_;
+    std::vector<PayloadObject> payload_objects_;
+    uint64_t vertices_;
+    uint64_t edges_;
+    uint64_t cuts_;
+    uint64_t temp_blocks_;
+
+    DISALLOW_COPY_AND_ASSIGN(GeneratorProfile);
+};
+
+// Adds the time from its construction to its destruction to |profile|, if
+// not NULL, as phase |name|.
+class ScopedPhaseTimer
+{
+public:
+    ScopedPhaseTimer(GeneratorProfile *profile, const std::string &name)
+        : profile_(profile),
+          name_(name),
+          start_(std::chrono::steady_clock::now()) {}
+    ~ScopedPhaseTimer();
+
+private:
+    GeneratorProfile *profile_;
+    const std::string name_;
+    const std::chrono::steady_clock::time_point start_;
+
+    DISALLOW_COPY_AND_ASSIGN(ScopedPhaseTimer);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_GENERATOR_PROFILE_H__
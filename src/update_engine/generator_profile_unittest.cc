@@ -0,0 +1,112 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/generator_profile.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+class GeneratorProfileTest : public ::testing::Test {};
+
+TEST(GeneratorProfileTest, WriteJsonTest)
+{
+    GeneratorProfile profile;
+    profile.AddPhase("DeltaReadFiles", 1.5);
+    profile.SetGraphSize(10, 20);
+    profile.SetCuts(2, 3);
+
+    // Files come out sorted, whatever the order they were added in.
+    GeneratorProfile::File file;
+    file.path = "/b";
+    file.chunk_offset = 4096;
+    file.read_seconds = 0.25;
+    file.compress_seconds = 0.5;
+    file.bsdiff_seconds = 0;
+    file.bzip_skipped = true;
+    file.bsdiff_skipped = false;
+    file.type = InstallOperation_Type_REPLACE_BZ;
+    file.raw_size = 8192;
+    file.blob_size = 100;
+    profile.AddFile(file);
+    file.path = "/a \"quoted\"\n";
+    file.chunk_offset = 0;
+    file.type = InstallOperation_Type_BSDIFF;
+    profile.AddFile(file);
+
+    GeneratorProfile::PayloadObject object;
+    object.name = "/b";
+    object.type = "REPLACE_BZ";
+    object.size = 100;
+    profile.AddPayloadObject(object);
+    object.name = "<manifest-metadata>";
+    object.type = "";
+    object.size = 50;
+    profile.AddPayloadObject(object);
+
+    string path;
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/GeneratorProfileTest.XXXXXX",
+                                    &path, NULL));
+    ScopedPathUnlinker path_unlinker(path);
+    EXPECT_TRUE(profile.WriteJson(path));
+
+    string json;
+    EXPECT_TRUE(utils::ReadFile(path, &json));
+    EXPECT_NE(string::npos, json.find("\"peak_rss_bytes\": "));
+    EXPECT_NE(string::npos, json.find(
+                  "{\"name\": \"DeltaReadFiles\", \"seconds\": 1.500000}"));
+    EXPECT_NE(string::npos, json.find(
+                  "\"graph\": {\"vertices\": 10, \"edges\": 20, \"cuts\": 2, "
+                  "\"temp_blocks\": 3}"));
+    EXPECT_NE(string::npos, json.find(
+                  "{\"path\": \"/a \\\"quoted\\\"\\u000a\", "
+                  "\"chunk_offset\": 0, \"read_seconds\": 0.250000, "
+                  "\"compress_seconds\": 0.500000, "
+                  "\"bsdiff_seconds\": 0.000000, \"bzip_skipped\": true, "
+                  "\"bsdiff_skipped\": false, \"type\": \"BSDIFF\", "
+                  "\"raw_size\": 8192, \"blob_size\": 100}"));
+    EXPECT_LT(json.find("\"/a "), json.find("\"/b\", \"chunk_offset\""));
+    EXPECT_NE(string::npos, json.find(
+                  "{\"name\": \"<manifest-metadata>\", \"type\": null, "
+                  "\"size\": 50}"));
+    EXPECT_NE(string::npos, json.find("\"total_size\": 150"));
+}
+
+TEST(GeneratorProfileTest, WriteJsonNonUtf8PathTest)
+{
+    // ext2 paths are bytes: valid UTF-8 is kept as is, the rest is escaped.
+    GeneratorProfile profile;
+    GeneratorProfile::File file;
+    file.path = "/caf\xc3\xa9-\xe9t\xe9-\xc3(\xed\xa0\x80\xf0\x9f\x98";
+    file.chunk_offset = 0;
+    file.read_seconds = 0;
+    file.compress_seconds = 0;
+    file.bsdiff_seconds = 0;
+    file.bzip_skipped = false;
+    file.bsdiff_skipped = false;
+    file.type = InstallOperation_Type_REPLACE;
+    file.raw_size = 4096;
+    file.blob_size = 4096;
+    profile.AddFile(file);
+
+    string path;
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/GeneratorProfileTest.XXXXXX",
+                                    &path, NULL));
+    ScopedPathUnlinker path_unlinker(path);
+    EXPECT_TRUE(profile.WriteJson(path));
+
+    string json;
+    EXPECT_TRUE(utils::ReadFile(path, &json));
+    EXPECT_NE(string::npos, json.find(
+                  "{\"path\": \"/caf\xc3\xa9-\\u00e9t\\u00e9-\\u00c3("
+                  "\\u00ed\\u00a0\\u0080\\u00f0\\u009f\\u0098\", "));
+}
+
+}  // namespace chromeos_update_engine
@@ -5,6 +5,8 @@
 #ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_GRAPH_TYPES_H__
 #define CHROMEOS_PLATFORM_UPDATE_ENGINE_GRAPH_TYPES_H__
 
+#include <sys/types.h>
+
 #include <limits>
 #include <map>
 #include <set>
@@ -22,6 +24,12 @@ namespace chromeos_update_engine {
 
 bool operator==(const Extent &a, const Extent &b);
 
+// A plain copy of an Extent, for where many of them are kept or worked on.
+struct CompactExtent {
+    uint64_t start_block;
+    uint64_t num_blocks;
+};
+
 struct EdgeProperties {
     // Read-before extents. I.e., blocks in |extents| must be read by the
     // node pointed to before the pointing node runs (presumably b/c it
@@ -40,7 +48,12 @@ struct EdgeProperties {
 };
 
 struct Vertex {
-    Vertex() : valid(true), index(-1), lowlink(-1) {}
+    Vertex()
+        : valid(true),
+          index(-1),
+          lowlink(-1),
+          chunk_offset(0),
+          chunk_size(-1) {}
     bool valid;
 
     typedef std::map<std::vector<Vertex>::size_type, EdgeProperties> EdgeMap;
@@ -61,6 +74,11 @@ struct Vertex {
     InstallOperation op;
     std::string file_name;
 
+    // The part of |file_name| that |op| writes: |chunk_size| bytes from
+    // |chunk_offset|, or all of it from there if |chunk_size| is -1.
+    off_t chunk_offset;
+    off_t chunk_size;
+
     typedef std::vector<Vertex>::size_type Index;
     static const Vertex::Index kInvalidIndex = -1;
 };
@@ -36,6 +36,13 @@ uint64_t EdgeWeight(const Graph &graph, const Edge &edge)
 }
 
 void AppendBlockToExtents(vector<Extent> *extents, uint64_t block)
+{
+    AppendBlocksToExtents(extents, block, 1);
+}
+
+void AppendBlocksToExtents(vector<Extent> *extents,
+                           uint64_t start_block,
+                           uint64_t num_blocks)
 {
     // First try to extend the last extent in |extents|, if any.
     if (!extents->empty()) {
@@ -43,22 +50,30 @@ void AppendBlockToExtents(vector<Extent> *extents, uint64_t block)
         uint64_t next_block = extent.start_block() == kSparseHole ?
                               kSparseHole : extent.start_block() + extent.num_blocks();
 
-        if (next_block == block) {
-            extent.set_num_blocks(extent.num_blocks() + 1);
+        if (next_block == start_block) {
+            extent.set_num_blocks(extent.num_blocks() + num_blocks);
             return;
         }
     }
 
-    // If unable to extend the last extent, append a new single-block extent.
+    // If unable to extend the last extent, append a new extent.
     Extent new_extent;
-    new_extent.set_start_block(block);
-    new_extent.set_num_blocks(1);
+    new_extent.set_start_block(start_block);
+    new_extent.set_num_blocks(num_blocks);
     extents->push_back(new_extent);
 }
 
 void AddReadBeforeDep(Vertex *src,
                       Vertex::Index dst,
                       uint64_t block)
+{
+    AddReadBeforeDepBlocks(src, dst, block, 1);
+}
+
+void AddReadBeforeDepBlocks(Vertex *src,
+                            Vertex::Index dst,
+                            uint64_t start_block,
+                            uint64_t num_blocks)
 {
     Vertex::EdgeMap::iterator edge_it = src->out_edges.find(dst);
 
@@ -70,23 +85,16 @@ void AddReadBeforeDep(Vertex *src,
         edge_it = result.first;
     }
 
-    AppendBlockToExtents(&edge_it->second.extents, block);
+    AppendBlocksToExtents(&edge_it->second.extents, start_block, num_blocks);
 }
 
 void AddReadBeforeDepExtents(Vertex *src,
                              Vertex::Index dst,
                              const vector<Extent> &extents)
 {
-    // TODO(adlr): Be more efficient than adding each block individually.
-    for (vector<Extent>::const_iterator it = extents.begin(), e = extents.end();
-            it != e; ++it) {
-        const Extent &extent = *it;
-
-        for (uint64_t block = extent.start_block(),
-                block_end = extent.start_block() + extent.num_blocks();
-                block != block_end; ++block) {
-            AddReadBeforeDep(src, dst, block);
-        }
+    for (const Extent &extent : extents) {
+        AddReadBeforeDepBlocks(src, dst, extent.start_block(),
+                               extent.num_blocks());
     }
 }
 
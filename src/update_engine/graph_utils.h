@@ -24,6 +24,10 @@ uint64_t EdgeWeight(const Graph &graph, const Edge &edge);
 void AddReadBeforeDep(Vertex *src,
                       Vertex::Index dst,
                       uint64_t block);
+void AddReadBeforeDepBlocks(Vertex *src,
+                            Vertex::Index dst,
+                            uint64_t start_block,
+                            uint64_t num_blocks);
 void AddReadBeforeDepExtents(Vertex *src,
                              Vertex::Index dst,
                              const std::vector<Extent> &extents);
@@ -38,6 +42,11 @@ void DropIncomingEdgesTo(Graph *graph, Vertex::Index index);
 // into an arbitrary place in the extents.
 void AppendBlockToExtents(std::vector<Extent> *extents, uint64_t block);
 
+// Same as above, for |num_blocks| blocks from |start_block|.
+void AppendBlocksToExtents(std::vector<Extent> *extents,
+                           uint64_t start_block,
+                           uint64_t num_blocks);
+
 // Get/SetElement are intentionally overloaded so that templated functions
 // can accept either type of collection of Extents.
 Extent GetElement(const std::vector<Extent> &collection, size_t index);
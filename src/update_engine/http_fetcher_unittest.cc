@@ -17,11 +17,13 @@
 #include <gtest/gtest.h>
 
 #include "strings/string_printf.h"
+#include "update_engine/file_http_fetcher.h"
 #include "update_engine/http_common.h"
 #include "update_engine/http_fetcher_unittest.h"
 #include "update_engine/libcurl_http_fetcher.h"
 #include "update_engine/mock_http_fetcher.h"
 #include "update_engine/multi_range_http_fetcher.h"
+#include "update_engine/test_utils.h"
 #include "update_engine/utils.h"
 
 using std::make_pair;
@@ -1158,4 +1160,89 @@ TYPED_TEST(HttpFetcherTest, BlockedTransferTest)
     }
 }
 
+namespace {
+class ThroughputTestDelegate : public HttpFetcherDelegate
+{
+public:
+    ThroughputTestDelegate() : loop_(NULL), bytes_(0), successful_(false) {}
+
+    virtual void ReceivedBytes(HttpFetcher *fetcher,
+                               const char *bytes, int length)
+    {
+        bytes_ += length;
+    }
+    virtual void TransferComplete(HttpFetcher *fetcher, bool successful)
+    {
+        successful_ = successful;
+        g_main_loop_quit(loop_);
+    }
+    virtual void TransferTerminated(HttpFetcher *fetcher)
+    {
+        ADD_FAILURE();
+        g_main_loop_quit(loop_);
+    }
+
+    GMainLoop *loop_;
+    size_t bytes_;
+    bool successful_;
+};
+
+// Fetches |url| and returns the throughput in MiB/s.
+double MeasureThroughput(HttpFetcher *fetcher,
+                         const string &url,
+                         size_t expected_bytes)
+{
+    GMainLoop *loop = g_main_loop_new(g_main_context_default(), FALSE);
+    ThroughputTestDelegate delegate;
+    delegate.loop_ = loop;
+    fetcher->set_delegate(&delegate);
+    StartTransferArgs start_xfer_args = {fetcher, url};
+    const auto start = std::chrono::steady_clock::now();
+    g_timeout_add(0, StartTransfer, &start_xfer_args);
+    g_main_loop_run(loop);
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    g_main_loop_unref(loop);
+    EXPECT_TRUE(delegate.successful_);
+    EXPECT_EQ(expected_bytes, delegate.bytes_);
+    return delegate.bytes_ / elapsed.count() / (1024 * 1024);
+}
+}  // namespace
+
+// Compares reading a payload through FileHttpFetcher with downloading it from
+// test_http_server over loopback. This is a benchmark rather than a test, run
+// it with --gtest_also_run_disabled_tests.
+TEST(HttpFetcherBenchmark, DISABLED_FileVersusLoopbackThroughputTest)
+{
+    const int kLength = 64 * 1024 * 1024;
+    vector<char> data(kLength);
+    FillWithData(&data);
+    string path;
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/HttpFetcherBenchmark.XXXXXX",
+                                    &path,
+                                    NULL));
+    ScopedPathUnlinker path_unlinker(path);
+    ASSERT_TRUE(WriteFileVector(path, data));
+
+    PythonHttpServer server;
+    ASSERT_TRUE(server.started_);
+
+    LibcurlHttpFetcher libcurl_fetcher;
+    libcurl_fetcher.set_idle_seconds(1);
+    libcurl_fetcher.set_retry_seconds(1);
+    libcurl_fetcher.SetBuildType(false);
+    const double loopback_throughput = MeasureThroughput(
+        &libcurl_fetcher,
+        LocalServerUrlForPath(StringPrintf("/download/%d", kLength)),
+        kLength);
+
+    FileHttpFetcher file_fetcher;
+    const double file_throughput =
+        MeasureThroughput(&file_fetcher, "file://" + path, kLength);
+
+    LOG(INFO) << "Loopback HTTP: " << loopback_throughput << " MiB/s, "
+              << "file: " << file_throughput << " MiB/s ("
+              << file_throughput / loopback_throughput << "x)";
+}
+
 }  // namespace chromeos_update_engine
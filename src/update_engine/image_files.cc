@@ -0,0 +1,162 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/image_files.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include "files/scoped_file.h"
+#include "update_engine/extent_mapper.h"
+#include "update_engine/filesystem_iterator.h"
+#include "update_engine/utils.h"
+
+using std::max;
+using std::set;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Reads a file through ImageFiles::ReadChunk(), by its path.
+class PathImageFileReader : public ImageFileReader
+{
+public:
+    PathImageFileReader(const ImageFiles &files, const string &path)
+        : files_(files), path_(path) {}
+
+    virtual bool ReadChunk(off_t offset,
+                           off_t size,
+                           vector<char> *out_p) const
+    {
+        return files_.ReadChunk(path_, offset, size, out_p);
+    }
+
+private:
+    const ImageFiles &files_;
+    const string path_;
+
+    DISALLOW_COPY_AND_ASSIGN(PathImageFileReader);
+};
+
+// Reads a file through a descriptor of it, like utils::ReadFileChunk().
+class FdImageFileReader : public ImageFileReader
+{
+public:
+    explicit FdImageFileReader(int fd) : fd_(fd) {}
+
+    virtual bool ReadChunk(off_t offset,
+                           off_t size,
+                           vector<char> *out_p) const
+    {
+        if (size == -1) {
+            struct stat stbuf;
+            TEST_AND_RETURN_FALSE_ERRNO(fstat(fd_.get(), &stbuf) == 0);
+            size = max(stbuf.st_size - offset, static_cast<off_t>(0));
+        }
+
+        TEST_AND_RETURN_FALSE(offset >= 0 && size >= 0);
+        const size_t start = out_p->size();
+        out_p->resize(start + size);
+        ssize_t bytes_read = -1;
+        TEST_AND_RETURN_FALSE(utils::PReadAll(fd_.get(), out_p->data() + start,
+                                              size, offset, &bytes_read));
+        out_p->resize(start + bytes_read);
+        return true;
+    }
+
+private:
+    files::ScopedFD fd_;
+
+    DISALLOW_COPY_AND_ASSIGN(FdImageFileReader);
+};
+
+}  // namespace {}
+
+bool ImageFiles::OpenFile(const string &path,
+                          unique_ptr<ImageFileReader> *out_reader) const
+{
+    out_reader->reset(new PathImageFileReader(*this, path));
+    return true;
+}
+
+bool MountedImageFiles::ListFiles(vector<ImageFile> *out_files) const
+{
+    FilesystemIterator fs_iter(root_, set<string> {"/lost+found"});
+
+    for (; !fs_iter.IsEnd(); fs_iter.Increment()) {
+        const struct stat stbuf = fs_iter.GetStat();
+
+        if (!S_ISREG(stbuf.st_mode)) {
+            continue;
+        }
+
+        ImageFile file;
+        file.path = fs_iter.GetPartialPath();
+        file.inode = stbuf.st_ino;
+        file.mode = stbuf.st_mode;
+        file.size = stbuf.st_size;
+        out_files->push_back(file);
+    }
+
+    TEST_AND_RETURN_FALSE(!fs_iter.IsErr());
+    return true;
+}
+
+bool MountedImageFiles::GetFile(const string &path,
+                                bool *out_exists,
+                                ImageFile *out_file) const
+{
+    struct stat stbuf;
+
+    if (lstat((root_ + path).c_str(), &stbuf) != 0) {
+        // If stat-ing the file fails, it should be because it doesn't exist.
+        TEST_AND_RETURN_FALSE_ERRNO(errno == ENOTDIR || errno == ENOENT);
+        *out_exists = false;
+        return true;
+    }
+
+    *out_exists = true;
+    out_file->path = path;
+    out_file->inode = stbuf.st_ino;
+    out_file->mode = stbuf.st_mode;
+    out_file->size = stbuf.st_size;
+    return true;
+}
+
+bool MountedImageFiles::ReadChunk(const string &path,
+                                  off_t offset,
+                                  off_t size,
+                                  vector<char> *out_p) const
+{
+    return utils::ReadFileChunk(root_ + path, offset, size, out_p);
+}
+
+bool MountedImageFiles::OpenFile(const string &path,
+                                 unique_ptr<ImageFileReader> *out_reader) const
+{
+    int fd = open((root_ + path).c_str(), O_RDONLY);
+    TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+    out_reader->reset(new FdImageFileReader(fd));
+    return true;
+}
+
+bool MountedImageFiles::GetExtents(const string &path,
+                                   vector<Extent> *out) const
+{
+    return extent_mapper::ExtentsForFile(root_ + path, out);
+}
+
+}  // namespace chromeos_update_engine
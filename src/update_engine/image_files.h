@@ -0,0 +1,110 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_IMAGE_FILES_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_IMAGE_FILES_H__
+
+#include <sys/types.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "macros.h"
+#include "update_engine/update_metadata.pb.h"
+
+// ImageFiles gives the delta generator access to the files of a filesystem
+// image: which files there are, what's in them and which blocks of the image
+// they're in. MountedImageFiles looks at an image mounted somewhere, while
+// Ext2ImageFiles (see ext2_image_files.h) reads the image itself.
+
+namespace chromeos_update_engine {
+
+struct ImageFile {
+    std::string path;  // within the image, starting with "/"
+    ino_t inode;
+    mode_t mode;  // as in struct stat
+    off_t size;  // in bytes
+};
+
+// A file of an image opened for reading many chunks of it, without looking
+// it up for each one. May be used from multiple threads at once.
+class ImageFileReader
+{
+public:
+    virtual ~ImageFileReader() {}
+
+    // Like ImageFiles::ReadChunk(), for the open file.
+    virtual bool ReadChunk(off_t offset,
+                           off_t size,
+                           std::vector<char> *out_p) const = 0;
+};
+
+// All methods are const and may be called from multiple threads at once.
+class ImageFiles
+{
+public:
+    virtual ~ImageFiles() {}
+
+    // Appends the regular files of the image, other than those in
+    // /lost+found, to |out_files|. Each hard link to a file is listed.
+    // Returns true on success.
+    virtual bool ListFiles(std::vector<ImageFile> *out_files) const = 0;
+
+    // Looks up the file at |path| without following symlinks. Sets
+    // |out_exists| to whether there is one and, if so, fills in |out_file|.
+    // Returns true on success, which includes there being no such file.
+    virtual bool GetFile(const std::string &path,
+                         bool *out_exists,
+                         ImageFile *out_file) const = 0;
+
+    // Like utils::ReadFileChunk(), appends up to |size| bytes from |offset|
+    // of the file at |path|, or up to its end if |size| is -1, to |out_p|.
+    // Returns true on success.
+    virtual bool ReadChunk(const std::string &path,
+                           off_t offset,
+                           off_t size,
+                           std::vector<char> *out_p) const = 0;
+
+    // Opens the file at |path| for reading and sets |out_reader| to a reader
+    // of it, which must not outlive this object. The default reads through
+    // ReadChunk(). Returns true on success.
+    virtual bool OpenFile(const std::string &path,
+                          std::unique_ptr<ImageFileReader> *out_reader) const;
+
+    // Like extent_mapper::ExtentsForFile(), appends the blocks of the image
+    // that hold the file at |path| to |out|. Returns true on success.
+    virtual bool GetExtents(const std::string &path,
+                            std::vector<Extent> *out) const = 0;
+};
+
+// The files of an image mounted at |root|. An empty |root| makes paths
+// refer to the files themselves.
+class MountedImageFiles : public ImageFiles
+{
+public:
+    explicit MountedImageFiles(const std::string &root) : root_(root) {}
+
+    virtual bool ListFiles(std::vector<ImageFile> *out_files) const;
+    virtual bool GetFile(const std::string &path,
+                         bool *out_exists,
+                         ImageFile *out_file) const;
+    virtual bool ReadChunk(const std::string &path,
+                           off_t offset,
+                           off_t size,
+                           std::vector<char> *out_p) const;
+    virtual bool OpenFile(const std::string &path,
+                          std::unique_ptr<ImageFileReader> *out_reader) const;
+    virtual bool GetExtents(const std::string &path,
+                            std::vector<Extent> *out) const;
+
+private:
+    const std::string root_;
+
+    DISALLOW_COPY_AND_ASSIGN(MountedImageFiles);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_IMAGE_FILES_H__
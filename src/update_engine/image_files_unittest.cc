@@ -0,0 +1,69 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/image_files.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class ImageFilesTest : public ::testing::Test {};
+
+TEST(ImageFilesTest, MountedImageFilesTest)
+{
+    string root;
+    ASSERT_TRUE(utils::MakeTempDirectory("/tmp/ImageFilesTest.XXXXXX", &root));
+    ScopedDirRemover root_remover(root);
+
+    ASSERT_EQ(0, mkdir((root + "/dir").c_str(), 0755));
+    ASSERT_EQ(0, mkdir((root + "/lost+found").c_str(), 0755));
+    ASSERT_TRUE(WriteFileString(root + "/dir/file", "contents"));
+    ASSERT_TRUE(WriteFileString(root + "/lost+found/lost", "lost"));
+    ASSERT_EQ(0, symlink("dir/file", (root + "/link").c_str()));
+
+    MountedImageFiles files(root);
+    vector<ImageFile> listed;
+    EXPECT_TRUE(files.ListFiles(&listed));
+    ASSERT_EQ(1, listed.size());
+    EXPECT_EQ("/dir/file", listed[0].path);
+    EXPECT_EQ(8, listed[0].size);
+    EXPECT_TRUE(S_ISREG(listed[0].mode));
+
+    bool exists = false;
+    ImageFile file;
+    EXPECT_TRUE(files.GetFile("/link", &exists, &file));
+    EXPECT_TRUE(exists);
+    EXPECT_TRUE(S_ISLNK(file.mode));
+    EXPECT_TRUE(files.GetFile("/dir/file/nothing", &exists, &file));
+    EXPECT_FALSE(exists);
+    EXPECT_TRUE(files.GetFile("/nothing", &exists, &file));
+    EXPECT_FALSE(exists);
+
+    vector<char> data(1, 'x');
+    EXPECT_TRUE(files.ReadChunk("/dir/file", 3, 2, &data));
+    EXPECT_EQ("xte", string(data.begin(), data.end()));
+    EXPECT_FALSE(files.ReadChunk("/nothing", 0, -1, &data));
+
+    std::unique_ptr<ImageFileReader> reader;
+    ASSERT_TRUE(files.OpenFile("/dir/file", &reader));
+    data.assign(1, 'x');
+    EXPECT_TRUE(reader->ReadChunk(3, 2, &data));
+    EXPECT_TRUE(reader->ReadChunk(6, -1, &data));
+    EXPECT_EQ("xtets", string(data.begin(), data.end()));
+    EXPECT_FALSE(files.OpenFile("/nothing", &reader));
+}
+
+}  // namespace chromeos_update_engine
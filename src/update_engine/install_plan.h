@@ -46,6 +46,13 @@ struct InstallPlan {
     std::vector<char> old_partition_hash;
     std::vector<char> old_kernel_hash;
 
+    // Whether each operation of the payload, in the order they are applied,
+    // is already applied on the partitions, found by
+    // FilesystemCopierAction(verify_hashes=false) when an earlier attempt
+    // verified this payload. The running system isn't copied then and
+    // PayloadProcessor skips these operations. Empty otherwise.
+    std::vector<bool> applied_operations;
+
     // For verifying the update applied successfully. Values filled in by
     // PayloadProcessor once the update payload has been verified.
     // FilesystemCopierAction(verify_hashes=true) computes and verifies the
@@ -26,8 +26,10 @@ void KernelCopierAction::PerformAction()
 
     install_plan_ = GetInputObject();
 
-    if (install_plan_.is_resume || install_plan_.kernel_path.empty()) {
-        // Resuming download or no kernel to install, no copy needed.
+    if (install_plan_.is_resume || install_plan_.kernel_path.empty() ||
+            !install_plan_.applied_operations.empty()) {
+        // Resuming download, reapplying a verified payload over the last
+        // attempt or no kernel to install, no copy needed.
         if (HasOutputPipe()) {
             SetOutputObject(install_plan_);
         }
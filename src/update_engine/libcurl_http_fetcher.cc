@@ -347,6 +347,11 @@ size_t LibcurlHttpFetcher::LibcurlWrite(void *ptr, size_t size, size_t nmemb)
         return 0;
     }
 
+    // Have libcurl hold on to the data until we're unpaused.
+    if (paused_) {
+        return CURL_WRITEFUNC_PAUSE;
+    }
+
     sent_byte_ = true;
     {
         double transfer_size_double;
@@ -372,16 +377,21 @@ size_t LibcurlHttpFetcher::LibcurlWrite(void *ptr, size_t size, size_t nmemb)
 
 void LibcurlHttpFetcher::Pause()
 {
-    CHECK(curl_handle_);
-    CHECK(transfer_in_progress_);
-    CHECK_EQ(curl_easy_pause(curl_handle_, CURLPAUSE_ALL), CURLE_OK);
+    paused_ = true;
+
+    // The connection may be down while waiting to be retried.
+    if (curl_handle_ && transfer_in_progress_) {
+        CHECK_EQ(curl_easy_pause(curl_handle_, CURLPAUSE_ALL), CURLE_OK);
+    }
 }
 
 void LibcurlHttpFetcher::Unpause()
 {
-    CHECK(curl_handle_);
-    CHECK(transfer_in_progress_);
-    CHECK_EQ(curl_easy_pause(curl_handle_, CURLPAUSE_CONT), CURLE_OK);
+    paused_ = false;
+
+    if (curl_handle_ && transfer_in_progress_) {
+        CHECK_EQ(curl_easy_pause(curl_handle_, CURLPAUSE_CONT), CURLE_OK);
+    }
 }
 
 // This method sets up callbacks with the glib main loop.
@@ -51,6 +51,7 @@ public:
           in_write_callback_(false),
           sent_byte_(false),
           terminate_requested_(false),
+          paused_(false),
           check_certificate_(CertificateChecker::kNone) {}
 
     // Cleans up all internal state. Does not notify delegate
@@ -77,7 +78,8 @@ public:
     // cannot be resumed.
     virtual void TerminateTransfer();
 
-    // Suspend the transfer by calling curl_easy_pause(CURLPAUSE_ALL).
+    // Suspend the transfer by calling curl_easy_pause(CURLPAUSE_ALL). The
+    // pause persists across resumed and restarted transfers until Unpause().
     virtual void Pause();
 
     // Resume the transfer by calling curl_easy_pause(CURLPAUSE_CONT).
@@ -278,6 +280,10 @@ private:
     // if we get a terminate request, queue it until we can handle it.
     bool terminate_requested_;
 
+    // True if the delegate asked us to stop delivering bytes. A connection
+    // opened while paused is paused again from the write callback.
+    bool paused_;
+
     // Buffer for curl to dump useful information into
     char curl_error_buffer_[CURL_ERROR_SIZE] ;
 
@@ -78,6 +78,12 @@ public:
     // Resume the mock transfer.
     virtual void Unpause();
 
+    // Whether the transfer is suspended.
+    bool paused() const
+    {
+        return paused_;
+    }
+
     // Fail the transfer. This simulates a network failure.
     void FailTransfer(int http_response_code);
 
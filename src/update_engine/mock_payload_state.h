@@ -23,6 +23,7 @@ public:
     MOCK_METHOD1(SetResponse, void(const OmahaResponse &response));
     MOCK_METHOD0(DownloadComplete, void());
     MOCK_METHOD1(DownloadProgress, void(size_t count));
+    MOCK_METHOD1(DownloadPaused, void(bool paused));
     MOCK_METHOD1(UpdateFailed, void(ActionExitCode error));
     MOCK_METHOD0(ShouldBackoffDownload, bool());
 
@@ -32,6 +33,16 @@ public:
     MOCK_METHOD0(GetUrlIndex, uint32_t());
     MOCK_METHOD0(GetUrlFailureCount, uint32_t());
     MOCK_METHOD0(GetBackoffExpiryTime, std::chrono::system_clock::time_point());
+    MOCK_METHOD0(GetCurrentUrl, std::string());
+
+    // Mirror selection.
+    MOCK_METHOD3(SetUrlStats, void(uint32_t url_index,
+                                   std::chrono::milliseconds latency,
+                                   uint64_t throughput));
+    MOCK_METHOD3(GetUrlStats, bool(uint32_t url_index,
+                                   std::chrono::milliseconds *latency,
+                                   uint64_t *throughput));
+    MOCK_METHOD0(SelectFastestUrl, void());
 };
 
 }  // namespace chromeos_update_engine
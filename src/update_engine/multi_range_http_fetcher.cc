@@ -57,6 +57,24 @@ void MultiRangeHttpFetcher::TerminateTransfer()
     }
 }
 
+// State change: Downloading -> Downloading
+void MultiRangeHttpFetcher::SwitchUrl(const std::string &url)
+{
+    if (!base_fetcher_active_ || pending_transfer_ended_ || terminating_) {
+        // Nothing is in flight from the old URL; any later range uses |url|.
+        url_ = url;
+        return;
+    }
+
+    LOG(INFO) << "switching transfer to " << url;
+    next_url_ = url;
+
+    if (!switching_url_) {
+        switching_url_ = true;
+        base_fetcher_->TerminateTransfer();
+    }
+}
+
 // State change: Stopped or Downloading -> Downloading
 void MultiRangeHttpFetcher::StartTransfer()
 {
@@ -144,6 +162,29 @@ void MultiRangeHttpFetcher::TransferEnded(HttpFetcher *fetcher,
     // If we didn't get enough bytes, it's failure
     Range range = ranges_[current_index_];
 
+    if (switching_url_) {
+        switching_url_ = false;
+        url_ = next_url_;
+
+        // Unless the current range happened to complete, restart it from the
+        // first byte not received yet.
+        if (!range.HasLength() || bytes_received_this_range_ < range.length()) {
+            const off_t offset = range.offset() + bytes_received_this_range_;
+
+            if (range.HasLength()) {
+                ranges_[current_index_] =
+                    Range(offset, range.length() - bytes_received_this_range_);
+            } else {
+                ranges_[current_index_] = Range(offset);
+            }
+
+            LOG(INFO) << "Resuming transfer (" << current_index_ << ") from "
+                      << url_;
+            StartTransfer();
+            return;
+        }
+    }
+
     if (range.HasLength()) {
         if (bytes_received_this_range_ < range.length()) {
             // Failure
@@ -195,6 +236,7 @@ void MultiRangeHttpFetcher::TransferTerminated(HttpFetcher *fetcher)
 void MultiRangeHttpFetcher::Reset()
 {
     base_fetcher_active_ = pending_transfer_ended_ = terminating_ = false;
+    switching_url_ = false;
     current_index_ = 0;
     bytes_received_this_range_ = 0;
 }
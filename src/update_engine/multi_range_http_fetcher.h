@@ -39,10 +39,20 @@ public:
           base_fetcher_active_(false),
           pending_transfer_ended_(false),
           terminating_(false),
+          switching_url_(false),
           current_index_(0),
           bytes_received_this_range_(0) {}
     ~MultiRangeHttpFetcher() {}
 
+    // Replaces the base fetcher, e.g. once the scheme of the URL to fetch is
+    // known. Must not be called while a transfer is in progress. Takes
+    // ownership of the passed in fetcher.
+    void set_base_fetcher(HttpFetcher *base_fetcher)
+    {
+        CHECK(!base_fetcher_active_) << "Replacing an active base fetcher.";
+        base_fetcher_.reset(base_fetcher);
+    }
+
     void ClearRanges()
     {
         ranges_.clear();
@@ -72,6 +82,12 @@ public:
     // State change: Downloading -> Pending transfer ended
     virtual void TerminateTransfer();
 
+    // Continues the transfer from |url|, e.g. a faster mirror of the same
+    // payload. The remaining ranges, starting with the unreceived part of the
+    // current one, are fetched from |url| once the base fetcher reports that
+    // the transfer from the old URL was terminated.
+    void SwitchUrl(const std::string &url);
+
     virtual void Pause()
     {
         base_fetcher_->Pause();
@@ -162,6 +178,11 @@ private:
     // ourselves terminating.
     bool terminating_;
 
+    // True if we are waiting for base fetcher to terminate b/c we are
+    // switching to |next_url_|.
+    bool switching_url_;
+    std::string next_url_;
+
     RangesVect ranges_;
 
     RangesVect::size_type current_index_;  // index into ranges_
@@ -0,0 +1,220 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/payload_inspector.h"
+
+#include <inttypes.h>
+#include <string.h>
+
+#include <vector>
+
+#include <glog/logging.h>
+
+#include "update_engine/delta_metadata.h"
+#include "update_engine/delta_performer.h"
+#include "update_engine/graph_types.h"
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+const uint64_t kSmallestBlobBucket = 4096;
+
+// Returns the blocks of |extents|, not counting sparse holes.
+template<typename T>
+uint64_t CountBlocks(const T &extents)
+{
+    uint64_t blocks = 0;
+
+    for (const Extent &extent : extents) {
+        if (extent.start_block() != kSparseHole) {
+            blocks += extent.num_blocks();
+        }
+    }
+
+    return blocks;
+}
+
+// Adds |op| to |stats|.
+void AddOperation(const InstallOperation &op, PayloadStats *stats)
+{
+    const uint64_t src_blocks = CountBlocks(op.src_extents());
+    const uint64_t dst_blocks = CountBlocks(op.dst_extents());
+    const uint64_t dst_bytes = dst_blocks * stats->block_size;
+
+    stats->ops[op.type()]++;
+    stats->blob_bytes[op.type()] += op.data_length();
+    stats->dst_blocks[op.type()] += dst_blocks;
+
+    if (op.data_length() > 0) {
+        int bucket = 0;
+
+        for (uint64_t limit = kSmallestBlobBucket;
+                op.data_length() >= limit &&
+                bucket < PayloadStats::kBlobSizeBuckets - 1; limit *= 4) {
+            bucket++;
+        }
+
+        stats->blob_size_histogram[bucket]++;
+    }
+
+    stats->src_blocks += src_blocks;
+    stats->dst_blocks_total += dst_blocks;
+    stats->src_extents += op.src_extents_size();
+    stats->dst_extents += op.dst_extents_size();
+
+    if (op.dst_extents_size() > 1) {
+        stats->fragmented_ops++;
+    }
+
+    if (!DeltaPerformer::IsIdempotentOperation(op)) {
+        stats->non_idempotent_ops++;
+    }
+
+    stats->read_bytes += src_blocks * stats->block_size;
+    stats->write_bytes += dst_bytes;
+
+    switch (op.type()) {
+    case InstallOperation_Type_REPLACE_BZ:
+        stats->decompress_bytes += dst_bytes;
+        break;
+
+    case InstallOperation_Type_BSDIFF:
+        stats->bspatch_bytes += op.has_dst_length() ? op.dst_length() :
+                                dst_bytes;
+        break;
+
+    default:
+        break;
+    }
+}
+
+// Returns how long processing |bytes| at |mbps| takes, in seconds.
+double Seconds(uint64_t bytes, double mbps)
+{
+    CHECK_GT(mbps, 0);
+    return bytes / (mbps * 1000 * 1000);
+}
+}  // namespace {}
+
+PayloadStats::PayloadStats()
+{
+    memset(this, 0, sizeof(*this));
+}
+
+bool PayloadInspector::ReadManifest(const string &path,
+                                    DeltaArchiveManifest *manifest,
+                                    uint64_t *metadata_size)
+{
+    // The header tells the size of the metadata; read that much more.
+    vector<char> payload;
+    TEST_AND_RETURN_FALSE(utils::ReadFileChunk(path, 0, kDeltaManifestOffset,
+                          &payload));
+    ActionExitCode code = DeltaMetadata::ParsePayload(payload, manifest,
+                          metadata_size);
+
+    if (code == kActionCodeDownloadIncomplete &&
+            payload.size() == kDeltaManifestOffset) {
+        TEST_AND_RETURN_FALSE(utils::ReadFileChunk(
+                                  path, payload.size(),
+                                  *metadata_size - payload.size(), &payload));
+        code = DeltaMetadata::ParsePayload(payload, manifest, metadata_size);
+    }
+
+    if (code != kActionCodeSuccess) {
+        LOG(ERROR) << "Unable to read the manifest of " << path << ": "
+                   << utils::CodeToString(code);
+        return false;
+    }
+
+    return true;
+}
+
+void PayloadInspector::GetStats(const DeltaArchiveManifest &manifest,
+                                uint64_t metadata_size,
+                                PayloadStats *stats)
+{
+    *stats = PayloadStats();
+    stats->metadata_size = metadata_size;
+    stats->block_size = manifest.block_size();
+
+    for (const InstallOperation &op : manifest.partition_operations()) {
+        AddOperation(op, stats);
+    }
+
+    for (const InstallProcedure &procedure : manifest.procedures()) {
+        for (const InstallOperation &op : procedure.operations()) {
+            AddOperation(op, stats);
+        }
+    }
+}
+
+ApplyCost PayloadInspector::EstimateApplyCost(const PayloadStats &stats,
+        const DeviceProfile &profile)
+{
+    ApplyCost cost;
+    cost.read_seconds = Seconds(stats.read_bytes, profile.read_mbps);
+    cost.write_seconds = Seconds(stats.write_bytes, profile.write_mbps);
+    cost.decompress_seconds = Seconds(stats.decompress_bytes,
+                                      profile.decompress_mbps);
+    cost.bspatch_seconds = Seconds(stats.bspatch_bytes, profile.bspatch_mbps);
+    return cost;
+}
+
+void PayloadInspector::Print(const PayloadStats &stats,
+                             const ApplyCost &cost,
+                             FILE *out)
+{
+    uint64_t ops = 0, blob_bytes = 0;
+
+    for (int i = 0; i < InstallOperation_Type_Type_ARRAYSIZE; i++) {
+        ops += stats.ops[i];
+        blob_bytes += stats.blob_bytes[i];
+    }
+
+    fprintf(out, "Metadata: %" PRIu64 " bytes, block size %" PRIu64 "\n",
+            stats.metadata_size, stats.block_size);
+    fprintf(out, "Operations: %" PRIu64 ", %" PRIu64 " bytes of data\n",
+            ops, blob_bytes);
+    fprintf(out, "%12s %10s %14s %12s\n",
+            "type", "ops", "data bytes", "dst blocks");
+
+    for (int i = 0; i < InstallOperation_Type_Type_ARRAYSIZE; i++) {
+        fprintf(out, "%12s %10" PRIu64 " %14" PRIu64 " %12" PRIu64 "\n",
+                InstallOperation_Type_Name(
+                    static_cast<InstallOperation_Type>(i)).c_str(),
+                stats.ops[i], stats.blob_bytes[i], stats.dst_blocks[i]);
+    }
+
+    fprintf(out, "Data sizes:\n");
+    uint64_t limit = kSmallestBlobBucket;
+
+    for (int i = 0; i < PayloadStats::kBlobSizeBuckets; i++, limit *= 4) {
+        if (i < PayloadStats::kBlobSizeBuckets - 1) {
+            fprintf(out, "  < %8" PRIu64 " KiB: %" PRIu64 "\n",
+                    limit / 1024, stats.blob_size_histogram[i]);
+        } else {
+            fprintf(out, "  >= %7" PRIu64 " KiB: %" PRIu64 "\n",
+                    limit / 4 / 1024, stats.blob_size_histogram[i]);
+        }
+    }
+
+    fprintf(out, "Blocks read: %" PRIu64 " in %" PRIu64 " extents\n",
+            stats.src_blocks, stats.src_extents);
+    fprintf(out, "Blocks written: %" PRIu64 " in %" PRIu64 " extents\n",
+            stats.dst_blocks_total, stats.dst_extents);
+    fprintf(out, "Fragmented operations: %" PRIu64 "\n",
+            stats.fragmented_ops);
+    fprintf(out, "Non-idempotent operations: %" PRIu64 "\n",
+            stats.non_idempotent_ops);
+    fprintf(out, "Estimated apply time: %.1f s (read %.1f s, write %.1f s, "
+            "decompress %.1f s, bspatch %.1f s)\n",
+            cost.total_seconds(), cost.read_seconds, cost.write_seconds,
+            cost.decompress_seconds, cost.bspatch_seconds);
+}
+
+}  // namespace chromeos_update_engine
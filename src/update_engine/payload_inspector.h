@@ -0,0 +1,113 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_PAYLOAD_INSPECTOR_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_PAYLOAD_INSPECTOR_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+
+#include "macros.h"
+#include "update_engine/update_metadata.pb.h"
+
+// PayloadInspector describes the operations of a payload without applying
+// it: how many there are of each type, how big their data is, how many
+// blocks they read and write, and how fragmented those are. From that and
+// the speeds of a device it estimates how long the device takes to apply
+// the payload, so that payloads too slow to install can be caught before
+// they ship.
+
+namespace chromeos_update_engine {
+
+// The speeds of a device applying payloads, in MB (10^6 bytes) per second.
+// Decompressing and patching are measured by the bytes they output.
+struct DeviceProfile {
+    double read_mbps;
+    double write_mbps;
+    double decompress_mbps;
+    double bspatch_mbps;
+};
+
+// What applying the operations of a payload involves. The partition
+// operations and those of the procedures are counted, but not the legacy
+// noop_operations.
+struct PayloadStats {
+    // Blob sizes are counted in buckets of under 4 KiB, under 16 KiB and so
+    // on, each 4 times as big as the one before. The last holds the rest.
+    static const int kBlobSizeBuckets = 8;
+
+    PayloadStats();
+
+    uint64_t metadata_size;
+    uint64_t block_size;
+
+    // By operation type.
+    uint64_t ops[InstallOperation_Type_Type_ARRAYSIZE];
+    uint64_t blob_bytes[InstallOperation_Type_Type_ARRAYSIZE];
+    uint64_t dst_blocks[InstallOperation_Type_Type_ARRAYSIZE];
+
+    uint64_t blob_size_histogram[kBlobSizeBuckets];  // of non-empty blobs
+    uint64_t src_blocks;  // not counting sparse holes
+    uint64_t dst_blocks_total;
+    uint64_t src_extents;
+    uint64_t dst_extents;
+    uint64_t fragmented_ops;  // writing more than one extent
+    uint64_t non_idempotent_ops;
+
+    // The bytes the device reads, writes, decompresses and patches.
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    uint64_t decompress_bytes;
+    uint64_t bspatch_bytes;
+};
+
+// The estimated time for a device to apply a payload, in seconds.
+struct ApplyCost {
+    double read_seconds;
+    double write_seconds;
+    double decompress_seconds;
+    double bspatch_seconds;
+
+    double total_seconds() const
+    {
+        return read_seconds + write_seconds + decompress_seconds +
+               bspatch_seconds;
+    }
+};
+
+class PayloadInspector
+{
+public:
+    // Reads the manifest of the payload at |path| into |manifest| and sets
+    // |metadata_size| to the bytes before its data, without reading the
+    // data. Returns true on success.
+    static bool ReadManifest(const std::string &path,
+                             DeltaArchiveManifest *manifest,
+                             uint64_t *metadata_size);
+
+    // Sets |stats| to what applying the operations of |manifest| involves.
+    static void GetStats(const DeltaArchiveManifest &manifest,
+                         uint64_t metadata_size,
+                         PayloadStats *stats);
+
+    // Returns how long a device of |profile| takes to apply a payload of
+    // |stats|, not counting downloading it. Operations are assumed to run
+    // one at a time, each step at the full speed of the device.
+    static ApplyCost EstimateApplyCost(const PayloadStats &stats,
+                                       const DeviceProfile &profile);
+
+    // Prints |stats| and |cost| to |out|.
+    static void Print(const PayloadStats &stats,
+                      const ApplyCost &cost,
+                      FILE *out);
+
+private:
+    DISALLOW_IMPLICIT_CONSTRUCTORS(PayloadInspector);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_PAYLOAD_INSPECTOR_H__
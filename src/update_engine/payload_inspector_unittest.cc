@@ -0,0 +1,176 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <endian.h>
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/delta_metadata.h"
+#include "update_engine/graph_types.h"
+#include "update_engine/payload_inspector.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/update_metadata.pb.h"
+#include "update_engine/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+class PayloadInspectorTest : public ::testing::Test {};
+
+namespace {
+// Adds an operation of |type| with |data_length| bytes of data, reading
+// |src_blocks| from block |src_start| and writing |dst_blocks| to block
+// |dst_start|, to |ops|. A count of 0 adds no extent.
+void AddOperation(InstallOperation_Type type,
+                  uint32_t data_length,
+                  uint64_t src_start, uint64_t src_blocks,
+                  uint64_t dst_start, uint64_t dst_blocks,
+                  google::protobuf::RepeatedPtrField<InstallOperation> *ops)
+{
+    InstallOperation *op = ops->Add();
+    op->set_type(type);
+    op->set_data_length(data_length);
+
+    if (src_blocks) {
+        Extent *extent = op->add_src_extents();
+        extent->set_start_block(src_start);
+        extent->set_num_blocks(src_blocks);
+    }
+
+    if (dst_blocks) {
+        Extent *extent = op->add_dst_extents();
+        extent->set_start_block(dst_start);
+        extent->set_num_blocks(dst_blocks);
+    }
+}
+
+// Returns a manifest with one operation of each type, a kernel procedure
+// and a noop operation.
+DeltaArchiveManifest MakeManifest()
+{
+    DeltaArchiveManifest manifest;
+    manifest.set_block_size(4096);
+    AddOperation(InstallOperation_Type_REPLACE, 100, 0, 0, 0, 1,
+                 manifest.mutable_partition_operations());
+    AddOperation(InstallOperation_Type_REPLACE_BZ, 20000, 0, 0, 1, 10,
+                 manifest.mutable_partition_operations());
+    // Moves blocks 20-23 onto 22-25, writing blocks it reads.
+    AddOperation(InstallOperation_Type_MOVE, 0, 20, 4, 22, 4,
+                 manifest.mutable_partition_operations());
+    AddOperation(InstallOperation_Type_BSDIFF, 5000000, 30, 100, 200, 100,
+                 manifest.mutable_partition_operations());
+    // The BSDIFF writes two extents, the second not a whole block.
+    InstallOperation *bsdiff =
+        manifest.mutable_partition_operations()->Mutable(3);
+    Extent *extent = bsdiff->add_dst_extents();
+    extent->set_start_block(400);
+    extent->set_num_blocks(1);
+    bsdiff->set_dst_length(101 * 4096 - 10);
+
+    InstallProcedure *kernel = manifest.add_procedures();
+    kernel->set_type(InstallProcedure_Type_KERNEL);
+    AddOperation(InstallOperation_Type_REPLACE_BZ, 70000, 0, 0, 0, 50,
+                 kernel->mutable_operations());
+
+    AddOperation(InstallOperation_Type_REPLACE, 256, 0, 0, kSparseHole, 1,
+                 manifest.mutable_noop_operations());
+    return manifest;
+}
+}  // namespace {}
+
+TEST(PayloadInspectorTest, GetStatsTest)
+{
+    PayloadStats stats;
+    PayloadInspector::GetStats(MakeManifest(), 1234, &stats);
+
+    EXPECT_EQ(1234, stats.metadata_size);
+    EXPECT_EQ(4096, stats.block_size);
+    EXPECT_EQ(1, stats.ops[InstallOperation_Type_REPLACE]);
+    EXPECT_EQ(2, stats.ops[InstallOperation_Type_REPLACE_BZ]);
+    EXPECT_EQ(1, stats.ops[InstallOperation_Type_MOVE]);
+    EXPECT_EQ(1, stats.ops[InstallOperation_Type_BSDIFF]);
+    EXPECT_EQ(100, stats.blob_bytes[InstallOperation_Type_REPLACE]);
+    EXPECT_EQ(90000, stats.blob_bytes[InstallOperation_Type_REPLACE_BZ]);
+    EXPECT_EQ(0, stats.blob_bytes[InstallOperation_Type_MOVE]);
+    EXPECT_EQ(60, stats.dst_blocks[InstallOperation_Type_REPLACE_BZ]);
+    EXPECT_EQ(101, stats.dst_blocks[InstallOperation_Type_BSDIFF]);
+
+    // 100 bytes, 20000, 70000 and 5000000.
+    EXPECT_EQ(1, stats.blob_size_histogram[0]);
+    EXPECT_EQ(1, stats.blob_size_histogram[2]);
+    EXPECT_EQ(1, stats.blob_size_histogram[3]);
+    EXPECT_EQ(1, stats.blob_size_histogram[6]);
+    EXPECT_EQ(0, stats.blob_size_histogram[PayloadStats::kBlobSizeBuckets
+                                           - 1]);
+
+    EXPECT_EQ(104, stats.src_blocks);
+    EXPECT_EQ(166, stats.dst_blocks_total);
+    EXPECT_EQ(2, stats.src_extents);
+    EXPECT_EQ(6, stats.dst_extents);
+    EXPECT_EQ(1, stats.fragmented_ops);
+    EXPECT_EQ(1, stats.non_idempotent_ops);
+
+    EXPECT_EQ(104 * 4096, stats.read_bytes);
+    EXPECT_EQ(166 * 4096, stats.write_bytes);
+    EXPECT_EQ(60 * 4096, stats.decompress_bytes);
+    EXPECT_EQ(101 * 4096 - 10, stats.bspatch_bytes);
+}
+
+TEST(PayloadInspectorTest, EstimateApplyCostTest)
+{
+    PayloadStats stats;
+    stats.read_bytes = 10000000;
+    stats.write_bytes = 20000000;
+    stats.decompress_bytes = 30000000;
+    stats.bspatch_bytes = 40000000;
+    DeviceProfile profile = {100, 10, 30, 8};
+
+    ApplyCost cost = PayloadInspector::EstimateApplyCost(stats, profile);
+    EXPECT_DOUBLE_EQ(0.1, cost.read_seconds);
+    EXPECT_DOUBLE_EQ(2, cost.write_seconds);
+    EXPECT_DOUBLE_EQ(1, cost.decompress_seconds);
+    EXPECT_DOUBLE_EQ(5, cost.bspatch_seconds);
+    EXPECT_DOUBLE_EQ(8.1, cost.total_seconds());
+}
+
+TEST(PayloadInspectorTest, ReadManifestTest)
+{
+    string path;
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/PayloadInspectorTest.XXXXXX",
+                                    &path, NULL));
+    ScopedPathUnlinker path_unlinker(path);
+
+    // Only the metadata is read, so the data needn't be there.
+    string serialized_manifest;
+    ASSERT_TRUE(MakeManifest().AppendToString(&serialized_manifest));
+    const uint64_t version_be = htobe64(kDeltaVersion);
+    const uint64_t manifest_size_be = htobe64(serialized_manifest.size());
+    string payload(kDeltaMagic, kDeltaMagicSize);
+    payload.append(reinterpret_cast<const char *>(&version_be),
+                   sizeof(version_be));
+    payload.append(reinterpret_cast<const char *>(&manifest_size_be),
+                   sizeof(manifest_size_be));
+    payload += serialized_manifest;
+    ASSERT_TRUE(utils::WriteFile(path.c_str(), payload.data(),
+                                 payload.size()));
+
+    DeltaArchiveManifest manifest;
+    uint64_t metadata_size = 0;
+    EXPECT_TRUE(PayloadInspector::ReadManifest(path, &manifest,
+                &metadata_size));
+    EXPECT_EQ(payload.size(), metadata_size);
+    EXPECT_EQ(4, manifest.partition_operations_size());
+    EXPECT_EQ(1, manifest.procedures_size());
+
+    // Truncated metadata.
+    ASSERT_TRUE(utils::WriteFile(path.c_str(), payload.data(),
+                                 payload.size() - 1));
+    EXPECT_FALSE(PayloadInspector::ReadManifest(path, &manifest,
+                 &metadata_size));
+}
+
+}  // namespace chromeos_update_engine
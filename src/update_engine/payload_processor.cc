@@ -5,6 +5,11 @@
 #include "update_engine/payload_processor.h"
 
 #include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
 
 #include <string>
 #include <vector>
@@ -17,6 +22,7 @@
 #include "update_engine/prefs_interface.h"
 #include "update_engine/terminator.h"
 
+using std::pair;
 using std::string;
 using std::vector;
 using google::protobuf::RepeatedPtrField;
@@ -30,6 +36,14 @@ const char PayloadProcessor::kUpdatePayloadPublicKeyPath[] =
 const char PayloadProcessor::kUpdatePayloadPublicKeyOverridePath[] =
     "/home/root/.update_engine/update-payload-key.pub.pem";
 
+const char PayloadProcessor::kUpdatePartialDataPath[] =
+    "/var/lib/update_engine/partial-data";
+
+const char PayloadProcessor::kVerifiedManifestPath[] =
+    "/var/lib/update_engine/verified-manifest";
+
+const uint64_t PayloadProcessor::kPartialDataCheckpointSize = 1024 * 1024;
+
 namespace {
 const int kUpdateStateOperationInvalid = -1;
 const int kMaxResumedUpdateFailures = 10;
@@ -59,6 +73,23 @@ void LogPartitionInfo(const DeltaArchiveManifest &manifest)
     }
 }
 
+// Appends the operations of |manifest| to |operations| in the order they are
+// applied, along with their procedure, null for partition operations.
+void ListOperations(const DeltaArchiveManifest &manifest,
+                    vector<pair<const InstallProcedure *,
+                    const InstallOperation *>> *operations)
+{
+    for (const InstallOperation &op : manifest.partition_operations()) {
+        operations->emplace_back(nullptr, &op);
+    }
+
+    for (const InstallProcedure &proc : manifest.procedures()) {
+        for (const InstallOperation &op : proc.operations()) {
+            operations->emplace_back(&proc, &op);
+        }
+    }
+}
+
 }  // namespace {}
 
 PayloadProcessor::PayloadProcessor(PrefsInterface *prefs, InstallPlan *install_plan)
@@ -72,7 +103,14 @@ PayloadProcessor::PayloadProcessor(PrefsInterface *prefs, InstallPlan *install_p
       buffer_offset_(0),
       last_updated_buffer_offset_(std::numeric_limits<uint64_t>::max()),
       public_key_path_(kUpdatePayloadPublicKeyPath),
-      public_key_override_path_(kUpdatePayloadPublicKeyOverridePath)
+      public_key_override_path_(kUpdatePayloadPublicKeyOverridePath),
+      partial_data_path_(kUpdatePartialDataPath),
+      partial_data_fd_(-1),
+      partial_data_spooled_(0),
+      partial_data_checkpointed_(0),
+      partial_data_failed_(false),
+      verified_manifest_path_(kVerifiedManifestPath),
+      skipped_data_length_(0)
 {
 }
 
@@ -110,6 +148,11 @@ int PayloadProcessor::Close()
 
     LOG_IF(ERROR, !hash_calculator_.Finalize()) << "Unable to finalize the hash.";
 
+    if (partial_data_fd_ >= 0) {
+        close(partial_data_fd_);
+        partial_data_fd_ = -1;
+    }
+
     if (!buffer_.empty()) {
         LOG(ERROR) << "Called Close() while buffer not empty!";
 
@@ -156,6 +199,7 @@ bool PayloadProcessor::Write(const void *bytes, size_t count,
         *error = PerformOperation();
 
         if (*error == kActionCodeDownloadIncomplete) {
+            SpoolPartialData();
             *error = kActionCodeSuccess;
             return true;
         } else if (*error != kActionCodeSuccess) {
@@ -193,6 +237,19 @@ ActionExitCode PayloadProcessor::LoadManifest()
         return error;
     }
 
+    manifest_metadata_.assign(buffer_.begin(),
+                              buffer_.begin() + manifest_metadata_size_);
+
+    // The planned skips are only valid for the manifest they were planned
+    // with, which is also what vouches for the rest of the download.
+    if (!skipped_operations_.empty() &&
+            manifest_metadata_ != verified_manifest_metadata_) {
+        LOG(ERROR) << "The manifest doesn't match the verified one in "
+                   << verified_manifest_path_;
+        ResetVerifiedManifest(prefs_, verified_manifest_path_);
+        return kActionCodeDownloadPayloadVerificationError;
+    }
+
     // Remove protobuf and header info from buffer_, so buffer_ contains
     // just data blobs
     DiscardBufferHeadBytes(manifest_metadata_size_);
@@ -245,22 +302,7 @@ ActionExitCode PayloadProcessor::PerformOperation()
 
     const InstallProcedure *proc = operations_[next_operation_num_].first;
     const InstallOperation *op = operations_[next_operation_num_].second;
-    DeltaPerformer *performer = nullptr;
-
-    // There is no InstallProcedure type for partitions, so it will be null.
-    if (proc == nullptr) {
-        performer = &partition_performer_;
-    } else if (proc->has_type()) {
-        // has_type is only true if it is present and has a known enum value.
-        switch (proc->type()) {
-        case InstallProcedure_Type_KERNEL:
-            if (!install_plan_->kernel_path.empty()) {
-                performer = &kernel_performer_;
-            }
-
-            break;
-        }
-    }
+    DeltaPerformer *performer = GetPerformer(proc);
 
     if (op->data_length() && op->data_offset() != buffer_offset_) {
         LOG(ERROR) << "Operation " << next_operation_num_
@@ -269,6 +311,24 @@ ActionExitCode PayloadProcessor::PerformOperation()
         return kActionCodeDownloadOperationExecutionError;
     }
 
+    if (!skipped_operations_.empty() &&
+            skipped_operations_[next_operation_num_]) {
+        // The data wasn't downloaded, nothing may have changed since.
+        if (performer != nullptr && !performer->DestinationMatches(*op)) {
+            LOG(ERROR) << "Destination of skipped operation "
+                       << next_operation_num_ << " changed";
+            return kActionCodeDownloadOperationExecutionError;
+        }
+
+        buffer_offset_ += op->data_length();
+        next_operation_num_++;
+        LOG(INFO) << "Skipped " << next_operation_num_ << "/"
+                  << operations_.size() << " operations ("
+                  << (next_operation_num_ * 100 / operations_.size())
+                  << "%), destination already up to date";
+        return kActionCodeSuccess;
+    }
+
     if (op->data_length() > buffer_.size()) {
         return kActionCodeDownloadIncomplete;
     }
@@ -289,6 +349,7 @@ ActionExitCode PayloadProcessor::PerformOperation()
 
     buffer_offset_ += op->data_length();
     DiscardBufferHeadBytes(op->data_length());
+    ClosePartialData();
     next_operation_num_++;
 
     LOG(INFO) << (performer ? "Completed " : "Skipped ")
@@ -300,6 +361,206 @@ ActionExitCode PayloadProcessor::PerformOperation()
     return kActionCodeSuccess;
 }
 
+DeltaPerformer *PayloadProcessor::GetPerformer(const InstallProcedure *proc)
+{
+    // There is no InstallProcedure type for partitions, so it will be null.
+    if (proc == nullptr) {
+        return &partition_performer_;
+    }
+
+    // has_type is only true if it is present and has a known enum value.
+    if (proc->has_type()) {
+        switch (proc->type()) {
+        case InstallProcedure_Type_KERNEL:
+            if (!install_plan_->kernel_path.empty()) {
+                return &kernel_performer_;
+            }
+
+            break;
+        }
+    }
+
+    return nullptr;
+}
+
+bool PayloadProcessor::LoadVerifiedManifest(PrefsInterface *prefs,
+        const string &payload_hash,
+        const string &verified_manifest_path,
+        vector<char> *metadata)
+{
+    string verified_hash;
+
+    if (!prefs->GetString(kPrefsVerifiedManifestHash, &verified_hash) ||
+            verified_hash.empty() || verified_hash != payload_hash) {
+        return false;
+    }
+
+    metadata->clear();
+
+    if (!utils::ReadFile(verified_manifest_path, metadata)) {
+        LOG(WARNING) << "Unable to read the verified manifest "
+                     << verified_manifest_path;
+        return false;
+    }
+
+    return true;
+}
+
+void PayloadProcessor::ResetVerifiedManifest(PrefsInterface *prefs,
+        const string &verified_manifest_path)
+{
+    prefs->SetString(kPrefsVerifiedManifestHash, "");
+    prefs->SetString(kPrefsVerifiedManifestSignedSHA256Context, "");
+    PLOG_IF(WARNING, unlink(verified_manifest_path.c_str()) != 0 &&
+            errno != ENOENT)
+            << "Unable to remove " << verified_manifest_path;
+}
+
+bool PayloadProcessor::FindAppliedOperations(const vector<char> &metadata,
+        const InstallPlan &install_plan,
+        vector<bool> *applied_operations)
+{
+    DeltaArchiveManifest manifest;
+    uint64_t metadata_size = 0;
+
+    if (DeltaMetadata::ParsePayload(metadata, &manifest, &metadata_size) !=
+            kActionCodeSuccess || metadata_size != metadata.size()) {
+        LOG(WARNING) << "Ignoring unusable verified manifest";
+        return false;
+    }
+
+    const bool has_kernel = !install_plan.kernel_path.empty();
+    DeltaPerformer partition_performer(NULL, install_plan.partition_path);
+    DeltaPerformer kernel_performer(NULL, install_plan.kernel_path);
+    TEST_AND_RETURN_FALSE(partition_performer.Open() == 0);
+
+    if (has_kernel && kernel_performer.Open() != 0) {
+        partition_performer.Close();
+        return false;
+    }
+
+    partition_performer.SetBlockSize(manifest.block_size());
+    kernel_performer.SetBlockSize(manifest.block_size());
+
+    vector<pair<const InstallProcedure *, const InstallOperation *>> operations;
+    ListOperations(manifest, &operations);
+    LOG(INFO) << "Checking which operations of the verified payload are "
+              << "already applied";
+    vector<bool> applied(operations.size(), false);
+    uint64_t applied_data_length = 0;
+    size_t source_operations = 0;  // Not applied and reading source blocks.
+
+    for (size_t i = 0; i < operations.size(); i++) {
+        const InstallProcedure *proc = operations[i].first;
+        const InstallOperation *op = operations[i].second;
+        DeltaPerformer *performer = &partition_performer;
+
+        // Operations of procedures not installed here are never applied.
+        if (proc != nullptr) {
+            performer = has_kernel && proc->has_type() &&
+                        proc->type() == InstallProcedure_Type_KERNEL ?
+                        &kernel_performer : nullptr;
+        }
+
+        if (performer == nullptr) {
+            applied[i] = true;
+        } else if (performer->DestinationMatches(*op)) {
+            applied[i] = true;
+            applied_data_length += op->data_length();
+        } else if (op->src_extents_size() > 0) {
+            source_operations++;
+        }
+    }
+
+    partition_performer.Close();
+
+    if (has_kernel) {
+        kernel_performer.Close();
+    }
+
+    if (applied_data_length == 0) {
+        LOG(INFO) << "No operation is applied yet";
+        return false;
+    }
+
+    if (source_operations > 0) {
+        LOG(INFO) << source_operations << " operations that aren't applied "
+                  << "read the running system, it has to be copied";
+        return false;
+    }
+
+    LOG(INFO) << "Operations with " << applied_data_length << " bytes of "
+              << "data are already applied";
+    applied_operations->swap(applied);
+    return true;
+}
+
+bool PayloadProcessor::PlanSkippedOperations(
+    vector<pair<uint64_t, uint64_t>> *ranges)
+{
+    CHECK(!manifest_valid_ && buffer_.empty());
+
+    if (install_plan_->applied_operations.empty()) {
+        return false;
+    }
+
+    // The partitions weren't copied, which the operations found applied
+    // before rely on, so the manifest mustn't have gone in the meantime.
+    vector<char> metadata;
+    string signed_hash_context;
+    DeltaArchiveManifest manifest;
+    uint64_t metadata_size = 0;
+    vector<pair<const InstallProcedure *, const InstallOperation *>> operations;
+
+    if (LoadVerifiedManifest(prefs_, install_plan_->payload_hash,
+                             verified_manifest_path_, &metadata) &&
+            prefs_->GetString(kPrefsVerifiedManifestSignedSHA256Context,
+                              &signed_hash_context) &&
+            DeltaMetadata::ParsePayload(metadata, &manifest, &metadata_size) ==
+            kActionCodeSuccess) {
+        ListOperations(manifest, &operations);
+    }
+
+    if (operations.size() != install_plan_->applied_operations.size()) {
+        LOG(ERROR) << "The verified manifest " << verified_manifest_path_
+                   << " changed, unable to skip the applied operations";
+        return false;
+    }
+
+    skipped_data_length_ = 0;
+    uint64_t offset = 0;  // Payload offset of the first byte not planned yet.
+    ranges->clear();
+
+    for (size_t i = 0; i < operations.size(); i++) {
+        const InstallOperation *op = operations[i].second;
+
+        if (!install_plan_->applied_operations[i] || op->data_length() == 0) {
+            continue;
+        }
+
+        const uint64_t data_offset = metadata_size + op->data_offset();
+
+        if (data_offset > offset) {
+            ranges->emplace_back(offset, data_offset - offset);
+        }
+
+        offset = data_offset + op->data_length();
+        skipped_data_length_ += op->data_length();
+    }
+
+    if (offset < install_plan_->payload_size) {
+        ranges->emplace_back(offset, install_plan_->payload_size - offset);
+    }
+
+    LOG(INFO) << "Skipping " << skipped_data_length_ << " of "
+              << install_plan_->payload_size << " payload bytes, already "
+              << "applied by a previous attempt";
+    verified_manifest_metadata_.swap(metadata);
+    verified_signed_hash_context_ = signed_hash_context;
+    skipped_operations_ = install_plan_->applied_operations;
+    return true;
+}
+
 bool PayloadProcessor::ExtractSignatureMessage(const vector<char> &data)
 {
     TEST_AND_RETURN_FALSE(manifest_.has_signatures_offset());
@@ -352,12 +613,24 @@ ActionExitCode PayloadProcessor::VerifyPayload()
                         install_plan_->payload_size ==
                         manifest_metadata_size_ + buffer_offset_);
 
-    // Verifies the payload hash.
-    const string &payload_hash_data = hash_calculator_.hash();
-    TEST_AND_RETURN_VAL(kActionCodeDownloadPayloadVerificationError,
-                        !payload_hash_data.empty());
-    TEST_AND_RETURN_VAL(kActionCodePayloadHashMismatchError,
-                        payload_hash_data == install_plan_->payload_hash);
+    if (skipped_data_length_ > 0) {
+        // The payload hash covers data that wasn't downloaded, but the
+        // manifest matched the one verified for this payload before and the
+        // downloaded data matched the operation hashes in it. The signature
+        // is checked against the hash of the payload computed back then.
+        LOG(INFO) << "Not verifying the payload hash, " << skipped_data_length_
+                  << " bytes were skipped";
+        TEST_AND_RETURN_VAL(kActionCodeDownloadPayloadVerificationError,
+                            !verified_signed_hash_context_.empty());
+        signed_hash_context_ = verified_signed_hash_context_;
+    } else {
+        // Verifies the payload hash.
+        const string &payload_hash_data = hash_calculator_.hash();
+        TEST_AND_RETURN_VAL(kActionCodeDownloadPayloadVerificationError,
+                            !payload_hash_data.empty());
+        TEST_AND_RETURN_VAL(kActionCodePayloadHashMismatchError,
+                            payload_hash_data == install_plan_->payload_hash);
+    }
 
     // Update the InstallPlan so the update can be verified.
     TEST_AND_RETURN_VAL(kActionCodeDownloadPayloadVerificationError,
@@ -422,9 +695,34 @@ ActionExitCode PayloadProcessor::VerifyPayload()
         return kActionCodeDownloadPayloadPubKeyVerificationError;
     }
 
+    SaveVerifiedManifest();
     return kActionCodeSuccess;
 }
 
+void PayloadProcessor::SaveVerifiedManifest()
+{
+    // Invalidate the old copy first, the file may end up half written.
+    prefs_->SetString(kPrefsVerifiedManifestHash, "");
+
+    if (!utils::WriteFile(verified_manifest_path_.c_str(),
+                          manifest_metadata_.data(),
+                          manifest_metadata_.size())) {
+        LOG(WARNING) << "Unable to save the verified manifest to "
+                     << verified_manifest_path_;
+        return;
+    }
+
+    if (!prefs_->SetString(kPrefsVerifiedManifestSignedSHA256Context,
+                           signed_hash_context_)) {
+        LOG(WARNING) << "Unable to save the verified signed hash context.";
+        return;
+    }
+
+    LOG_IF(WARNING, !prefs_->SetString(kPrefsVerifiedManifestHash,
+                                       install_plan_->payload_hash))
+            << "Unable to save the verified manifest hash.";
+}
+
 bool PayloadProcessor::SetNewPartitionInfo()
 {
     TEST_AND_RETURN_FALSE(manifest_valid_ &&
@@ -585,13 +883,53 @@ bool PayloadProcessor::ResetUpdateProgress(PrefsInterface *prefs, bool quick)
         prefs->SetString(kPrefsUpdateStateSignatureBlob, "");
         prefs->SetInt64(kPrefsManifestMetadataSize, -1);
         prefs->SetInt64(kPrefsResumedUpdateFailures, 0);
+        prefs->SetInt64(kPrefsUpdateStatePartialDataLength, 0);
+        prefs->SetInt64(kPrefsUpdateStatePartialDataOffset, -1);
+        PLOG_IF(WARNING, unlink(kUpdatePartialDataPath) != 0 &&
+                errno != ENOENT)
+                << "Unable to remove " << kUpdatePartialDataPath;
     }
 
     return true;
 }
 
+uint64_t PayloadProcessor::GetPartialDataLength(PrefsInterface *prefs,
+                                                const string &partial_data_path)
+{
+    int64_t next_data_offset = -1;
+    int64_t partial_data_offset = -1;
+    int64_t partial_data_length = 0;
+
+    // The partial data is only valid for the operation it was spooled for.
+    if (!prefs->GetInt64(kPrefsUpdateStateNextDataOffset, &next_data_offset) ||
+            !prefs->GetInt64(kPrefsUpdateStatePartialDataOffset,
+                             &partial_data_offset) ||
+            !prefs->GetInt64(kPrefsUpdateStatePartialDataLength,
+                             &partial_data_length) ||
+            next_data_offset < 0 ||
+            partial_data_offset != next_data_offset ||
+            partial_data_length <= 0) {
+        return 0;
+    }
+
+    if (utils::FileSize(partial_data_path) < partial_data_length) {
+        LOG(WARNING) << "Partial data file " << partial_data_path
+                     << " is shorter than " << partial_data_length << " bytes.";
+        return 0;
+    }
+
+    return partial_data_length;
+}
+
 bool PayloadProcessor::CheckpointUpdateProgress()
 {
+    // A resumed update downloads all the remaining data and expects the
+    // payload hash of everything before it, nor does it know which
+    // operations to skip, so start over instead.
+    if (!skipped_operations_.empty()) {
+        return true;
+    }
+
     Terminator::set_exit_blocked(true);
 
     if (last_updated_buffer_offset_ != buffer_offset_) {
@@ -620,7 +958,12 @@ bool PayloadProcessor::PrimeUpdateState()
             next_operation == kUpdateStateOperationInvalid ||
             next_operation <= 0) {
         // Initiating a new update, no more state needs to be initialized.
-        TEST_AND_RETURN_FALSE(VerifySource());
+        // The download can't have skipped any spooled data then.
+        TEST_AND_RETURN_FALSE(partial_data_.empty());
+
+        // Without the copy of the running system there's no source to verify,
+        // but no operation reading it is applied either.
+        TEST_AND_RETURN_FALSE(!skipped_operations_.empty() || VerifySource());
         return true;
     }
 
@@ -655,6 +998,15 @@ bool PayloadProcessor::PrimeUpdateState()
                           manifest_metadata_size > 0);
     manifest_metadata_size_ = manifest_metadata_size;
 
+    // The download skipped the data spooled for the next operation.
+    if (!partial_data_.empty()) {
+        buffer_.insert(buffer_.begin(), partial_data_.begin(),
+                       partial_data_.end());
+        LOG(INFO) << "Resuming with " << partial_data_.size()
+                  << " bytes of partially downloaded operation data";
+        partial_data_.clear();
+    }
+
     // Speculatively count the resume as a failure.
     int64_t resumed_update_failures;
 
@@ -668,4 +1020,152 @@ bool PayloadProcessor::PrimeUpdateState()
     return true;
 }
 
+void PayloadProcessor::SpoolPartialData()
+{
+    const InstallOperation *op = operations_[next_operation_num_].second;
+
+    // Small blobs are cheap enough to download again. Updates skipping data
+    // can't be resumed at all.
+    if (op->data_length() < kPartialDataCheckpointSize || partial_data_failed_ ||
+            skipped_data_length_ > 0) {
+        return;
+    }
+
+    if (partial_data_fd_ < 0 && !OpenPartialData()) {
+        LOG(WARNING) << "Unable to spool the data of operation "
+                     << next_operation_num_ << " to " << partial_data_path_;
+        partial_data_failed_ = true;
+        return;
+    }
+
+    const uint64_t available = std::min<uint64_t>(buffer_.size(),
+                                                  op->data_length());
+
+    if (available > partial_data_spooled_) {
+        if (!utils::WriteAll(partial_data_fd_,
+                             &buffer_[partial_data_spooled_],
+                             available - partial_data_spooled_)) {
+            PLOG(WARNING) << "Unable to write to " << partial_data_path_;
+            partial_data_failed_ = true;
+            return;
+        }
+
+        partial_data_spooled_ = available;
+    }
+
+    if (partial_data_spooled_ - partial_data_checkpointed_ <
+            kPartialDataCheckpointSize) {
+        return;
+    }
+
+    // The data must hit the disk before it's declared usable.
+    if (fdatasync(partial_data_fd_) != 0 ||
+            !prefs_->SetInt64(kPrefsUpdateStatePartialDataLength,
+                              partial_data_spooled_)) {
+        LOG(WARNING) << "Unable to checkpoint the partial data of operation "
+                     << next_operation_num_;
+        partial_data_failed_ = true;
+        return;
+    }
+
+    partial_data_checkpointed_ = partial_data_spooled_;
+}
+
+bool PayloadProcessor::OpenPartialData()
+{
+    // Invalidate whatever was spooled before reusing the file.
+    TEST_AND_RETURN_FALSE(prefs_->SetInt64(kPrefsUpdateStatePartialDataLength,
+                                           0));
+    partial_data_fd_ = open(partial_data_path_.c_str(),
+                            O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    TEST_AND_RETURN_FALSE_ERRNO(partial_data_fd_ >= 0);
+    TEST_AND_RETURN_FALSE(prefs_->SetInt64(kPrefsUpdateStatePartialDataOffset,
+                                           buffer_offset_));
+    partial_data_spooled_ = 0;
+    partial_data_checkpointed_ = 0;
+    return true;
+}
+
+bool PayloadProcessor::PlanResumedRanges(
+    vector<pair<uint64_t, uint64_t>> *ranges)
+{
+    CHECK(!manifest_valid_ && buffer_.empty());
+
+    int64_t manifest_metadata_size = 0;
+    int64_t next_data_offset = -1;
+
+    if (!prefs_->GetInt64(kPrefsManifestMetadataSize,
+                          &manifest_metadata_size) ||
+            manifest_metadata_size <= 0 ||
+            !prefs_->GetInt64(kPrefsUpdateStateNextDataOffset,
+                              &next_data_offset) ||
+            next_data_offset < 0) {
+        return false;
+    }
+
+    if (!LoadPartialData()) {
+        // Whatever was spooled is unusable, download the whole operation
+        // again instead.
+        ClosePartialData();
+        partial_data_.clear();
+        unlink(partial_data_path_.c_str());
+        prefs_->SetInt64(kPrefsUpdateStatePartialDataLength, 0);
+        prefs_->SetInt64(kPrefsUpdateStatePartialDataOffset, -1);
+        return false;
+    }
+
+    ranges->clear();
+    ranges->emplace_back(0, manifest_metadata_size);
+    const uint64_t resume_offset = manifest_metadata_size + next_data_offset +
+                                   partial_data_.size();
+
+    if (resume_offset < install_plan_->payload_size) {
+        ranges->emplace_back(resume_offset,
+                             install_plan_->payload_size - resume_offset);
+    }
+
+    return true;
+}
+
+bool PayloadProcessor::LoadPartialData()
+{
+    const uint64_t length = GetPartialDataLength(prefs_, partial_data_path_);
+
+    if (length == 0) {
+        return false;
+    }
+
+    partial_data_fd_ = open(partial_data_path_.c_str(), O_RDWR);
+    TEST_AND_RETURN_FALSE_ERRNO(partial_data_fd_ >= 0);
+
+    partial_data_.resize(length);
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(partial_data_fd_, &partial_data_[0],
+                                          length, 0, &bytes_read) &&
+                          static_cast<uint64_t>(bytes_read) == length);
+
+    // Drop anything written after the last checkpoint and keep appending.
+    TEST_AND_RETURN_FALSE_ERRNO(ftruncate(partial_data_fd_, length) == 0);
+    TEST_AND_RETURN_FALSE_ERRNO(lseek(partial_data_fd_, length, SEEK_SET) ==
+                                static_cast<off_t>(length));
+
+    partial_data_spooled_ = length;
+    partial_data_checkpointed_ = length;
+    return true;
+}
+
+void PayloadProcessor::ClosePartialData()
+{
+    if (partial_data_fd_ >= 0) {
+        close(partial_data_fd_);
+        partial_data_fd_ = -1;
+        PLOG_IF(WARNING, unlink(partial_data_path_.c_str()) != 0)
+                << "Unable to remove " << partial_data_path_;
+    }
+
+    partial_data_spooled_ = 0;
+    partial_data_checkpointed_ = 0;
+    partial_data_failed_ = false;
+}
+
 }  // namespace chromeos_update_engine
@@ -9,6 +9,9 @@
 #include <inttypes.h>
 
 #include <limits>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "update_engine/delta_performer.h"
 #include "update_engine/file_writer.h"
@@ -30,6 +33,13 @@ public:
 
     static const char kUpdatePayloadPublicKeyPath[];
     static const char kUpdatePayloadPublicKeyOverridePath[];
+    static const char kUpdatePartialDataPath[];
+    static const char kVerifiedManifestPath[];
+
+    // Operations with at least this much data have their partially downloaded
+    // data spooled to disk, checkpointed every time this many more bytes
+    // arrive.
+    static const uint64_t kPartialDataCheckpointSize;
 
     PayloadProcessor(PrefsInterface *prefs, InstallPlan *install_plan);
 
@@ -55,7 +65,8 @@ public:
     // payload, against the update check hash and size from the install_plan.
     // Returns kActionCodeSuccess on success, an error code on failure.  This
     // method should be called after closing the stream.  Note this method skips
-    // the signed hash check if the public key is unavailable; it returns
+    // the signed hash check if the public key is unavailable, in which case
+    // the manifest isn't cached as verified either; it returns
     // kActionCodeSignedDeltaPayloadExpectedError if the public key is available
     // but the delta payload doesn't include a signature.
     ActionExitCode VerifyPayload();
@@ -71,11 +82,84 @@ public:
     // success, false otherwise.
     static bool ResetUpdateProgress(PrefsInterface *prefs, bool quick);
 
+    // Returns the number of data bytes of the next operation that were spooled
+    // to |partial_data_path| by an interrupted update and can be reused when
+    // resuming, 0 if there are none. Downloads should resume after them.
+    static uint64_t GetPartialDataLength(PrefsInterface *prefs,
+                                         const std::string &partial_data_path);
+
     void set_public_key_path(const std::string &public_key_path)
     {
         public_key_path_ = public_key_path;
     }
 
+    void set_partial_data_path(const std::string &partial_data_path)
+    {
+        partial_data_path_ = partial_data_path;
+    }
+
+    void set_verified_manifest_path(const std::string &verified_manifest_path)
+    {
+        verified_manifest_path_ = verified_manifest_path;
+    }
+
+    // Reads the header and manifest cached at |verified_manifest_path| into
+    // |metadata| if |prefs| say they are those of the payload with
+    // |payload_hash|, verified by an earlier attempt. Returns false otherwise.
+    static bool LoadVerifiedManifest(PrefsInterface *prefs,
+                                     const std::string &payload_hash,
+                                     const std::string &verified_manifest_path,
+                                     std::vector<char> *metadata);
+
+    // Forgets the header and manifest an earlier attempt verified and cached
+    // at |verified_manifest_path|, so that the next attempt copies the
+    // running system to the partitions again rather than trusting what's on
+    // them. Called whenever the partitions are overwritten or fail to verify.
+    static void ResetVerifiedManifest(PrefsInterface *prefs,
+                                      const std::string &verified_manifest_path);
+
+    // Sets |applied_operations| to whether the destination of each operation
+    // of the payload with the header and manifest |metadata| already holds
+    // the data it writes on the partitions of |install_plan|, e.g. because an
+    // earlier attempt applied the payload and failed later on. Returns true
+    // if some do and none of the others reads source blocks, so that the
+    // payload can be applied without first copying the running system to the
+    // partitions. Reads the destination of every operation, so it shouldn't
+    // run on the main loop; it doesn't touch anything but the partitions.
+    static bool FindAppliedOperations(const std::vector<char> &metadata,
+                                      const InstallPlan &install_plan,
+                                      std::vector<bool> *applied_operations);
+
+    // Leaves the operations in |install_plan->applied_operations|, found by
+    // FindAppliedOperations() before the partitions were left uncopied, out
+    // of the update. Must be called after Open() and before the first
+    // Write(). Returns true if there are some, in which case |ranges| is set
+    // to the (offset, length) payload ranges that still have to be written,
+    // in order. Otherwise the whole payload must be written as usual.
+    //
+    // Skipping data rules out checking the payload hash. The downloaded
+    // manifest must instead match the verified one, the downloaded data is
+    // checked against the operation hashes in it and the signature against
+    // the payload hash saved when the payload was verified.
+    bool PlanSkippedOperations(
+        std::vector<std::pair<uint64_t, uint64_t>> *ranges);
+
+    // Loads the data of the next operation that an interrupted update spooled
+    // to the partial data file. Must be called after Open() and before the
+    // first Write() of a resumed update. Returns true if there is some, in
+    // which case |ranges| is set to the (offset, length) payload ranges that
+    // still have to be written: the metadata and the data after the spooled
+    // bytes. Otherwise, including when the spooled data can't be read, the
+    // partial data is discarded and the download resumes from the start of
+    // the operation as usual.
+    bool PlanResumedRanges(std::vector<std::pair<uint64_t, uint64_t>> *ranges);
+
+    // Number of payload bytes that PlanSkippedOperations() left out.
+    uint64_t skipped_data_length() const
+    {
+        return skipped_data_length_;
+    }
+
 private:
     // Parses the manifest and finishes any initialization that needs info from
     // the manifest. Result may be kActionCodeDownloadIncomplete.
@@ -84,6 +168,14 @@ private:
     // Execute a single operation. Result may be kActionCodeDownloadIncomplete.
     ActionExitCode PerformOperation();
 
+    // Returns the writer for the operations of |proc|, the main partition if
+    // null, or null if the operations aren't applied on this system.
+    DeltaPerformer *GetPerformer(const InstallProcedure *proc);
+
+    // Stores the manifest of the payload whose signature was just checked,
+    // so that a later attempt to apply the same payload can skip data.
+    void SaveVerifiedManifest();
+
     // Verifies that the expected source hashes (if present) match the hash
     // for the current partition/files. Returns true if there're no expected
     // hash in the payload (e.g., if it's a new-style full update) or if the
@@ -111,6 +203,23 @@ private:
     bool SetNewPartitionInfo();
     bool SetNewKernelInfo();
 
+    // Appends the data received so far for the next operation to the partial
+    // data file and periodically checkpoints its length so that a resumed
+    // update doesn't have to download it again. Failures only disable
+    // spooling for the current operation.
+    void SpoolPartialData();
+
+    // Starts a new partial data file for the operation at |buffer_offset_|.
+    bool OpenPartialData();
+
+    // Reads the partial data spooled by an interrupted update into
+    // |partial_data_|. Returns false if there is none or it can't be read.
+    bool LoadPartialData();
+
+    // Closes and removes the partial data file once the operation has been
+    // performed or its spooled data is unusable.
+    void ClosePartialData();
+
     // Writer for the main partition to be updated.
     DeltaPerformer partition_performer_;
 
@@ -127,6 +236,9 @@ private:
     bool manifest_valid_;
     uint64_t manifest_metadata_size_;
 
+    // The payload header and manifest, as downloaded.
+    std::vector<char> manifest_metadata_;
+
     // Index of the next operation to perform in the manifest.
     size_t next_operation_num_;
 
@@ -164,6 +276,33 @@ private:
     // tests can override with test keys.
     std::string public_key_override_path_;
 
+    // Where partially downloaded operation data is spooled.
+    std::string partial_data_path_;
+    int partial_data_fd_;
+
+    // Number of bytes at the head of |buffer_| written to the partial data
+    // file, and how many of those were checkpointed in the prefs.
+    uint64_t partial_data_spooled_;
+    uint64_t partial_data_checkpointed_;
+
+    // Set if spooling failed for the next operation.
+    bool partial_data_failed_;
+
+    // The data loaded by PlanResumedRanges(), prepended to |buffer_| once the
+    // update state is primed.
+    std::vector<char> partial_data_;
+
+    // Where the metadata of the last verified payload is cached.
+    std::string verified_manifest_path_;
+
+    // The cached metadata the download must match and the signed hash context
+    // saved with it, which operations are skipped and the total length of the
+    // data left out of the download.
+    std::vector<char> verified_manifest_metadata_;
+    std::string verified_signed_hash_context_;
+    std::vector<bool> skipped_operations_;
+    uint64_t skipped_data_length_;
+
     DISALLOW_COPY_AND_ASSIGN(PayloadProcessor);
 };
 
@@ -4,6 +4,7 @@
 
 #include <sys/mount.h>
 #include <sys/types.h>
+#include <endian.h>
 #include <inttypes.h>
 #include <unistd.h>
 
@@ -18,11 +19,15 @@
 #include "files/scoped_file.h"
 #include "strings/string_printf.h"
 #include "update_engine/delta_diff_generator.h"
+#include "update_engine/delta_metadata.h"
 #include "update_engine/extent_ranges.h"
+#include "update_engine/filesystem_copier_action.h"
 #include "update_engine/full_update_generator.h"
 #include "update_engine/graph_types.h"
+#include "update_engine/omaha_hash_calculator.h"
 #include "update_engine/payload_processor.h"
 #include "update_engine/payload_signer.h"
+#include "update_engine/prefs.h"
 #include "update_engine/prefs_mock.h"
 #include "update_engine/test_utils.h"
 #include "update_engine/update_metadata.pb.h"
@@ -35,7 +40,9 @@ using std::string;
 using std::vector;
 using strings::StringPrintf;
 using testing::_;
+using testing::DoAll;
 using testing::Return;
+using testing::SaveArg;
 
 extern const char *kUnittestPrivateKeyPath;
 extern const char *kUnittestPublicKeyPath;
@@ -89,6 +96,15 @@ struct DeltaState {
 
     // The in-memory copy of delta file.
     vector<char> delta;
+
+    // Where the payload processor caches the manifest once verified, and the
+    // signed hash context it saves along.
+    string verified_manifest_path;
+    string verified_signed_hash_context;
+
+    // Outlives the payload processor, which uses it until the payload is
+    // verified.
+    PrefsMock prefs;
 };
 } // namespace {}
 
@@ -512,7 +528,7 @@ static void ApplyDeltaFile(DeltaState *state,
         EXPECT_EQ(noop_operations_size, manifest.noop_operations_size());
     }
 
-    PrefsMock prefs;
+    PrefsMock &prefs = state->prefs;
     EXPECT_CALL(prefs, SetInt64(kPrefsManifestMetadataSize,
                                 state->metadata_size)).WillOnce(Return(true));
     EXPECT_CALL(prefs, SetInt64(kPrefsUpdateStateNextOperation, _))
@@ -523,6 +539,16 @@ static void ApplyDeltaFile(DeltaState *state,
     .WillRepeatedly(Return(true));
     EXPECT_CALL(prefs, SetString(kPrefsUpdateStateSHA256Context, _))
     .WillRepeatedly(Return(true));
+    EXPECT_CALL(prefs, SetInt64(kPrefsUpdateStatePartialDataLength, _))
+    .WillRepeatedly(Return(true));
+    EXPECT_CALL(prefs, SetInt64(kPrefsUpdateStatePartialDataOffset, _))
+    .WillRepeatedly(Return(true));
+
+    EXPECT_CALL(prefs, SetString(kPrefsVerifiedManifestHash, _))
+    .WillRepeatedly(Return(true));
+    EXPECT_CALL(prefs, SetString(kPrefsVerifiedManifestSignedSHA256Context, _))
+    .WillRepeatedly(DoAll(SaveArg<1>(&state->verified_signed_hash_context),
+                          Return(true)));
 
     if (op_hash_test == kValidOperationData &&
             state->signature_test != kSignatureNone) {
@@ -542,6 +568,14 @@ static void ApplyDeltaFile(DeltaState *state,
     *performer = new PayloadProcessor(&prefs, &state->install_plan);
     EXPECT_TRUE(utils::FileExists(kUnittestPublicKeyPath));
     (*performer)->set_public_key_path(kUnittestPublicKeyPath);
+    string partial_data_path;
+    EXPECT_TRUE(utils::MakeTempFile("/tmp/partial_data.XXXXXX",
+                                    &partial_data_path, NULL));
+    ScopedPathUnlinker partial_data_unlinker(partial_data_path);
+    (*performer)->set_partial_data_path(partial_data_path);
+    EXPECT_TRUE(utils::MakeTempFile("/tmp/verified_manifest.XXXXXX",
+                                    &state->verified_manifest_path, NULL));
+    (*performer)->set_verified_manifest_path(state->verified_manifest_path);
 
     EXPECT_EQ(state->image_size,
               OmahaHashCalculator::RawHashOfFile(
@@ -689,6 +723,7 @@ void DoSmallImageTest(DeltaState *state)
     ScopedPathUnlinker b_kernel_unlinker(state->b_kernel);
     ScopedPathUnlinker delta_unlinker(state->delta_path);
     ApplyDeltaFile(state, kValidOperationData, &performer);
+    ScopedPathUnlinker manifest_unlinker(state->verified_manifest_path);
     VerifyPayload(performer, state);
 }
 
@@ -706,6 +741,7 @@ void DoOperationHashMismatchTest(OperationHashTest op_hash_test)
     ScopedPathUnlinker delta_unlinker(state.delta_path);
     PayloadProcessor *performer;
     ApplyDeltaFile(&state, op_hash_test, &performer);
+    ScopedPathUnlinker manifest_unlinker(state.verified_manifest_path);
 }
 
 class PayloadProcessorTest : public ::testing::Test { };
@@ -768,9 +804,541 @@ TEST(PayloadProcessorTest, BadDeltaMagicTest)
     EXPECT_LT(performer.Close(), 0);
 }
 
+TEST(PayloadProcessorTest, PartialDataLengthTest)
+{
+    files::FilePath prefs_dir;
+    ASSERT_TRUE(files::CreateNewTempDirectory("auprefs", &prefs_dir));
+    Prefs prefs;
+    ASSERT_TRUE(prefs.Init(prefs_dir));
+    const string partial_data_path = prefs_dir.Append("partial-data").value();
+
+    EXPECT_EQ(0U, PayloadProcessor::GetPartialDataLength(&prefs,
+                                                         partial_data_path));
+
+    EXPECT_TRUE(prefs.SetInt64(kPrefsUpdateStateNextDataOffset, 4096));
+    EXPECT_TRUE(prefs.SetInt64(kPrefsUpdateStatePartialDataOffset, 4096));
+    EXPECT_TRUE(prefs.SetInt64(kPrefsUpdateStatePartialDataLength, 10));
+
+    // The spooled data must be on disk.
+    EXPECT_EQ(0U, PayloadProcessor::GetPartialDataLength(&prefs,
+                                                         partial_data_path));
+    EXPECT_TRUE(utils::WriteFile(partial_data_path.c_str(), "0123456789ab", 12));
+    EXPECT_EQ(10U, PayloadProcessor::GetPartialDataLength(&prefs,
+                                                          partial_data_path));
+
+    // Spooled data of an operation that completed doesn't count.
+    EXPECT_TRUE(prefs.SetInt64(kPrefsUpdateStateNextDataOffset, 8192));
+    EXPECT_EQ(0U, PayloadProcessor::GetPartialDataLength(&prefs,
+                                                         partial_data_path));
+
+    EXPECT_TRUE(PayloadProcessor::ResetUpdateProgress(&prefs, false));
+    EXPECT_EQ(0U, PayloadProcessor::GetPartialDataLength(&prefs,
+                                                         partial_data_path));
+
+    files::DeleteFile(prefs_dir, true);  // recursive
+}
+
+namespace {
+// Returns a payload that writes |first| and then |second| to the blocks of
+// the partition, signed with the unittest key if |sign| is set, and sets
+// |metadata_size|.
+string MakeTwoOperationPayload(const vector<char> &first,
+                               const vector<char> &second,
+                               bool sign,
+                               uint64_t *metadata_size)
+{
+    DeltaArchiveManifest manifest;
+    manifest.set_block_size(kBlockSize);
+    uint64_t offset = 0;
+
+    for (const vector<char> *data : {&first, &second}) {
+        InstallOperation *op = manifest.add_partition_operations();
+        op->set_type(InstallOperation_Type_REPLACE);
+        op->set_data_offset(offset);
+        op->set_data_length(data->size());
+        vector<char> hash;
+        EXPECT_TRUE(OmahaHashCalculator::RawHashOfData(*data, &hash));
+        op->set_data_sha256_hash(hash.data(), hash.size());
+        op->set_dst_sha256_hash(hash.data(), hash.size());
+        Extent *extent = op->add_dst_extents();
+        extent->set_start_block(offset / kBlockSize);
+        extent->set_num_blocks(data->size() / kBlockSize);
+        offset += data->size();
+    }
+
+    vector<char> new_partition(first);
+    new_partition.insert(new_partition.end(), second.begin(), second.end());
+    vector<char> new_partition_hash;
+    EXPECT_TRUE(OmahaHashCalculator::RawHashOfData(new_partition,
+                &new_partition_hash));
+    manifest.mutable_new_partition_info()->set_size(new_partition.size());
+    manifest.mutable_new_partition_info()->set_hash(new_partition_hash.data(),
+            new_partition_hash.size());
+
+    const vector<string> key_paths(1, kUnittestPrivateKeyPath);
+    uint64_t signature_size = 0;
+
+    if (sign) {
+        EXPECT_TRUE(PayloadSigner::SignatureBlobLength(key_paths,
+                    &signature_size));
+        manifest.set_signatures_offset(offset);
+        manifest.set_signatures_size(signature_size);
+    }
+
+    string serialized_manifest;
+    EXPECT_TRUE(manifest.AppendToString(&serialized_manifest));
+    const uint64_t version_be = htobe64(kDeltaVersion);
+    const uint64_t manifest_size_be = htobe64(serialized_manifest.size());
+    string payload(kDeltaMagic, kDeltaMagicSize);
+    payload.append(reinterpret_cast<const char *>(&version_be),
+                   sizeof(version_be));
+    payload.append(reinterpret_cast<const char *>(&manifest_size_be),
+                   sizeof(manifest_size_be));
+    payload += serialized_manifest;
+    *metadata_size = payload.size();
+    payload.append(first.begin(), first.end());
+    payload.append(second.begin(), second.end());
+
+    if (sign) {
+        string payload_path;
+        EXPECT_TRUE(utils::MakeTempFile("/tmp/payload.XXXXXX", &payload_path,
+                                        NULL));
+        ScopedPathUnlinker payload_unlinker(payload_path);
+        EXPECT_TRUE(utils::WriteFile(payload_path.c_str(), payload.data(),
+                                     payload.size()));
+        vector<char> signature_blob;
+        EXPECT_TRUE(PayloadSigner::SignPayload(payload_path, key_paths,
+                                               &signature_blob));
+        EXPECT_EQ(signature_size, signature_blob.size());
+        payload.append(signature_blob.begin(), signature_blob.end());
+    }
+
+    return payload;
+}
+
+// Applies the first |length| bytes of |payload| and stops, as if the update
+// was interrupted.
+void InterruptUpdate(const string &payload,
+                     uint64_t length,
+                     PrefsInterface *prefs,
+                     InstallPlan *install_plan,
+                     const string &partial_data_path)
+{
+    PayloadProcessor processor(prefs, install_plan);
+    processor.set_partial_data_path(partial_data_path);
+    EXPECT_EQ(0, processor.Open());
+    EXPECT_TRUE(processor.Write(payload.data(), length));
+    EXPECT_NE(0, processor.Close());
+}
+
+// Runs FilesystemCopierAction on |install_plan| as the update attempter
+// does and returns the install plan it passes on.
+InstallPlan RunFilesystemCopier(const InstallPlan &install_plan,
+                                PrefsInterface *prefs,
+                                const string &verified_manifest_path)
+{
+    ActionProcessor processor;
+    ActionTestDelegate<FilesystemCopierAction> delegate;
+    ObjectFeederAction<InstallPlan> feeder_action;
+    FilesystemCopierAction copier_action(false);
+    ObjectCollectorAction<InstallPlan> collector_action;
+
+    feeder_action.set_obj(install_plan);
+    copier_action.set_verified_manifest(prefs, verified_manifest_path);
+    BondActions(&feeder_action, &copier_action);
+    BondActions(&copier_action, &collector_action);
+    processor.EnqueueAction(&feeder_action);
+    processor.EnqueueAction(&copier_action);
+    processor.EnqueueAction(&collector_action);
+    delegate.RunProcessorInMainLoop(&processor);
+    EXPECT_TRUE(delegate.ran());
+    EXPECT_EQ(kActionCodeSuccess, delegate.code());
+    return collector_action.object();
+}
+
+// Downloads |payload| as the download action does, leaving out what the
+// install plan says is applied already, and returns the verification result.
+// Sets |skipped_data_length| to the bytes left out.
+ActionExitCode ApplyPayload(const string &payload,
+                            PrefsInterface *prefs,
+                            InstallPlan *install_plan,
+                            const string &verified_manifest_path,
+                            uint64_t *skipped_data_length)
+{
+    string partial_data_path;
+    EXPECT_TRUE(utils::MakeTempFile("/tmp/partial_data.XXXXXX",
+                                    &partial_data_path, NULL));
+    ScopedPathUnlinker partial_data_unlinker(partial_data_path);
+    // Every attempt is a new update, as the response handler makes it.
+    EXPECT_TRUE(PayloadProcessor::ResetUpdateProgress(prefs, false));
+    PayloadProcessor processor(prefs, install_plan);
+    processor.set_public_key_path(kUnittestPublicKeyPath);
+    processor.set_partial_data_path(partial_data_path);
+    processor.set_verified_manifest_path(verified_manifest_path);
+    EXPECT_EQ(0, processor.Open());
+    vector<std::pair<uint64_t, uint64_t>> ranges;
+
+    if (!processor.PlanSkippedOperations(&ranges)) {
+        ranges.assign(1, std::make_pair(0, payload.size()));
+    }
+
+    for (const std::pair<uint64_t, uint64_t> &range : ranges) {
+        EXPECT_TRUE(processor.Write(&payload[range.first], range.second));
+    }
+
+    EXPECT_EQ(0, processor.Close());
+    *skipped_data_length = processor.skipped_data_length();
+    return processor.VerifyPayload();
+}
+}  // namespace {}
+
+TEST(PayloadProcessorTest, ResumeWithPartialDataTest)
+{
+    files::FilePath prefs_dir;
+    ASSERT_TRUE(files::CreateNewTempDirectory("auprefs", &prefs_dir));
+    Prefs prefs;
+    ASSERT_TRUE(prefs.Init(prefs_dir));
+    const string partial_data_path = prefs_dir.Append("partial-data").value();
+
+    vector<char> first(kBlockSize), second(512 * kBlockSize);
+    FillWithData(&first);
+    FillWithData(&second);
+    second[0] = 'x';
+    uint64_t metadata_size = 0;
+    const string payload = MakeTwoOperationPayload(first, second, false,
+                           &metadata_size);
+    vector<char> expected(first);
+    expected.insert(expected.end(), second.begin(), second.end());
+
+    string partition_path;
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/partition.XXXXXX", &partition_path,
+                                    NULL));
+    ScopedPathUnlinker partition_unlinker(partition_path);
+    InstallPlan install_plan;
+    install_plan.partition_path = partition_path;
+    install_plan.payload_size = payload.size();
+
+    // Interrupt the second operation once some of its data was spooled.
+    const uint64_t spooled = 3 * PayloadProcessor::kPartialDataCheckpointSize /
+                             2;
+    InterruptUpdate(payload, metadata_size + first.size() + spooled, &prefs,
+                    &install_plan, partial_data_path);
+    EXPECT_EQ(spooled, PayloadProcessor::GetPartialDataLength(
+                  &prefs, partial_data_path));
+
+    // The resumed download starts after the spooled data.
+    install_plan.is_resume = true;
+    {
+        PayloadProcessor processor(&prefs, &install_plan);
+        processor.set_partial_data_path(partial_data_path);
+        EXPECT_EQ(0, processor.Open());
+        vector<std::pair<uint64_t, uint64_t>> ranges;
+        EXPECT_TRUE(processor.PlanResumedRanges(&ranges));
+        ASSERT_EQ(2U, ranges.size());
+        EXPECT_EQ(0U, ranges[0].first);
+        EXPECT_EQ(metadata_size, ranges[0].second);
+        EXPECT_EQ(metadata_size + first.size() + spooled, ranges[1].first);
+        EXPECT_EQ(second.size() - spooled, ranges[1].second);
+
+        for (const std::pair<uint64_t, uint64_t> &range : ranges) {
+            EXPECT_TRUE(processor.Write(&payload[range.first], range.second));
+        }
+
+        EXPECT_EQ(0, processor.Close());
+    }
+
+    // The partial data is gone once its operation is performed.
+    EXPECT_FALSE(utils::FileExists(partial_data_path.c_str()));
+    vector<char> partition;
+    EXPECT_TRUE(utils::ReadFile(partition_path, &partition));
+    EXPECT_TRUE(partition == expected);
+
+    // Interrupt again, then lose the end of the spooled data.
+    EXPECT_TRUE(PayloadProcessor::ResetUpdateProgress(&prefs, false));
+    EXPECT_TRUE(WriteFileVector(partition_path, vector<char>(
+                                    expected.size(), 'j')));
+    install_plan.is_resume = false;
+    InterruptUpdate(payload, metadata_size + first.size() + spooled, &prefs,
+                    &install_plan, partial_data_path);
+    EXPECT_EQ(0, truncate(partial_data_path.c_str(), spooled - 1));
+
+    // The resumed download starts from the beginning of the operation.
+    install_plan.is_resume = true;
+    {
+        PayloadProcessor processor(&prefs, &install_plan);
+        processor.set_partial_data_path(partial_data_path);
+        EXPECT_EQ(0, processor.Open());
+        vector<std::pair<uint64_t, uint64_t>> ranges;
+        EXPECT_FALSE(processor.PlanResumedRanges(&ranges));
+        EXPECT_FALSE(utils::FileExists(partial_data_path.c_str()));
+        EXPECT_EQ(0U, PayloadProcessor::GetPartialDataLength(
+                      &prefs, partial_data_path));
+
+        EXPECT_TRUE(processor.Write(payload.data(), metadata_size));
+        EXPECT_TRUE(processor.Write(&payload[metadata_size + first.size()],
+                                    second.size()));
+        EXPECT_EQ(0, processor.Close());
+    }
+
+    partition.clear();
+    EXPECT_TRUE(utils::ReadFile(partition_path, &partition));
+    EXPECT_TRUE(partition == expected);
+
+    files::DeleteFile(prefs_dir, true);  // recursive
+}
+
+TEST(PayloadProcessorTest, ReapplyWithoutCopyTest)
+{
+    files::FilePath prefs_dir;
+    ASSERT_TRUE(files::CreateNewTempDirectory("auprefs", &prefs_dir));
+    Prefs prefs;
+    ASSERT_TRUE(prefs.Init(prefs_dir));
+    const string verified_manifest_path =
+        prefs_dir.Append("verified-manifest").value();
+
+    vector<char> first(kBlockSize), second(16 * kBlockSize);
+    FillWithData(&first);
+    FillWithData(&second);
+    second[0] = 'x';
+    uint64_t metadata_size = 0;
+    const string payload = MakeTwoOperationPayload(first, second, true,
+                           &metadata_size);
+    vector<char> expected(first);
+    expected.insert(expected.end(), second.begin(), second.end());
+
+    // The running system has none of the update.
+    string old_partition_path, partition_path;
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/old_partition.XXXXXX",
+                                    &old_partition_path, NULL));
+    ScopedPathUnlinker old_partition_unlinker(old_partition_path);
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/partition.XXXXXX", &partition_path,
+                                    NULL));
+    ScopedPathUnlinker partition_unlinker(partition_path);
+    const vector<char> old_data(expected.size(), 'o');
+    ASSERT_TRUE(utils::WriteFile(old_partition_path.c_str(), old_data.data(),
+                                 old_data.size()));
+
+    InstallPlan install_plan;
+    install_plan.old_partition_path = old_partition_path;
+    install_plan.partition_path = partition_path;
+    install_plan.payload_size = payload.size();
+    install_plan.payload_hash = OmahaHashCalculator::OmahaHashOfString(payload);
+
+    // The first attempt copies the running system and applies everything.
+    InstallPlan plan = RunFilesystemCopier(install_plan, &prefs,
+                                           verified_manifest_path);
+    EXPECT_TRUE(plan.applied_operations.empty());
+    uint64_t skipped_data_length = 0;
+    EXPECT_EQ(kActionCodeSuccess,
+              ApplyPayload(payload, &prefs, &plan, verified_manifest_path,
+                           &skipped_data_length));
+    EXPECT_EQ(0U, skipped_data_length);
+    vector<char> partition;
+    EXPECT_TRUE(utils::ReadFile(partition_path, &partition));
+    EXPECT_TRUE(partition == expected);
+
+    // Clobber the first operation's block, as if a later step had failed
+    // midway.
+    vector<char> junk(kBlockSize, 'j');
+    {
+        int fd = open(partition_path.c_str(), O_WRONLY);
+        ASSERT_GE(fd, 0);
+        files::ScopedFD fd_closer(fd);
+        EXPECT_TRUE(utils::PWriteAll(fd, &junk[0], junk.size(), 0));
+    }
+
+    // The next attempt leaves the partition alone and downloads only what
+    // the clobbered operation and the signature need.
+    plan = RunFilesystemCopier(install_plan, &prefs, verified_manifest_path);
+    ASSERT_EQ(2U, plan.applied_operations.size());
+    EXPECT_FALSE(plan.applied_operations[0]);
+    EXPECT_TRUE(plan.applied_operations[1]);
+    partition.clear();
+    EXPECT_TRUE(utils::ReadFile(partition_path, &partition));
+    EXPECT_TRUE(std::equal(second.begin(), second.end(),
+                           partition.begin() + kBlockSize));
+
+    // The signature is still checked.
+    string tampered_payload = payload;
+    tampered_payload[tampered_payload.size() - 1]++;
+    EXPECT_EQ(kActionCodeDownloadPayloadPubKeyVerificationError,
+              ApplyPayload(tampered_payload, &prefs, &plan,
+                           verified_manifest_path, &skipped_data_length));
+
+    EXPECT_EQ(kActionCodeSuccess,
+              ApplyPayload(payload, &prefs, &plan, verified_manifest_path,
+                           &skipped_data_length));
+    EXPECT_EQ(second.size(), skipped_data_length);
+    partition.clear();
+    EXPECT_TRUE(utils::ReadFile(partition_path, &partition));
+    EXPECT_TRUE(partition == expected);
+
+    files::DeleteFile(prefs_dir, true);  // recursive
+}
+
+TEST(PayloadProcessorTest, CopyForgetsVerifiedManifestTest)
+{
+    files::FilePath prefs_dir;
+    ASSERT_TRUE(files::CreateNewTempDirectory("auprefs", &prefs_dir));
+    Prefs prefs;
+    ASSERT_TRUE(prefs.Init(prefs_dir));
+    const string verified_manifest_path =
+        prefs_dir.Append("verified-manifest").value();
+
+    vector<char> first(kBlockSize), second(16 * kBlockSize);
+    FillWithData(&first);
+    FillWithData(&second);
+    second[0] = 'x';
+    uint64_t metadata_size = 0;
+    const string payload = MakeTwoOperationPayload(first, second, true,
+                           &metadata_size);
+
+    string old_partition_path, partition_path;
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/old_partition.XXXXXX",
+                                    &old_partition_path, NULL));
+    ScopedPathUnlinker old_partition_unlinker(old_partition_path);
+    ASSERT_TRUE(utils::MakeTempFile("/tmp/partition.XXXXXX", &partition_path,
+                                    NULL));
+    ScopedPathUnlinker partition_unlinker(partition_path);
+    const vector<char> old_data(first.size() + second.size(), 'o');
+    ASSERT_TRUE(utils::WriteFile(old_partition_path.c_str(), old_data.data(),
+                                 old_data.size()));
+
+    InstallPlan install_plan;
+    install_plan.old_partition_path = old_partition_path;
+    install_plan.partition_path = partition_path;
+    install_plan.payload_size = payload.size();
+    install_plan.payload_hash = OmahaHashCalculator::OmahaHashOfString(payload);
+
+    InstallPlan plan = RunFilesystemCopier(install_plan, &prefs,
+                                           verified_manifest_path);
+    uint64_t skipped_data_length = 0;
+    EXPECT_EQ(kActionCodeSuccess,
+              ApplyPayload(payload, &prefs, &plan, verified_manifest_path,
+                           &skipped_data_length));
+    EXPECT_TRUE(utils::FileExists(verified_manifest_path.c_str()));
+
+    // Nothing of the update is left, so the next attempt copies the running
+    // system, which overwrites what the verified manifest describes.
+    EXPECT_TRUE(WriteFileVector(partition_path, vector<char>(
+                                    old_data.size(), 'j')));
+    plan = RunFilesystemCopier(install_plan, &prefs, verified_manifest_path);
+    EXPECT_TRUE(plan.applied_operations.empty());
+    vector<char> partition;
+    EXPECT_TRUE(utils::ReadFile(partition_path, &partition));
+    EXPECT_TRUE(partition == old_data);
+    EXPECT_FALSE(utils::FileExists(verified_manifest_path.c_str()));
+    string verified_hash;
+    EXPECT_TRUE(prefs.GetString(kPrefsVerifiedManifestHash, &verified_hash));
+    EXPECT_EQ("", verified_hash);
+
+    EXPECT_EQ(kActionCodeSuccess,
+              ApplyPayload(payload, &prefs, &plan, verified_manifest_path,
+                           &skipped_data_length));
+    EXPECT_TRUE(utils::FileExists(verified_manifest_path.c_str()));
+
+    // Every operation is applied, but the partition failed to verify, e.g.
+    // in blocks no operation writes. The next attempt copies it again.
+    PayloadProcessor::ResetVerifiedManifest(&prefs, verified_manifest_path);
+    EXPECT_FALSE(utils::FileExists(verified_manifest_path.c_str()));
+    plan = RunFilesystemCopier(install_plan, &prefs, verified_manifest_path);
+    EXPECT_TRUE(plan.applied_operations.empty());
+    partition.clear();
+    EXPECT_TRUE(utils::ReadFile(partition_path, &partition));
+    EXPECT_TRUE(partition == old_data);
+
+    files::DeleteFile(prefs_dir, true);  // recursive
+}
+
 TEST(PayloadProcessorTest, RunAsRootOperationHashMismatchTest)
 {
     DoOperationHashMismatchTest(kInvalidOperationData);
 }
 
+TEST(PayloadProcessorTest, RunAsRootSkipAppliedOperationsTest)
+{
+    DeltaState state;
+    state.delta_test = kFullUpdate;
+    state.signature_test = kSignatureGenerator;
+
+    // Apply the payload once, which caches the verified manifest.
+    PayloadProcessor *performer;
+    GenerateDeltaFile(&state);
+    ScopedPathUnlinker a_img_unlinker(state.a_img);
+    ScopedPathUnlinker b_img_unlinker(state.b_img);
+    ScopedPathUnlinker a_kernel_unlinker(state.a_kernel);
+    ScopedPathUnlinker b_kernel_unlinker(state.b_kernel);
+    ScopedPathUnlinker delta_unlinker(state.delta_path);
+    ApplyDeltaFile(&state, kValidOperationData, &performer);
+    ScopedPathUnlinker manifest_unlinker(state.verified_manifest_path);
+    VerifyPayload(performer, &state);
+    delete performer;
+
+    vector<char> verified_manifest;
+    EXPECT_TRUE(utils::ReadFile(state.verified_manifest_path,
+                                &verified_manifest));
+    EXPECT_TRUE(verified_manifest ==
+                vector<char>(state.delta.begin(),
+                             state.delta.begin() + state.metadata_size));
+
+    // Clobber the start of the updated partition, as if a later step of the
+    // previous attempt had failed midway.
+    vector<char> junk(kBlockSize, 'j');
+    {
+        int fd = open(state.a_img.c_str(), O_WRONLY);
+        ASSERT_GE(fd, 0);
+        files::ScopedFD fd_closer(fd);
+        EXPECT_TRUE(utils::PWriteAll(fd, &junk[0], junk.size(), 0));
+    }
+
+    files::FilePath prefs_dir;
+    ASSERT_TRUE(files::CreateNewTempDirectory("auprefs", &prefs_dir));
+    Prefs prefs;
+    ASSERT_TRUE(prefs.Init(prefs_dir));
+    EXPECT_TRUE(prefs.SetString(kPrefsVerifiedManifestHash,
+                                state.install_plan.payload_hash));
+    EXPECT_TRUE(prefs.SetString(kPrefsVerifiedManifestSignedSHA256Context,
+                                state.verified_signed_hash_context));
+
+    InstallPlan install_plan = state.install_plan;
+    install_plan.postinst_args.clear();
+    EXPECT_TRUE(PayloadProcessor::LoadVerifiedManifest(
+                    &prefs, install_plan.payload_hash,
+                    state.verified_manifest_path, &verified_manifest));
+    EXPECT_TRUE(PayloadProcessor::FindAppliedOperations(
+                    verified_manifest, install_plan,
+                    &install_plan.applied_operations));
+    EXPECT_FALSE(install_plan.applied_operations.front());
+    PayloadProcessor processor(&prefs, &install_plan);
+    processor.set_public_key_path(kUnittestPublicKeyPath);
+    processor.set_partial_data_path(prefs_dir.Append("partial-data").value());
+    processor.set_verified_manifest_path(state.verified_manifest_path);
+    EXPECT_EQ(0, processor.Open());
+
+    // Only the metadata, the data of the clobbered operation, the kernel and
+    // the signature are downloaded.
+    vector<std::pair<uint64_t, uint64_t>> ranges;
+    EXPECT_TRUE(processor.PlanSkippedOperations(&ranges));
+    ASSERT_FALSE(ranges.empty());
+    EXPECT_EQ(0U, ranges.front().first);
+    EXPECT_LT(0U, processor.skipped_data_length());
+    uint64_t planned_length = 0;
+
+    for (const std::pair<uint64_t, uint64_t> &range : ranges) {
+        EXPECT_TRUE(processor.Write(&state.delta[range.first], range.second));
+        planned_length += range.second;
+    }
+
+    EXPECT_EQ(state.delta.size(),
+              planned_length + processor.skipped_data_length());
+    EXPECT_EQ(0, processor.Close());
+    EXPECT_EQ(kActionCodeSuccess, processor.VerifyPayload());
+    CompareFilesByBlock(state.a_img, state.b_img);
+    CompareFiles(state.a_kernel, state.b_kernel);
+    EXPECT_TRUE(install_plan.new_partition_hash ==
+                state.install_plan.new_partition_hash);
+
+    files::DeleteFile(prefs_dir, true);  // recursive
+}
+
 }  // namespace chromeos_update_engine
@@ -4,9 +4,15 @@
 
 #include "update_engine/payload_signer.h"
 
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+
 #include <glog/logging.h>
 #include <openssl/pem.h>
 
+#include "files/scoped_file.h"
 #include "update_engine/delta_diff_generator.h"
 #include "update_engine/delta_metadata.h"
 #include "update_engine/omaha_hash_calculator.h"
@@ -14,6 +20,7 @@
 #include "update_engine/update_metadata.pb.h"
 #include "update_engine/utils.h"
 
+using std::min;
 using std::string;
 using std::vector;
 
@@ -101,49 +108,79 @@ bool ConvertSignatureToProtobufBlob(const vector<vector<char>> &signatures,
     return true;
 }
 
+// Payloads are hashed and copied this many bytes at a time, so that
+// signing doesn't need as much memory as the payload is big.
+const off_t kPayloadBufferSize = 1024 * 1024;  // 1 MiB
+
+// Feeds the |length| bytes of |fd| from |offset| on to |hasher|. Returns true
+// on success, false otherwise.
+bool HashFileRange(int fd, off_t offset, off_t length,
+                   OmahaHashCalculator *hasher)
+{
+    vector<char> buf(min(length, kPayloadBufferSize));
+
+    while (length > 0) {
+        const size_t chunk = min(length, kPayloadBufferSize);
+        ssize_t bytes_read = -1;
+        TEST_AND_RETURN_FALSE(utils::PReadAll(fd, buf.data(), chunk, offset,
+                                              &bytes_read));
+        TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(chunk));
+        TEST_AND_RETURN_FALSE(hasher->Update(buf.data(), chunk));
+        offset += chunk;
+        length -= chunk;
+    }
+
+    return true;
+}
+
 // Given an unsigned payload under |payload_path| and the |signature_blob_size|
-// generates an updated payload that includes a dummy signature op in its
-// manifest. It populates |out_metadata_size| with the size of the final
-// manifest after adding the dummy signature operation.  Returns true on
-// success, false otherwise.
-bool AddSignatureOpToPayload(const string &payload_path,
-                             int signature_blob_size,
-                             vector<char> *out_payload,
-                             uint64_t *out_metadata_size)
+// generates the metadata of an updated payload that includes a dummy signature
+// op in its manifest into |out_metadata|. The data blobs of the updated
+// payload are the |out_blobs_length| bytes of |payload_path| from
+// |out_blobs_offset| on, which are left on disk. Returns true on success,
+// false otherwise.
+bool AddSignatureOpToMetadata(const string &payload_path,
+                              int signature_blob_size,
+                              vector<char> *out_metadata,
+                              uint64_t *out_blobs_offset,
+                              uint64_t *out_blobs_length)
 {
     const int kProtobufOffset = 20;
     const int kProtobufSizeOffset = 12;
 
-    // Loads the payload.
-    vector<char> payload;
+    // Loads the payload metadata.
+    vector<char> metadata;
     DeltaArchiveManifest manifest;
     uint64_t metadata_size;
-    TEST_AND_RETURN_FALSE(PayloadSigner::LoadPayload(
-                              payload_path, &payload, &manifest, &metadata_size));
+    TEST_AND_RETURN_FALSE(PayloadSigner::LoadPayloadMetadata(
+                              payload_path, &metadata, &manifest, &metadata_size));
     TEST_AND_RETURN_FALSE(!manifest.has_signatures_offset() &&
                           !manifest.has_signatures_size());
+    const off_t payload_size = utils::FileSize(payload_path);
+    TEST_AND_RETURN_FALSE(payload_size >= static_cast<off_t>(metadata_size));
+    const uint64_t blobs_length = payload_size - metadata_size;
 
     // Updates the manifest to include the signature operation.
-    DeltaDiffGenerator::AddSignatureOp(payload.size() - metadata_size,
+    DeltaDiffGenerator::AddSignatureOp(blobs_length,
                                        signature_blob_size,
                                        manifest);
 
-    // Updates the payload to include the new manifest.
+    // Updates the metadata to include the new manifest.
     string serialized_manifest;
     TEST_AND_RETURN_FALSE(manifest.AppendToString(&serialized_manifest));
     LOG(INFO) << "Updated protobuf size: " << serialized_manifest.size();
-    payload.erase(payload.begin() + kProtobufOffset,
-                  payload.begin() + metadata_size);
-    payload.insert(payload.begin() + kProtobufOffset,
-                   serialized_manifest.begin(),
-                   serialized_manifest.end());
+    metadata.resize(kProtobufOffset);
+    metadata.insert(metadata.end(),
+                    serialized_manifest.begin(),
+                    serialized_manifest.end());
 
     // Updates the protobuf size.
     uint64_t size_be = htobe64(serialized_manifest.size());
-    memcpy(&payload[kProtobufSizeOffset], &size_be, sizeof(size_be));
-    LOG(INFO) << "Updated payload size: " << payload.size();
-    out_payload->swap(payload);
-    *out_metadata_size = serialized_manifest.size() + kProtobufOffset;
+    memcpy(&metadata[kProtobufSizeOffset], &size_be, sizeof(size_be));
+    LOG(INFO) << "Updated payload size: " << metadata.size() + blobs_length;
+    out_metadata->swap(metadata);
+    *out_blobs_offset = metadata_size;
+    *out_blobs_length = blobs_length;
     return true;
 }
 }  // namespace {}
@@ -169,6 +206,45 @@ bool PayloadSigner::LoadPayload(const string &payload_path,
     return true;
 }
 
+bool PayloadSigner::LoadPayloadMetadata(const string &payload_path,
+                                        vector<char> *out_metadata,
+                                        DeltaArchiveManifest *out_manifest,
+                                        uint64_t *out_metadata_size)
+{
+    int fd = open(payload_path.c_str(), O_RDONLY);
+    TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+    files::ScopedFD fd_closer(fd);
+    const off_t payload_size = utils::FileSize(payload_path);
+    LOG(INFO) << "Payload size: " << payload_size;
+
+    // Reads the header first, which tells how big the whole metadata is.
+    vector<char> metadata(kDeltaManifestOffset);
+
+    for (;;) {
+        TEST_AND_RETURN_FALSE(payload_size >=
+                              static_cast<off_t>(metadata.size()));
+        ssize_t bytes_read = -1;
+        TEST_AND_RETURN_FALSE(utils::PReadAll(fd, metadata.data(),
+                                              metadata.size(), 0, &bytes_read));
+        TEST_AND_RETURN_FALSE(bytes_read ==
+                              static_cast<ssize_t>(metadata.size()));
+        ActionExitCode error = DeltaMetadata::ParsePayload(
+                                   metadata, out_manifest, out_metadata_size);
+
+        if (error == kActionCodeSuccess) {
+            break;
+        }
+
+        TEST_AND_RETURN_FALSE(error == kActionCodeDownloadIncomplete &&
+                              *out_metadata_size > metadata.size());
+        metadata.resize(*out_metadata_size);
+    }
+
+    LOG(INFO) << "Metadata size: " << *out_metadata_size;
+    out_metadata->swap(metadata);
+    return true;
+}
+
 bool PayloadSigner::SignHash(const vector<char> &hash,
                              const string &private_key_path,
                              vector<char> *out_signature)
@@ -343,26 +419,36 @@ bool PayloadSigner::VerifySignedPayload(const std::string &payload_path,
                                         const std::string &public_key_path,
                                         uint32_t client_key_check_version)
 {
-    vector<char> payload;
+    vector<char> metadata;
     DeltaArchiveManifest manifest;
     uint64_t metadata_size;
-    TEST_AND_RETURN_FALSE(LoadPayload(
-                              payload_path, &payload, &manifest, &metadata_size));
+    TEST_AND_RETURN_FALSE(LoadPayloadMetadata(
+                              payload_path, &metadata, &manifest, &metadata_size));
     TEST_AND_RETURN_FALSE(manifest.has_signatures_offset() &&
                           manifest.has_signatures_size());
-    CHECK_EQ(payload.size(),
-             metadata_size + manifest.signatures_offset() +
-             manifest.signatures_size());
-    vector<char> signature_blob(
-        payload.begin() + metadata_size + manifest.signatures_offset(),
-        payload.end());
+    const uint64_t signed_size = metadata_size + manifest.signatures_offset();
+    CHECK_EQ(utils::FileSize(payload_path),
+             signed_size + manifest.signatures_size());
+
+    int fd = open(payload_path.c_str(), O_RDONLY);
+    TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+    files::ScopedFD fd_closer(fd);
+    vector<char> signature_blob(manifest.signatures_size());
+    ssize_t bytes_read = -1;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(fd, signature_blob.data(),
+                                          signature_blob.size(), signed_size,
+                                          &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read ==
+                          static_cast<ssize_t>(signature_blob.size()));
+
     vector<char> signed_hash;
     TEST_AND_RETURN_FALSE(VerifySignatureBlob(
                               signature_blob, public_key_path, client_key_check_version, &signed_hash));
     TEST_AND_RETURN_FALSE(!signed_hash.empty());
-    vector<char> hash;
-    TEST_AND_RETURN_FALSE(OmahaHashCalculator::RawHashOfBytes(
-                              payload.data(), metadata_size + manifest.signatures_offset(), &hash));
+    OmahaHashCalculator hasher;
+    TEST_AND_RETURN_FALSE(HashFileRange(fd, 0, signed_size, &hasher));
+    TEST_AND_RETURN_FALSE(hasher.Finalize());
+    vector<char> hash = hasher.raw_hash();
     PadRSA2048SHA256Hash(&hash);
     TEST_AND_RETURN_FALSE(hash == signed_hash);
     return true;
@@ -372,9 +458,7 @@ bool PayloadSigner::HashPayloadForSigning(const string &payload_path,
         const vector<int> &signature_sizes,
         vector<char> *out_hash_data)
 {
-    // TODO(petkov): Reduce memory usage -- the payload is manipulated in memory.
-
-    // Loads the payload and adds the signature op to it.
+    // Loads the payload metadata and adds the signature op to it.
     vector<vector<char>> signatures;
 
     for (int signature_size : signature_sizes) {
@@ -384,16 +468,26 @@ bool PayloadSigner::HashPayloadForSigning(const string &payload_path,
     vector<char> signature_blob;
     TEST_AND_RETURN_FALSE(ConvertSignatureToProtobufBlob(signatures,
                           &signature_blob));
-    vector<char> payload;
-    uint64_t final_metadata_size;
-    TEST_AND_RETURN_FALSE(AddSignatureOpToPayload(payload_path,
+    vector<char> metadata;
+    uint64_t blobs_offset, blobs_length;
+    TEST_AND_RETURN_FALSE(AddSignatureOpToMetadata(payload_path,
                           signature_blob.size(),
-                          &payload,
-                          &final_metadata_size));
+                          &metadata,
+                          &blobs_offset,
+                          &blobs_length));
+
     // Calculates the hash on the updated payload. Note that the payload includes
-    // the signature op but doesn't include the signature blob at the end.
-    TEST_AND_RETURN_FALSE(OmahaHashCalculator::RawHashOfData(payload,
-                          out_hash_data));
+    // the signature op but doesn't include the signature blob at the end. The
+    // data blobs are hashed from disk.
+    int fd = open(payload_path.c_str(), O_RDONLY);
+    TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+    files::ScopedFD fd_closer(fd);
+    OmahaHashCalculator hasher;
+    TEST_AND_RETURN_FALSE(hasher.Update(metadata.data(), metadata.size()));
+    TEST_AND_RETURN_FALSE(HashFileRange(fd, blobs_offset, blobs_length,
+                                        &hasher));
+    TEST_AND_RETURN_FALSE(hasher.Finalize());
+    *out_hash_data = hasher.raw_hash();
     return true;
 }
 
@@ -401,14 +495,14 @@ bool PayloadSigner::HashMetadataForSigning(const string &payload_path,
         vector<char> *out_metadata_hash)
 {
     // Extract the manifest first.
-    vector<char> payload;
+    vector<char> metadata;
     DeltaArchiveManifest manifest_proto;
     uint64_t metadata_size;
-    TEST_AND_RETURN_FALSE(LoadPayload(
-                              payload_path, &payload, &manifest_proto, &metadata_size));
+    TEST_AND_RETURN_FALSE(LoadPayloadMetadata(
+                              payload_path, &metadata, &manifest_proto, &metadata_size));
 
     // Calculates the hash on the manifest.
-    TEST_AND_RETURN_FALSE(OmahaHashCalculator::RawHashOfBytes(&payload[0],
+    TEST_AND_RETURN_FALSE(OmahaHashCalculator::RawHashOfBytes(&metadata[0],
                           metadata_size,
                           out_metadata_hash));
     return true;
@@ -420,24 +514,52 @@ bool PayloadSigner::AddSignatureToPayload(
     const string &signed_payload_path,
     uint64_t *out_metadata_size)
 {
-    // TODO(petkov): Reduce memory usage -- the payload is manipulated in memory.
-
-    // Loads the payload and adds the signature op to it.
+    // Loads the payload metadata and adds the signature op to it.
     vector<char> signature_blob;
     TEST_AND_RETURN_FALSE(ConvertSignatureToProtobufBlob(signatures,
                           &signature_blob));
-    vector<char> payload;
-    TEST_AND_RETURN_FALSE(AddSignatureOpToPayload(payload_path,
+    vector<char> metadata;
+    uint64_t blobs_offset, blobs_length;
+    TEST_AND_RETURN_FALSE(AddSignatureOpToMetadata(payload_path,
                           signature_blob.size(),
-                          &payload,
-                          out_metadata_size));
-    // Appends the signature blob to the end of the payload and writes the new
-    // payload.
-    payload.insert(payload.end(), signature_blob.begin(), signature_blob.end());
-    LOG(INFO) << "Signed payload size: " << payload.size();
-    TEST_AND_RETURN_FALSE(utils::WriteFile(signed_payload_path.c_str(),
-                                           payload.data(),
-                                           payload.size()));
+                          &metadata,
+                          &blobs_offset,
+                          &blobs_length));
+
+    // The signed payload is put together next to |signed_payload_path|, which
+    // may be |payload_path|, and moved over it when complete. The data blobs
+    // are copied from disk after the new metadata, followed by the signature
+    // blob.
+    int in_fd = open(payload_path.c_str(), O_RDONLY);
+    TEST_AND_RETURN_FALSE_ERRNO(in_fd >= 0);
+    files::ScopedFD in_fd_closer(in_fd);
+
+    string temp_path;
+    int out_fd;
+    TEST_AND_RETURN_FALSE(utils::MakeTempFile(signed_payload_path + ".XXXXXX",
+                          &temp_path,
+                          &out_fd));
+    ScopedPathUnlinker temp_path_unlinker(temp_path);
+    files::ScopedFD out_fd_closer(out_fd);
+
+    // The temp file is private; the signed payload gets the permissions of
+    // the unsigned one instead.
+    struct stat payload_stat;
+    TEST_AND_RETURN_FALSE_ERRNO(fstat(in_fd, &payload_stat) == 0);
+    TEST_AND_RETURN_FALSE_ERRNO(fchmod(out_fd,
+                                       payload_stat.st_mode & 07777) == 0);
+    TEST_AND_RETURN_FALSE(utils::WriteAll(out_fd, metadata.data(),
+                                          metadata.size()));
+    TEST_AND_RETURN_FALSE(utils::CopyFileRange(in_fd, blobs_offset, out_fd,
+                          blobs_length));
+    TEST_AND_RETURN_FALSE(utils::WriteAll(out_fd, signature_blob.data(),
+                                          signature_blob.size()));
+    LOG(INFO) << "Signed payload size: "
+              << metadata.size() + blobs_length + signature_blob.size();
+    TEST_AND_RETURN_FALSE_ERRNO(rename(temp_path.c_str(),
+                                       signed_payload_path.c_str()) == 0);
+    temp_path_unlinker.set_should_remove(false);
+    *out_metadata_size = metadata.size();
     return true;
 }
 
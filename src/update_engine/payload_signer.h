@@ -130,6 +130,13 @@ public:
                             DeltaArchiveManifest *out_manifest,
                             uint64_t *out_metadata_size);
 
+    // Like LoadPayload(), but only reads the metadata of the payload, i.e. its
+    // header and manifest, into |out_metadata|, leaving the data blobs on disk.
+    static bool LoadPayloadMetadata(const std::string &payload_path,
+                                    std::vector<char> *out_metadata,
+                                    DeltaArchiveManifest *out_manifest,
+                                    uint64_t *out_metadata_size);
+
 private:
     // This should never be constructed
     DISALLOW_IMPLICIT_CONSTRUCTORS(PayloadSigner);
@@ -2,10 +2,14 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <endian.h>
+#include <sys/stat.h>
 #include <string>
 #include <vector>
 #include <glog/logging.h>
 #include <gtest/gtest.h>
+#include "update_engine/delta_metadata.h"
+#include "update_engine/omaha_hash_calculator.h"
 #include "update_engine/payload_signer.h"
 #include "update_engine/update_metadata.pb.h"
 #include "update_engine/utils.h"
@@ -142,4 +146,68 @@ TEST(PayloadSignerTest, VerifySignatureTest)
     }
 }
 
+
+TEST(PayloadSignerTest, AddSignatureToPayloadTest)
+{
+    string payload_path;
+    EXPECT_TRUE(utils::MakeTempFile("/tmp/payload.XXXXXX", &payload_path, NULL));
+    ScopedPathUnlinker payload_path_unlinker(payload_path);
+
+    // An unsigned payload with some data blobs.
+    DeltaArchiveManifest manifest;
+    manifest.set_block_size(4096);
+    string serialized_manifest;
+    EXPECT_TRUE(manifest.AppendToString(&serialized_manifest));
+    const string blobs = "Some data blobs.";
+    const uint64_t version_be = htobe64(kDeltaVersion);
+    const uint64_t manifest_size_be = htobe64(serialized_manifest.size());
+    string payload(kDeltaMagic, kDeltaMagicSize);
+    payload.append(reinterpret_cast<const char *>(&version_be),
+                   sizeof(version_be));
+    payload.append(reinterpret_cast<const char *>(&manifest_size_be),
+                   sizeof(manifest_size_be));
+    payload += serialized_manifest + blobs;
+    EXPECT_TRUE(utils::WriteFile(payload_path.c_str(), payload.data(),
+                                 payload.size()));
+    EXPECT_EQ(0, chmod(payload_path.c_str(), 0644));
+
+    vector<char> hash;
+    EXPECT_TRUE(PayloadSigner::HashPayloadForSigning(payload_path,
+                vector<int>(1, 256),
+                &hash));
+    uint64_t metadata_size;
+    EXPECT_TRUE(PayloadSigner::AddSignatureToPayload(
+                    payload_path,
+                    vector<vector<char>>(1, vector<char>(256, 'x')),
+                    payload_path,
+                    &metadata_size));
+
+    vector<char> signed_payload;
+    DeltaArchiveManifest signed_manifest;
+    uint64_t signed_metadata_size;
+    EXPECT_TRUE(PayloadSigner::LoadPayload(payload_path,
+                                           &signed_payload,
+                                           &signed_manifest,
+                                           &signed_metadata_size));
+    EXPECT_EQ(metadata_size, signed_metadata_size);
+    EXPECT_EQ(blobs.size(), signed_manifest.signatures_offset());
+    EXPECT_EQ(signed_payload.size(), metadata_size + blobs.size() +
+              signed_manifest.signatures_size());
+    EXPECT_EQ(blobs, string(signed_payload.begin() + metadata_size,
+                            signed_payload.begin() + metadata_size +
+                            blobs.size()));
+
+    // The hash covers all of the signed payload but the signature blob.
+    vector<char> signed_hash;
+    EXPECT_TRUE(OmahaHashCalculator::RawHashOfBytes(signed_payload.data(),
+                metadata_size + blobs.size(),
+                &signed_hash));
+    EXPECT_TRUE(hash == signed_hash);
+
+    // The signed payload keeps the permissions of the unsigned one.
+    struct stat payload_stat;
+    EXPECT_EQ(0, stat(payload_path.c_str(), &payload_stat));
+    EXPECT_EQ(0644, payload_stat.st_mode & 07777);
+}
+
 }  // namespace chromeos_update_engine
@@ -12,7 +12,11 @@
 #include "update_engine/prefs.h"
 #include "update_engine/utils.h"
 
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
 using std::chrono::system_clock;
+using std::max;
 using std::min;
 using std::string;
 using strings::StringPrintf;
@@ -25,6 +29,15 @@ static const uint32_t kMaxBackoffDays = 16;
 // We want to randomize retry attempts after the backoff by +/- 6 hours.
 static const uint32_t kMaxBackoffFuzzMinutes = 12 * 60;
 
+// A persisted Url stats count above this is corrupt rather than the URL
+// count of any real response.
+static const int64_t kMaxUrlStatsCount = 1000;
+
+const milliseconds PayloadState::kThroughputWindow(10000);
+const uint64_t PayloadState::kUrlSwitchRatio = 4;
+const int PayloadState::kSlowWindowsBeforeSwitch = 3;
+const int PayloadState::kMaxUrlSwitches = 3;
+
 bool PayloadState::Initialize(PrefsInterface *prefs)
 {
     CHECK(prefs);
@@ -66,6 +79,8 @@ void PayloadState::SetResponse(const OmahaResponse &omaha_response)
         ResetPersistedState();
         return;
     }
+
+    LoadUrlStats();
 }
 
 void PayloadState::DownloadComplete()
@@ -80,6 +95,8 @@ void PayloadState::DownloadProgress(size_t count)
         return;
     }
 
+    UpdateThroughput(count);
+
     // We've received non-zero bytes from a recent download operation.  Since our
     // URL failure count is meant to penalize a URL only for consecutive
     // failures, downloading bytes successfully means we should reset the failure
@@ -335,6 +352,7 @@ void PayloadState::ResetPersistedState()
     SetUrlIndex(0);
     SetUrlFailureCount(0);
     UpdateBackoffExpiryTime(); // This will reset the backoff expiry time.
+    ResetUrlStats();
 }
 
 string PayloadState::CalculateResponseSignature()
@@ -491,4 +509,261 @@ void PayloadState::SetBackoffExpiryTime(const system_clock::time_point &new_time
                      system_clock::to_time_t(backoff_expiry_time_));
 }
 
+string PayloadState::GetCurrentUrl()
+{
+    if (url_index_ >= GetNumUrls()) {
+        return "";
+    }
+
+    return response_.payload_urls[url_index_];
+}
+
+void PayloadState::SetUrlStats(uint32_t url_index,
+                               milliseconds latency,
+                               uint64_t throughput)
+{
+    CHECK(prefs_);
+
+    if (url_index >= url_throughputs_.size()) {
+        LOG(ERROR) << "Ignoring stats for unknown Url" << url_index;
+        return;
+    }
+
+    url_throughputs_[url_index] = throughput;
+    url_latencies_[url_index] = latency.count();
+    LOG(INFO) << "Url" << url_index << " Stats = " << throughput << " B/s, "
+              << utils::ToString(latency) << " to the first byte";
+
+    // Remember how many URLs have stats persisted before persisting them, so
+    // that ResetUrlStats finds them even once a response with fewer URLs
+    // comes along.
+    if (GetUrlStatsCount() <= url_index) {
+        prefs_->SetInt64(kPrefsUrlStatsCount, url_index + 1);
+    }
+
+    prefs_->SetInt64(GetUrlStatsKey(kPrefsUrlThroughput, url_index),
+                     url_throughputs_[url_index]);
+    prefs_->SetInt64(GetUrlStatsKey(kPrefsUrlLatency, url_index),
+                     url_latencies_[url_index]);
+}
+
+bool PayloadState::GetUrlStats(uint32_t url_index,
+                               milliseconds *latency,
+                               uint64_t *throughput)
+{
+    if (url_index >= url_throughputs_.size() ||
+            url_throughputs_[url_index] < 0) {
+        return false;
+    }
+
+    *latency = milliseconds(url_latencies_[url_index]);
+    *throughput = url_throughputs_[url_index];
+    return true;
+}
+
+void PayloadState::SelectFastestUrl()
+{
+    int64_t fastest_url_index = -1;
+
+    for (size_t i = 0; i < url_throughputs_.size(); i++) {
+        if (url_throughputs_[i] <= 0) {
+            continue;
+        }
+
+        // On equal throughput, prefer the lower latency and then the URL that
+        // appears earlier in the response.
+        if (fastest_url_index < 0 ||
+                url_throughputs_[i] > url_throughputs_[fastest_url_index] ||
+                (url_throughputs_[i] == url_throughputs_[fastest_url_index] &&
+                 url_latencies_[i] < url_latencies_[fastest_url_index])) {
+            fastest_url_index = i;
+        }
+    }
+
+    if (fastest_url_index < 0) {
+        LOG(INFO) << "No usable URL measurements, keeping Url" << GetUrlIndex();
+        return;
+    }
+
+    if (fastest_url_index == url_index_) {
+        LOG(INFO) << "Url" << GetUrlIndex() << " is already the fastest URL";
+        return;
+    }
+
+    LOG(INFO) << "Selecting Url" << fastest_url_index << " as the fastest URL";
+    SetUrlIndex(fastest_url_index);
+    SetUrlFailureCount(0);
+}
+
+void PayloadState::LoadUrlStats()
+{
+    CHECK(prefs_);
+    url_throughputs_.assign(GetNumUrls(), -1);
+    url_latencies_.assign(GetNumUrls(), 0);
+
+    for (uint32_t i = 0; i < GetNumUrls(); i++) {
+        int64_t throughput;
+        int64_t latency;
+
+        if (!prefs_->GetInt64(GetUrlStatsKey(kPrefsUrlThroughput, i),
+                              &throughput) ||
+                !prefs_->GetInt64(GetUrlStatsKey(kPrefsUrlLatency, i),
+                                  &latency)) {
+            continue;
+        }
+
+        if (throughput < 0 || latency < 0) {
+            LOG(ERROR) << "Invalid stats for Url" << i
+                       << " in persisted state. Ignoring";
+            continue;
+        }
+
+        url_throughputs_[i] = throughput;
+        url_latencies_[i] = latency;
+    }
+}
+
+void PayloadState::ResetUrlStats()
+{
+    CHECK(prefs_);
+    url_throughputs_.assign(GetNumUrls(), -1);
+    url_latencies_.assign(GetNumUrls(), 0);
+
+    // The persisted stats may be those of a previous response with more
+    // URLs than the current one.
+    uint32_t count = max(GetUrlStatsCount(), GetNumUrls());
+
+    for (uint32_t i = 0; i < count; i++) {
+        prefs_->Delete(GetUrlStatsKey(kPrefsUrlThroughput, i));
+        prefs_->Delete(GetUrlStatsKey(kPrefsUrlLatency, i));
+    }
+
+    prefs_->Delete(kPrefsUrlStatsCount);
+
+    window_url_index_ = -1;
+    slow_windows_ = 0;
+}
+
+void PayloadState::DownloadPaused(bool paused)
+{
+    if (paused == window_paused_) {
+        return;
+    }
+
+    window_paused_ = paused;
+
+    if (paused) {
+        window_paused_since_ = steady_clock::now();
+        return;
+    }
+
+    window_start_ += steady_clock::now() - window_paused_since_;
+}
+
+void PayloadState::UpdateThroughput(size_t count)
+{
+    // Bytes still in flight may arrive while paused; the clock has stopped.
+    const steady_clock::time_point now =
+        window_paused_ ? window_paused_since_ : steady_clock::now();
+
+    // The bytes of the first notification may have been in flight for a
+    // while, so only start measuring from there.
+    if (window_url_index_ != url_index_) {
+        window_url_index_ = url_index_;
+        window_start_ = now;
+        window_bytes_ = 0;
+        slow_windows_ = 0;
+        return;
+    }
+
+    window_bytes_ += count;
+    const milliseconds elapsed = duration_cast<milliseconds>(now - window_start_);
+
+    if (elapsed < throughput_window_) {
+        return;
+    }
+
+    const uint64_t throughput =
+        window_bytes_ * 1000 / max<int64_t>(elapsed.count(), 1);
+    window_start_ = now;
+    window_bytes_ = 0;
+
+    if (url_index_ >= static_cast<int64_t>(url_throughputs_.size())) {
+        return;
+    }
+
+    // Weigh the new sample equally with the history so that a single
+    // hiccup doesn't erase what was learnt about the URL.
+    uint64_t average = throughput;
+
+    if (url_throughputs_[url_index_] > 0) {
+        average = (url_throughputs_[url_index_] + throughput) / 2;
+    }
+
+    SetUrlStats(url_index_, milliseconds(url_latencies_[url_index_]), average);
+    MaybeSwitchUrl(throughput);
+}
+
+void PayloadState::MaybeSwitchUrl(uint64_t throughput)
+{
+    if (url_switches_ >= kMaxUrlSwitches) {
+        return;
+    }
+
+    int64_t fastest_url_index = -1;
+
+    for (size_t i = 0; i < url_throughputs_.size(); i++) {
+        if (static_cast<int64_t>(i) == url_index_ ||
+                url_throughputs_[i] <= 0 ||
+                static_cast<uint64_t>(url_throughputs_[i]) <=
+                throughput * kUrlSwitchRatio) {
+            continue;
+        }
+
+        if (fastest_url_index < 0 ||
+                url_throughputs_[i] > url_throughputs_[fastest_url_index]) {
+            fastest_url_index = i;
+        }
+    }
+
+    if (fastest_url_index < 0) {
+        slow_windows_ = 0;
+        return;
+    }
+
+    if (++slow_windows_ < kSlowWindowsBeforeSwitch) {
+        return;
+    }
+
+    LOG(INFO) << "Throughput of Url" << GetUrlIndex() << " dropped to "
+              << throughput << " B/s, switching to Url" << fastest_url_index
+              << " (" << url_throughputs_[fastest_url_index] << " B/s)";
+    url_switches_++;
+    SetUrlIndex(fastest_url_index);
+    SetUrlFailureCount(0);
+}
+
+string PayloadState::GetUrlStatsKey(const char *prefix, uint32_t url_index)
+{
+    return StringPrintf("%s-%u", prefix, url_index);
+}
+
+uint32_t PayloadState::GetUrlStatsCount()
+{
+    CHECK(prefs_);
+    int64_t count;
+
+    if (!prefs_->GetInt64(kPrefsUrlStatsCount, &count)) {
+        return 0;
+    }
+
+    if (count < 0 || count > kMaxUrlStatsCount) {
+        LOG(ERROR) << "Invalid Url stats count " << count
+                   << " in persisted state. Ignoring";
+        return 0;
+    }
+
+    return count;
+}
+
 }  // namespace chromeos_update_engine
@@ -6,6 +6,8 @@
 #define CHROMEOS_PLATFORM_UPDATE_ENGINE_PAYLOAD_STATE_H__
 
 #include <chrono>
+#include <string>
+#include <vector>
 
 #include "update_engine/payload_state_interface.h"
 #include "update_engine/prefs_interface.h"
@@ -25,7 +27,13 @@ public:
         : prefs_(NULL),
           payload_attempt_number_(0),
           url_index_(0),
-          url_failure_count_(0) {}
+          url_failure_count_(0),
+          window_bytes_(0),
+          window_url_index_(-1),
+          window_paused_(false),
+          throughput_window_(kThroughputWindow),
+          slow_windows_(0),
+          url_switches_(0) {}
 
     virtual ~PayloadState() {}
 
@@ -41,6 +49,7 @@ public:
     virtual void SetResponse(const OmahaResponse &response);
     virtual void DownloadComplete();
     virtual void DownloadProgress(size_t count);
+    virtual void DownloadPaused(bool paused);
     virtual void UpdateFailed(ActionExitCode error);
     virtual bool ShouldBackoffDownload();
 
@@ -69,6 +78,34 @@ public:
         return backoff_expiry_time_;
     }
 
+    virtual std::string GetCurrentUrl();
+    virtual void SetUrlStats(uint32_t url_index,
+                             std::chrono::milliseconds latency,
+                             uint64_t throughput);
+    virtual bool GetUrlStats(uint32_t url_index,
+                             std::chrono::milliseconds *latency,
+                             uint64_t *throughput);
+    virtual void SelectFastestUrl();
+
+    // The interval over which the download throughput of the current URL is
+    // sampled. Useful for testing.
+    void set_throughput_window(std::chrono::milliseconds window)
+    {
+        throughput_window_ = window;
+    }
+
+    static const std::chrono::milliseconds kThroughputWindow;
+
+    // Switch to another URL mid-download if its measured throughput is this
+    // many times higher than what the current URL is delivering.
+    static const uint64_t kUrlSwitchRatio;
+
+    // Number of consecutive slow samples before switching, and the maximum
+    // number of switches per process lifetime, to avoid flapping between
+    // mirrors.
+    static const int kSlowWindowsBeforeSwitch;
+    static const int kMaxUrlSwitches;
+
 private:
     // Increments the payload attempt number which governs the backoff behavior
     // at the time of the next update check.
@@ -138,6 +175,29 @@ private:
     // restart.
     void SetBackoffExpiryTime(const std::chrono::system_clock::time_point &new_time);
 
+    // Initializes the per-URL stats of the current response from the persisted
+    // state.
+    void LoadUrlStats();
+
+    // Forgets the per-URL stats, both in memory and in the persisted state.
+    void ResetUrlStats();
+
+    // Accounts |count| bytes downloaded from the current URL. Once per
+    // throughput window, folds the measured throughput into the URL's stats
+    // and switches to a faster URL if the current one has collapsed.
+    void UpdateThroughput(size_t count);
+
+    // Switches to the fastest other URL if it is more than kUrlSwitchRatio
+    // times faster than the |throughput| just measured for the current URL.
+    void MaybeSwitchUrl(uint64_t throughput);
+
+    // Returns the prefs key holding the stat |prefix| for URL |url_index|.
+    static std::string GetUrlStatsKey(const char *prefix, uint32_t url_index);
+
+    // Returns the number of URLs, counting from Url0, that may have stats in
+    // the persisted state, whatever the response they were measured for.
+    uint32_t GetUrlStatsCount();
+
     // Interface object with which we read/write persisted state. This must
     // be set by calling the Initialize method before calling any other method.
     PrefsInterface *prefs_;
@@ -174,6 +234,29 @@ private:
     // payload again, so as to backoff repeated downloads.
     std::chrono::system_clock::time_point backoff_expiry_time_;
 
+    // The throughput, in bytes per second, and the time to the first byte, in
+    // milliseconds, measured for each URL in the current response. A negative
+    // throughput means the URL hasn't been measured. Each update to these
+    // values is persisted so that the measurements survive process restarts.
+    std::vector<int64_t> url_throughputs_;
+    std::vector<int64_t> url_latencies_;
+
+    // The current throughput sample: bytes downloaded from |window_url_index_|
+    // since |window_start_|. |window_start_| is moved forward by the time the
+    // download is paused, from |window_paused_since_| on, so the sample only
+    // covers the time spent waiting on the network.
+    std::chrono::steady_clock::time_point window_start_;
+    uint64_t window_bytes_;
+    int64_t window_url_index_;
+    bool window_paused_;
+    std::chrono::steady_clock::time_point window_paused_since_;
+    std::chrono::milliseconds throughput_window_;
+
+    // Consecutive samples in which the current URL was much slower than
+    // another one, and the number of mid-download URL switches made so far.
+    int slow_windows_;
+    int url_switches_;
+
     // Returns the number of URLs in the current response.
     // Note: This value will be 0 if this method is called before we receive
     // the first valid Omaha response in this process.
@@ -41,6 +41,13 @@ public:
     // able to make forward progress with the current URL.
     virtual void DownloadProgress(size_t count) = 0;
 
+    // This method should be called with |paused| set to true whenever the
+    // download stops taking in bytes for reasons other than the network, e.g.
+    // while the received bytes are being applied, and with |paused| set to
+    // false once it takes them in again. The time in between isn't counted
+    // against the throughput of the current URL.
+    virtual void DownloadPaused(bool paused) = 0;
+
     // This method should be called whenever an update attempt fails with the
     // given error code. We use this notification to update the payload state
     // depending on the type of the error that happened.
@@ -65,6 +72,25 @@ public:
 
     // Returns the expiry time for the current backoff period.
     virtual std::chrono::system_clock::time_point GetBackoffExpiryTime() = 0;
+
+    // Returns the current URL, or an empty string if there's no response yet.
+    virtual std::string GetCurrentUrl() = 0;
+
+    // Records the time to the first byte and the throughput, in bytes per
+    // second, measured for the URL at |url_index|. A zero throughput marks
+    // the URL as unusable.
+    virtual void SetUrlStats(uint32_t url_index,
+                             std::chrono::milliseconds latency,
+                             uint64_t throughput) = 0;
+
+    // Returns true and fills in the stats of the URL at |url_index| if it has
+    // been measured, false otherwise.
+    virtual bool GetUrlStats(uint32_t url_index,
+                             std::chrono::milliseconds *latency,
+                             uint64_t *throughput) = 0;
+
+    // Makes the measured URL with the highest throughput the current URL.
+    virtual void SelectFastestUrl() = 0;
 };
 
 }  // namespace chromeos_update_engine
@@ -2,6 +2,8 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <unistd.h>
+
 #include <glib.h>
 
 #include "gmock/gmock.h"
@@ -14,10 +16,12 @@
 #include "update_engine/test_utils.h"
 #include "update_engine/utils.h"
 
+using std::chrono::milliseconds;
 using std::chrono::system_clock;
 using std::string;
 using strings::StringPrintf;
 using testing::_;
+using testing::AnyNumber;
 using testing::NiceMock;
 using testing::Return;
 using testing::SetArgumentPointee;
@@ -344,6 +348,7 @@ TEST(PayloadStateTest, SetResponseResetsInvalidUrlIndex)
     EXPECT_CALL(prefs2, GetInt64(kPrefsCurrentUrlIndex, _))
     .WillOnce(DoAll(SetArgumentPointee<1>(2), Return(true)));
     EXPECT_CALL(prefs2, GetInt64(kPrefsCurrentUrlFailureCount, _));
+    EXPECT_CALL(prefs2, GetInt64(kPrefsUrlStatsCount, _));
 
     // Note: This will be a different payload object, but the response should
     // have the same hash as before so as to not trivially reset because the
@@ -450,4 +455,140 @@ TEST(PayloadStateTest, BackoffLogicCanBeDisabled)
     EXPECT_FALSE(payload_state.ShouldBackoffDownload());
 }
 
+TEST(PayloadStateTest, UrlStatsArePersistedAndReloaded)
+{
+    OmahaResponse response;
+    PayloadState payload_state;
+    NiceMock<PrefsMock> prefs;
+    const string throughput_key = string(kPrefsUrlThroughput) + "-1";
+    const string latency_key = string(kPrefsUrlLatency) + "-1";
+
+    EXPECT_TRUE(payload_state.Initialize(&prefs));
+    SetupPayloadStateWith2Urls("Hash3141", &payload_state, &response);
+    EXPECT_CALL(prefs, SetInt64(kPrefsUrlStatsCount, 2));
+    EXPECT_CALL(prefs, SetInt64(throughput_key, 2000));
+    EXPECT_CALL(prefs, SetInt64(latency_key, 40));
+    payload_state.SetUrlStats(1, milliseconds(40), 2000);
+
+    // Simulate an update_engine restart with the same response.
+    NiceMock<PrefsMock> prefs2;
+    EXPECT_CALL(prefs2, Exists(_)).WillRepeatedly(Return(true));
+    EXPECT_CALL(prefs2, GetInt64(_, _)).WillRepeatedly(Return(false));
+    EXPECT_CALL(prefs2, GetInt64(throughput_key, _))
+    .WillOnce(DoAll(SetArgumentPointee<1>(2000), Return(true)));
+    EXPECT_CALL(prefs2, GetInt64(latency_key, _))
+    .WillOnce(DoAll(SetArgumentPointee<1>(40), Return(true)));
+    EXPECT_TRUE(payload_state.Initialize(&prefs2));
+    SetupPayloadStateWith2Urls("Hash3141", &payload_state, &response);
+
+    milliseconds latency;
+    uint64_t throughput;
+    EXPECT_FALSE(payload_state.GetUrlStats(0, &latency, &throughput));
+    EXPECT_TRUE(payload_state.GetUrlStats(1, &latency, &throughput));
+    EXPECT_EQ(40, latency.count());
+    EXPECT_EQ(2000U, throughput);
+
+    // A new response forgets the stats.
+    EXPECT_CALL(prefs2, Delete(_)).Times(AnyNumber());
+    EXPECT_CALL(prefs2, Delete(throughput_key));
+    EXPECT_CALL(prefs2, Delete(latency_key));
+    SetupPayloadStateWith2Urls("Hash2718", &payload_state, &response);
+    EXPECT_FALSE(payload_state.GetUrlStats(1, &latency, &throughput));
+}
+
+TEST(PayloadStateTest, UrlStatsOfLargerResponsesAreForgotten)
+{
+    OmahaResponse response;
+    PayloadState payload_state;
+    NiceMock<PrefsMock> prefs;
+
+    // The stats persisted for a previous response with 3 URLs are all
+    // deleted once a response with only 2 comes along.
+    EXPECT_TRUE(payload_state.Initialize(&prefs));
+    EXPECT_CALL(prefs, GetInt64(_, _)).WillRepeatedly(Return(false));
+    EXPECT_CALL(prefs, GetInt64(kPrefsUrlStatsCount, _))
+    .WillRepeatedly(DoAll(SetArgumentPointee<1>(3), Return(true)));
+    EXPECT_CALL(prefs, Delete(_)).Times(AnyNumber());
+    EXPECT_CALL(prefs, Delete(string(kPrefsUrlThroughput) + "-2"));
+    EXPECT_CALL(prefs, Delete(string(kPrefsUrlLatency) + "-2"));
+    EXPECT_CALL(prefs, Delete(kPrefsUrlStatsCount));
+    SetupPayloadStateWith2Urls("Hash1414", &payload_state, &response);
+}
+
+TEST(PayloadStateTest, SelectFastestUrlPicksHighestThroughput)
+{
+    OmahaResponse response;
+    PayloadState payload_state;
+    NiceMock<PrefsMock> prefs;
+
+    EXPECT_TRUE(payload_state.Initialize(&prefs));
+    SetupPayloadStateWith2Urls("Hash1618", &payload_state, &response);
+
+    // Nothing measured yet, so the selection is left alone.
+    payload_state.SelectFastestUrl();
+    EXPECT_EQ(0, payload_state.GetUrlIndex());
+
+    payload_state.SetUrlStats(0, milliseconds(10), 1000);
+    payload_state.SetUrlStats(1, milliseconds(200), 3000);
+    payload_state.SelectFastestUrl();
+    EXPECT_EQ(1, payload_state.GetUrlIndex());
+    EXPECT_EQ("https://test", payload_state.GetCurrentUrl());
+
+    // Equal throughput is broken by the latency.
+    payload_state.SetUrlStats(0, milliseconds(10), 3000);
+    payload_state.SelectFastestUrl();
+    EXPECT_EQ(0, payload_state.GetUrlIndex());
+}
+
+TEST(PayloadStateTest, SwitchesUrlWhenThroughputCollapses)
+{
+    OmahaResponse response;
+    PayloadState payload_state;
+    NiceMock<PrefsMock> prefs;
+
+    EXPECT_TRUE(payload_state.Initialize(&prefs));
+    SetupPayloadStateWith2Urls("Hash1414", &payload_state, &response);
+    payload_state.set_throughput_window(milliseconds(0));
+
+    // Url1 was measured to be far faster than anything Url0 can deliver a
+    // byte at a time.
+    payload_state.SetUrlStats(1, milliseconds(10), 1000000000000LL);
+
+    // The first notification only starts the sampling.
+    payload_state.DownloadProgress(100);
+
+    for (int i = 1; i < PayloadState::kSlowWindowsBeforeSwitch; i++) {
+        payload_state.DownloadProgress(1);
+        EXPECT_EQ(0, payload_state.GetUrlIndex());
+    }
+
+    payload_state.DownloadProgress(1);
+    EXPECT_EQ(1, payload_state.GetUrlIndex());
+    EXPECT_EQ(0, payload_state.GetUrlFailureCount());
+}
+
+TEST(PayloadStateTest, PausedDownloadDoesNotSwitchUrl)
+{
+    OmahaResponse response;
+    PayloadState payload_state;
+    NiceMock<PrefsMock> prefs;
+
+    EXPECT_TRUE(payload_state.Initialize(&prefs));
+    SetupPayloadStateWith2Urls("Hash1415", &payload_state, &response);
+    payload_state.set_throughput_window(milliseconds(50));
+    payload_state.SetUrlStats(1, milliseconds(10), 1000000000000LL);
+    payload_state.DownloadProgress(100);
+
+    // Each byte comes in after a pause longer than the window, e.g. while
+    // the writer catches up. Only the time between the pauses is measured,
+    // which is too short to make a sample.
+    for (int i = 0; i <= PayloadState::kSlowWindowsBeforeSwitch; i++) {
+        payload_state.DownloadPaused(true);
+        usleep(100 * 1000);
+        payload_state.DownloadPaused(false);
+        payload_state.DownloadProgress(1);
+        EXPECT_EQ(0, payload_state.GetUrlIndex());
+    }
+}
+
 }
@@ -27,16 +27,26 @@ const char kPrefsUpdateCheckResponseHash[] = "update-check-response-hash";
 const char kPrefsUpdateServerCertificate[] = "update-server-cert";
 const char kPrefsUpdateStateNextDataOffset[] = "update-state-next-data-offset";
 const char kPrefsUpdateStateNextOperation[] = "update-state-next-operation";
+const char kPrefsUpdateStatePartialDataLength[] =
+    "update-state-partial-data-length";
+const char kPrefsUpdateStatePartialDataOffset[] =
+    "update-state-partial-data-offset";
 const char kPrefsUpdateStateSHA256Context[] = "update-state-sha-256-context";
 const char kPrefsUpdateStateSignatureBlob[] = "update-state-signature-blob";
 const char kPrefsUpdateStateSignedSHA256Context[] =
     "update-state-signed-sha-256-context";
+const char kPrefsVerifiedManifestHash[] = "verified-manifest-hash";
+const char kPrefsVerifiedManifestSignedSHA256Context[] =
+    "verified-manifest-signed-sha-256-context";
 
 const char kPrefsPayloadAttemptNumber[] = "payload-attempt-number";
 const char kPrefsCurrentResponseSignature[] = "current-response-signature";
 const char kPrefsCurrentUrlIndex[] = "current-url-index";
 const char kPrefsCurrentUrlFailureCount[] = "current-url-failure-count";
 const char kPrefsBackoffExpiryTime[] = "backoff-expiry-time";
+const char kPrefsUrlLatency[] = "url-latency";
+const char kPrefsUrlThroughput[] = "url-throughput";
+const char kPrefsUrlStatsCount[] = "url-stats-count";
 const char kPrefsAlephVersion[] = "aleph-version";
 
 bool Prefs::Init(const files::FilePath &prefs_dir)
@@ -19,14 +19,21 @@ extern const char kPrefsUpdateCheckResponseHash[];
 extern const char kPrefsUpdateServerCertificate[];
 extern const char kPrefsUpdateStateNextDataOffset[];
 extern const char kPrefsUpdateStateNextOperation[];
+extern const char kPrefsUpdateStatePartialDataLength[];
+extern const char kPrefsUpdateStatePartialDataOffset[];
 extern const char kPrefsUpdateStateSHA256Context[];
 extern const char kPrefsUpdateStateSignatureBlob[];
 extern const char kPrefsUpdateStateSignedSHA256Context[];
+extern const char kPrefsVerifiedManifestHash[];
+extern const char kPrefsVerifiedManifestSignedSHA256Context[];
 extern const char kPrefsPayloadAttemptNumber[];
 extern const char kPrefsCurrentResponseSignature[];
 extern const char kPrefsCurrentUrlIndex[];
 extern const char kPrefsCurrentUrlFailureCount[];
 extern const char kPrefsBackoffExpiryTime[];
+extern const char kPrefsUrlLatency[];
+extern const char kPrefsUrlThroughput[];
+extern const char kPrefsUrlStatsCount[];
 extern const char kPrefsAlephVersion[];
 
 // The prefs interface allows access to a persistent preferences
@@ -0,0 +1,201 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/rename_matcher.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "update_engine/block_index.h"
+#include "update_engine/utils.h"
+
+using std::max;
+using std::min;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+const size_t kBlockSize = BlockIndex::kBlockSize;
+
+// Candidates must be at least this alike in name (see NameSimilarity()) and
+// in size (the smaller over the larger).
+const double kMinNameSimilarity = 0.5;
+const double kMinSizeRatio = 0.5;
+
+// The number of blocks sampled from each file to compare contents. The
+// first and last block are always among them.
+const size_t kFingerprintSamples = 16;
+
+// Candidates must share at least this many of the sampled blocks of the new
+// file (see FingerprintSimilarity()), or alike names and sizes are all they
+// have in common.
+const double kMinFingerprintSimilarity = 0.125;
+
+string Basename(const string &path)
+{
+    string::size_type slash = path.rfind('/');
+    return slash == string::npos ? path : path.substr(slash + 1);
+}
+
+// Returns the share of |new_fingerprint| that is in |old_fingerprint|.
+double FingerprintSimilarity(const vector<uint64_t> &new_fingerprint,
+                             const vector<uint64_t> &old_fingerprint)
+{
+    if (new_fingerprint.empty()) {
+        return 0;
+    }
+
+    size_t found = 0;
+
+    for (uint64_t hash : new_fingerprint) {
+        if (std::binary_search(old_fingerprint.begin(), old_fingerprint.end(),
+                               hash)) {
+            found++;
+        }
+    }
+
+    return static_cast<double>(found) / new_fingerprint.size();
+}
+}  // namespace {}
+
+void RenameMatcher::AddCandidate(const ImageFile &old_file)
+{
+    if (old_file.size == 0) {
+        return;
+    }
+
+    Candidate candidate;
+    candidate.file = old_file;
+    candidates_.push_back(candidate);
+    by_size_.insert(std::make_pair(old_file.size, candidates_.size() - 1));
+}
+
+double RenameMatcher::NameSimilarity(const string &a, const string &b)
+{
+    const string a_name = Basename(a);
+    const string b_name = Basename(b);
+    const size_t shorter = min(a_name.size(), b_name.size());
+    const size_t longer = max(a_name.size(), b_name.size());
+
+    if (longer == 0) {
+        return 0;
+    }
+
+    size_t prefix = 0;
+
+    while (prefix < shorter && a_name[prefix] == b_name[prefix]) {
+        prefix++;
+    }
+
+    // The suffix may not overlap the prefix.
+    size_t suffix = 0;
+
+    while (prefix + suffix < shorter &&
+            a_name[a_name.size() - 1 - suffix] ==
+            b_name[b_name.size() - 1 - suffix]) {
+        suffix++;
+    }
+
+    return static_cast<double>(prefix + suffix) / longer;
+}
+
+bool RenameMatcher::Fingerprint(const ImageFiles &files,
+                                const ImageFile &file,
+                                vector<uint64_t> *out)
+{
+    const uint64_t blocks = (file.size + kBlockSize - 1) / kBlockSize;
+    const uint64_t samples = min<uint64_t>(blocks, kFingerprintSamples);
+    out->clear();
+
+    for (uint64_t i = 0; i < samples; i++) {
+        const uint64_t block =
+            samples == 1 ? 0 : i * (blocks - 1) / (samples - 1);
+        vector<char> data;
+        TEST_AND_RETURN_FALSE(files.ReadChunk(file.path, block * kBlockSize,
+                                              kBlockSize, &data));
+        // The last block may be partial.
+        data.resize(kBlockSize, 0);
+        out->push_back(BlockIndex::HashBlock(data.data()));
+    }
+
+    std::sort(out->begin(), out->end());
+    return true;
+}
+
+bool RenameMatcher::Match(const ImageFiles &new_files,
+                          const ImageFile &new_file,
+                          bool *out_found,
+                          ImageFile *out_old_file)
+{
+    *out_found = false;
+
+    if (new_file.size == 0) {
+        return true;
+    }
+
+    vector<uint64_t> new_fingerprint;
+    bool have_new_fingerprint = false;
+    std::multimap<off_t, size_t>::iterator best = by_size_.end();
+    double best_score = 0;
+
+    for (auto it = by_size_.lower_bound(new_file.size / 2);
+            it != by_size_.end() && it->first <= new_file.size * 2; ++it) {
+        Candidate &candidate = candidates_[it->second];
+        const double size_ratio =
+            static_cast<double>(min(new_file.size, candidate.file.size)) /
+            max(new_file.size, candidate.file.size);
+        const double name_similarity =
+            NameSimilarity(new_file.path, candidate.file.path);
+
+        if (size_ratio < kMinSizeRatio ||
+                name_similarity < kMinNameSimilarity) {
+            continue;
+        }
+
+        // Fingerprints are only taken of files that get this far, and only
+        // once.
+        if (!have_new_fingerprint) {
+            TEST_AND_RETURN_FALSE(Fingerprint(new_files, new_file,
+                                              &new_fingerprint));
+            have_new_fingerprint = true;
+        }
+
+        if (candidate.fingerprint.empty()) {
+            TEST_AND_RETURN_FALSE(Fingerprint(old_files_, candidate.file,
+                                              &candidate.fingerprint));
+        }
+
+        const double fingerprint_similarity =
+            FingerprintSimilarity(new_fingerprint, candidate.fingerprint);
+
+        if (fingerprint_similarity < kMinFingerprintSimilarity) {
+            continue;
+        }
+
+        const double score =
+            name_similarity + size_ratio + fingerprint_similarity;
+
+        // Ties go to the first candidate, so matching is reproducible.
+        if (score > best_score) {
+            best = it;
+            best_score = score;
+        }
+    }
+
+    if (best == by_size_.end()) {
+        return true;
+    }
+
+    *out_found = true;
+    *out_old_file = candidates_[best->second].file;
+    // Its fingerprint won't be needed again.
+    vector<uint64_t>().swap(candidates_[best->second].fingerprint);
+    by_size_.erase(best);
+    return true;
+}
+
+}  // namespace chromeos_update_engine
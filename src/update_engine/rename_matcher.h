@@ -0,0 +1,79 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_RENAME_MATCHER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_RENAME_MATCHER_H__
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "macros.h"
+#include "update_engine/image_files.h"
+
+// A RenameMatcher guesses which old file a new file with no old version at
+// its own path was renamed or moved from, e.g. /lib/libfoo.so.1.2 to
+// /lib/libfoo.so.1.3 or /usr/bin/foo to /bin/foo, so that it can be diffed
+// against that file rather than sent in full. Candidates must have a
+// similar basename and size and share some sampled blocks; among those, the
+// one whose sampled blocks are most alike wins. A wrong guess only costs
+// diffing time, as the delta generator still falls back to a full
+// replacement if that's smaller.
+
+namespace chromeos_update_engine {
+
+class RenameMatcher
+{
+public:
+    explicit RenameMatcher(const ImageFiles &old_files)
+        : old_files_(old_files) {}
+
+    // Makes |old_file|, a regular file of the old image, a candidate.
+    void AddCandidate(const ImageFile &old_file);
+
+    // Looks for the candidate |new_file| of |new_files| was most likely
+    // renamed from. Sets |out_found| to whether there's one and, if so,
+    // fills in |out_old_file| and stops it from being a candidate. Returns
+    // true on success, which includes finding nothing.
+    bool Match(const ImageFiles &new_files,
+               const ImageFile &new_file,
+               bool *out_found,
+               ImageFile *out_old_file);
+
+    // The number of candidates not matched yet.
+    size_t size() const
+    {
+        return by_size_.size();
+    }
+
+    // Returns how alike the basenames of |a| and |b| are, from 0 to 1: the
+    // length of their common prefix and suffix over that of the longer one.
+    static double NameSimilarity(const std::string &a, const std::string &b);
+
+private:
+    struct Candidate {
+        ImageFile file;
+        std::vector<uint64_t> fingerprint;  // sorted; empty until needed
+    };
+
+    // Sets |out| to the sorted hashes of up to kFingerprintSamples blocks
+    // spread evenly over |file| of |files|. Returns true on success.
+    static bool Fingerprint(const ImageFiles &files,
+                            const ImageFile &file,
+                            std::vector<uint64_t> *out);
+
+    const ImageFiles &old_files_;
+    std::vector<Candidate> candidates_;
+
+    // Indices into |candidates_| of those not matched yet, by file size.
+    std::multimap<off_t, size_t> by_size_;
+
+    DISALLOW_COPY_AND_ASSIGN(RenameMatcher);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_RENAME_MATCHER_H__
@@ -0,0 +1,157 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/image_files.h"
+#include "update_engine/rename_matcher.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class RenameMatcherTest : public ::testing::Test {};
+
+namespace {
+const size_t kBlockSize = 4096;
+
+// Adds the file at |path| of |files| to |matcher| as a candidate.
+void AddCandidate(const ImageFiles &files,
+                  const string &path,
+                  RenameMatcher *matcher)
+{
+    bool exists = false;
+    ImageFile file;
+    EXPECT_TRUE(files.GetFile(path, &exists, &file));
+    ASSERT_TRUE(exists) << path;
+    matcher->AddCandidate(file);
+}
+
+// Returns the path of the old file |matcher| matches to the file at |path|
+// of |files|, or "" if none.
+string Match(const ImageFiles &files,
+             const string &path,
+             RenameMatcher *matcher)
+{
+    bool exists = false;
+    ImageFile file;
+    EXPECT_TRUE(files.GetFile(path, &exists, &file));
+    EXPECT_TRUE(exists) << path;
+    bool found = false;
+    ImageFile old_file;
+    EXPECT_TRUE(matcher->Match(files, file, &found, &old_file));
+    return found ? old_file.path : "";
+}
+}  // namespace {}
+
+TEST(RenameMatcherTest, NameSimilarityTest)
+{
+    EXPECT_DOUBLE_EQ(1.0, RenameMatcher::NameSimilarity("/usr/bin/foo",
+                     "/bin/foo"));
+    EXPECT_DOUBLE_EQ(12.0 / 13, RenameMatcher::NameSimilarity(
+                         "/lib/libfoo.so.1.2", "/lib/libfoo.so.1.3"));
+    EXPECT_DOUBLE_EQ(8.0 / 10, RenameMatcher::NameSimilarity("/foo-1.txt",
+                     "/foo-22.txt"));
+    EXPECT_DOUBLE_EQ(0.0, RenameMatcher::NameSimilarity("/foo", "/bar"));
+    EXPECT_DOUBLE_EQ(0.0, RenameMatcher::NameSimilarity("/", "/"));
+    // The prefix and suffix don't overlap.
+    EXPECT_DOUBLE_EQ(2.0 / 3, RenameMatcher::NameSimilarity("/aa", "/aaa"));
+}
+
+TEST(RenameMatcherTest, MatchTest)
+{
+    string old_root, new_root;
+    ASSERT_TRUE(utils::MakeTempDirectory("/tmp/RenameMatcherTest.XXXXXX",
+                                         &old_root));
+    ScopedDirRemover old_root_remover(old_root);
+    ASSERT_TRUE(utils::MakeTempDirectory("/tmp/RenameMatcherTest.XXXXXX",
+                                         &new_root));
+    ScopedDirRemover new_root_remover(new_root);
+
+    vector<char> libfoo(8 * kBlockSize);
+    FillWithData(&libfoo);
+    vector<char> other(libfoo.rbegin(), libfoo.rend());
+    vector<char> tool(3 * kBlockSize + 10, 't');
+
+    ASSERT_EQ(0, mkdir((old_root + "/lib").c_str(), 0755));
+    ASSERT_EQ(0, mkdir((old_root + "/bin").c_str(), 0755));
+    ASSERT_TRUE(WriteFileVector(old_root + "/lib/libfoo.so.1.1", other));
+    ASSERT_TRUE(WriteFileVector(old_root + "/lib/libfoo.so.1.2", libfoo));
+    ASSERT_TRUE(WriteFileVector(old_root + "/lib/libbar.so.1", libfoo));
+    ASSERT_TRUE(WriteFileVector(old_root + "/bin/tool", tool));
+
+    // libfoo.so.1.3 is libfoo.so.1.2 with a byte changed; tool moved.
+    libfoo[3 * kBlockSize + 5]++;
+    ASSERT_EQ(0, mkdir((new_root + "/lib").c_str(), 0755));
+    ASSERT_EQ(0, mkdir((new_root + "/usr").c_str(), 0755));
+    ASSERT_EQ(0, mkdir((new_root + "/usr/bin").c_str(), 0755));
+    ASSERT_TRUE(WriteFileVector(new_root + "/lib/libfoo.so.1.3", libfoo));
+    ASSERT_TRUE(WriteFileVector(new_root + "/usr/bin/tool", tool));
+    ASSERT_TRUE(WriteFileVector(new_root + "/usr/bin/tool2", tool));
+    ASSERT_TRUE(WriteFileVector(new_root + "/lib/big", vector<char>(
+                                    3 * libfoo.size(), 'b')));
+    ASSERT_TRUE(WriteFileVector(new_root + "/lib/libfoo.so.1.4",
+                                vector<char>(kBlockSize, 'x')));
+
+    MountedImageFiles old_files(old_root), new_files(new_root);
+    RenameMatcher matcher(old_files);
+    AddCandidate(old_files, "/lib/libfoo.so.1.1", &matcher);
+    AddCandidate(old_files, "/lib/libfoo.so.1.2", &matcher);
+    AddCandidate(old_files, "/lib/libbar.so.1", &matcher);
+    AddCandidate(old_files, "/bin/tool", &matcher);
+    EXPECT_EQ(4, matcher.size());
+
+    // Both libfoo versions have a similar name and the same size, but only
+    // 1.2 has similar contents. libbar.so.1 has the very same, but a name
+    // too different.
+    EXPECT_EQ("/lib/libfoo.so.1.2",
+              Match(new_files, "/lib/libfoo.so.1.3", &matcher));
+    EXPECT_EQ("/bin/tool", Match(new_files, "/usr/bin/tool", &matcher));
+    EXPECT_EQ(2, matcher.size());
+
+    // Each old file is matched once at most.
+    EXPECT_EQ("", Match(new_files, "/usr/bin/tool2", &matcher));
+    // Too big for any candidate.
+    EXPECT_EQ("", Match(new_files, "/lib/big", &matcher));
+    // Too small for libfoo.so.1.1.
+    EXPECT_EQ("", Match(new_files, "/lib/libfoo.so.1.4", &matcher));
+    EXPECT_EQ(2, matcher.size());
+}
+
+TEST(RenameMatcherTest, NoSharedBlocksTest)
+{
+    string old_root, new_root;
+    ASSERT_TRUE(utils::MakeTempDirectory("/tmp/RenameMatcherTest.XXXXXX",
+                                         &old_root));
+    ScopedDirRemover old_root_remover(old_root);
+    ASSERT_TRUE(utils::MakeTempDirectory("/tmp/RenameMatcherTest.XXXXXX",
+                                         &new_root));
+    ScopedDirRemover new_root_remover(new_root);
+
+    vector<char> foo(4 * kBlockSize);
+    FillWithData(&foo);
+    vector<char> bar(foo.rbegin(), foo.rend());
+    ASSERT_TRUE(WriteFileVector(old_root + "/foo.conf", foo));
+    ASSERT_TRUE(WriteFileVector(new_root + "/bar.conf", bar));
+    ASSERT_TRUE(WriteFileVector(new_root + "/baz.conf", foo));
+
+    MountedImageFiles old_files(old_root), new_files(new_root);
+    RenameMatcher matcher(old_files);
+    AddCandidate(old_files, "/foo.conf", &matcher);
+
+    // Alike in name and size, but nothing else.
+    EXPECT_EQ("", Match(new_files, "/bar.conf", &matcher));
+    EXPECT_EQ(1, matcher.size());
+    EXPECT_EQ("/foo.conf", Match(new_files, "/baz.conf", &matcher));
+}
+
+}  // namespace chromeos_update_engine
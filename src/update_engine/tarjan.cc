@@ -3,6 +3,7 @@
 // found in the LICENSE file.
 
 #include <algorithm>
+#include <utility>
 #include <vector>
 #include <glog/logging.h>
 #include "update_engine/tarjan.h"
@@ -38,6 +39,83 @@ void TarjanAlgorithm::Execute(Vertex::Index vertex,
     }
 }
 
+void TarjanAlgorithm::FindAllComponents(
+    const Graph &graph,
+    vector<vector<Vertex::Index>> *components)
+{
+    FindAllComponents(CompactGraph(graph), components);
+}
+
+void TarjanAlgorithm::FindAllComponents(
+    const CompactGraph &graph,
+    vector<vector<Vertex::Index>> *components)
+{
+    components->clear();
+    vector<Vertex::Index> index(graph.size(), kInvalidIndex);
+    vector<Vertex::Index> lowlink(graph.size(), kInvalidIndex);
+    vector<bool> on_stack(graph.size(), false);
+    vector<Vertex::Index> stack;
+    Vertex::Index next_index = 0;
+
+    // The explicit call stack: each frame is a vertex and the out edge to
+    // visit next.
+    vector<std::pair<Vertex::Index, CompactGraph::EdgeIndex>> frames;
+
+    for (Vertex::Index root = 0; root < graph.size(); root++) {
+        if (index[root] != kInvalidIndex) {
+            continue;
+        }
+
+        index[root] = lowlink[root] = next_index++;
+        stack.push_back(root);
+        on_stack[root] = true;
+        frames.push_back(std::make_pair(root, graph.EdgesBegin(root)));
+
+        while (!frames.empty()) {
+            const Vertex::Index vertex = frames.back().first;
+            const CompactGraph::EdgeIndex edge = frames.back().second;
+
+            if (edge != graph.EdgesEnd(vertex)) {
+                const Vertex::Index vertex_next = graph.EdgeTarget(edge);
+                frames.back().second++;
+
+                if (index[vertex_next] == kInvalidIndex) {
+                    index[vertex_next] = lowlink[vertex_next] = next_index++;
+                    stack.push_back(vertex_next);
+                    on_stack[vertex_next] = true;
+                    frames.push_back(std::make_pair(
+                                         vertex_next,
+                                         graph.EdgesBegin(vertex_next)));
+                } else if (on_stack[vertex_next]) {
+                    lowlink[vertex] = min(lowlink[vertex], index[vertex_next]);
+                }
+
+                continue;
+            }
+
+            // All out edges are done; pop the frame.
+            frames.pop_back();
+
+            if (!frames.empty()) {
+                const Vertex::Index parent = frames.back().first;
+                lowlink[parent] = min(lowlink[parent], lowlink[vertex]);
+            }
+
+            if (lowlink[vertex] == index[vertex]) {
+                components->resize(components->size() + 1);
+                Vertex::Index other_vertex;
+
+                do {
+                    other_vertex = stack.back();
+                    stack.pop_back();
+                    on_stack[other_vertex] = false;
+                    components->back().push_back(other_vertex);
+                } while (other_vertex != vertex);
+            }
+        }
+    }
+}
+
 void TarjanAlgorithm::Tarjan(Vertex::Index vertex, Graph *graph)
 {
     CHECK_EQ((*graph)[vertex].index, kInvalidIndex);
@@ -9,10 +9,11 @@
 // Strongly Connected Components in a graph.
 
 // Note: a true Tarjan algorithm would find all strongly connected components
-// in the graph. This implementation will only find the strongly connected
-// component containing the vertex passed in.
+// in the graph. Execute() will only find the strongly connected component
+// containing the vertex passed in; FindAllComponents() finds all of them.
 
 #include <vector>
+#include "update_engine/compact_graph.h"
 #include "update_engine/graph_types.h"
 
 namespace chromeos_update_engine {
@@ -26,6 +27,17 @@ public:
     void Execute(Vertex::Index vertex,
                  Graph *graph,
                  std::vector<Vertex::Index> *out);
+
+    // Replaces |components| with all strongly connected components of
+    // |graph|, in reverse topological order of the condensed graph. Unlike
+    // Execute() it doesn't recurse, so it handles graphs of any depth, and
+    // doesn't touch the Tarjan fields of the vertices.
+    static void FindAllComponents(
+        const Graph &graph,
+        std::vector<std::vector<Vertex::Index>> *components);
+    static void FindAllComponents(
+        const CompactGraph &graph,
+        std::vector<std::vector<Vertex::Index>> *components);
 private:
     void Tarjan(Vertex::Index vertex, Graph *graph);
 
@@ -3,44 +3,56 @@
 // found in the LICENSE file.
 
 #include "update_engine/topological_sort.h"
-#include <set>
+#include <utility>
 #include <vector>
 #include <glog/logging.h>
 
-using std::set;
+using std::make_pair;
+using std::pair;
 using std::vector;
 
 namespace chromeos_update_engine {
 
-namespace {
-void TopologicalSortVisit(const Graph &graph,
-                          set<Vertex::Index> *visited_nodes,
-                          vector<Vertex::Index> *nodes,
-                          Vertex::Index node)
+void TopologicalSort(const Graph &graph, vector<Vertex::Index> *out)
 {
-    if (visited_nodes->find(node) != visited_nodes->end()) {
-        return;
-    }
-
-    visited_nodes->insert(node);
-
-    // Visit all children.
-    for (Vertex::EdgeMap::const_iterator it = graph[node].out_edges.begin();
-            it != graph[node].out_edges.end(); ++it) {
-        TopologicalSortVisit(graph, visited_nodes, nodes, it->first);
-    }
-
-    // Visit this node.
-    nodes->push_back(node);
+    TopologicalSort(CompactGraph(graph), out);
 }
-}  // namespace {}
 
-void TopologicalSort(const Graph &graph, vector<Vertex::Index> *out)
+void TopologicalSort(const CompactGraph &graph, vector<Vertex::Index> *out)
 {
-    set<Vertex::Index> visited_nodes;
+    vector<bool> visited_nodes(graph.size(), false);
+
+    // The explicit call stack: each frame is a node and its out edge to
+    // visit next.
+    vector<pair<Vertex::Index, CompactGraph::EdgeIndex>> frames;
 
     for (Vertex::Index i = 0; i < graph.size(); i++) {
-        TopologicalSortVisit(graph, &visited_nodes, out, i);
+        if (visited_nodes[i]) {
+            continue;
+        }
+
+        visited_nodes[i] = true;
+        frames.push_back(make_pair(i, graph.EdgesBegin(i)));
+
+        while (!frames.empty()) {
+            const Vertex::Index node = frames.back().first;
+            const CompactGraph::EdgeIndex edge = frames.back().second;
+
+            if (edge == graph.EdgesEnd(node)) {
+                // All children are visited; visit this node.
+                out->push_back(node);
+                frames.pop_back();
+                continue;
+            }
+
+            frames.back().second++;
+            const Vertex::Index child = graph.EdgeTarget(edge);
+
+            if (!visited_nodes[child]) {
+                visited_nodes[child] = true;
+                frames.push_back(make_pair(child, graph.EdgesBegin(child)));
+            }
+        }
     }
 }
 
@@ -7,6 +7,7 @@
 
 
 #include <vector>
+#include "update_engine/compact_graph.h"
 #include "update_engine/graph_types.h"
 
 namespace chromeos_update_engine {
@@ -25,6 +26,11 @@ namespace chromeos_update_engine {
 // Note: results are undefined if there is a cycle in the graph.
 void TopologicalSort(const Graph &graph, std::vector<Vertex::Index> *out);
 
+// Same as above, for a compact copy of the graph. It doesn't recurse, so it
+// handles graphs of any depth.
+void TopologicalSort(const CompactGraph &graph,
+                     std::vector<Vertex::Index> *out);
+
 }  // namespace chromeos_update_engine
 
 #endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_TOPOLOGICAL_SORT_H__
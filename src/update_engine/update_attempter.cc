@@ -20,6 +20,7 @@
 #include "update_engine/certificate_checker.h"
 #include "update_engine/dbus_service.h"
 #include "update_engine/download_action.h"
+#include "update_engine/file_http_fetcher.h"
 #include "update_engine/filesystem_copier_action.h"
 #include "update_engine/kernel_copier_action.h"
 #include "update_engine/kernel_verifier_action.h"
@@ -28,12 +29,14 @@
 #include "update_engine/omaha_request_action.h"
 #include "update_engine/omaha_request_params.h"
 #include "update_engine/omaha_response_handler_action.h"
+#include "update_engine/payload_processor.h"
 #include "update_engine/payload_state_interface.h"
 #include "update_engine/postinstall_runner_action.h"
 #include "update_engine/prefs_interface.h"
 #include "update_engine/subprocess.h"
 #include "update_engine/system_state.h"
 #include "update_engine/update_check_scheduler.h"
+#include "update_engine/url_probe_action.h"
 
 using std::chrono::steady_clock;
 using std::make_pair;
@@ -204,10 +207,17 @@ void UpdateAttempter::BuildUpdateActions(bool interactive)
                                NULL,
                                update_check_fetcher,  // passes ownership
                                false));
+    LibcurlHttpFetcher *url_probe_fetcher = new LibcurlHttpFetcher();
+    url_probe_fetcher->set_check_certificate(CertificateChecker::kDownload);
+    shared_ptr<UrlProbeAction> url_probe_action(
+        new UrlProbeAction(system_state_,
+                           url_probe_fetcher));  // passes ownership
     shared_ptr<OmahaResponseHandlerAction> response_handler_action(
         new OmahaResponseHandlerAction(system_state_));
     shared_ptr<FilesystemCopierAction> filesystem_copier_action(
         new FilesystemCopierAction(false));
+    filesystem_copier_action->set_verified_manifest(
+        prefs_, PayloadProcessor::kVerifiedManifestPath);
     shared_ptr<KernelCopierAction> kernel_copier_action(new KernelCopierAction);
     shared_ptr<OmahaRequestAction> download_started_action(
         new OmahaRequestAction(system_state_,
@@ -244,6 +254,7 @@ void UpdateAttempter::BuildUpdateActions(bool interactive)
     download_action_ = download_action;
 
     actions_.push_back(shared_ptr<AbstractAction>(update_check_action));
+    actions_.push_back(shared_ptr<AbstractAction>(url_probe_action));
     actions_.push_back(shared_ptr<AbstractAction>(response_handler_action));
     actions_.push_back(shared_ptr<AbstractAction>(filesystem_copier_action));
     actions_.push_back(shared_ptr<AbstractAction>(kernel_copier_action));
@@ -263,6 +274,8 @@ void UpdateAttempter::BuildUpdateActions(bool interactive)
     // Bond them together. We have to use the leaf-types when calling
     // BondActions().
     BondActions(update_check_action.get(),
+                url_probe_action.get());
+    BondActions(url_probe_action.get(),
                 response_handler_action.get());
     BondActions(response_handler_action.get(),
                 filesystem_copier_action.get());
@@ -408,6 +421,20 @@ void UpdateAttempter::ActionCompleted(ActionProcessor *processor,
             MarkDeltaUpdateFailure();
         }
 
+        // The partitions didn't turn out as the verified manifest says, so
+        // the next attempt mustn't skip copying them.
+        switch (GetErrorCodeForAction(action, code)) {
+        case kActionCodeNewRootfsVerificationError:
+        case kActionCodeNewKernelVerificationError:
+        case kActionCodePostinstallRunnerError:
+            PayloadProcessor::ResetVerifiedManifest(
+                prefs_, PayloadProcessor::kVerifiedManifestPath);
+            break;
+
+        default:
+            break;
+        }
+
         // On failure, schedule an error event to be sent to Omaha.
         CreatePendingErrorEvent(action, code);
         return;
@@ -443,6 +470,11 @@ void UpdateAttempter::SetDownloadStatus(bool active)
     LOG(INFO) << "Download status: " << (active ? "active" : "inactive");
 }
 
+void UpdateAttempter::DownloadPaused(bool paused)
+{
+    system_state_->payload_state()->DownloadPaused(paused);
+}
+
 void UpdateAttempter::BytesReceived(uint64_t received,
                                     uint64_t progress,
                                     uint64_t total)
@@ -452,7 +484,13 @@ void UpdateAttempter::BytesReceived(uint64_t received,
         return;
     }
 
-    system_state_->payload_state()->DownloadProgress(received);
+    PayloadStateInterface *payload_state = system_state_->payload_state();
+    const uint32_t url_index = payload_state->GetUrlIndex();
+    payload_state->DownloadProgress(received);
+
+    if (payload_state->GetUrlIndex() != url_index) {
+        SwitchDownloadUrl(payload_state->GetCurrentUrl());
+    }
 
     double pct = static_cast<double>(progress) / static_cast<double>(total);
     // Self throttle based on progress. Also send notifications if
@@ -744,6 +782,14 @@ void UpdateAttempter::SetupDownload()
         dynamic_cast<MultiRangeHttpFetcher *>(download_action_->http_fetcher());
     fetcher->ClearRanges();
 
+    // Payloads on local storage are read straight from the file
+    // instead of going through libcurl.
+    if (!FileHttpFetcher::PathForUrl(
+                response_handler_action_->install_plan().download_url).empty()) {
+        LOG(INFO) << "Reading the payload from local storage.";
+        fetcher->set_base_fetcher(new FileHttpFetcher());
+    }
+
     if (response_handler_action_->install_plan().is_resume) {
         // Resuming an update so fetch the update manifest metadata first.
         int64_t manifest_metadata_size = 0;
@@ -754,6 +800,8 @@ void UpdateAttempter::SetupDownload()
         // error codes.
         int64_t next_data_offset = 0;
         prefs_->GetInt64(kPrefsUpdateStateNextDataOffset, &next_data_offset);
+        // DownloadAction skips over the data of the next operation spooled
+        // before the update was interrupted, if it's still usable.
         uint64_t resume_offset = manifest_metadata_size + next_data_offset;
 
         if (resume_offset < response_handler_action_->install_plan().payload_size) {
@@ -764,6 +812,26 @@ void UpdateAttempter::SetupDownload()
     }
 }
 
+void UpdateAttempter::SwitchDownloadUrl(const string &url)
+{
+    if (url.empty()) {
+        return;
+    }
+
+    // The base fetcher was picked for the scheme of the original URL.
+    if (!FileHttpFetcher::PathForUrl(url).empty() ||
+            !FileHttpFetcher::PathForUrl(
+                response_handler_action_->install_plan().download_url).empty()) {
+        LOG(INFO) << "Not switching the download to or from local storage.";
+        return;
+    }
+
+    MultiRangeHttpFetcher *fetcher =
+        dynamic_cast<MultiRangeHttpFetcher *>(download_action_->http_fetcher());
+    LOG(INFO) << "Continuing the download from " << url;
+    fetcher->SwitchUrl(url);
+}
+
 void UpdateAttempter::PingOmaha()
 {
     if (!processor_->IsRunning()) {
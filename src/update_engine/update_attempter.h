@@ -137,6 +137,7 @@ public:
     // DownloadActionDelegate methods
     void SetDownloadStatus(bool active);
     void BytesReceived(uint64_t received, uint64_t progress, uint64_t total);
+    void DownloadPaused(bool paused);
 
     // Broadcasts the current status over D-Bus.
     void BroadcastStatus();
@@ -169,6 +170,10 @@ private:
     // Sets up the download parameters after receiving the update check response.
     void SetupDownload();
 
+    // Continues the download in progress from |url|, e.g. after the payload
+    // state switched away from a mirror whose throughput collapsed.
+    void SwitchDownloadUrl(const std::string &url);
+
     // Creates an error event object in |error_event_| to be included in an
     // OmahaRequestAction once the current action processor is done.
     void CreatePendingErrorEvent(AbstractAction *action, ActionExitCode code);
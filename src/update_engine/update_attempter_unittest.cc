@@ -22,6 +22,7 @@
 #include "update_engine/test_utils.h"
 #include "update_engine/update_attempter.h"
 #include "update_engine/update_check_scheduler.h"
+#include "update_engine/url_probe_action.h"
 
 using std::string;
 using testing::_;
@@ -123,6 +124,28 @@ TEST_F(UpdateAttempterTest, ActionCompletedErrorTest)
     ASSERT_TRUE(attempter_.error_event_.get() != NULL);
 }
 
+TEST_F(UpdateAttempterTest, ActionCompletedVerificationErrorTest)
+{
+    // Failing to verify the partitions forgets the verified manifest, so
+    // that the next attempt copies them again.
+    ActionMock action;
+    EXPECT_CALL(action, Type()).WillRepeatedly(Return("ActionMock"));
+    EXPECT_CALL(*prefs_, SetString(kPrefsVerifiedManifestHash, ""))
+    .Times(3);
+    attempter_.ActionCompleted(NULL, &action,
+                               kActionCodeNewRootfsVerificationError);
+    attempter_.ActionCompleted(NULL, &action,
+                               kActionCodeNewKernelVerificationError);
+
+    PostinstallRunnerAction postinstall_runner_action;
+    attempter_.ActionCompleted(NULL, &postinstall_runner_action,
+                               kActionCodeError);
+
+    // Download errors don't touch the partitions.
+    attempter_.ActionCompleted(NULL, &action,
+                               kActionCodeDownloadTransferError);
+}
+
 TEST_F(UpdateAttempterTest, ActionCompletedOmahaRequestTest)
 {
     std::unique_ptr<MockHttpFetcher> fetcher(new MockHttpFetcher("", 0));
@@ -327,6 +350,7 @@ gboolean UpdateAttempterTest::StaticPingOmahaTestStart(gpointer data)
 namespace {
 const string kActionTypes[] = {
     OmahaRequestAction::StaticType(),
+    UrlProbeAction::StaticType(),
     OmahaResponseHandlerAction::StaticType(),
     FilesystemCopierAction::StaticType(),
     KernelCopierAction::StaticType(),
@@ -371,9 +395,9 @@ void UpdateAttempterTest::UpdateTestVerify()
     // actions_ itself is initialized by a series of push_back operations
     // in UpdateAttempter::BuildUpdateActions.
     EXPECT_EQ(attempter_.response_handler_action_.get(),
-              attempter_.actions_[1].get());
+              attempter_.actions_[2].get());
     DownloadAction *download_action =
-        dynamic_cast<DownloadAction *>(attempter_.actions_[5].get());
+        dynamic_cast<DownloadAction *>(attempter_.actions_[6].get());
     ASSERT_TRUE(download_action != NULL);
     EXPECT_EQ(&attempter_, download_action->delegate());
     EXPECT_EQ(UPDATE_STATUS_CHECKING_FOR_UPDATE, attempter_.status());
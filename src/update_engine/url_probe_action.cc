@@ -0,0 +1,204 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/url_probe_action.h"
+
+#include <algorithm>
+
+#include <glog/logging.h>
+
+#include "update_engine/file_http_fetcher.h"
+#include "update_engine/payload_state_interface.h"
+
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::max;
+using std::string;
+
+namespace chromeos_update_engine {
+
+const size_t UrlProbeAction::kProbeLength = 128 * 1024;
+const int UrlProbeAction::kProbeTimeoutSeconds = 10;
+
+UrlProbeAction::UrlProbeAction(SystemState *system_state,
+                               HttpFetcher *http_fetcher)
+    : system_state_(system_state),
+      http_fetcher_(http_fetcher),
+      fetcher_(http_fetcher),
+      url_index_(0),
+      probed_(false),
+      bytes_received_(0),
+      timeout_source_id_(0),
+      idle_source_id_(0),
+      transfer_active_(false),
+      terminating_(false) {}
+
+UrlProbeAction::~UrlProbeAction()
+{
+    CancelSources();
+}
+
+void UrlProbeAction::PerformAction()
+{
+    CHECK(HasInputObject());
+    http_fetcher_->set_delegate(this);
+    response_ = GetInputObject();
+    url_index_ = 0;
+    probed_ = false;
+    terminating_ = false;
+
+    // With a single URL there's nothing to choose from.
+    if (!response_.update_exists || response_.payload_urls.size() < 2) {
+        if (HasOutputPipe()) {
+            SetOutputObject(response_);
+        }
+
+        processor_->ActionComplete(this, kActionCodeSuccess);
+        return;
+    }
+
+    ProbeNextUrl();
+}
+
+void UrlProbeAction::TerminateProcessing()
+{
+    terminating_ = true;
+    CancelSources();
+
+    if (transfer_active_) {
+        fetcher_->TerminateTransfer();
+    }
+}
+
+void UrlProbeAction::ProbeNextUrl()
+{
+    idle_source_id_ = 0;
+    PayloadStateInterface *payload_state = system_state_->payload_state();
+    milliseconds latency;
+    uint64_t throughput;
+
+    while (url_index_ < response_.payload_urls.size() &&
+            payload_state->GetUrlStats(url_index_, &latency, &throughput)) {
+        url_index_++;
+    }
+
+    if (url_index_ >= response_.payload_urls.size()) {
+        if (probed_) {
+            payload_state->SelectFastestUrl();
+        }
+
+        if (HasOutputPipe()) {
+            SetOutputObject(response_);
+        }
+
+        processor_->ActionComplete(this, kActionCodeSuccess);
+        return;
+    }
+
+    const string &url = response_.payload_urls[url_index_];
+    LOG(INFO) << "Probing Url" << url_index_ << ": " << url;
+    fetcher_ = http_fetcher_.get();
+
+    if (!FileHttpFetcher::PathForUrl(url).empty()) {
+        if (!file_fetcher_) {
+            file_fetcher_.reset(new FileHttpFetcher());
+            file_fetcher_->set_delegate(this);
+        }
+
+        fetcher_ = file_fetcher_.get();
+    }
+
+    probed_ = true;
+    bytes_received_ = 0;
+    start_time_ = steady_clock::now();
+    transfer_active_ = true;
+    timeout_source_id_ = g_timeout_add_seconds(kProbeTimeoutSeconds,
+                                               StaticProbeTimeout,
+                                               this);
+    fetcher_->SetOffset(0);
+    fetcher_->SetLength(kProbeLength);
+    fetcher_->BeginTransfer(url);
+}
+
+void UrlProbeAction::ReceivedBytes(HttpFetcher *fetcher,
+                                   const char *bytes,
+                                   int length)
+{
+    if (bytes_received_ == 0) {
+        first_byte_time_ = steady_clock::now();
+    }
+
+    bytes_received_ += length;
+
+    // Not all fetchers honor the length, stop once we've seen enough.
+    if (bytes_received_ >= kProbeLength) {
+        fetcher->TerminateTransfer();
+    }
+}
+
+void UrlProbeAction::TransferComplete(HttpFetcher *fetcher, bool successful)
+{
+    ProbeDone(successful);
+}
+
+void UrlProbeAction::TransferTerminated(HttpFetcher *fetcher)
+{
+    if (terminating_) {
+        transfer_active_ = false;
+        return;
+    }
+
+    // Terminated by this action after enough bytes or on timeout.
+    ProbeDone(true);
+}
+
+void UrlProbeAction::ProbeDone(bool successful)
+{
+    transfer_active_ = false;
+    CancelSources();
+    milliseconds latency(0);
+    uint64_t throughput = 0;
+
+    if (successful && bytes_received_ > 0) {
+        const steady_clock::time_point now = steady_clock::now();
+        latency = duration_cast<milliseconds>(first_byte_time_ - start_time_);
+        const milliseconds elapsed =
+            duration_cast<milliseconds>(now - start_time_);
+        throughput = bytes_received_ * 1000 / max<int64_t>(elapsed.count(), 1);
+    } else {
+        LOG(WARNING) << "Probing Url" << url_index_ << " failed, code "
+                     << fetcher_->http_response_code();
+    }
+
+    system_state_->payload_state()->SetUrlStats(url_index_, latency, throughput);
+    url_index_++;
+
+    // Don't restart the fetcher from within its own callback.
+    idle_source_id_ = g_idle_add(StaticProbeNextUrl, this);
+}
+
+bool UrlProbeAction::ProbeTimeout()
+{
+    timeout_source_id_ = 0;
+    LOG(WARNING) << "Probing Url" << url_index_ << " timed out after "
+                 << bytes_received_ << " bytes";
+    fetcher_->TerminateTransfer();
+    return false;
+}
+
+void UrlProbeAction::CancelSources()
+{
+    if (timeout_source_id_) {
+        g_source_remove(timeout_source_id_);
+        timeout_source_id_ = 0;
+    }
+
+    if (idle_source_id_) {
+        g_source_remove(idle_source_id_);
+        idle_source_id_ = 0;
+    }
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,139 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_URL_PROBE_ACTION_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_URL_PROBE_ACTION_H__
+
+#include <chrono>
+#include <memory>
+#include <string>
+
+#include <glib.h>
+
+#include "update_engine/action.h"
+#include "update_engine/http_fetcher.h"
+#include "update_engine/omaha_response.h"
+#include "update_engine/system_state.h"
+
+// This action measures each payload URL of an Omaha response by fetching the
+// first bytes of the payload from it, records the time to the first byte and
+// the throughput in the payload state and selects the fastest URL for the
+// download. URLs measured for the same response before, e.g. by a previous
+// update attempt, are not probed again and the selection is left alone, so
+// that the failure based URL rotation of the payload state still applies.
+// The response is passed through unchanged; probing never fails the update.
+
+namespace chromeos_update_engine {
+
+class UrlProbeAction;
+
+template<>
+class ActionTraits<UrlProbeAction>
+{
+public:
+    typedef OmahaResponse InputObjectType;
+    typedef OmahaResponse OutputObjectType;
+};
+
+class UrlProbeAction : public Action<UrlProbeAction>,
+    public HttpFetcherDelegate
+{
+public:
+    // Number of bytes fetched from each URL.
+    static const size_t kProbeLength;
+
+    // Time after which a URL that hasn't delivered all the probe bytes is
+    // measured on what it has delivered so far.
+    static const int kProbeTimeoutSeconds;
+
+    // Takes ownership of the passed in HttpFetcher, which is used for all the
+    // network probes in turn. file:// URLs are probed with a FileHttpFetcher,
+    // the fetcher the download uses for them.
+    UrlProbeAction(SystemState *system_state, HttpFetcher *http_fetcher);
+    virtual ~UrlProbeAction();
+    typedef ActionTraits<UrlProbeAction>::InputObjectType InputObjectType;
+    typedef ActionTraits<UrlProbeAction>::OutputObjectType OutputObjectType;
+    void PerformAction();
+    void TerminateProcessing();
+
+    // Debugging/logging
+    static std::string StaticType()
+    {
+        return "UrlProbeAction";
+    }
+    std::string Type() const
+    {
+        return StaticType();
+    }
+
+    // HttpFetcherDelegate methods (see http_fetcher.h)
+    virtual void ReceivedBytes(HttpFetcher *fetcher,
+                               const char *bytes, int length);
+    virtual void TransferComplete(HttpFetcher *fetcher, bool successful);
+    virtual void TransferTerminated(HttpFetcher *fetcher);
+
+private:
+    // Starts probing the next URL without stats, or completes the action if
+    // there's none left.
+    void ProbeNextUrl();
+    static gboolean StaticProbeNextUrl(gpointer data)
+    {
+        reinterpret_cast<UrlProbeAction *>(data)->ProbeNextUrl();
+        return FALSE;
+    }
+
+    // Records the stats of the URL just probed and schedules the next probe.
+    void ProbeDone(bool successful);
+
+    // Ends a probe that takes too long.
+    bool ProbeTimeout();
+    static gboolean StaticProbeTimeout(gpointer data)
+    {
+        return reinterpret_cast<UrlProbeAction *>(data)->ProbeTimeout();
+    }
+
+    // Removes the glib sources, if any.
+    void CancelSources();
+
+    // Global system context.
+    SystemState *system_state_;
+
+    std::unique_ptr<HttpFetcher> http_fetcher_;
+
+    // Fetcher for file:// URLs, created when the first one is probed.
+    std::unique_ptr<HttpFetcher> file_fetcher_;
+
+    // The fetcher of the current probe, |http_fetcher_| or |file_fetcher_|.
+    HttpFetcher *fetcher_;
+
+    // The response whose URLs are probed.
+    OmahaResponse response_;
+
+    // Index of the URL being probed and whether any URL was probed at all.
+    size_t url_index_;
+    bool probed_;
+
+    // Bytes received from the current URL and when the probe started and
+    // received its first byte.
+    size_t bytes_received_;
+    std::chrono::steady_clock::time_point start_time_;
+    std::chrono::steady_clock::time_point first_byte_time_;
+
+    // Glib sources ending the current probe and starting the next one, 0 if
+    // none.
+    guint timeout_source_id_;
+    guint idle_source_id_;
+
+    // True while a transfer is in progress.
+    bool transfer_active_;
+
+    // True if the action processor is terminating this action.
+    bool terminating_;
+
+    DISALLOW_COPY_AND_ASSIGN(UrlProbeAction);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_URL_PROBE_ACTION_H__
@@ -0,0 +1,117 @@
+// Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string>
+#include <vector>
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/mock_http_fetcher.h"
+#include "update_engine/mock_system_state.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/url_probe_action.h"
+
+using std::string;
+using std::vector;
+using testing::_;
+using testing::DoAll;
+using testing::Gt;
+using testing::Return;
+using testing::SetArgumentPointee;
+
+namespace chromeos_update_engine {
+
+class UrlProbeActionTest : public ::testing::Test
+{
+protected:
+    virtual void SetUp()
+    {
+        response_.update_exists = true;
+        response_.payload_urls.push_back("http://fast.test/payload");
+        response_.payload_urls.push_back("http://slow.test/payload");
+        data_.resize(UrlProbeAction::kProbeLength / 2);
+        FillWithData(&data_);
+    }
+
+    // Runs the probe action on |response_| with |fetcher| and returns the
+    // response it passed on.
+    OmahaResponse RunAction(MockHttpFetcher *fetcher)
+    {
+        ActionProcessor processor;
+        ActionTestDelegate<UrlProbeAction> delegate;
+        ObjectFeederAction<OmahaResponse> feeder_action;
+        feeder_action.set_obj(response_);
+        UrlProbeAction probe_action(&mock_system_state_, fetcher);
+        ObjectCollectorAction<OmahaResponse> collector_action;
+        BondActions(&feeder_action, &probe_action);
+        BondActions(&probe_action, &collector_action);
+        processor.EnqueueAction(&feeder_action);
+        processor.EnqueueAction(&probe_action);
+        processor.EnqueueAction(&collector_action);
+        delegate.RunProcessorInMainLoop(&processor);
+        EXPECT_TRUE(delegate.ran());
+        EXPECT_EQ(kActionCodeSuccess, delegate.code());
+        return collector_action.object();
+    }
+
+    MockSystemState mock_system_state_;
+    OmahaResponse response_;
+    vector<char> data_;
+};
+
+TEST_F(UrlProbeActionTest, ProbesAllUrlsTest)
+{
+    MockPayloadState *payload_state = mock_system_state_.mock_payload_state();
+    EXPECT_CALL(*payload_state, GetUrlStats(_, _, _))
+    .WillRepeatedly(Return(false));
+    EXPECT_CALL(*payload_state, SetUrlStats(0, _, Gt(0U))).Times(1);
+    EXPECT_CALL(*payload_state, SetUrlStats(1, _, Gt(0U))).Times(1);
+    EXPECT_CALL(*payload_state, SelectFastestUrl()).Times(1);
+    OmahaResponse out =
+        RunAction(new MockHttpFetcher(&data_[0], data_.size()));
+    EXPECT_TRUE(out.update_exists);
+    EXPECT_TRUE(out.payload_urls == response_.payload_urls);
+}
+
+TEST_F(UrlProbeActionTest, FailedProbeTest)
+{
+    MockPayloadState *payload_state = mock_system_state_.mock_payload_state();
+    EXPECT_CALL(*payload_state, GetUrlStats(_, _, _))
+    .WillRepeatedly(Return(false));
+    EXPECT_CALL(*payload_state, SetUrlStats(_, _, 0U)).Times(2);
+    EXPECT_CALL(*payload_state, SelectFastestUrl()).Times(1);
+    MockHttpFetcher *fetcher = new MockHttpFetcher(&data_[0], data_.size());
+    fetcher->FailTransfer(404);
+    OmahaResponse out = RunAction(fetcher);
+    EXPECT_TRUE(out.update_exists);
+}
+
+TEST_F(UrlProbeActionTest, SkipsMeasuredUrlsTest)
+{
+    MockPayloadState *payload_state = mock_system_state_.mock_payload_state();
+    EXPECT_CALL(*payload_state, GetUrlStats(_, _, _))
+    .WillRepeatedly(DoAll(SetArgumentPointee<2>(1000),
+                          Return(true)));
+    EXPECT_CALL(*payload_state, SetUrlStats(_, _, _)).Times(0);
+    EXPECT_CALL(*payload_state, SelectFastestUrl()).Times(0);
+    MockHttpFetcher *fetcher = new MockHttpFetcher(&data_[0], data_.size());
+    fetcher->set_never_use(true);
+    OmahaResponse out = RunAction(fetcher);
+    EXPECT_TRUE(out.payload_urls == response_.payload_urls);
+}
+
+TEST_F(UrlProbeActionTest, SingleUrlTest)
+{
+    response_.payload_urls.resize(1);
+    MockPayloadState *payload_state = mock_system_state_.mock_payload_state();
+    EXPECT_CALL(*payload_state, GetUrlStats(_, _, _)).Times(0);
+    EXPECT_CALL(*payload_state, SelectFastestUrl()).Times(0);
+    MockHttpFetcher *fetcher = new MockHttpFetcher(&data_[0], data_.size());
+    fetcher->set_never_use(true);
+    OmahaResponse out = RunAction(fetcher);
+    EXPECT_EQ(1U, out.payload_urls.size());
+}
+
+}  // namespace chromeos_update_engine
@@ -7,6 +7,7 @@
 #include <sys/mount.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <dirent.h>
@@ -213,6 +214,42 @@ bool PReadAll(int fd, void *buf, size_t count, off_t offset,
 
 }
 
+bool CopyFileRange(int in_fd, off_t in_offset, int out_fd, size_t count)
+{
+    size_t bytes_copied = 0;
+
+#ifdef __NR_copy_file_range
+    // Not all kernels and filesystems support it, e.g. across filesystems;
+    // whatever is left is copied by hand then.
+    while (bytes_copied < count) {
+        loff_t offset = in_offset + bytes_copied;
+        ssize_t rc = syscall(__NR_copy_file_range, in_fd, &offset, out_fd,
+                             NULL, count - bytes_copied, 0);
+
+        if (rc <= 0) {
+            break;
+        }
+
+        bytes_copied += rc;
+    }
+#endif  // __NR_copy_file_range
+
+    const size_t kBufferSize = 1024 * 1024;
+    vector<char> buf(min(count - bytes_copied, kBufferSize));
+
+    while (bytes_copied < count) {
+        const size_t chunk = min(count - bytes_copied, buf.size());
+        ssize_t bytes_read = -1;
+        TEST_AND_RETURN_FALSE(PReadAll(in_fd, buf.data(), chunk,
+                                       in_offset + bytes_copied, &bytes_read));
+        TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(chunk));
+        TEST_AND_RETURN_FALSE(WriteAll(out_fd, buf.data(), chunk));
+        bytes_copied += chunk;
+    }
+
+    return true;
+}
+
 // Append |nbytes| of content from |buf| to the vector pointed to by either
 // |vec_p| or |str_p|.
 static void AppendBytes(const char *buf, size_t nbytes,
@@ -287,6 +324,29 @@ bool ReadFile(const std::string &path, std::string *out_p)
     return ReadFileAndAppend(path, out_p);
 }
 
+bool ReadFileChunk(const std::string &path, off_t offset, off_t size,
+                   std::vector<char> *out_p)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+    files::ScopedFD fd_closer(fd);
+
+    if (size == -1) {
+        struct stat stbuf;
+        TEST_AND_RETURN_FALSE_ERRNO(fstat(fd, &stbuf) == 0);
+        size = std::max(stbuf.st_size - offset, static_cast<off_t>(0));
+    }
+
+    TEST_AND_RETURN_FALSE(offset >= 0 && size >= 0);
+    const size_t start = out_p->size();
+    out_p->resize(start + size);
+    ssize_t bytes_read = -1;
+    TEST_AND_RETURN_FALSE(PReadAll(fd, out_p->data() + start, size, offset,
+                                   &bytes_read));
+    out_p->resize(start + bytes_read);
+    return true;
+}
+
 bool ReadPipe(const std::string &cmd, std::vector<char> *out_p)
 {
     return ReadPipeAndAppend(cmd, out_p);
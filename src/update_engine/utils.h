@@ -62,6 +62,13 @@ bool PWriteAll(int fd, const void *buf, size_t count, off_t offset);
 bool PReadAll(int fd, void *buf, size_t count, off_t offset,
               ssize_t *out_bytes_read);
 
+// Copies |count| bytes from |in_offset| in |in_fd| to the current position
+// of |out_fd|, which it advances. The kernel copies the data, or shares it
+// where the filesystem allows, through copy_file_range() when it can, so it
+// doesn't go through user space; otherwise it's copied in large buffered
+// chunks. Returns true on success.
+bool CopyFileRange(int in_fd, off_t in_offset, int out_fd, size_t count);
+
 // Opens |path| for reading and appends its entire content to the container
 // pointed to by |out_p|. Returns true upon successfully reading all of the
 // file's content, false otherwise, in which case the state of the output
@@ -69,6 +76,12 @@ bool PReadAll(int fd, void *buf, size_t count, off_t offset,
 bool ReadFile(const std::string &path, std::vector<char> *out_p);
 bool ReadFile(const std::string &path, std::string *out_p);
 
+// Reads up to |size| bytes from |offset| in the file at |path|, or up to
+// the end of the file if |size| is -1, and appends them to the container
+// pointed to by |out_p|. Returns true on success, false otherwise.
+bool ReadFileChunk(const std::string &path, off_t offset, off_t size,
+                   std::vector<char> *out_p);
+
 // Invokes |cmd| in a pipe and appends its stdout to the container pointed to by
 // |out_p|. Returns true upon successfully reading all of the output, false
 // otherwise, in which case the state of the output container is unknown.
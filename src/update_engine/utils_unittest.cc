@@ -14,6 +14,7 @@
 
 #include <gtest/gtest.h>
 
+#include "files/scoped_file.h"
 #include "strings/string_printf.h"
 #include "update_engine/test_utils.h"
 #include "update_engine/utils.h"
@@ -82,6 +83,60 @@ TEST(UtilsTest, ReadFileFailure)
     EXPECT_FALSE(utils::ReadFile("/this/doesn't/exist", &empty));
 }
 
+TEST(UtilsTest, ReadFileChunkTest)
+{
+    string path;
+    EXPECT_TRUE(utils::MakeTempFile("/tmp/UtilsTest.XXXXXX", &path, NULL));
+    ScopedPathUnlinker path_unlinker(path);
+    EXPECT_TRUE(utils::WriteFile(path.c_str(), "0123456789", 10));
+
+    vector<char> data;
+    EXPECT_TRUE(utils::ReadFileChunk(path, 2, 3, &data));
+    EXPECT_EQ("234", string(data.begin(), data.end()));
+
+    // Reads append, and stop at the end of the file.
+    EXPECT_TRUE(utils::ReadFileChunk(path, 8, 5, &data));
+    EXPECT_EQ("23489", string(data.begin(), data.end()));
+    EXPECT_TRUE(utils::ReadFileChunk(path, 7, -1, &data));
+    EXPECT_EQ("23489789", string(data.begin(), data.end()));
+    EXPECT_TRUE(utils::ReadFileChunk(path, 20, -1, &data));
+    EXPECT_EQ(8, data.size());
+
+    EXPECT_FALSE(utils::ReadFileChunk("/this/doesn't/exist", 0, -1, &data));
+}
+
+TEST(UtilsTest, CopyFileRangeTest)
+{
+    string in_path, out_path;
+    int in_fd, out_fd;
+    EXPECT_TRUE(utils::MakeTempFile("/tmp/UtilsTest.XXXXXX", &in_path, &in_fd));
+    ScopedPathUnlinker in_path_unlinker(in_path);
+    files::ScopedFD in_fd_closer(in_fd);
+    EXPECT_TRUE(utils::MakeTempFile("/tmp/UtilsTest.XXXXXX", &out_path,
+                                    &out_fd));
+    ScopedPathUnlinker out_path_unlinker(out_path);
+    files::ScopedFD out_fd_closer(out_fd);
+
+    vector<char> data(3 * 1024 * 1024);
+    FillWithData(&data);
+    EXPECT_TRUE(utils::WriteAll(in_fd, data.data(), data.size()));
+
+    // Copies go to the current position of the output.
+    EXPECT_TRUE(utils::WriteAll(out_fd, "ab", 2));
+    EXPECT_TRUE(utils::CopyFileRange(in_fd, 10, out_fd, data.size() - 20));
+    EXPECT_TRUE(utils::CopyFileRange(in_fd, 0, out_fd, 5));
+    EXPECT_FALSE(utils::CopyFileRange(in_fd, data.size() - 5, out_fd, 10));
+
+    vector<char> expected(1, 'a');
+    expected.push_back('b');
+    expected.insert(expected.end(), data.begin() + 10, data.end() - 10);
+    expected.insert(expected.end(), data.begin(), data.begin() + 5);
+    vector<char> out_data;
+    EXPECT_TRUE(utils::ReadFile(out_path, &out_data));
+    out_data.resize(expected.size());
+    EXPECT_TRUE(out_data == expected);
+}
+
 TEST(UtilsTest, ErrnoNumberAsStringTest)
 {
     EXPECT_EQ("No such file or directory", utils::ErrnoNumberAsString(ENOENT));